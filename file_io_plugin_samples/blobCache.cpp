@@ -0,0 +1,538 @@
+//
+// BlobCache, see blobCache.h
+//
+#include "blobCache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unordered_set>
+
+//lzsa memory compressor
+#include "shrink_inmem.h"
+//lzsa memory decompressor
+#include "expand_inmem.h"
+
+// CRC32C instruction, picked at run time
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BLOB_CACHE_SSE42 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BLOB_CACHE_TARGET(isa)
+#else
+#define BLOB_CACHE_TARGET(isa) __attribute__((target(isa)))
+#endif
+#else
+#define BLOB_CACHE_SSE42 0
+#endif
+
+// LZSA flag for raw blocks (from lib.h, which is C only)
+#define BLOB_CACHE_LZSA_FLAG_RAW_BLOCK (1<<1)
+
+// Set to 1 to also compress every incrementally recompressed blob from
+// scratch, and log what the incremental parse cost in size
+#ifndef BLOB_CACHE_CHECK_INCREMENTAL
+#define BLOB_CACHE_CHECK_INCREMENTAL 0
+#endif
+
+#if BLOB_CACHE_CHECK_INCREMENTAL
+#include <windows.h>
+#include <wchar.h>
+#endif
+
+//------------------------------------------------------------------------------
+// Sidecar layout, all little endian:
+//   'B','L','B','C'  u32 version  u32 numEntries
+//   numEntries x { u32 crc  u32 size  u32 settings  u32 dataSize  data[] }
+//
+static const unsigned int kSidecarVersion = 1;
+
+// Slots hold a blob and its parse (5 bytes per input byte), so only the first
+// few blobs of a file get incremental recompression
+static const int kMaxSlots = 32;
+// Each incremental save can lose a few bytes against a full parse; start over
+// from scratch every so often so that doesn't add up
+static const int kMaxSlotReuses = 16;
+
+namespace
+{
+	//--------------------------------------------------------------------------
+	// CRC32C
+
+	unsigned int s_crcTable[ 256 ];
+
+	void BuildCrcTable()
+	{
+		for (unsigned int idx = 0; idx < 256; ++idx)
+		{
+			unsigned int crc = idx;
+			for (int bit = 0; bit < 8; ++bit)
+				crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+			s_crcTable[ idx ] = crc;
+		}
+	}
+
+	unsigned int Crc32c_Scalar(const unsigned char* pData, size_t nSize, unsigned int crc)
+	{
+		for (size_t idx = 0; idx < nSize; ++idx)
+			crc = s_crcTable[ (crc ^ pData[ idx ]) & 0xFF ] ^ (crc >> 8);
+		return crc;
+	}
+
+#if BLOB_CACHE_SSE42
+	BLOB_CACHE_TARGET("sse4.2")
+	unsigned int Crc32c_SSE42(const unsigned char* pData, size_t nSize, unsigned int crc)
+	{
+	#if defined(_M_X64) || defined(__x86_64__)
+		unsigned long long crc64 = crc;
+		for (; nSize >= 8; nSize -= 8, pData += 8)
+		{
+			unsigned long long chunk;
+			memcpy(&chunk, pData, 8);
+			crc64 = _mm_crc32_u64(crc64, chunk);
+		}
+		crc = (unsigned int)crc64;
+	#else
+		for (; nSize >= 4; nSize -= 4, pData += 4)
+		{
+			unsigned int chunk;
+			memcpy(&chunk, pData, 4);
+			crc = _mm_crc32_u32(crc, chunk);
+		}
+	#endif
+		for (; nSize; --nSize)
+			crc = _mm_crc32_u8(crc, *pData++);
+		return crc;
+	}
+
+	bool CpuHasSSE42()
+	{
+	#if defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 1);
+		return (regs[2] & (1 << 20)) != 0;
+	#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.2") != 0;
+	#endif
+	}
+#endif
+
+	typedef unsigned int (*CrcFn)(const unsigned char* pData, size_t nSize, unsigned int crc);
+
+	// Picked once, on first use
+	CrcFn GetCrcFn()
+	{
+		static const CrcFn fn = []()
+		{
+			BuildCrcTable();
+		#if BLOB_CACHE_SSE42
+			if (CpuHasSSE42())
+				return (CrcFn)Crc32c_SSE42;
+		#endif
+			return (CrcFn)Crc32c_Scalar;
+		}();
+
+		return fn;
+	}
+
+	//--------------------------------------------------------------------------
+	// Sidecar helpers
+
+	bool ReadU32(FILE* pFile, unsigned int& value)
+	{
+		unsigned char b[4];
+		if (fread(b, 1, 4, pFile) != 4)
+			return false;
+		value = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+		return true;
+	}
+
+	void PutU32(std::vector<unsigned char>& bytes, unsigned int value)
+	{
+		bytes.push_back( (value>>0)  & 0xFF );
+		bytes.push_back( (value>>8)  & 0xFF );
+		bytes.push_back( (value>>16) & 0xFF );
+		bytes.push_back( (value>>24) & 0xFF );
+	}
+
+	//--------------------------------------------------------------------------
+	// True if pCompressed expands back to exactly pInputData, after the
+	// nHistorySize bytes before it
+	bool ExpandsTo(const unsigned char* pCompressed, size_t nCompressedSize,
+				   const unsigned char* pInputData, size_t nInputSize,
+				   unsigned int nFlags, int nFormatVersion, size_t nHistorySize = 0)
+	{
+		std::vector<unsigned char> check( nHistorySize + nInputSize );
+		size_t checkSize;
+
+		if (nHistorySize)
+		{
+			memcpy( check.data(), pInputData - nHistorySize, nHistorySize );
+			checkSize = lzsa_decompress_block_inmem_history( (unsigned char*)pCompressed,
+															 check.data() + nHistorySize, nHistorySize,
+															 nCompressedSize, nInputSize,
+															 nFlags & BLOB_CACHE_LZSA_FLAG_RAW_BLOCK,
+															 nFormatVersion );
+		}
+		else
+		{
+			int version = nFormatVersion;
+			checkSize = lzsa_decompress_inmem( (unsigned char*)pCompressed, check.data(),
+											   nCompressedSize, nInputSize,
+											   nFlags & BLOB_CACHE_LZSA_FLAG_RAW_BLOCK,
+											   &version );
+		}
+
+		return (checkSize == nInputSize) &&
+			   (0 == memcmp( check.data() + nHistorySize, pInputData, nInputSize ));
+	}
+}
+
+//------------------------------------------------------------------------------
+unsigned int BlobCache::Crc32c(const unsigned char* pData, size_t nSize, unsigned int crc)
+{
+	return ~GetCrcFn()(pData, nSize, ~crc);
+}
+
+//------------------------------------------------------------------------------
+BlobCache::BlobCache(size_t maxBytes)
+	: m_bytes( 0 )
+	, m_maxBytes( maxBytes )
+	, m_hits( 0 )
+	, m_misses( 0 )
+	, m_incremental( 0 )
+	, m_incrementalSizeDelta( 0 )
+{
+}
+
+//------------------------------------------------------------------------------
+void BlobCache::Clear()
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	m_entries.clear();
+	m_index.clear();
+	m_batch.clear();
+	m_slots.clear();
+	m_bytes = 0;
+}
+
+//------------------------------------------------------------------------------
+void BlobCache::BeginBatch()
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	m_batch.clear();
+	m_hits = 0;
+	m_misses = 0;
+	m_incremental = 0;
+	m_incrementalSizeDelta = 0;
+}
+
+//------------------------------------------------------------------------------
+// Copy out a cached blob, and mark it most recently used
+//
+bool BlobCache::Find(const Key& key, std::vector<unsigned char>& data)
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	auto it = m_index.find( key );
+	if (it == m_index.end())
+		return false;
+
+	m_entries.splice( m_entries.begin(), m_entries, it->second );
+	data = it->second->data;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+void BlobCache::Store(const Key& key, const unsigned char* pData, size_t nSize)
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	m_batch.push_back( key );
+
+	auto it = m_index.find( key );
+	if (it != m_index.end())
+	{
+		m_bytes -= it->second->data.size();
+		m_entries.erase( it->second );
+		m_index.erase( it );
+	}
+
+	if (nSize > m_maxBytes)
+		return;
+
+	Entry entry;
+	entry.key = key;
+	entry.data.assign( pData, pData + nSize );
+	m_entries.push_front( entry );
+	m_index[ key ] = m_entries.begin();
+	m_bytes += nSize;
+
+	while (m_bytes > m_maxBytes)
+	{
+		Entry& oldest = m_entries.back();
+		m_bytes -= oldest.data.size();
+		m_index.erase( oldest.key );
+		m_entries.pop_back();
+	}
+}
+
+//------------------------------------------------------------------------------
+size_t BlobCache::Compress(const unsigned char* pInputData, unsigned char* pOutBuffer,
+						   size_t nInputSize, size_t nMaxOutBufferSize,
+						   unsigned int nFlags, int nMinMatchSize, int nFormatVersion,
+						   int slot, size_t nHistorySize)
+{
+	if (nHistorySize && ((2 != nFormatVersion) || !(nFlags & BLOB_CACHE_LZSA_FLAG_RAW_BLOCK)))
+		return (size_t)-1;
+
+	// With history, the key covers it too, and a flag bit keeps it apart from
+	// the same bytes without
+	Key key;
+	key.crc  = Crc32c( pInputData - nHistorySize, nHistorySize + nInputSize );
+	key.size = (unsigned int)nInputSize;
+	key.settings = (nFlags & 0x7FFF) | (nHistorySize ? 0x8000 : 0) |
+				   ((nMinMatchSize & 0xFF) << 16) | ((nFormatVersion & 0xFF) << 24);
+
+	std::vector<unsigned char> cached;
+	if (Find( key, cached ) && (cached.size() <= nMaxOutBufferSize))
+	{
+		// Only trust it if it really expands back to this blob
+		if (ExpandsTo( cached.data(), cached.size(), pInputData, nInputSize, nFlags, nFormatVersion, nHistorySize ))
+		{
+			memcpy( pOutBuffer, cached.data(), cached.size() );
+
+			std::lock_guard<std::mutex> lock( m_mutex );
+			m_batch.push_back( key );
+			++m_hits;
+			return cached.size();
+		}
+	}
+
+	size_t compSize;
+	if (nHistorySize)
+	{
+		compSize = lzsa_compress_block_inmem_history( (unsigned char*)pInputData, nHistorySize,
+													  pOutBuffer, nInputSize, nMaxOutBufferSize,
+													  nFlags, nMinMatchSize );
+	}
+	else if ((slot >= 0) && (slot < kMaxSlots) && (2 == nFormatVersion) &&
+		(nFlags & BLOB_CACHE_LZSA_FLAG_RAW_BLOCK) && (nInputSize <= 0x10000))
+	{
+		compSize = CompressSlot( slot, key.settings, pInputData, pOutBuffer,
+								 nInputSize, nMaxOutBufferSize, nFlags, nMinMatchSize );
+	}
+	else
+	{
+		compSize = lzsa_compress_inmem( (unsigned char*)pInputData, pOutBuffer,
+										nInputSize, nMaxOutBufferSize,
+										nFlags, nMinMatchSize, nFormatVersion );
+	}
+
+	if ((compSize > 0) && (compSize != (size_t)-1))
+	{
+		Store( key, pOutBuffer, compSize );
+	}
+
+	std::lock_guard<std::mutex> lock( m_mutex );
+	++m_misses;
+	return compSize;
+}
+
+//------------------------------------------------------------------------------
+// Compress against what the slot held last time, then keep the new input and
+// parse there for the next save
+//
+size_t BlobCache::CompressSlot(int slot, unsigned int settings,
+							   const unsigned char* pInputData, unsigned char* pOutBuffer,
+							   size_t nInputSize, size_t nMaxOutBufferSize,
+							   unsigned int nFlags, int nMinMatchSize)
+{
+	Slot prev;
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+
+		if (slot >= (int)m_slots.size())
+			m_slots.resize( slot + 1 );
+		prev.input.swap( m_slots[ slot ].input );
+		prev.parse.swap( m_slots[ slot ].parse );
+		prev.settings = m_slots[ slot ].settings;
+		prev.reuses = m_slots[ slot ].reuses;
+	}
+
+	bool usePrev = (prev.settings == settings) && (prev.input.size() == nInputSize) &&
+				   (prev.reuses < kMaxSlotReuses);
+	prev.parse.resize( lzsa_get_parse_size_inmem( nInputSize ) );
+
+	int reused = 0;
+	size_t compSize = lzsa_compress_block_inmem_incremental( usePrev ? prev.input.data() : nullptr,
+															 prev.input.size(),
+															 (unsigned char*)pInputData, pOutBuffer,
+															 nInputSize, nMaxOutBufferSize,
+															 nFlags, nMinMatchSize,
+															 prev.parse.data(), &reused );
+
+	if (reused && ((compSize == (size_t)-1) ||
+		!ExpandsTo( pOutBuffer, compSize, pInputData, nInputSize, nFlags, 2 )))
+	{
+		// Shouldn't happen, but the parse we kept is no good; start over
+		reused = 0;
+		compSize = lzsa_compress_block_inmem_incremental( nullptr, 0,
+														  (unsigned char*)pInputData, pOutBuffer,
+														  nInputSize, nMaxOutBufferSize,
+														  nFlags, nMinMatchSize,
+														  prev.parse.data(), nullptr );
+	}
+
+	long long sizeDelta = 0;
+#if BLOB_CACHE_CHECK_INCREMENTAL
+	if (reused && (compSize != (size_t)-1))
+	{
+		std::vector<unsigned char> full( nMaxOutBufferSize );
+		size_t fullSize = lzsa_compress_inmem( (unsigned char*)pInputData, full.data(),
+											   nInputSize, nMaxOutBufferSize,
+											   nFlags, nMinMatchSize, 2 );
+		if (fullSize != (size_t)-1)
+		{
+			sizeDelta = (long long)compSize - (long long)fullSize;
+
+			wchar_t buf[ 160 ];
+			swprintf(buf, 160, L"BlobCache: slot %d incremental %u bytes, full %u bytes (%+lld)\n",
+					 slot, (unsigned)compSize, (unsigned)fullSize, sizeDelta);
+			OutputDebugStringW(buf);
+		}
+	}
+#endif
+
+	if (compSize != (size_t)-1)
+	{
+		prev.input.assign( pInputData, pInputData + nInputSize );
+		prev.settings = settings;
+		prev.reuses = reused ? prev.reuses + 1 : 0;
+	}
+	else
+	{
+		prev.input.clear();
+		prev.parse.clear();
+	}
+
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	if (slot < (int)m_slots.size())
+	{
+		m_slots[ slot ].input.swap( prev.input );
+		m_slots[ slot ].parse.swap( prev.parse );
+		m_slots[ slot ].settings = prev.settings;
+		m_slots[ slot ].reuses = prev.reuses;
+	}
+
+	if (reused)
+	{
+		++m_incremental;
+		m_incrementalSizeDelta += sizeDelta;
+	}
+
+	return compSize;
+}
+
+//------------------------------------------------------------------------------
+bool BlobCache::LoadSidecar(const wchar_t* pPath)
+{
+	FILE* pFile = nullptr;
+	errno_t err = _wfopen_s(&pFile, pPath, L"rb");
+	if ((0 != err) || (nullptr == pFile))
+		return false;
+
+	bool ok = false;
+	char magic[4];
+	unsigned int version = 0;
+	unsigned int numEntries = 0;
+
+	if ((fread(magic, 1, 4, pFile) == 4) && (0 == memcmp(magic, "BLBC", 4)) &&
+		ReadU32(pFile, version) && (kSidecarVersion == version) &&
+		ReadU32(pFile, numEntries))
+	{
+		ok = true;
+		std::vector<unsigned char> data;
+
+		for (unsigned int idx = 0; ok && (idx < numEntries); ++idx)
+		{
+			Key key;
+			unsigned int dataSize = 0;
+
+			ok = ReadU32(pFile, key.crc) && ReadU32(pFile, key.size) &&
+				 ReadU32(pFile, key.settings) && ReadU32(pFile, dataSize) &&
+				 (dataSize > 0) && (dataSize <= 0x20000);
+
+			if (ok)
+			{
+				data.resize( dataSize );
+				ok = fread(data.data(), 1, dataSize, pFile) == dataSize;
+			}
+
+			if (ok)
+			{
+				Store( key, data.data(), dataSize );
+			}
+		}
+	}
+
+	fclose(pFile);
+
+	// Loading isn't part of any save
+	std::lock_guard<std::mutex> lock( m_mutex );
+	m_batch.clear();
+
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+bool BlobCache::SaveSidecar(const wchar_t* pPath)
+{
+	std::vector<unsigned char> bytes;
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+
+		bytes.insert(bytes.end(), "BLBC", "BLBC" + 4);
+		PutU32(bytes, kSidecarVersion);
+		size_t countOffset = bytes.size();
+		PutU32(bytes, 0);
+
+		// Repeated blobs (blank space, mostly) share an entry
+		std::unordered_set<Key, KeyHash> written;
+
+		unsigned int numEntries = 0;
+		for (size_t idx = 0; idx < m_batch.size(); ++idx)
+		{
+			auto it = m_index.find( m_batch[ idx ] );
+			if ((it == m_index.end()) || !written.insert( m_batch[ idx ] ).second)
+				continue;
+
+			const Entry& entry = *it->second;
+			PutU32(bytes, entry.key.crc);
+			PutU32(bytes, entry.key.size);
+			PutU32(bytes, entry.key.settings);
+			PutU32(bytes, (unsigned int)entry.data.size());
+			bytes.insert(bytes.end(), entry.data.begin(), entry.data.end());
+			++numEntries;
+		}
+
+		bytes[ countOffset + 0 ] = (numEntries>>0)  & 0xFF;
+		bytes[ countOffset + 1 ] = (numEntries>>8)  & 0xFF;
+		bytes[ countOffset + 2 ] = (numEntries>>16) & 0xFF;
+		bytes[ countOffset + 3 ] = (numEntries>>24) & 0xFF;
+	}
+
+	FILE* pFile = nullptr;
+	errno_t err = _wfopen_s(&pFile, pPath, L"wb");
+	if ((0 != err) || (nullptr == pFile))
+		return false;
+
+	size_t written = fwrite(&bytes[0], 1, bytes.size(), pFile);
+	fclose(pFile);
+
+	return written == bytes.size();
+}
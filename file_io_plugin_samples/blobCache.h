@@ -0,0 +1,132 @@
+//
+// BlobCache: remembers the LZSA output for the 64KB PIXL blobs written by the
+// I256 and I16 encoders, so re-saving an image after a small edit only pays
+// for the optimal parse on the blobs that actually changed.
+//
+// Entries are keyed by a CRC32C of the blob's input bytes, the input size and
+// the compression settings (flags, min match size, format version). A hit is
+// only used after the stored bytes decompress back to the exact input, so a
+// hash collision, or a stale sidecar file, just costs a normal compress.
+//
+// A blob that misses the cache can still be recompressed incrementally: for
+// each blob position in the file (its slot) the cache keeps the last input and
+// the LZSA parse that was written for it, and when only a few bytes changed
+// just the area around them is parsed again.
+//
+// Shared by the i16 and i256 plugins; each DLL owns one cache in its shim and
+// hands it to the file object with SetBlobCache().
+//
+#ifndef BLOB_CACHE_H
+#define BLOB_CACHE_H
+
+#include <stddef.h>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class BlobCache
+{
+public:
+	// maxBytes caps the compressed bytes held; least recently used blobs are
+	// dropped first
+	BlobCache(size_t maxBytes = 32 * 1024 * 1024);
+
+	// Same contract as lzsa_compress_inmem: returns the compressed size, or
+	// (size_t)-1 on error. Served from the cache when possible, otherwise
+	// compressed and remembered. slot is the blob's index in the file; raw
+	// LZSA2 blobs with a slot are recompressed incrementally on a miss.
+	// nHistorySize bytes before pInputData, at most 64KB, are history the
+	// blob can match into (raw LZSA2 only, no incremental recompression);
+	// they're part of the cache key.
+	size_t Compress(const unsigned char* pInputData, unsigned char* pOutBuffer,
+					size_t nInputSize, size_t nMaxOutBufferSize,
+					unsigned int nFlags, int nMinMatchSize, int nFormatVersion,
+					int slot = -1, size_t nHistorySize = 0);
+
+	// Start a new save: resets the hit/miss counters and the list of blobs
+	// that SaveSidecar() writes out
+	void BeginBatch();
+	int  GetHits()   const { return m_hits; }
+	int  GetMisses() const { return m_misses; }
+	// Misses that reused the parse of their slot
+	int  GetIncremental() const { return m_incremental; }
+	// With BLOB_CACHE_CHECK_INCREMENTAL, the bytes the incremental blobs of
+	// this batch cost over a full compression
+	long long GetIncrementalSizeDelta() const { return m_incrementalSizeDelta; }
+
+	void Clear();
+
+	// Optional persistence, next to the image (<image>.blobcache). Load merges
+	// the file's entries into the cache; Save writes the blobs used since the
+	// last BeginBatch(). Both return false on any I/O or format problem.
+	bool LoadSidecar(const wchar_t* pPath);
+	bool SaveSidecar(const wchar_t* pPath);
+
+	// CRC32C (Castagnoli), SSE4.2 accelerated when the CPU has it
+	static unsigned int Crc32c(const unsigned char* pData, size_t nSize,
+							   unsigned int crc = 0);
+
+private:
+	struct Key
+	{
+		unsigned int crc;
+		unsigned int size;
+		unsigned int settings;
+
+		bool operator==(const Key& other) const
+		{
+			return (crc == other.crc) && (size == other.size) &&
+				   (settings == other.settings);
+		}
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const
+		{
+			return (size_t)key.crc ^ ((size_t)key.size << 7) ^ ((size_t)key.settings << 17);
+		}
+	};
+
+	struct Entry
+	{
+		Key key;
+		std::vector<unsigned char> data;
+	};
+
+	typedef std::list<Entry> EntryList;
+
+	// Last input and parse written for one blob position
+	struct Slot
+	{
+		unsigned int settings;
+		int reuses;				// incremental saves since the last full parse
+		std::vector<unsigned char> input;
+		std::vector<unsigned char> parse;
+	};
+
+	bool Find(const Key& key, std::vector<unsigned char>& data);
+	void Store(const Key& key, const unsigned char* pData, size_t nSize);
+
+	size_t CompressSlot(int slot, unsigned int settings,
+						const unsigned char* pInputData, unsigned char* pOutBuffer,
+						size_t nInputSize, size_t nMaxOutBufferSize,
+						unsigned int nFlags, int nMinMatchSize);
+
+	EntryList m_entries;     // most recently used first
+	std::unordered_map<Key, EntryList::iterator, KeyHash> m_index;
+	std::vector<Key> m_batch;
+	std::vector<Slot> m_slots;
+
+	size_t m_bytes;
+	size_t m_maxBytes;
+	int    m_hits;
+	int    m_misses;
+	int    m_incremental;
+	long long m_incrementalSizeDelta;
+
+	std::mutex m_mutex;
+};
+
+#endif // BLOB_CACHE_H
@@ -36,11 +36,12 @@ PMNG_PLUGINS="${PMNG_PLUGINS:-$HOME/Applications/ProMotionNG/wineprefix/drive_c/
 
 # --- per-plugin config -----------------------------------------------------
 # Fields: dir | output DLL basename | export-shim cpp | file-format cpp | uses lzsa?
+#         | shared cpp(s) from this directory, comma separated ("-" for none)
 plugin_cfg() {
     case "$1" in
-        c1)   echo "c1   c1ImgIo   c1ImageIo.cpp   c1_file.cpp   no"  ;;
-        i16)  echo "i16  i16ImgIo  i16ImageIo.cpp  16_file.cpp   yes" ;;
-        i256) echo "i256 i256ImgIo i256ImageIo.cpp 256_file.cpp  yes" ;;
+        c1)   echo "c1   c1ImgIo   c1ImageIo.cpp   c1_file.cpp   no   metaIndex.cpp,colorQuantizer.cpp" ;;
+        i16)  echo "i16  i16ImgIo  i16ImageIo.cpp  16_file.cpp   yes  blobCache.cpp,pixlBlobs.cpp,metaIndex.cpp,colorQuantizer.cpp" ;;
+        i256) echo "i256 i256ImgIo i256ImageIo.cpp 256_file.cpp  yes  blobCache.cpp,pixlBlobs.cpp,metaIndex.cpp,colorQuantizer.cpp" ;;
         *)    return 1 ;;
     esac
 }
@@ -64,8 +65,10 @@ done
 
 build_one() {
     local name="$1"
-    local dir binary shim_cpp fmt_cpp uses_lzsa
-    read -r dir binary shim_cpp fmt_cpp uses_lzsa <<<"$(plugin_cfg "$name")"
+    local dir binary shim_cpp fmt_cpp uses_lzsa shared
+    read -r dir binary shim_cpp fmt_cpp uses_lzsa shared <<<"$(plugin_cfg "$name")"
+    local shared_cpps=()
+    [[ "$shared" != "-" ]] && IFS=',' read -r -a shared_cpps <<<"$shared"
     local SD="$HERE/$dir"
     local OUT="$SD/build"
     local STAGE="$OUT/obj"
@@ -74,14 +77,19 @@ build_one() {
     echo "==================== $name ===================="
     rm -rf "$STAGE"; mkdir -p "$STAGE"
 
-    # Stage the plugin's own C++ sources + headers flat. The export-shim header
-    # (<name>ImageIo.h) includes "..\pluginInterface.h" -- a Windows backslash
-    # path to the shared interface header one dir up. Copy that shared header in
-    # flat and rewrite the backslash include so it resolves under a Unix
+    # Stage the plugin's own C++ sources + headers flat. Sources include the
+    # shared files one dir up with Windows backslash paths
+    # ("..\pluginInterface.h", "..\blobCache.h"). Copy those shared files in
+    # flat (every shared header, some of them header-only, plus each shared
+    # cpp) and rewrite the backslash includes so they resolve under a Unix
     # toolchain. (Harmless if a plugin already ships a local copy.)
     cp "$SD"/*.cpp "$SD"/*.h "$STAGE"/
-    cp "$HERE"/pluginInterface.h "$STAGE"/ 2>/dev/null || true
-    perl -0pi -e 's/#include\s+"\.\.[\\\/]+pluginInterface\.h"/#include "pluginInterface.h"/' "$STAGE/${name}ImageIo.h"
+    cp "$HERE"/*.h "$STAGE"/ 2>/dev/null || true
+    local sc
+    for sc in ${shared_cpps[@]+"${shared_cpps[@]}"}; do
+        cp "$HERE/$sc" "$STAGE"/
+    done
+    perl -0pi -e 's/#include\s+"\.\.[\\\/]+([A-Za-z_0-9.]+)"/#include "$1"/g' "$STAGE"/*.h "$STAGE"/*.cpp
 
     # i16 ships compat.h, which provides static-inline fopen_s / sscanf_s shims
     # for "non-MSVC compilers" (guarded by #ifndef _MSC_VER). mingw is non-MSVC
@@ -131,10 +139,12 @@ PY
     # Force-include <cstring> on the C++ compiles: i256's 256_file.cpp uses
     # memcpy without including <string.h>, relying on MSVC headers to pull it in
     # transitively. mingw's libstdc++ doesn't, so inject it. Harmless elsewhere.
-    echo "==> compiling C++ ($shim_cpp, $fmt_cpp)"
-    "$CXX" -O2 -std=c++17 -municode -include cstring "${DEF[@]}" "${INC[@]}" -c "$STAGE/$shim_cpp" -o "$STAGE/${shim_cpp%.cpp}.o"
-    "$CXX" -O2 -std=c++17 -municode -include cstring "${DEF[@]}" "${INC[@]}" -c "$STAGE/$fmt_cpp"  -o "$STAGE/${fmt_cpp%.cpp}.o"
-    OBJS+=("$STAGE/${shim_cpp%.cpp}.o" "$STAGE/${fmt_cpp%.cpp}.o")
+    local cpp
+    echo "==> compiling C++ ($shim_cpp, $fmt_cpp${shared_cpps[@]+, ${shared_cpps[*]}})"
+    for cpp in "$shim_cpp" "$fmt_cpp" ${shared_cpps[@]+"${shared_cpps[@]}"}; do
+        "$CXX" -O2 -std=c++17 -municode -include cstring "${DEF[@]}" "${INC[@]}" -c "$STAGE/$cpp" -o "$STAGE/${cpp%.cpp}.o"
+        OBJS+=("$STAGE/${cpp%.cpp}.o")
+    done
 
     if [[ "$uses_lzsa" == yes ]]; then
         # lzsa core: every .c in lzsa/src except the command-line driver lzsa.c
@@ -1,5 +1,6 @@
 // c1 file I/O plugin shim. Wraps C1File for the Promotion plugin contract.
-// Handles a single raw 32768-byte Apple IIgs SHR screen (.c1).
+// Handles a single raw 32768-byte Apple IIgs SHR screen (.c1), and its
+// PackBytes compressed and 3200 color relatives.
 //
 // NOTE: do NOT add a translation-unit-wide `#pragma pack(1)` here. The on-disk
 // structs (C1_Color, C1_FileImage) manage their own packing with push/pop in
@@ -10,14 +11,29 @@
 
 #include "c1ImageIo.h"
 #include "c1_file.h"
+#include "..\metaIndex.h"
+#include "..\decodedFileCache.h"
+#include "..\pinModule.h"
 
 #include <stdio.h>
 #include <malloc.h>
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #define GDEBUG 0
 
+// 1 to remember each file's size and palette in the shared metadata index, so
+// browsing a folder doesn't open files that were seen before
+#define META_INDEX 1
+
+// Memory kept for recently opened files, so going back to one is a copy
+// instead of another read and decode; 0 turns that off.
+#define DECODED_FILE_CACHE_BYTES (16 * 1024 * 1024)
+
 #define FILE_TYPE_ID "de.cosmigo.fileio.c1"
-#define FILE_BOX_DESCRIPTION L"C1 - Apple IIgs SHR (raw 32K)"
+#define FILE_BOX_DESCRIPTION L"C1 - Apple IIgs SHR (32K, 3200 color, PackBytes)"
 #define FILE_EXTENSION L"c1"
 
 // Plugin interface version
@@ -27,15 +43,29 @@
 #define ERROR_NO_FILE_NAME    L"No file given to load!"
 #define ERROR_FILE_OPEN_FAILED L"Could not open file!"
 #define ERROR_BAD_DIMENSIONS  L"C1 plugin only supports 320x200 or 640x200 images."
+#define ERROR_BAD_DIMENSIONS_3200 L"3200 color files ($C1/0002) are 320x200 only."
+
+// ProDOS file and aux type, as in a CiderPress suffix, of 3200 color SHR
+// files and of PackBytes compressed ones
+#define PRODOS_TYPE_3200   0xC10002
+#define PRODOS_TYPE_PACKED 0xC00001
 
 wchar_t lastErrorMessage[2048];
 ProgressCallback progressCallback = NULL;
 
 // Filename Promotion last gave us, normalized (CiderPress aux-type suffix stripped).
 wchar_t currentFileName[2048];
+// File and aux type from that suffix, -1 without one. Saves to $C1/0002 are
+// 3200 color, saves to $C0/0001 are packed. Loads go by the contents.
+static long currentProdosType = -1;
 
 bool basicDataLoaded = false;
 C1File* CurrentFile = nullptr;
+// CurrentFile's file as it was when loaded.
+static FileStamp currentStamp;
+
+// Files opened earlier; CurrentFile goes back in here when it's done with.
+static DecodedFileCache<C1File> fileCache(DECODED_FILE_CACHE_BYTES);
 
 // Promotion-side 256-entry RGB palette (8 bits/channel).
 unsigned char rgbTable[768];
@@ -47,6 +77,26 @@ struct
 	int height;
 } fileHeader;
 
+// Write-behind: writeNextImage hands its C1File (which holds a copy of the
+// frame) to saveThread, which does the row analysis, remapping and file write
+// off Promotion's UI thread. finishProcessing waits for it and reports any
+// failure.
+static std::thread       saveThread;
+static std::atomic<int>  saveProgress(0);
+static std::atomic<bool> saveRunning(false);
+static wchar_t saveFileName[2048];
+static wchar_t saveErrorMessage[2048];
+
+// True color saves: the frame as handed over; the worker fits the palettes
+// and SCBs to it.
+static std::vector<unsigned char> saveRgba;
+// Write the image PackBytes compressed
+static bool savePacked = false;
+
+#if META_INDEX
+static MetaIndex metaIndex(L"c1");
+#endif
+
 #if GDEBUG
 volatile bool GWaitAttach = true;
 
@@ -76,9 +126,13 @@ static void resetBasicData()
 	fileHeader.width = -1;
 	fileHeader.height = -1;
 	memset(rgbTable, 0, sizeof(rgbTable));
+	// Keep the file around, in case Promotion comes back to it.
 	if (CurrentFile)
 	{
-		delete CurrentFile;
+		if (CurrentFile->IsValid())
+			fileCache.Put(currentFileName, currentStamp, CurrentFile);
+		else
+			delete CurrentFile;
 		CurrentFile = nullptr;
 	}
 	resetError();
@@ -98,27 +152,54 @@ static inline bool isHex(wchar_t c)
 	    || (c >= L'A' && c <= L'F');
 }
 
-// CiderPress-style filenames carry the ProDOS type/aux as an "#XXXXXXXX"
-// suffix (8 hex digits). The plugin accepts both:
+// CiderPress-style filenames carry the ProDOS type/aux as a "#TTAAAA"
+// suffix (6 hex digits: 2 of file type, 4 of aux type). The plugin accepts
+// both:
 //   foo.c1            (plain)
 //   foo.c1#c10000     (extension + suffix)
 //   foo#c10000        (suffix only, no extension)
-// This function strips any trailing "#XXXXXXXX" so file-open uses the
-// actual on-disk filename — we don't ever rewrite filenames on save.
-static void normalizeCiderPressSuffix(wchar_t* path)
+// This function strips any trailing "#TTAAAA" so file-open uses the actual
+// on-disk filename — we don't ever rewrite filenames on save. Returns the file
+// and aux type as 0xTTAAAA, or -1 if there was no suffix.
+static long normalizeCiderPressSuffix(wchar_t* path)
 {
 	size_t len = wcslen(path);
-	if (len < 9) return;
+	if (len < 7) return -1;
 
-	// Look for "#" followed by exactly 8 hex digits, ending the basename.
+	// Look for "#" followed by exactly 6 hex digits, ending the basename.
 	// The suffix is always at the end of the string.
-	if (path[len - 9] != L'#') return;
-	for (size_t i = len - 8; i < len; ++i)
+	if (path[len - 7] != L'#') return -1;
+	for (size_t i = len - 6; i < len; ++i)
+	{
+		if (!isHex(path[i])) return -1;
+	}
+	long prodosType = wcstol(path + len - 6, NULL, 16);
+	path[len - 7] = 0;
+	return prodosType;
+}
+
+#if META_INDEX
+// Remember what loadBasicData reports for pPath.
+static void storeMetaData(const wchar_t* pPath, const C1File* pFile)
+{
+	MetaIndexEntry meta;
+	meta.handled = true;
+	meta.width = pFile->GetWidthPixels();
+	meta.height = pFile->GetHeight();
+	meta.frameCount = 1;
+	meta.numColors = 256;
+
+	const C1_Color* pal = pFile->GetPalette();
+	for (int i = 0; i < 256; ++i)
 	{
-		if (!isHex(path[i])) return;
+		meta.rgb[i * 3 + 0] = expand4to8((unsigned char)pal[i].r);
+		meta.rgb[i * 3 + 1] = expand4to8((unsigned char)pal[i].g);
+		meta.rgb[i * 3 + 2] = expand4to8((unsigned char)pal[i].b);
 	}
-	path[len - 9] = 0;
+
+	metaIndex.Store(pPath, meta);
 }
+#endif
 
 // auto load basic file information from the given file
 static bool ensureBasicData()
@@ -134,14 +215,45 @@ static bool ensureBasicData()
 		return false;
 	}
 
-	CurrentFile = new C1File(currentFileName);
+	// Opened lately? Then it's all still here.
+	CurrentFile = fileCache.Take(currentFileName, currentStamp);
 
-	if (!CurrentFile->IsValid())
+	if (!CurrentFile)
 	{
-		delete CurrentFile;
-		CurrentFile = nullptr;
-		// Silent on probe — Promotion asks every plugin about every file.
-		return false;
+#if META_INDEX
+		// Seen this file before? Then it doesn't need to be opened until
+		// loadNextImage.
+		MetaIndexEntry meta;
+		if (metaIndex.Lookup(currentFileName, meta))
+		{
+			if (!meta.handled)
+				return false;
+
+			fileHeader.width  = meta.width;
+			fileHeader.height = meta.height;
+			memcpy(rgbTable, meta.rgb, meta.numColors * 3);
+
+			basicDataLoaded = true;
+			return true;
+		}
+#endif
+
+		CurrentFile = new C1File(currentFileName);
+
+		if (!CurrentFile->IsValid())
+		{
+			delete CurrentFile;
+			CurrentFile = nullptr;
+#if META_INDEX
+			metaIndex.Store(currentFileName, MetaIndexEntry());
+#endif
+			// Silent on probe — Promotion asks every plugin about every file.
+			return false;
+		}
+
+#if META_INDEX
+		storeMetaData(currentFileName, CurrentFile);
+#endif
 	}
 
 	fileHeader.width  = CurrentFile->GetWidthPixels();
@@ -167,6 +279,64 @@ static void updateProgress(int progress)
 	}
 }
 
+// Block until the background save (if any) is done. The worker's progress is
+// forwarded from this thread, so the callback never runs on the worker.
+static void waitForSave()
+{
+	if (!saveThread.joinable())
+		return;
+
+	while (saveRunning)
+	{
+		updateProgress(saveProgress);
+		std::this_thread::sleep_for(std::chrono::milliseconds(15));
+	}
+	saveThread.join();
+
+	updateProgress(saveProgress);
+}
+
+// Body of the background save; owns pFile or, for 3200 color, pFile3200.
+static void runSave(C1File* pFile, C1File3200* pFile3200)
+{
+	if (!saveRgba.empty())
+	{
+		if (pFile3200)
+			pFile3200->SetTrueColorImage(saveRgba.data());
+		else
+			pFile->SetTrueColorImage(saveRgba.data());
+		std::vector<unsigned char>().swap(saveRgba);
+	}
+
+	saveProgress = 60;
+
+	bool saved = pFile3200 ? pFile3200->SaveToFile(saveFileName)
+	                       : pFile->SaveToFile(saveFileName, savePacked);
+	if (!saved)
+	{
+		wcscpy_s(saveErrorMessage, 2048, ERROR_FILE_OPEN_FAILED);
+	}
+#if META_INDEX
+	else
+	{
+		// Index the file as written. Read it back rather than trusting pFile:
+		// a 640 image whose rows all collapsed to 320 mode loads as 320 wide.
+		C1File written(saveFileName);
+		if (written.IsValid())
+		{
+			storeMetaData(saveFileName, &written);
+			metaIndex.Flush(true);
+		}
+	}
+#endif
+
+	delete pFile;
+	delete pFile3200;
+
+	saveProgress = 100;
+	saveRunning = false;
+}
+
 //------------------------------------------------------------------------------
 
 extern "C"
@@ -199,7 +369,7 @@ extern "C"
 
 	bool __stdcall isReadSupported()      { resetError(); return true;  }
 	bool __stdcall isWriteSupported()     { resetError(); return true;  }
-	bool __stdcall isWriteTrueColorSupported() { resetError(); return false; }
+	bool __stdcall isWriteTrueColorSupported() { resetError(); return true;  }
 
 	wchar_t* __stdcall getFileBoxDescription() { resetError(); return (wchar_t*)FILE_BOX_DESCRIPTION; }
 	wchar_t* __stdcall getFileExtension()      { resetError(); return (wchar_t*)FILE_EXTENSION; }
@@ -208,21 +378,29 @@ extern "C"
 	{
 		resetError();
 
-		if (wcscmp(currentFileName, filename) != 0)
+		// Compare without the suffix, or a name with one would never match.
+		wchar_t name[2048];
+		wcscpy_s(name, 2048, filename);
+		long prodosType = normalizeCiderPressSuffix(name);
+
+		if (wcscmp(currentFileName, name) != 0)
 		{
 			resetBasicData();
-			wcscpy_s(currentFileName, 2048, filename);
-			normalizeCiderPressSuffix(currentFileName);
+			wcscpy_s(currentFileName, 2048, name);
 		}
+		currentProdosType = prodosType;
 	}
 
 	bool __stdcall canHandle()
 	{
+		// A save in flight may still be writing this file.
+		waitForSave();
 		return ensureBasicData();
 	}
 
 	bool __stdcall loadBasicData()
 	{
+		waitForSave();
 		return ensureBasicData();
 	}
 
@@ -252,6 +430,21 @@ extern "C"
 
 		updateProgress(0);
 
+		if (!CurrentFile)
+		{
+			// Basic data came from the metadata index; the file itself hasn't
+			// been opened yet.
+			CurrentFile = new C1File(currentFileName);
+		}
+
+		if (!CurrentFile->IsValid() ||
+		    CurrentFile->GetWidthPixels() != fileHeader.width ||
+		    CurrentFile->GetHeight() != fileHeader.height)
+		{
+			wcscpy_s(lastErrorMessage, 2048, ERROR_FILE_OPEN_FAILED);
+			return false;
+		}
+
 		const std::vector<unsigned char*>& maps = CurrentFile->GetPixelMaps();
 		int w = CurrentFile->GetWidthPixels();
 		int h = CurrentFile->GetHeight();
@@ -273,6 +466,7 @@ extern "C"
 	                          int /*transparentColor*/, bool /*alphaEnabled*/,
 	                          int /*numberOfFrames*/)
 	{
+		waitForSave();
 		resetBasicData();
 
 		if ((width != 320 && width != 640) || height != 200)
@@ -281,6 +475,12 @@ extern "C"
 			return false;
 		}
 
+		if (currentProdosType == PRODOS_TYPE_3200 && width != 320)
+		{
+			wcscpy_s(lastErrorMessage, 2048, ERROR_BAD_DIMENSIONS_3200);
+			return false;
+		}
+
 		fileHeader.width  = width;
 		fileHeader.height = height;
 
@@ -292,41 +492,114 @@ extern "C"
 	                              unsigned char* colorFramePalette,
 	                              unsigned char* /*alphaFrame*/,
 	                              unsigned char* /*alphaFramePalette*/,
-	                              unsigned char* /*rgba*/,
+	                              unsigned char* rgba,
 	                              unsigned short /*delayMs*/)
 	{
+		waitForSave();
+
 		if (CurrentFile)
 		{
 			delete CurrentFile;
 			CurrentFile = nullptr;
 		}
 
-		CurrentFile = new C1File(fileHeader.width, fileHeader.height);
-		if (!CurrentFile->IsValid())
-		{
-			wcscpy_s(lastErrorMessage, 2048, ERROR_BAD_DIMENSIONS);
-			return false;
-		}
+		// Whatever was kept of the old file is stale now.
+		fileCache.Remove(currentFileName);
 
-		CurrentFile->SetPalette(colorFramePalette);
-		CurrentFile->AddImage(colorFrame);
+#if META_INDEX
+		// The file is about to change under its index entry.
+		metaIndex.Forget(currentFileName);
+#endif
 
-		updateProgress(60);
+		size_t numPixels = (size_t)fileHeader.width * fileHeader.height;
 
-		bool ok = CurrentFile->SaveToFile(currentFileName);
+		// The save object belongs to the worker from here on.
+		C1File*     pFile     = nullptr;
+		C1File3200* pFile3200 = nullptr;
 
-		updateProgress(100);
+		if (currentProdosType == PRODOS_TYPE_3200)
+		{
+			// Every row gets its own palette, which takes true color; an
+			// indexed frame is expanded through its palette first.
+			pFile3200 = new C1File3200();
+
+			if (rgba != NULL)
+			{
+				saveRgba.assign(rgba, rgba + numPixels * 4);
+			}
+			else
+			{
+				saveRgba.resize(numPixels * 4);
+				for (size_t i = 0; i < numPixels; ++i)
+				{
+					memcpy(&saveRgba[i * 4], colorFramePalette + colorFrame[i] * 3, 3);
+					saveRgba[i * 4 + 3] = 255;
+				}
+			}
+		}
+		else
+		{
+			pFile = new C1File(fileHeader.width, fileHeader.height);
+			if (!pFile->IsValid())
+			{
+				delete pFile;
+				wcscpy_s(lastErrorMessage, 2048, ERROR_BAD_DIMENSIONS);
+				return false;
+			}
+
+			if (rgba != NULL)
+			{
+				// True color: keep a copy for the worker, which picks the
+				// palettes.
+				saveRgba.assign(rgba, rgba + numPixels * 4);
+			}
+			else
+			{
+				// AddImage copies, so Promotion is free to reuse colorFrame.
+				pFile->SetPalette(colorFramePalette);
+				pFile->AddImage(colorFrame);
+			}
+		}
+
+		wcscpy_s(saveFileName, 2048, currentFileName);
+		savePacked = currentProdosType == PRODOS_TYPE_PACKED;
+		saveErrorMessage[0] = 0;
+		saveProgress = 10;
+		saveRunning = true;
 
-		if (!ok && !isError())
+		try
 		{
-			wcscpy_s(lastErrorMessage, 2048, ERROR_FILE_OPEN_FAILED);
+			pinModule();
+			saveThread = std::thread(runSave, pFile, pFile3200);
 		}
-		return ok;
+		catch (...)
+		{
+			// No thread to be had; save inline instead.
+			runSave(pFile, pFile3200);
+		}
+
+		updateProgress(10);
+		return true;
 	}
 
 	void __stdcall finishProcessing()
 	{
+		waitForSave();
+
 		resetBasicData();
+
+		// resetBasicData cleared the error; put back any failure from the
+		// background save.
+		if (saveErrorMessage[0])
+		{
+			wcscpy_s(lastErrorMessage, 2048, saveErrorMessage);
+			saveErrorMessage[0] = 0;
+		}
+
+#if META_INDEX
+		// Writes the index only now and then, not once per file of a scan.
+		metaIndex.Flush();
+#endif
 		updateProgress(0);
 	}
 }
@@ -345,7 +618,12 @@ BOOL APIENTRY DllMain(HANDLE /*hModule*/,
 		case DLL_PROCESS_ATTACH:
 		case DLL_THREAD_ATTACH:
 		case DLL_THREAD_DETACH:
+			break;
 		case DLL_PROCESS_DETACH:
+			// The DLL is pinned while a save can run, so this is process
+			// exit, with the worker already gone; let go of its handle.
+			if (saveThread.joinable())
+				saveThread.detach();
 			break;
 	}
 	return TRUE;
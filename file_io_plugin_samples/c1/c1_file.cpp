@@ -4,17 +4,34 @@
 //
 
 #include "c1_file.h"
+#include "..\colorQuantizer.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <wchar.h>
 
+#include <vector>
+
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #endif
 
+// Vector row kernels, picked at run time (see GetShrRowKernels)
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define C1_ROW_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define C1_TARGET(isa)
+#else
+#define C1_TARGET(isa) __attribute__((target(isa)))
+#endif
+#else
+#define C1_ROW_SIMD 0
+#endif
+
 //------------------------------------------------------------------------------
 // 640-mode pixel column -> palette offset within the row's 16-color bank.
 // 640 mode packs 4 pixels per byte: bits 7-6, 5-4, 3-2, 1-0. Each 2-bit pixel
@@ -25,6 +42,649 @@
 //   column %4 == 3  ->  bank + 4..7
 static const int k640ColumnBase[4] = { 8, 12, 0, 4 };
 
+//------------------------------------------------------------------------------
+// SHR row kernels
+//
+// Decoders expand numBytes of packed screen data into 8-bit indices with the
+// row's pre-shifted bank ORed in; packers do the reverse for rows whose
+// pixels are already legal for the row's SCB.  numBytes is 160 for every
+// real row; the vector loops run 16 (SSE2) or 32 (AVX2) source bytes per
+// iteration and leave any remainder to the scalar loop.
+//
+// Every k640ColumnBase entry is a multiple of 4, so a legal 640-mode pixel's
+// 2-bit code is just its low two bits, and bank | (base + code) is
+// (bank | base) | code.
+//
+namespace
+{
+	typedef void (*RowDecodeFn)(const unsigned char* pSrc, unsigned char* pDst,
+								int numBytes, unsigned char bank);
+	typedef void (*RowPackFn)(const unsigned char* pSrc, unsigned char* pDst,
+							  int numBytes);
+
+	// 320 mode: 2 pixels per byte
+	void Decode320_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+						  int numBytes, unsigned char bank)
+	{
+		for (int x = 0; x < numBytes; ++x)
+		{
+			unsigned char b = pSrc[x];
+			pDst[(x << 1)    ] = (unsigned char)(bank | ((b >> 4) & 0x0F));
+			pDst[(x << 1) + 1] = (unsigned char)(bank | (b        & 0x0F));
+		}
+	}
+
+	// 320 mode presented as 640: each pixel doubled
+	void Decode320x2_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+							int numBytes, unsigned char bank)
+	{
+		for (int x = 0; x < numBytes; ++x)
+		{
+			unsigned char b = pSrc[x];
+			unsigned char hi = (unsigned char)(bank | ((b >> 4) & 0x0F));
+			unsigned char lo = (unsigned char)(bank | (b        & 0x0F));
+			int dst = x << 2;
+			pDst[dst    ] = hi;
+			pDst[dst + 1] = hi;
+			pDst[dst + 2] = lo;
+			pDst[dst + 3] = lo;
+		}
+	}
+
+	// 640 mode: 4 pixels per byte, column-based palette offset
+	void Decode640_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+						  int numBytes, unsigned char bank)
+	{
+		for (int x = 0; x < numBytes; ++x)
+		{
+			unsigned char b = pSrc[x];
+			int baseCol = x << 2;
+			pDst[baseCol    ] = (unsigned char)(bank | (k640ColumnBase[0] + ((b >> 6) & 0x03)));
+			pDst[baseCol + 1] = (unsigned char)(bank | (k640ColumnBase[1] + ((b >> 4) & 0x03)));
+			pDst[baseCol + 2] = (unsigned char)(bank | (k640ColumnBase[2] + ((b >> 2) & 0x03)));
+			pDst[baseCol + 3] = (unsigned char)(bank | (k640ColumnBase[3] + ((b     ) & 0x03)));
+		}
+	}
+
+	// 2 legal 320-mode pixels -> 1 byte
+	void Pack320_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+						int numBytes)
+	{
+		for (int x = 0; x < numBytes; ++x)
+		{
+			pDst[x] = (unsigned char)(((pSrc[(x << 1)] & 0x0F) << 4) |
+									   (pSrc[(x << 1) + 1] & 0x0F));
+		}
+	}
+
+	// Pixel-doubled 640 row -> 320-mode bytes (every other pixel is used)
+	void PackCollapse_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+							 int numBytes)
+	{
+		for (int x = 0; x < numBytes; ++x)
+		{
+			pDst[x] = (unsigned char)(((pSrc[(x << 2)] & 0x0F) << 4) |
+									   (pSrc[(x << 2) + 2] & 0x0F));
+		}
+	}
+
+	// 4 legal 640-mode pixels -> 1 byte
+	void Pack640_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+						int numBytes)
+	{
+		for (int x = 0; x < numBytes; ++x)
+		{
+			const unsigned char* p = pSrc + (x << 2);
+			pDst[x] = (unsigned char)(((p[0] & 0x03) << 6) | ((p[1] & 0x03) << 4) |
+									  ((p[2] & 0x03) << 2) |  (p[3] & 0x03));
+		}
+	}
+
+#if C1_ROW_SIMD
+
+	C1_TARGET("sse2")
+	void Decode320_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+						int numBytes, unsigned char bank)
+	{
+		const __m128i nibbles = _mm_set1_epi8(0x0F);
+		const __m128i vbank   = _mm_set1_epi8((char)bank);
+		int x = 0;
+
+		for (; x + 16 <= numBytes; x += 16)
+		{
+			__m128i v  = _mm_loadu_si128((const __m128i*)(pSrc + x));
+			__m128i hi = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), nibbles), vbank);
+			__m128i lo = _mm_or_si128(_mm_and_si128(v, nibbles), vbank);
+
+			_mm_storeu_si128((__m128i*)(pDst + (x << 1)),      _mm_unpacklo_epi8(hi, lo));
+			_mm_storeu_si128((__m128i*)(pDst + (x << 1) + 16), _mm_unpackhi_epi8(hi, lo));
+		}
+
+		Decode320_Scalar(pSrc + x, pDst + (x << 1), numBytes - x, bank);
+	}
+
+	// Interleave hi/lo, then interleave the result with itself to double
+	C1_TARGET("sse2")
+	void Decode320x2_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+						  int numBytes, unsigned char bank)
+	{
+		const __m128i nibbles = _mm_set1_epi8(0x0F);
+		const __m128i vbank   = _mm_set1_epi8((char)bank);
+		int x = 0;
+
+		for (; x + 16 <= numBytes; x += 16)
+		{
+			__m128i v  = _mm_loadu_si128((const __m128i*)(pSrc + x));
+			__m128i hi = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), nibbles), vbank);
+			__m128i lo = _mm_or_si128(_mm_and_si128(v, nibbles), vbank);
+
+			__m128i pairsLo = _mm_unpacklo_epi8(hi, lo);
+			__m128i pairsHi = _mm_unpackhi_epi8(hi, lo);
+
+			unsigned char* pOut = pDst + (x << 2);
+			_mm_storeu_si128((__m128i*)(pOut),      _mm_unpacklo_epi8(pairsLo, pairsLo));
+			_mm_storeu_si128((__m128i*)(pOut + 16), _mm_unpackhi_epi8(pairsLo, pairsLo));
+			_mm_storeu_si128((__m128i*)(pOut + 32), _mm_unpacklo_epi8(pairsHi, pairsHi));
+			_mm_storeu_si128((__m128i*)(pOut + 48), _mm_unpackhi_epi8(pairsHi, pairsHi));
+		}
+
+		Decode320x2_Scalar(pSrc + x, pDst + (x << 2), numBytes - x, bank);
+	}
+
+	// One vector per column phase, then a two level byte/word interleave
+	C1_TARGET("sse2")
+	void Decode640_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+						int numBytes, unsigned char bank)
+	{
+		const __m128i twoBits = _mm_set1_epi8(0x03);
+		const __m128i base0 = _mm_set1_epi8((char)(bank | k640ColumnBase[0]));
+		const __m128i base1 = _mm_set1_epi8((char)(bank | k640ColumnBase[1]));
+		const __m128i base2 = _mm_set1_epi8((char)(bank | k640ColumnBase[2]));
+		const __m128i base3 = _mm_set1_epi8((char)(bank | k640ColumnBase[3]));
+		int x = 0;
+
+		for (; x + 16 <= numBytes; x += 16)
+		{
+			__m128i v  = _mm_loadu_si128((const __m128i*)(pSrc + x));
+			__m128i p0 = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 6), twoBits), base0);
+			__m128i p1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), twoBits), base1);
+			__m128i p2 = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 2), twoBits), base2);
+			__m128i p3 = _mm_or_si128(_mm_and_si128(v, twoBits), base3);
+
+			__m128i p01lo = _mm_unpacklo_epi8(p0, p1);
+			__m128i p01hi = _mm_unpackhi_epi8(p0, p1);
+			__m128i p23lo = _mm_unpacklo_epi8(p2, p3);
+			__m128i p23hi = _mm_unpackhi_epi8(p2, p3);
+
+			unsigned char* pOut = pDst + (x << 2);
+			_mm_storeu_si128((__m128i*)(pOut),      _mm_unpacklo_epi16(p01lo, p23lo));
+			_mm_storeu_si128((__m128i*)(pOut + 16), _mm_unpackhi_epi16(p01lo, p23lo));
+			_mm_storeu_si128((__m128i*)(pOut + 32), _mm_unpacklo_epi16(p01hi, p23hi));
+			_mm_storeu_si128((__m128i*)(pOut + 48), _mm_unpackhi_epi16(p01hi, p23hi));
+		}
+
+		Decode640_Scalar(pSrc + x, pDst + (x << 2), numBytes - x, bank);
+	}
+
+	C1_TARGET("avx2")
+	void Decode320_AVX2(const unsigned char* pSrc, unsigned char* pDst,
+						int numBytes, unsigned char bank)
+	{
+		const __m256i nibbles = _mm256_set1_epi8(0x0F);
+		const __m256i vbank   = _mm256_set1_epi8((char)bank);
+		int x = 0;
+
+		for (; x + 32 <= numBytes; x += 32)
+		{
+			__m256i v  = _mm256_loadu_si256((const __m256i*)(pSrc + x));
+			__m256i hi = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 4), nibbles), vbank);
+			__m256i lo = _mm256_or_si256(_mm256_and_si256(v, nibbles), vbank);
+
+			// unpack works per 128 bit lane; swap the middle halves back
+			__m256i a = _mm256_unpacklo_epi8(hi, lo);
+			__m256i b = _mm256_unpackhi_epi8(hi, lo);
+
+			_mm256_storeu_si256((__m256i*)(pDst + (x << 1)),
+								_mm256_permute2x128_si256(a, b, 0x20));
+			_mm256_storeu_si256((__m256i*)(pDst + (x << 1) + 32),
+								_mm256_permute2x128_si256(a, b, 0x31));
+		}
+
+		Decode320_SSE2(pSrc + x, pDst + (x << 1), numBytes - x, bank);
+	}
+
+	C1_TARGET("avx2")
+	void Decode320x2_AVX2(const unsigned char* pSrc, unsigned char* pDst,
+						  int numBytes, unsigned char bank)
+	{
+		const __m256i nibbles = _mm256_set1_epi8(0x0F);
+		const __m256i vbank   = _mm256_set1_epi8((char)bank);
+		int x = 0;
+
+		for (; x + 32 <= numBytes; x += 32)
+		{
+			__m256i v  = _mm256_loadu_si256((const __m256i*)(pSrc + x));
+			__m256i hi = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 4), nibbles), vbank);
+			__m256i lo = _mm256_or_si256(_mm256_and_si256(v, nibbles), vbank);
+
+			// Lane 0 of each result covers source bytes 0-15, lane 1 bytes
+			// 16-31, in four 4-byte steps
+			__m256i pairsLo = _mm256_unpacklo_epi8(hi, lo);
+			__m256i pairsHi = _mm256_unpackhi_epi8(hi, lo);
+			__m256i q0 = _mm256_unpacklo_epi8(pairsLo, pairsLo);
+			__m256i q1 = _mm256_unpackhi_epi8(pairsLo, pairsLo);
+			__m256i q2 = _mm256_unpacklo_epi8(pairsHi, pairsHi);
+			__m256i q3 = _mm256_unpackhi_epi8(pairsHi, pairsHi);
+
+			unsigned char* pOut = pDst + (x << 2);
+			_mm256_storeu_si256((__m256i*)(pOut),      _mm256_permute2x128_si256(q0, q1, 0x20));
+			_mm256_storeu_si256((__m256i*)(pOut + 32), _mm256_permute2x128_si256(q2, q3, 0x20));
+			_mm256_storeu_si256((__m256i*)(pOut + 64), _mm256_permute2x128_si256(q0, q1, 0x31));
+			_mm256_storeu_si256((__m256i*)(pOut + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+		}
+
+		Decode320x2_SSE2(pSrc + x, pDst + (x << 2), numBytes - x, bank);
+	}
+
+	C1_TARGET("avx2")
+	void Decode640_AVX2(const unsigned char* pSrc, unsigned char* pDst,
+						int numBytes, unsigned char bank)
+	{
+		const __m256i twoBits = _mm256_set1_epi8(0x03);
+		const __m256i base0 = _mm256_set1_epi8((char)(bank | k640ColumnBase[0]));
+		const __m256i base1 = _mm256_set1_epi8((char)(bank | k640ColumnBase[1]));
+		const __m256i base2 = _mm256_set1_epi8((char)(bank | k640ColumnBase[2]));
+		const __m256i base3 = _mm256_set1_epi8((char)(bank | k640ColumnBase[3]));
+		int x = 0;
+
+		for (; x + 32 <= numBytes; x += 32)
+		{
+			__m256i v  = _mm256_loadu_si256((const __m256i*)(pSrc + x));
+			__m256i p0 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 6), twoBits), base0);
+			__m256i p1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 4), twoBits), base1);
+			__m256i p2 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 2), twoBits), base2);
+			__m256i p3 = _mm256_or_si256(_mm256_and_si256(v, twoBits), base3);
+
+			__m256i p01lo = _mm256_unpacklo_epi8(p0, p1);
+			__m256i p01hi = _mm256_unpackhi_epi8(p0, p1);
+			__m256i p23lo = _mm256_unpacklo_epi8(p2, p3);
+			__m256i p23hi = _mm256_unpackhi_epi8(p2, p3);
+
+			__m256i q0 = _mm256_unpacklo_epi16(p01lo, p23lo);
+			__m256i q1 = _mm256_unpackhi_epi16(p01lo, p23lo);
+			__m256i q2 = _mm256_unpacklo_epi16(p01hi, p23hi);
+			__m256i q3 = _mm256_unpackhi_epi16(p01hi, p23hi);
+
+			unsigned char* pOut = pDst + (x << 2);
+			_mm256_storeu_si256((__m256i*)(pOut),      _mm256_permute2x128_si256(q0, q1, 0x20));
+			_mm256_storeu_si256((__m256i*)(pOut + 32), _mm256_permute2x128_si256(q2, q3, 0x20));
+			_mm256_storeu_si256((__m256i*)(pOut + 64), _mm256_permute2x128_si256(q0, q1, 0x31));
+			_mm256_storeu_si256((__m256i*)(pOut + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+		}
+
+		Decode640_SSE2(pSrc + x, pDst + (x << 2), numBytes - x, bank);
+	}
+
+	// 16 bit lanes hold (even, odd); fold to (even << 4) | odd and pack down
+	C1_TARGET("sse2")
+	void Pack320_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+					  int numBytes)
+	{
+		const __m128i nibbles = _mm_set1_epi16(0x0F0F);
+		const __m128i lowByte = _mm_set1_epi16(0x00FF);
+		int x = 0;
+
+		for (; x + 16 <= numBytes; x += 16)
+		{
+			__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + (x << 1))), nibbles);
+			__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + (x << 1) + 16)), nibbles);
+
+			a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, lowByte), 4), _mm_srli_epi16(a, 8));
+			b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, lowByte), 4), _mm_srli_epi16(b, 8));
+
+			_mm_storeu_si128((__m128i*)(pDst + x), _mm_packus_epi16(a, b));
+		}
+
+		Pack320_Scalar(pSrc + (x << 1), pDst + x, numBytes - x);
+	}
+
+	// 32 bit lanes hold (a, a, b, b); fold to (a << 4) | b and pack down twice
+	C1_TARGET("sse2")
+	void PackCollapse_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+						   int numBytes)
+	{
+		const __m128i nibbles = _mm_set1_epi32(0x000F000F);
+		const __m128i lowWord = _mm_set1_epi32(0x0000FFFF);
+		int x = 0;
+
+		for (; x + 16 <= numBytes; x += 16)
+		{
+			__m128i v[4];
+			for (int i = 0; i < 4; ++i)
+			{
+				__m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + (x << 2) + i * 16)), nibbles);
+				v[i] = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(d, lowWord), 4), _mm_srli_epi32(d, 16));
+			}
+
+			__m128i lo = _mm_packs_epi32(v[0], v[1]);
+			__m128i hi = _mm_packs_epi32(v[2], v[3]);
+			_mm_storeu_si128((__m128i*)(pDst + x), _mm_packus_epi16(lo, hi));
+		}
+
+		PackCollapse_Scalar(pSrc + (x << 2), pDst + x, numBytes - x);
+	}
+
+	// 32 bit lanes hold 4 two-bit codes; fold bytes into words, words into
+	// dwords, then pack down twice
+	C1_TARGET("sse2")
+	void Pack640_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+					  int numBytes)
+	{
+		const __m128i twoBits = _mm_set1_epi8(0x03);
+		const __m128i lowByte = _mm_set1_epi16(0x00FF);
+		const __m128i lowWord = _mm_set1_epi32(0x0000FFFF);
+		int x = 0;
+
+		for (; x + 16 <= numBytes; x += 16)
+		{
+			__m128i v[4];
+			for (int i = 0; i < 4; ++i)
+			{
+				__m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + (x << 2) + i * 16)), twoBits);
+				d = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(d, lowByte), 2), _mm_srli_epi16(d, 8));
+				v[i] = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(d, lowWord), 4), _mm_srli_epi32(d, 16));
+			}
+
+			__m128i lo = _mm_packs_epi32(v[0], v[1]);
+			__m128i hi = _mm_packs_epi32(v[2], v[3]);
+			_mm_storeu_si128((__m128i*)(pDst + x), _mm_packus_epi16(lo, hi));
+		}
+
+		Pack640_Scalar(pSrc + (x << 2), pDst + x, numBytes - x);
+	}
+
+	//--------------------------------------------------------------------------
+
+	bool CpuHasAVX2()
+	{
+	#if defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 0);
+		int maxLeaf = regs[0];
+
+		__cpuid(regs, 1);
+		bool osAvx = ((regs[2] & (1 << 27)) != 0) && ((regs[2] & (1 << 28)) != 0) &&
+					 ((_xgetbv(0) & 6) == 6);
+		if (!osAvx || maxLeaf < 7)
+			return false;
+
+		__cpuidex(regs, 7, 0);
+		return (regs[1] & (1 << 5)) != 0;
+	#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	#endif
+	}
+
+	bool CpuHasSSE2()
+	{
+	#if defined(_M_X64) || defined(__x86_64__)
+		return true;
+	#elif defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 1);
+		return (regs[3] & (1 << 26)) != 0;
+	#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") != 0;
+	#endif
+	}
+
+#endif // C1_ROW_SIMD
+
+	struct ShrRowKernels
+	{
+		RowDecodeFn decode320;
+		RowDecodeFn decode320x2;
+		RowDecodeFn decode640;
+		RowPackFn   pack320;
+		RowPackFn   packCollapse;
+		RowPackFn   pack640;
+	};
+
+	// Picked once, on first use.  The packers gain nothing from AVX2 over
+	// 160 byte rows, so they stop at SSE2.
+	const ShrRowKernels& GetShrRowKernels()
+	{
+		static const ShrRowKernels kernels = []()
+		{
+			ShrRowKernels k = { Decode320_Scalar, Decode320x2_Scalar, Decode640_Scalar,
+								Pack320_Scalar, PackCollapse_Scalar, Pack640_Scalar };
+		#if C1_ROW_SIMD
+			if (CpuHasSSE2())
+			{
+				k.decode320    = Decode320_SSE2;
+				k.decode320x2  = Decode320x2_SSE2;
+				k.decode640    = Decode640_SSE2;
+				k.pack320      = Pack320_SSE2;
+				k.packCollapse = PackCollapse_SSE2;
+				k.pack640      = Pack640_SSE2;
+
+				if (CpuHasAVX2())
+				{
+					k.decode320   = Decode320_AVX2;
+					k.decode320x2 = Decode320x2_AVX2;
+					k.decode640   = Decode640_AVX2;
+				}
+			}
+		#endif
+			return k;
+		}();
+
+		return kernels;
+	}
+}
+
+//------------------------------------------------------------------------------
+// PackBytes ($C0/$0001): the 32768 bytes of a $C1 image run through the IIgs
+// toolbox's PackBytes. A stream of records, each a flag byte and its data:
+//   00nnnnnn  n+1 bytes follow, copied as they are
+//   01nnnnnn  1 byte follows, repeated n+1 times
+//   10nnnnnn  4 bytes follow, repeated n+1 times
+//   11nnnnnn  1 byte follows, repeated 4*(n+1) times
+//
+// The encoder packs each 160-byte pixel row on its own, then the SCBs,
+// padding and palettes, so no record crosses a row. Finding runs and
+// repeated 4-byte patterns is comparing bytes to the ones 1 or 4 before
+// them, which the vector kernels do 16 at a time.
+//
+namespace
+{
+	// Worst case other packers might write, far above ours: no file this
+	// size or less is anything else the plugin could read.
+	const long kMaxPackedSize = 32768 + 32768 / 32;
+
+	// Leading bytes where a[i] == b[i], up to n
+	typedef int (*MatchLengthFn)(const unsigned char* a, const unsigned char* b, int n);
+
+	int MatchLength_Scalar(const unsigned char* a, const unsigned char* b, int n)
+	{
+		int i = 0;
+		while (i < n && a[i] == b[i])
+			++i;
+		return i;
+	}
+
+#if C1_ROW_SIMD
+
+	inline int lowestSetBit(unsigned int v)
+	{
+	#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanForward(&idx, v);
+		return (int)idx;
+	#else
+		return __builtin_ctz(v);
+	#endif
+	}
+
+	C1_TARGET("sse2")
+	int MatchLength_SSE2(const unsigned char* a, const unsigned char* b, int n)
+	{
+		int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+			unsigned int same = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+			if (same != 0xFFFF)
+				return i + lowestSetBit(~same);
+		}
+
+		return i + MatchLength_Scalar(a + i, b + i, n - i);
+	}
+
+#endif // C1_ROW_SIMD
+
+	MatchLengthFn GetMatchLength()
+	{
+		static const MatchLengthFn fn = []()
+		{
+		#if C1_ROW_SIMD
+			if (CpuHasSSE2())
+				return (MatchLengthFn)MatchLength_SSE2;
+		#endif
+			return (MatchLengthFn)MatchLength_Scalar;
+		}();
+
+		return fn;
+	}
+
+	void packChunk(const unsigned char* src, int n, std::vector<unsigned char>& out)
+	{
+		MatchLengthFn matchLength = GetMatchLength();
+
+		int literalStart = 0;
+		auto flushLiteral = [&](int end)
+		{
+			while (literalStart < end)
+			{
+				int count = end - literalStart;
+				if (count > 64)
+					count = 64;
+				out.push_back((unsigned char)(count - 1));
+				out.insert(out.end(), src + literalStart, src + literalStart + count);
+				literalStart += count;
+			}
+		};
+
+		int i = 0;
+		while (i < n)
+		{
+			// bytes equal to src[i], src[i] included
+			int run = 1 + matchLength(src + i + 1, src + i, n - i - 1);
+
+			if (run >= 8)
+			{
+				// whole groups of 4; what's left over goes round again
+				int groups = run / 4;
+				if (groups > 64)
+					groups = 64;
+				flushLiteral(i);
+				out.push_back((unsigned char)(0xC0 | (groups - 1)));
+				out.push_back(src[i]);
+				i += groups * 4;
+				literalStart = i;
+				continue;
+			}
+
+			if (run >= 3)
+			{
+				flushLiteral(i);
+				out.push_back((unsigned char)(0x40 | (run - 1)));
+				out.push_back(src[i]);
+				i += run;
+				literalStart = i;
+				continue;
+			}
+
+			if (n - i >= 8)
+			{
+				// times the 4 bytes at src[i] repeat back to back
+				int reps = 1 + matchLength(src + i + 4, src + i, n - i - 4) / 4;
+				if (reps >= 2)
+				{
+					if (reps > 64)
+						reps = 64;
+					flushLiteral(i);
+					out.push_back((unsigned char)(0x80 | (reps - 1)));
+					out.insert(out.end(), src + i, src + i + 4);
+					i += reps * 4;
+					literalStart = i;
+					continue;
+				}
+			}
+
+			++i;
+		}
+
+		flushLiteral(n);
+	}
+
+	// Unpack exactly dstLen bytes. False unless the records fill dst without
+	// running over and use up all of src.
+	bool unpackBytes(const unsigned char* src, size_t srcLen, unsigned char* dst, size_t dstLen)
+	{
+		size_t in = 0;
+		size_t out = 0;
+
+		while (out < dstLen)
+		{
+			if (in >= srcLen)
+				return false;
+
+			unsigned char flag = src[in++];
+			size_t count = (size_t)(flag & 0x3F) + 1;
+
+			switch (flag >> 6)
+			{
+			case 0:
+				if (in + count > srcLen || out + count > dstLen)
+					return false;
+				memcpy(dst + out, src + in, count);
+				in += count;
+				out += count;
+				break;
+
+			case 1:
+				if (in + 1 > srcLen || out + count > dstLen)
+					return false;
+				memset(dst + out, src[in++], count);
+				out += count;
+				break;
+
+			case 2:
+				if (in + 4 > srcLen || out + count * 4 > dstLen)
+					return false;
+				for (size_t k = 0; k < count; ++k)
+					memcpy(dst + out + k * 4, src + in, 4);
+				in += 4;
+				out += count * 4;
+				break;
+
+			default:
+				if (in + 1 > srcLen || out + count * 4 > dstLen)
+					return false;
+				memset(dst + out, src[in++], count * 4);
+				out += count * 4;
+				break;
+			}
+		}
+
+		return in == srcLen;
+	}
+}
+
 //------------------------------------------------------------------------------
 // Construct from file.
 //
@@ -82,18 +742,42 @@ void C1File::LoadFromFile(const wchar_t* pFilePath)
 	long fileLen = ftell(pFile);
 	fseek(pFile, 0, SEEK_SET);
 
-	if (fileLen != (long)sizeof(C1_FileImage))
+	if (fileLen == (long)sizeof(C1_3200FileImage))
 	{
 		fclose(pFile);
+
+		C1File3200 image(pFilePath);
+		if (image.IsValid())
+			LoadFrom3200(image);
 		return;
 	}
 
 	C1_FileImage img;
-	size_t got = fread(&img, 1, sizeof(img), pFile);
-	fclose(pFile);
 
-	if (got != sizeof(img))
+	if (fileLen == (long)sizeof(C1_FileImage))
+	{
+		size_t got = fread(&img, 1, sizeof(img), pFile);
+		fclose(pFile);
+
+		if (got != sizeof(img))
+			return;
+	}
+	else if (fileLen > 0 && fileLen <= kMaxPackedSize)
+	{
+		// PackBytes, if it unpacks to exactly one image.
+		std::vector<unsigned char> packed((size_t)fileLen);
+		size_t got = fread(&packed[0], 1, packed.size(), pFile);
+		fclose(pFile);
+
+		if (got != packed.size() ||
+		    !unpackBytes(&packed[0], packed.size(), (unsigned char*)&img, sizeof(img)))
+			return;
+	}
+	else
+	{
+		fclose(pFile);
 		return;
+	}
 
 	// Decide presented width: 640 if any SCB has bit 7 set.
 	bool any640 = false;
@@ -119,202 +803,498 @@ void C1File::LoadFromFile(const wchar_t* pFilePath)
 	m_pPixelMaps.push_back(pFrame);
 
 	// Decode each row.
+	const ShrRowKernels& kernels = GetShrRowKernels();
+
 	for (int y = 0; y < 200; ++y)
 	{
 		unsigned char scb = img.scbs[y];
-		int bank = (scb & 0x0F) << 4;          // pre-shifted palette base
+		unsigned char bank = (unsigned char)((scb & 0x0F) << 4); // pre-shifted palette base
 		bool is640 = (scb & 0x80) != 0;
 		const unsigned char* pRowSrc = img.pixels + (size_t)y * 160;
 		unsigned char* pRowDst = pFrame + (size_t)y * m_widthPixels;
 
-		if (!is640)
+		if (is640)
+			kernels.decode640(pRowSrc, pRowDst, 160, bank);
+		else if (m_widthPixels == 320)
+			kernels.decode320(pRowSrc, pRowDst, 160, bank);
+		else
+			kernels.decode320x2(pRowSrc, pRowDst, 160, bank); // presented as 640
+	}
+
+	m_valid = true;
+}
+
+//------------------------------------------------------------------------------
+// A 3200 color file, as the one 256-color frame the plugin can hand out: its
+// colors reduced to 256, each pixel an index into those. SCBs stay zero.
+//
+void C1File::LoadFrom3200(const C1File3200& image)
+{
+	std::vector<unsigned char> rgba((size_t)320 * 200 * 4);
+	image.DecodeRgba(rgba.data());
+
+	QuantizerColor colors[256];
+	int numColors = QuantizePalette(rgba.data(), (size_t)320 * 200, 256, colors);
+
+	// The file's colors are 4-bit already; rounding only moves averaged ones.
+	memset(m_palette, 0, sizeof(m_palette));
+	for (int i = 0; i < numColors; ++i)
+	{
+		colors[i].r = ChannelTo4Bit(colors[i].r);
+		colors[i].g = ChannelTo4Bit(colors[i].g);
+		colors[i].b = ChannelTo4Bit(colors[i].b);
+
+		m_palette[i].r = colors[i].r;
+		m_palette[i].g = colors[i].g;
+		m_palette[i].b = colors[i].b;
+	}
+
+	m_widthPixels  = 320;
+	m_heightPixels = 200;
+
+	unsigned char* pFrame = new unsigned char[(size_t)320 * 200];
+	MapToPalette444(rgba.data(), 320, 200, colors, numColors, false, pFrame);
+	m_pPixelMaps.push_back(pFrame);
+
+	m_valid = true;
+}
+
+//------------------------------------------------------------------------------
+void C1File::SetPalette(const unsigned char* rgbTriplets)
+{
+	for (int i = 0; i < 256; ++i)
+	{
+		// 8-bit -> 4-bit: keep top nibble. Top nibble of the on-disk color
+		// is reserved (canonical IIgs writes 0). Leave alpha = 0.
+		m_palette[i].r = (uint16_t)(rgbTriplets[i * 3 + 0] >> 4);
+		m_palette[i].g = (uint16_t)(rgbTriplets[i * 3 + 1] >> 4);
+		m_palette[i].b = (uint16_t)(rgbTriplets[i * 3 + 2] >> 4);
+		m_palette[i].a = 0;
+	}
+}
+
+//------------------------------------------------------------------------------
+void C1File::AddImage(const unsigned char* pixels)
+{
+	// Discard any prior frame.
+	for (size_t i = 0; i < m_pPixelMaps.size(); ++i)
+		delete[] m_pPixelMaps[i];
+	m_pPixelMaps.clear();
+
+	if (!m_valid || pixels == nullptr)
+		return;
+
+	size_t n = (size_t)m_widthPixels * (size_t)m_heightPixels;
+	unsigned char* p = new unsigned char[n];
+	memcpy(p, pixels, n);
+	m_pPixelMaps.push_back(p);
+}
+
+//------------------------------------------------------------------------------
+// Internal helpers for save.
+//
+
+namespace {
+
+// Squared RGB distance between two 4-bit palette entries.
+int colorDist(const C1_Color& a, const C1_Color& b)
+{
+	int dr = (int)a.r - (int)b.r;
+	int dg = (int)a.g - (int)b.g;
+	int db = (int)a.b - (int)b.b;
+	return dr * dr + dg * dg + db * db;
+}
+
+// Find the palette index in [lo, lo+count) whose color is closest to
+// palette[wantIdx]. Used when remapping an out-of-range pixel to the
+// nearest legal index in its column's legal range.
+unsigned char nearestInRange(const C1_Color* palette, unsigned char wantIdx,
+                             int lo, int count)
+{
+	int bestIdx = lo;
+	int bestDist = colorDist(palette[wantIdx], palette[lo]);
+	for (int i = 1; i < count; ++i)
+	{
+		int d = colorDist(palette[wantIdx], palette[lo + i]);
+		if (d < bestDist)
 		{
-			// 320 mode: 160 bytes -> 320 indices, nibble unpack, OR with bank.
-			if (m_widthPixels == 320)
-			{
-				for (int x = 0; x < 160; ++x)
-				{
-					unsigned char b = pRowSrc[x];
-					pRowDst[(x << 1)    ] = (unsigned char)(bank | ((b >> 4) & 0x0F));
-					pRowDst[(x << 1) + 1] = (unsigned char)(bank | (b        & 0x0F));
-				}
-			}
-			else
-			{
-				// Presented as 640: pixel-double each 320-mode pixel.
-				for (int x = 0; x < 160; ++x)
-				{
-					unsigned char b = pRowSrc[x];
-					unsigned char hi = (unsigned char)(bank | ((b >> 4) & 0x0F));
-					unsigned char lo = (unsigned char)(bank | (b        & 0x0F));
-					int dst = x << 2;
-					pRowDst[dst    ] = hi;
-					pRowDst[dst + 1] = hi;
-					pRowDst[dst + 2] = lo;
-					pRowDst[dst + 3] = lo;
-				}
-			}
+			bestDist = d;
+			bestIdx = lo + i;
 		}
-		else
+	}
+	return (unsigned char)bestIdx;
+}
+
+// Nearest legal index for every (pixel, 320 bank) and (pixel, 640 4-color
+// group), so remapping a pixel is one lookup instead of up to 16 colorDist
+// calls. Each table is filled in on the first remap of its row mode in a
+// save; the palette is fixed for the whole SaveToFile.
+//   inBank [want][P]     == nearestInRange(palette, want, P*16, 16)
+//   inGroup[want][lo/4]  == nearestInRange(palette, want, lo,    4)
+struct RemapTables
+{
+	bool          bankBuilt;
+	bool          groupBuilt;
+	unsigned char inBank[256][16];
+	unsigned char inGroup[256][64];
+
+	RemapTables() : bankBuilt(false), groupBuilt(false) {}
+
+	// 320 mode rows
+	void BuildBanks(const C1_Color* palette)
+	{
+		if (bankBuilt)
+			return;
+
+		for (int want = 0; want < 256; ++want)
+		{
+			for (int P = 0; P < 16; ++P)
+				inBank[want][P] = nearestInRange(palette, (unsigned char)want, P << 4, 16);
+		}
+		bankBuilt = true;
+	}
+
+	// 640 mode rows
+	void BuildGroups(const C1_Color* palette)
+	{
+		if (groupBuilt)
+			return;
+
+		for (int want = 0; want < 256; ++want)
+		{
+			for (int g = 0; g < 64; ++g)
+				inGroup[want][g] = nearestInRange(palette, (unsigned char)want, g << 2, 4);
+		}
+		groupBuilt = true;
+	}
+};
+
+// Count, for every candidate palette bank P at once, how many row pixels
+// would already be in-range. Each pixel is legal in at most one bank, so a
+// single pass over the row fills a 16-entry histogram. Best bank wins (lower
+// bank breaks ties).
+//
+// Validity per pixel:
+//   320-mode: pixel index >> 4 == P
+//   640-mode: pixel index in [P*16 + k640ColumnBase[col%4],
+//                              P*16 + k640ColumnBase[col%4] + 4)
+//             i.e. pixel index >> 4 == P and (index & 0x0C) == column base
+int bestBankFromCounts(const int* counts)
+{
+	int bestBank = 0;
+	for (int P = 1; P < 16; ++P)
+	{
+		if (counts[P] > counts[bestBank])
+			bestBank = P;
+	}
+	return bestBank;
+}
+
+int pickBest320Bank(const unsigned char* rowPixels, int rowWidth)
+{
+	int counts[16] = { 0 };
+	for (int x = 0; x < rowWidth; ++x)
+		++counts[rowPixels[x] >> 4];
+
+	return bestBankFromCounts(counts);
+}
+
+int pickBest640Bank(const unsigned char* rowPixels)
+{
+	int counts[16] = { 0 };
+	for (int x = 0; x < 640; ++x)
+	{
+		unsigned char v = rowPixels[x];
+		if ((v & 0x0C) == k640ColumnBase[x & 3])
+			++counts[v >> 4];
+	}
+
+	return bestBankFromCounts(counts);
+}
+
+// True if every pair (2x, 2x+1) is identical AND every pixel uses bank P.
+bool rowCanCollapseTo320(const unsigned char* row640, int P)
+{
+	int pBase = P << 4;
+	for (int x = 0; x < 640; x += 2)
+	{
+		if (row640[x] != row640[x + 1]) return false;
+		unsigned char v = row640[x];
+		if (v < pBase || v >= pBase + 16) return false;
+	}
+	return true;
+}
+
+void appendLog(std::vector<wchar_t>& log, const wchar_t* line)
+{
+	while (*line) log.push_back(*line++);
+	log.push_back(L'\n');
+}
+
+} // anonymous namespace
+
+//------------------------------------------------------------------------------
+// True color: fitting 16 palettes and 200 SCBs to an RGBA frame.
+//
+// Rows are clustered by which palette serves them best, k-means style: each
+// palette is quantized from the pixels of the rows using it, then each row
+// moves to the palette that maps it with the least error, until no row
+// moves. Both steps run in parallel, over palettes and over rows.
+//
+// A 640-mode pixel can only use the 4 colors of its column's group (see
+// k640ColumnBase), so there each palette is fitted as 4 groups of 4 colors,
+// each quantized from the pixels in the columns that use it. 320 mode is one
+// group of 16.
+//
+
+namespace {
+
+// Most clustering passes; they usually settle well before
+const int kTrueColorPasses = 12;
+
+struct ShrFit
+{
+	int width;              // 320 or 640
+	int numGroups;          // column groups: 1 (320) or 4 (640)
+	int groupSize;          // colors in each: 16 or 4
+	int groupBase[4];       // first palette entry of each within a bank
+
+	// per palette and group, for every 4-bit color: nearest entry within
+	// the group and its squared distance
+	std::vector<unsigned char>  nearest;
+	std::vector<unsigned short> distance;
+
+	size_t Table(int P, int group) const { return ((size_t)P * 4 + group) * 4096; }
+};
+
+// 4-bit rgb key of every pixel
+void keyPixels(const unsigned char* rgba, size_t numPixels, std::vector<unsigned short>& keys)
+{
+	keys.resize(numPixels);
+	for (size_t i = 0; i < numPixels; ++i)
+	{
+		const unsigned char* p = rgba + i * 4;
+		keys[i] = (unsigned short)((ChannelTo4Bit(p[0]) << 8) | (ChannelTo4Bit(p[1]) << 4) | ChannelTo4Bit(p[2]));
+	}
+}
+
+// Quantize palette P from the pixels of the rows assigned to it. A palette
+// no row uses is left as it was.
+void fitPalette(const ShrFit& fit, const unsigned char* rgba, const unsigned char* rowPalette,
+                int P, C1_Color* palette)
+{
+	std::vector<unsigned char> pixels;
+
+	for (int group = 0; group < fit.numGroups; ++group)
+	{
+		pixels.clear();
+		for (int y = 0; y < 200; ++y)
+		{
+			if (rowPalette[y] != P)
+				continue;
+
+			const unsigned char* row = rgba + (size_t)y * fit.width * 4;
+			for (int x = group; x < fit.width; x += fit.numGroups)
+				pixels.insert(pixels.end(), row + x * 4, row + x * 4 + 4);
+		}
+
+		if (pixels.empty())
+			return;
+
+		QuantizerColor colors[16];
+		int numColors = QuantizePalette(pixels.data(), pixels.size() / 4, fit.groupSize, colors);
+
+		// spare entries repeat the first color rather than add one
+		C1_Color* entries = palette + (P << 4) + fit.groupBase[group];
+		for (int i = 0; i < fit.groupSize; ++i)
 		{
-			// 640 mode: 4 pixels per byte, column-based palette offset.
-			for (int x = 0; x < 160; ++x)
+			const QuantizerColor& c = colors[i < numColors ? i : 0];
+			entries[i].r = ChannelTo4Bit(c.r);
+			entries[i].g = ChannelTo4Bit(c.g);
+			entries[i].b = ChannelTo4Bit(c.b);
+			entries[i].a = 0;
+		}
+	}
+}
+
+// Nearest entry and distance tables of palette P
+void buildTables(ShrFit& fit, const C1_Color* palette, int P)
+{
+	for (int group = 0; group < fit.numGroups; ++group)
+	{
+		const C1_Color* entries = palette + (P << 4) + fit.groupBase[group];
+		size_t table = fit.Table(P, group);
+
+		for (int key = 0; key < 4096; ++key)
+		{
+			C1_Color c;
+			c.r = (uint16_t)(key >> 8);
+			c.g = (uint16_t)((key >> 4) & 15);
+			c.b = (uint16_t)(key & 15);
+
+			int best = 0;
+			int bestDist = colorDist(c, entries[0]);
+			for (int i = 1; i < fit.groupSize; ++i)
 			{
-				unsigned char b = pRowSrc[x];
-				int baseCol = x << 2;
-				pRowDst[baseCol    ] = (unsigned char)(bank | (k640ColumnBase[0] + ((b >> 6) & 0x03)));
-				pRowDst[baseCol + 1] = (unsigned char)(bank | (k640ColumnBase[1] + ((b >> 4) & 0x03)));
-				pRowDst[baseCol + 2] = (unsigned char)(bank | (k640ColumnBase[2] + ((b >> 2) & 0x03)));
-				pRowDst[baseCol + 3] = (unsigned char)(bank | (k640ColumnBase[3] + ((b     ) & 0x03)));
+				int d = colorDist(c, entries[i]);
+				if (d < bestDist)
+				{
+					bestDist = d;
+					best = i;
+				}
 			}
+
+			fit.nearest[table + key] = (unsigned char)(fit.groupBase[group] + best);
+			fit.distance[table + key] = (unsigned short)bestDist;
 		}
 	}
-
-	m_valid = true;
 }
 
-//------------------------------------------------------------------------------
-void C1File::SetPalette(const unsigned char* rgbTriplets)
+// Error of row y under palette P
+int rowError(const ShrFit& fit, const unsigned short* rowKeys, int P)
 {
-	for (int i = 0; i < 256; ++i)
-	{
-		// 8-bit -> 4-bit: keep top nibble. Top nibble of the on-disk color
-		// is reserved (canonical IIgs writes 0). Leave alpha = 0.
-		m_palette[i].r = (uint16_t)(rgbTriplets[i * 3 + 0] >> 4);
-		m_palette[i].g = (uint16_t)(rgbTriplets[i * 3 + 1] >> 4);
-		m_palette[i].b = (uint16_t)(rgbTriplets[i * 3 + 2] >> 4);
-		m_palette[i].a = 0;
-	}
+	int error = 0;
+	for (int x = 0; x < fit.width; ++x)
+		error += fit.distance[fit.Table(P, x % fit.numGroups) + rowKeys[x]];
+	return error;
 }
 
+} // anonymous namespace
+
 //------------------------------------------------------------------------------
-void C1File::AddImage(const unsigned char* pixels)
+void C1File::SetTrueColorImage(const unsigned char* rgba)
 {
 	// Discard any prior frame.
 	for (size_t i = 0; i < m_pPixelMaps.size(); ++i)
 		delete[] m_pPixelMaps[i];
 	m_pPixelMaps.clear();
 
-	if (!m_valid || pixels == nullptr)
+	if (!m_valid || rgba == nullptr)
 		return;
 
-	size_t n = (size_t)m_widthPixels * (size_t)m_heightPixels;
-	unsigned char* p = new unsigned char[n];
-	memcpy(p, pixels, n);
-	m_pPixelMaps.push_back(p);
-}
+	ShrFit fit;
+	fit.width     = m_widthPixels;
+	fit.numGroups = m_widthPixels == 640 ? 4 : 1;
+	fit.groupSize = 16 / fit.numGroups;
+	for (int group = 0; group < 4; ++group)
+		fit.groupBase[group] = fit.numGroups == 4 ? k640ColumnBase[group] : 0;
+	fit.nearest.resize(16 * 4 * 4096);
+	fit.distance.resize(16 * 4 * 4096);
 
-//------------------------------------------------------------------------------
-// Internal helpers for save.
-//
+	std::vector<unsigned short> keys;
+	keyPixels(rgba, (size_t)fit.width * 200, keys);
 
-namespace {
+	// Start from 16 bands of neighboring rows, which tend to share colors.
+	unsigned char rowPalette[200];
+	int           rowErrors[200];
+	for (int y = 0; y < 200; ++y)
+		rowPalette[y] = (unsigned char)(y * 16 / 200);
 
-// Squared RGB distance between two 4-bit palette entries.
-int colorDist(const C1_Color& a, const C1_Color& b)
-{
-	int dr = (int)a.r - (int)b.r;
-	int dg = (int)a.g - (int)b.g;
-	int db = (int)a.b - (int)b.b;
-	return dr * dr + dg * dg + db * db;
-}
+	memset(m_palette, 0, sizeof(m_palette));
 
-// Find the palette index in [lo, lo+count) whose color is closest to
-// palette[wantIdx]. Used when remapping an out-of-range pixel to the
-// nearest legal index in its column's legal range.
-unsigned char nearestInRange(const C1_Color* palette, unsigned char wantIdx,
-                             int lo, int count)
-{
-	int bestIdx = lo;
-	int bestDist = colorDist(palette[wantIdx], palette[lo]);
-	for (int i = 1; i < count; ++i)
+	for (int pass = 0; pass < kTrueColorPasses; ++pass)
 	{
-		int d = colorDist(palette[wantIdx], palette[lo + i]);
-		if (d < bestDist)
+		ForEachBand(16, 1, [&](size_t first, size_t end)
 		{
-			bestDist = d;
-			bestIdx = lo + i;
-		}
-	}
-	return (unsigned char)bestIdx;
-}
+			for (size_t P = first; P < end; ++P)
+			{
+				fitPalette(fit, rgba, rowPalette, (int)P, m_palette);
+				buildTables(fit, m_palette, (int)P);
+			}
+		});
 
-// For each candidate palette bank P, count how many row pixels would already
-// be in-range. Best bank wins (lower bank breaks ties).
-//
-// Validity per pixel:
-//   320-mode: pixel index >> 4 == P
-//   640-mode: pixel index in [P*16 + k640ColumnBase[col%4],
-//                              P*16 + k640ColumnBase[col%4] + 4)
-//
-// rowPixels has rowWidth entries.
-int pickBest320Bank(const unsigned char* rowPixels, int rowWidth)
-{
-	int bestBank = 0;
-	int bestCount = -1;
-	for (int P = 0; P < 16; ++P)
-	{
-		int count = 0;
-		for (int x = 0; x < rowWidth; ++x)
-		{
-			if ((rowPixels[x] >> 4) == P)
-				++count;
-		}
-		if (count > bestCount)
+		// Move every row to its best palette.
+		unsigned char moved[200];
+		ForEachBand(200, 1, [&](size_t first, size_t end)
 		{
-			bestCount = count;
-			bestBank = P;
-		}
-	}
-	return bestBank;
-}
+			for (size_t y = first; y < end; ++y)
+			{
+				const unsigned short* rowKeys = &keys[y * fit.width];
+				int best = rowPalette[y];
+				int bestError = rowError(fit, rowKeys, best);
 
-int pickBest640Bank(const unsigned char* rowPixels)
-{
-	int bestBank = 0;
-	int bestCount = -1;
-	for (int P = 0; P < 16; ++P)
-	{
-		int count = 0;
-		for (int x = 0; x < 640; ++x)
+				for (int P = 0; P < 16; ++P)
+				{
+					int error = P == best ? bestError : rowError(fit, rowKeys, P);
+					if (error < bestError)
+					{
+						bestError = error;
+						best = P;
+					}
+				}
+
+				moved[y] = best != rowPalette[y];
+				rowPalette[y] = (unsigned char)best;
+				rowErrors[y] = bestError;
+			}
+		});
+
+		bool anyMoved = false;
+		for (int y = 0; y < 200; ++y)
+			anyMoved |= moved[y] != 0;
+
+		// A palette no row wants takes the worst row of a palette that has
+		// rows to spare.
+		int rowsUsing[16] = { 0 };
+		for (int y = 0; y < 200; ++y)
+			++rowsUsing[rowPalette[y]];
+
+		for (int P = 0; P < 16; ++P)
 		{
-			int lo = (P << 4) + k640ColumnBase[x & 3];
-			unsigned char v = rowPixels[x];
-			if ((int)v >= lo && (int)v < lo + 4)
-				++count;
+			if (rowsUsing[P] != 0)
+				continue;
+
+			int worst = -1;
+			for (int y = 0; y < 200; ++y)
+			{
+				if (rowsUsing[rowPalette[y]] > 1 && (worst < 0 || rowErrors[y] > rowErrors[worst]))
+					worst = y;
+			}
+			if (worst < 0 || rowErrors[worst] == 0)
+				break;
+
+			--rowsUsing[rowPalette[worst]];
+			rowPalette[worst] = (unsigned char)P;
+			rowsUsing[P] = 1;
+			rowErrors[worst] = 0;
+			anyMoved = true;
 		}
-		if (count > bestCount)
+
+		if (!anyMoved)
+			break;
+
+		// The last pass's palettes and rows must agree for the mapping.
+		if (pass == kTrueColorPasses - 1)
 		{
-			bestCount = count;
-			bestBank = P;
+			ForEachBand(16, 1, [&](size_t first, size_t end)
+			{
+				for (size_t P = first; P < end; ++P)
+				{
+					fitPalette(fit, rgba, rowPalette, (int)P, m_palette);
+					buildTables(fit, m_palette, (int)P);
+				}
+			});
 		}
 	}
-	return bestBank;
-}
 
-// True if every pair (2x, 2x+1) is identical AND every pixel uses bank P.
-bool rowCanCollapseTo320(const unsigned char* row640, int P)
-{
-	int pBase = P << 4;
-	for (int x = 0; x < 640; x += 2)
+	// Every pixel gets its nearest legal color, so SaveToFile has nothing to
+	// remap and picks the same banks.
+	size_t n = (size_t)fit.width * 200;
+	unsigned char* p = new unsigned char[n];
+	for (int y = 0; y < 200; ++y)
 	{
-		if (row640[x] != row640[x + 1]) return false;
-		unsigned char v = row640[x];
-		if (v < pBase || v >= pBase + 16) return false;
+		int P = rowPalette[y];
+		for (int x = 0; x < fit.width; ++x)
+		{
+			size_t i = (size_t)y * fit.width + x;
+			p[i] = (unsigned char)((P << 4) | fit.nearest[fit.Table(P, x % fit.numGroups) + keys[i]]);
+		}
 	}
-	return true;
-}
-
-void appendLog(std::vector<wchar_t>& log, const wchar_t* line)
-{
-	while (*line) log.push_back(*line++);
-	log.push_back(L'\n');
+	m_pPixelMaps.push_back(p);
 }
 
-} // anonymous namespace
-
 //------------------------------------------------------------------------------
-bool C1File::SaveToFile(const wchar_t* pFilenamePath)
+bool C1File::SaveToFile(const wchar_t* pFilenamePath, bool packBytes)
 {
 	if (!m_valid || m_pPixelMaps.empty())
 		return false;
@@ -330,6 +1310,12 @@ bool C1File::SaveToFile(const wchar_t* pFilenamePath)
 	int totalRemaps = 0;
 	wchar_t lineBuf[160];
 
+	// Row after remapping, ready for the packers.
+	const ShrRowKernels& kernels = GetShrRowKernels();
+	unsigned char legalRow[640];
+
+	RemapTables remap;
+
 	if (m_widthPixels == 320)
 	{
 		// Every row is 320-mode. Pick the best bank per row; remap pixels that
@@ -338,26 +1324,20 @@ bool C1File::SaveToFile(const wchar_t* pFilenamePath)
 		{
 			const unsigned char* row = src + (size_t)y * 320;
 			int P = pickBest320Bank(row, 320);
-			int pBase = P << 4;
 			int rowRemaps = 0;
 
-			for (int x = 0; x < 320; x += 2)
+			for (int x = 0; x < 320; ++x)
 			{
-				unsigned char a = row[x    ];
-				unsigned char b = row[x + 1];
-				if ((a >> 4) != P)
-				{
-					a = nearestInRange(m_palette, a, pBase, 16);
-					++rowRemaps;
-				}
-				if ((b >> 4) != P)
+				unsigned char v = row[x];
+				if ((v >> 4) != P)
 				{
-					b = nearestInRange(m_palette, b, pBase, 16);
+					remap.BuildBanks(m_palette);
+					v = remap.inBank[v][P];
 					++rowRemaps;
 				}
-				out.pixels[(size_t)y * 160 + (x >> 1)] =
-					(unsigned char)(((a & 0x0F) << 4) | (b & 0x0F));
+				legalRow[x] = v;
 			}
+			kernels.pack320(rowRemaps ? legalRow : row, out.pixels + (size_t)y * 160, 160);
 
 			out.scbs[y] = (unsigned char)(P & 0x0F); // 320 mode, no fill, no IRQ
 
@@ -381,15 +1361,7 @@ bool C1File::SaveToFile(const wchar_t* pFilenamePath)
 			if (rowCanCollapseTo320(row, P320))
 			{
 				// Save as 320-mode (no detail loss).
-				int pBase = P320 << 4;
-				for (int x = 0; x < 320; ++x)
-				{
-					unsigned char v = row[x << 1]; // pair is identical
-					out.pixels[(size_t)y * 160 + (x >> 1)] =
-						(x & 1)
-						? (out.pixels[(size_t)y * 160 + (x >> 1)] | (unsigned char)(v & 0x0F))
-						: (unsigned char)((v & 0x0F) << 4);
-				}
+				kernels.packCollapse(row, out.pixels + (size_t)y * 160, 160);
 				out.scbs[y] = (unsigned char)(P320 & 0x0F); // 320 mode
 				continue;
 			}
@@ -398,31 +1370,22 @@ bool C1File::SaveToFile(const wchar_t* pFilenamePath)
 			int P = pickBest640Bank(row);
 			int rowRemaps = 0;
 
-			for (int x = 0; x < 160; ++x)
+			for (int col = 0; col < 640; ++col)
 			{
-				int baseCol = x << 2;
-				unsigned char packed = 0;
-				for (int sub = 0; sub < 4; ++sub)
+				unsigned char want = row[col];
+				int lo = (P << 4) + k640ColumnBase[col & 3];
+				if ((int)want >= lo && (int)want < lo + 4)
 				{
-					int col = baseCol + sub;
-					unsigned char want = row[col];
-					int lo = (P << 4) + k640ColumnBase[sub];
-					int hi = lo + 4;
-					unsigned char use;
-					if ((int)want >= lo && (int)want < hi)
-					{
-						use = want;
-					}
-					else
-					{
-						use = nearestInRange(m_palette, want, lo, 4);
-						++rowRemaps;
-					}
-					unsigned int twoBit = (unsigned int)((int)use - lo) & 0x03;
-					packed = (unsigned char)(packed | (twoBit << (6 - 2 * sub)));
+					legalRow[col] = want;
+				}
+				else
+				{
+					remap.BuildGroups(m_palette);
+					legalRow[col] = remap.inGroup[want][lo >> 2];
+					++rowRemaps;
 				}
-				out.pixels[(size_t)y * 160 + x] = packed;
 			}
+			kernels.pack640(legalRow, out.pixels + (size_t)y * 160, 160);
 
 			out.scbs[y] = (unsigned char)(0x80 | (P & 0x0F)); // 640 mode
 
@@ -448,10 +1411,42 @@ bool C1File::SaveToFile(const wchar_t* pFilenamePath)
 	return false;
 #endif
 
-	size_t written = fwrite(&out, 1, sizeof(out), pFile);
+	const unsigned char* pBytes = (const unsigned char*)&out;
+	size_t size = sizeof(out);
+
+	std::vector<unsigned char> packed;
+	if (packBytes)
+	{
+		packed.reserve(sizeof(out));
+		for (int y = 0; y < 200; ++y)
+			packChunk(out.pixels + (size_t)y * 160, 160, packed);
+
+		size_t rowsSize = packed.size();
+		int rest = (int)(sizeof(out) - sizeof(out.pixels));
+		packChunk(out.scbs, rest, packed);
+
+		// Exactly 32768 bytes would load as a raw image; splitting the last
+		// chunk somewhere else changes the size.
+		for (int split = 1; packed.size() == sizeof(out) && split < rest; ++split)
+		{
+			packed.resize(rowsSize);
+			packChunk(out.scbs, split, packed);
+			packChunk(out.scbs + split, rest - split, packed);
+		}
+
+		// No split got away from 32768 bytes: the raw image is just as big
+		// and loads back as what it is.
+		if (packed.size() != sizeof(out))
+		{
+			pBytes = &packed[0];
+			size = packed.size();
+		}
+	}
+
+	size_t written = fwrite(pBytes, 1, size, pFile);
 	fclose(pFile);
 
-	if (written != sizeof(out))
+	if (written != size)
 		return false;
 
 	// Sidecar log + debug-output for any remaps.
@@ -498,3 +1493,163 @@ bool C1File::SaveToFile(const wchar_t* pFilenamePath)
 
 	return true;
 }
+
+//------------------------------------------------------------------------------
+// C1File3200
+//
+
+//------------------------------------------------------------------------------
+// Construct from file.
+//
+C1File3200::C1File3200(const wchar_t* pFilePath)
+	: m_valid(false)
+{
+	memset(m_palettes, 0, sizeof(m_palettes));
+	LoadFromFile(pFilePath);
+}
+
+//------------------------------------------------------------------------------
+// Construct blank for save.
+//
+C1File3200::C1File3200()
+	: m_valid(true)
+{
+	memset(m_palettes, 0, sizeof(m_palettes));
+}
+
+//------------------------------------------------------------------------------
+void C1File3200::LoadFromFile(const wchar_t* pFilePath)
+{
+	FILE* pFile = nullptr;
+#ifdef _WIN32
+	errno_t err = _wfopen_s(&pFile, pFilePath, L"rb");
+	if (err != 0 || pFile == nullptr)
+		return;
+#else
+	(void)pFilePath;
+	return;
+#endif
+
+	fseek(pFile, 0, SEEK_END);
+	long fileLen = ftell(pFile);
+	fseek(pFile, 0, SEEK_SET);
+
+	if (fileLen != (long)sizeof(C1_3200FileImage))
+	{
+		fclose(pFile);
+		return;
+	}
+
+	C1_3200FileImage img;
+	size_t got = fread(&img, 1, sizeof(img), pFile);
+	fclose(pFile);
+
+	if (got != sizeof(img))
+		return;
+
+	for (int y = 0; y < 200; ++y)
+	{
+		for (int i = 0; i < 16; ++i)
+			m_palettes[y * 16 + i] = img.palettes[y][15 - i];
+	}
+
+	// Every row is 320 mode with bank 0, so the indices come out 0..15.
+	const ShrRowKernels& kernels = GetShrRowKernels();
+
+	m_indices.resize((size_t)320 * 200);
+	for (int y = 0; y < 200; ++y)
+		kernels.decode320(img.pixels + (size_t)y * 160, &m_indices[(size_t)y * 320], 160, 0);
+
+	m_valid = true;
+}
+
+//------------------------------------------------------------------------------
+void C1File3200::DecodeRgba(unsigned char* rgba) const
+{
+	for (int y = 0; y < 200; ++y)
+	{
+		const C1_Color* palette = GetRowPalette(y);
+		const unsigned char* row = &m_indices[(size_t)y * 320];
+		unsigned char* dst = rgba + (size_t)y * 320 * 4;
+
+		for (int x = 0; x < 320; ++x)
+		{
+			const C1_Color& c = palette[row[x] & 0x0F];
+			dst[x * 4 + 0] = (unsigned char)(c.r * 17);
+			dst[x * 4 + 1] = (unsigned char)(c.g * 17);
+			dst[x * 4 + 2] = (unsigned char)(c.b * 17);
+			dst[x * 4 + 3] = 255;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+void C1File3200::SetTrueColorImage(const unsigned char* rgba)
+{
+	m_indices.resize((size_t)320 * 200);
+
+	// Rows don't share anything, so each band of them goes on its own.
+	ForEachBand(200, 1, [&](size_t first, size_t end)
+	{
+		for (size_t y = first; y < end; ++y)
+		{
+			const unsigned char* row = rgba + y * 320 * 4;
+
+			QuantizerColor colors[16];
+			int numColors = QuantizePalette(row, 320, 16, colors);
+
+			// Map to the colors as they will show, 4-bit each.
+			C1_Color* palette = m_palettes + y * 16;
+			for (int i = 0; i < 16; ++i)
+			{
+				const QuantizerColor& c = colors[i < numColors ? i : 0];
+				palette[i].r = ChannelTo4Bit(c.r);
+				palette[i].g = ChannelTo4Bit(c.g);
+				palette[i].b = ChannelTo4Bit(c.b);
+				palette[i].a = 0;
+			}
+
+			for (int i = 0; i < numColors; ++i)
+			{
+				colors[i].r = (unsigned char)(palette[i].r * 17);
+				colors[i].g = (unsigned char)(palette[i].g * 17);
+				colors[i].b = (unsigned char)(palette[i].b * 17);
+			}
+
+			MapToPalette(row, 320, colors, numColors, &m_indices[y * 320]);
+		}
+	});
+}
+
+//------------------------------------------------------------------------------
+bool C1File3200::SaveToFile(const wchar_t* pFilenamePath)
+{
+	if (!m_valid || m_indices.empty())
+		return false;
+
+	C1_3200FileImage out;
+
+	const ShrRowKernels& kernels = GetShrRowKernels();
+	for (int y = 0; y < 200; ++y)
+	{
+		kernels.pack320(&m_indices[(size_t)y * 320], out.pixels + (size_t)y * 160, 160);
+
+		for (int i = 0; i < 16; ++i)
+			out.palettes[y][15 - i] = m_palettes[y * 16 + i];
+	}
+
+	FILE* pFile = nullptr;
+#ifdef _WIN32
+	errno_t err = _wfopen_s(&pFile, pFilenamePath, L"wb");
+	if (err != 0 || pFile == nullptr)
+		return false;
+#else
+	(void)pFilenamePath;
+	return false;
+#endif
+
+	size_t written = fwrite(&out, 1, sizeof(out), pFile);
+	fclose(pFile);
+
+	return written == sizeof(out);
+}
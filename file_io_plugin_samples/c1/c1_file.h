@@ -18,6 +18,15 @@
 //                              Each color is little-endian "0000 RRRR GGGG BBBB":
 //                              byte0 = GGGGBBBB, byte1 = 0000RRRR.
 //
+// "3200 color" SHR (Brooks format), ProDOS aux type $0002, is a sibling with
+// one palette per row instead of SCBs; see C1File3200 below. C1File loads
+// those too, reduced to 256 colors, since the plugin hands Promotion a single
+// 256-color palette.
+//
+// The same 32768 bytes compressed by PackBytes are ProDOS file type $C0, aux
+// type $0001. C1File loads and saves those too; a file that isn't exactly
+// 32768 bytes long is taken for packed.
+//
 #ifndef C1_FILE_H
 #define C1_FILE_H
 
@@ -49,12 +58,29 @@ typedef struct C1_FileImage
 static_assert(sizeof(C1_Color) == 2,         "C1_Color must be 2 bytes");
 static_assert(sizeof(C1_FileImage) == 32768, "C1_FileImage must be exactly $8000 bytes");
 
+// The whole 3200 color file:
+//   $0000..$7CFF  32000 bytes  Pixel data, 320-mode rows as above.
+//   $7D00..$95FF   6400 bytes  One palette per row, 200 x 16 colors x 2 bytes,
+//                              each stored in reverse: entry 15 first.
+#pragma pack(push, 1)
+typedef struct C1_3200FileImage
+{
+	unsigned char pixels[32000];        // 200 rows x 160 bytes
+	C1_Color      palettes[200][16];    // reversed per row
+} C1_3200FileImage;
+#pragma pack(pop)
+
+static_assert(sizeof(C1_3200FileImage) == 38400, "C1_3200FileImage must be exactly $9600 bytes");
+
+class C1File3200;
+
 
 class C1File
 {
 public:
 	// Construct from an existing file on disk. After construction, call
-	// IsValid() to check whether the file was a well-formed 32768-byte SHR.
+	// IsValid() to check whether the file was a well-formed 32768-byte SHR,
+	// or one packed by PackBytes, or a 3200 color one.
 	C1File(const wchar_t* pFilePath);
 
 	// Construct a blank file for saving. widthPixels must be 320 or 640;
@@ -72,6 +98,12 @@ public:
 	int GetWidthPixels() const { return m_widthPixels; }
 	int GetHeight()      const { return m_heightPixels; }
 
+	// Heap held by this object (the unpacked frame).
+	size_t GetMemoryUsage() const
+	{
+		return sizeof(*this) + m_pPixelMaps.size() * (size_t)m_widthPixels * (size_t)m_heightPixels;
+	}
+
 	// One image; layout is [m_widthPixels x m_heightPixels] of 8-bit indices,
 	// where each index is (scb_palette_bank << 4) | per-pixel-nibble. So the
 	// 256-entry RGB palette returned by GetPalette() directly resolves them.
@@ -96,15 +128,23 @@ public:
 	// (m_widthPixels * m_heightPixels) bytes of 8-bit indices.
 	void AddImage(const unsigned char* pixels);
 
-	// Analyse rows, generate SCBs, pack pixels, write 32768 bytes to disk.
+	// True color instead of SetPalette and AddImage: choose the 16 palettes
+	// and every row's SCB bank for rgba (m_widthPixels x m_heightPixels,
+	// 4 bytes per pixel, alpha ignored) and map the frame to them.
+	void SetTrueColorImage(const unsigned char* rgba);
+
+	// Analyse rows, generate SCBs, pack pixels, write 32768 bytes to disk, or
+	// with packBytes that image compressed by PackBytes ($C0/$0001). A
+	// packing that can't be told from a raw image by its size is written raw.
 	// If any row violates strict SHR rules, the offending pixels are remapped
 	// to the nearest legal color (and a sidecar <path>.remap.log is written
 	// plus an OutputDebugStringW message issued).
 	// Returns true on a successful disk write.
-	bool SaveToFile(const wchar_t* pFilenamePath);
+	bool SaveToFile(const wchar_t* pFilenamePath, bool packBytes = false);
 
 private:
 	void LoadFromFile(const wchar_t* pFilePath);
+	void LoadFrom3200(const C1File3200& image);
 
 	bool m_valid;
 	int  m_widthPixels;
@@ -117,4 +157,47 @@ private:
 	std::vector<unsigned char*> m_pPixelMaps;
 };
 
+
+// 3200 color SHR: 320x200, every row with its own 16 colors.
+class C1File3200
+{
+public:
+	// Construct from an existing file on disk; check IsValid() after.
+	C1File3200(const wchar_t* pFilePath);
+
+	// Construct a blank file for saving.
+	C1File3200();
+
+	bool IsValid() const { return m_valid; }
+
+	int GetWidthPixels() const { return 320; }
+	int GetHeight()      const { return 200; }
+
+	// Row y's 16 colors, in index order (not reversed).
+	const C1_Color* GetRowPalette(int y) const { return m_palettes + y * 16; }
+
+	// 320 x 200 indices, each 0..15 into its row's palette.
+	const unsigned char* GetIndices() const { return m_indices.data(); }
+
+	// Expand to 320 x 200 RGBA, 4 bytes per pixel, alpha 255.
+	void DecodeRgba(unsigned char* rgba) const;
+
+	// --- Save-side setup ---
+
+	// Quantize every row of rgba (320 x 200, 4 bytes per pixel, alpha
+	// ignored) to its own 16 colors, rows in parallel.
+	void SetTrueColorImage(const unsigned char* rgba);
+
+	// Pack rows and write 38400 bytes. Returns true on a successful write.
+	bool SaveToFile(const wchar_t* pFilenamePath);
+
+private:
+	void LoadFromFile(const wchar_t* pFilePath);
+
+	bool m_valid;
+
+	C1_Color m_palettes[200 * 16];
+	std::vector<unsigned char> m_indices;
+};
+
 #endif // C1_FILE_H
@@ -0,0 +1,829 @@
+//
+// Color quantizer, see colorQuantizer.h
+//
+#include "colorQuantizer.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Palette search, picked at run time
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define QUANTIZER_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define QUANTIZER_TARGET(isa)
+#else
+#define QUANTIZER_TARGET(isa) __attribute__((target(isa)))
+#endif
+#else
+#define QUANTIZER_SIMD 0
+#endif
+
+// Pixels per thread below which more threads don't pay off
+#define QUANTIZER_MIN_BAND (64 * 1024)
+
+// k-means passes after the median cut
+#define QUANTIZER_KMEANS_PASSES 4
+
+// Recently mapped colors remembered per thread while mapping
+#define QUANTIZER_CACHE_SIZE 4096
+
+// Images up to this many pixels skip the histogram, each pixel is a sample;
+// clearing and scanning 32768 cells would cost more than it saves
+#define QUANTIZER_DIRECT_SAMPLES 1024
+
+namespace
+{
+	//--------------------------------------------------------------------------
+	// Bands to split count items into: one per core, but none smaller than
+	// minBand
+
+	size_t CountBands(size_t count, size_t minBand)
+	{
+		size_t numBands = std::thread::hardware_concurrency();
+		size_t maxBands = (count + minBand - 1) / minBand;
+		if (numBands > maxBands)
+			numBands = maxBands;
+		if (numBands < 1)
+			numBands = 1;
+		return numBands;
+	}
+}
+
+//------------------------------------------------------------------------------
+
+void ForEachBand(size_t count, size_t minBand, const std::function<void(size_t, size_t)>& fn)
+{
+	size_t numBands = CountBands(count, minBand);
+	size_t bandSize = (count + numBands - 1) / numBands;
+
+	std::vector<std::thread> threads;
+	for (size_t band = 1; band < numBands; ++band)
+	{
+		size_t begin = band * bandSize;
+		size_t end = std::min(count, begin + bandSize);
+		if (begin >= end)
+			break;
+
+		try
+		{
+			threads.push_back(std::thread(fn, begin, end));
+		}
+		catch (...)
+		{
+			// No thread to be had, do the band here
+			fn(begin, end);
+		}
+	}
+
+	fn(0, std::min(count, bandSize));
+
+	for (size_t idx = 0; idx < threads.size(); ++idx)
+		threads[idx].join();
+}
+
+namespace
+{
+	//--------------------------------------------------------------------------
+	// Exact colors: collect the distinct colors, giving up once there are
+	// more than maxColors
+
+	bool CollectExactColors(const unsigned char* pRgba, size_t numPixels,
+							int maxColors, QuantizerColor* pPalette, int& numColors)
+	{
+		// open addressing, keys are rgb | 1 << 24 so 0 means empty
+		const unsigned int tableSize = 1024;
+		unsigned int table[tableSize];
+		memset(table, 0, sizeof(table));
+
+		numColors = 0;
+		unsigned int lastKey = 0;
+
+		for (size_t idx = 0; idx < numPixels; ++idx)
+		{
+			const unsigned char* p = pRgba + idx * 4;
+			unsigned int key = (1u << 24) | (p[0] << 16) | (p[1] << 8) | p[2];
+
+			// runs of the same color are the norm in pixel art
+			if (key == lastKey)
+				continue;
+			lastKey = key;
+
+			unsigned int slot = (key * 2654435761u) >> 22;
+			while (table[slot] != 0 && table[slot] != key)
+				slot = (slot + 1) & (tableSize - 1);
+
+			if (table[slot] == key)
+				continue;
+
+			if (numColors == maxColors)
+				return false;
+
+			table[slot] = key;
+			pPalette[numColors].r = p[0];
+			pPalette[numColors].g = p[1];
+			pPalette[numColors].b = p[2];
+			numColors++;
+		}
+
+		return true;
+	}
+
+	//--------------------------------------------------------------------------
+	// Histogram of 5-5-5 cells, each remembering the mean of its colors
+
+	const int kNumCells = 32 * 32 * 32;
+
+	struct Cell
+	{
+		unsigned long long count;
+		unsigned long long r, g, b;		// sums
+	};
+
+	// A nonempty cell, as the median cut and k-means see it
+	struct Sample
+	{
+		float c[3];			// mean r, g, b
+		float weight;		// pixel count
+	};
+
+	void BuildSamples(const unsigned char* pRgba, size_t numPixels, std::vector<Sample>& samples)
+	{
+		samples.clear();
+
+		if (numPixels <= QUANTIZER_DIRECT_SAMPLES)
+		{
+			for (size_t idx = 0; idx < numPixels; ++idx)
+			{
+				const unsigned char* p = pRgba + idx * 4;
+				Sample sample = { { (float)p[0], (float)p[1], (float)p[2] }, 1.0f };
+				samples.push_back(sample);
+			}
+			return;
+		}
+
+		// one histogram per band, summed up after
+		std::vector< std::vector<Cell> > histograms;
+		size_t numBands = CountBands(numPixels, QUANTIZER_MIN_BAND);
+		histograms.resize(numBands);
+
+		std::vector<Cell> total(kNumCells);
+		memset(total.data(), 0, kNumCells * sizeof(Cell));
+
+		size_t bandSize = (numPixels + numBands - 1) / numBands;
+		ForEachBand(numBands, 1, [&](size_t firstBand, size_t endBand)
+		{
+			for (size_t band = firstBand; band < endBand; ++band)
+			{
+				std::vector<Cell>& cells = histograms[band];
+				cells.assign(kNumCells, Cell());
+
+				size_t end = std::min(numPixels, (band + 1) * bandSize);
+				for (size_t idx = band * bandSize; idx < end; ++idx)
+				{
+					const unsigned char* p = pRgba + idx * 4;
+					Cell& cell = cells[((p[0] >> 3) << 10) | ((p[1] >> 3) << 5) | (p[2] >> 3)];
+					cell.count++;
+					cell.r += p[0];
+					cell.g += p[1];
+					cell.b += p[2];
+				}
+			}
+		});
+
+		for (size_t band = 0; band < numBands; ++band)
+		{
+			const std::vector<Cell>& cells = histograms[band];
+			if (cells.empty())
+				continue;
+
+			for (int idx = 0; idx < kNumCells; ++idx)
+			{
+				total[idx].count += cells[idx].count;
+				total[idx].r += cells[idx].r;
+				total[idx].g += cells[idx].g;
+				total[idx].b += cells[idx].b;
+			}
+		}
+
+		for (int idx = 0; idx < kNumCells; ++idx)
+		{
+			const Cell& cell = total[idx];
+			if (cell.count == 0)
+				continue;
+
+			Sample sample;
+			sample.c[0] = (float)cell.r / cell.count;
+			sample.c[1] = (float)cell.g / cell.count;
+			sample.c[2] = (float)cell.b / cell.count;
+			sample.weight = (float)cell.count;
+			samples.push_back(sample);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Median cut over the samples
+
+	struct Box
+	{
+		size_t begin, end;		// range of samples
+		double error;			// weighted squared error around the mean
+		int axis;				// channel with the most of it
+	};
+
+	void MeasureBox(const std::vector<Sample>& samples, Box& box, float* pMean)
+	{
+		double weight = 0;
+		double sum[3] = { 0, 0, 0 };
+		double sumSq[3] = { 0, 0, 0 };
+
+		for (size_t idx = box.begin; idx < box.end; ++idx)
+		{
+			const Sample& s = samples[idx];
+			weight += s.weight;
+			for (int ch = 0; ch < 3; ++ch)
+			{
+				sum[ch] += s.weight * s.c[ch];
+				sumSq[ch] += s.weight * s.c[ch] * s.c[ch];
+			}
+		}
+
+		box.error = 0;
+		box.axis = 0;
+		double axisError = -1;
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			double mean = weight > 0 ? sum[ch] / weight : 0;
+			double error = sumSq[ch] - mean * sum[ch];
+			box.error += error;
+			if (error > axisError)
+			{
+				axisError = error;
+				box.axis = ch;
+			}
+			pMean[ch] = (float)mean;
+		}
+
+		// one sample can't be split
+		if (box.end - box.begin < 2)
+			box.error = 0;
+	}
+
+	void MedianCut(std::vector<Sample>& samples, int maxColors, std::vector<Box>& boxes)
+	{
+		float mean[3];
+
+		boxes.clear();
+		Box all = { 0, samples.size(), 0, 0 };
+		MeasureBox(samples, all, mean);
+		boxes.push_back(all);
+
+		while ((int)boxes.size() < maxColors)
+		{
+			// split the box that's furthest off
+			size_t worst = 0;
+			for (size_t idx = 1; idx < boxes.size(); ++idx)
+			{
+				if (boxes[idx].error > boxes[worst].error)
+					worst = idx;
+			}
+
+			Box box = boxes[worst];
+			if (box.error <= 0)
+				break;
+
+			int axis = box.axis;
+			std::sort(samples.begin() + box.begin, samples.begin() + box.end,
+					  [axis](const Sample& a, const Sample& b) { return a.c[axis] < b.c[axis]; });
+
+			// at the weighted median, leaving at least one sample either side
+			double weight = 0;
+			for (size_t idx = box.begin; idx < box.end; ++idx)
+				weight += samples[idx].weight;
+
+			size_t split = box.begin + 1;
+			double below = samples[box.begin].weight;
+			while (split < box.end - 1 && below + samples[split].weight <= weight / 2)
+			{
+				below += samples[split].weight;
+				split++;
+			}
+
+			Box low = { box.begin, split, 0, 0 };
+			Box high = { split, box.end, 0, 0 };
+			MeasureBox(samples, low, mean);
+			MeasureBox(samples, high, mean);
+
+			boxes[worst] = low;
+			boxes.push_back(high);
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Palette search kernels: index of the nearest entry for one pixel
+
+	// The palette as the kernels read it: r g pairs and b 0 pairs of 16 bit
+	// values, padded to a multiple of 8 with entries too far off to be picked
+	// (1000, where no 8 bit color comes near)
+	struct SearchPalette
+	{
+		short rg[2 * 256];
+		short b0[2 * 256];
+		int numColors;
+		int numPadded;
+		QuantizerColor colors[256];
+	};
+
+	void PrepareSearch(const QuantizerColor* pPalette, int numColors, SearchPalette& search)
+	{
+		search.numColors = numColors;
+		search.numPadded = (numColors + 7) & ~7;
+
+		for (int idx = 0; idx < search.numPadded; ++idx)
+		{
+			bool real = idx < numColors;
+			search.rg[idx * 2 + 0] = real ? pPalette[idx].r : 1000;
+			search.rg[idx * 2 + 1] = real ? pPalette[idx].g : 1000;
+			search.b0[idx * 2 + 0] = real ? pPalette[idx].b : 1000;
+			search.b0[idx * 2 + 1] = 0;
+			if (real)
+				search.colors[idx] = pPalette[idx];
+		}
+	}
+
+	typedef int (*NearestFn)(const SearchPalette& search, int r, int g, int b);
+
+	int Nearest_Scalar(const SearchPalette& search, int r, int g, int b)
+	{
+		int best = 0;
+		int bestDistance = 0x7FFFFFFF;
+
+		for (int idx = 0; idx < search.numColors; ++idx)
+		{
+			int distance = ColorDistance(r, g, b, search.colors[idx]);
+			if (distance < bestDistance)
+			{
+				bestDistance = distance;
+				best = idx;
+			}
+		}
+
+		return best;
+	}
+
+#if QUANTIZER_SIMD
+
+	// The kernels track distance << 8 | index per lane, so one compare keeps
+	// both and ties go to the lower index. Real distances stay below 3 * 255^2
+	// and the padding's below 3 * 1000^2, so the key fits 31 bits.
+
+	// Four entries at a time: madd of the 16 bit (dr, dg) pairs gives
+	// dr*dr + dg*dg per 32 bit lane, and of the (db, 0) pairs db*db
+	QUANTIZER_TARGET("sse2")
+	int Nearest_SSE2(const SearchPalette& search, int r, int g, int b)
+	{
+		const __m128i pixelRg = _mm_set1_epi32((g << 16) | r);
+		const __m128i pixelB  = _mm_set1_epi32(b);
+		const __m128i four    = _mm_set1_epi32(4);
+
+		__m128i best  = _mm_set1_epi32(0x7FFFFFFF);
+		__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+
+		for (int idx = 0; idx < search.numPadded; idx += 4)
+		{
+			__m128i drg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(search.rg + idx * 2)), pixelRg);
+			__m128i db  = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(search.b0 + idx * 2)), pixelB);
+			__m128i distance = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db, db));
+			__m128i key = _mm_or_si128(_mm_slli_epi32(distance, 8), index);
+
+			__m128i closer = _mm_cmplt_epi32(key, best);
+			best  = _mm_or_si128(_mm_and_si128(closer, key), _mm_andnot_si128(closer, best));
+			index = _mm_add_epi32(index, four);
+		}
+
+		int keys[4];
+		_mm_storeu_si128((__m128i*)keys, best);
+		int key = std::min(std::min(keys[0], keys[1]), std::min(keys[2], keys[3]));
+		return key & 0xFF;
+	}
+
+	QUANTIZER_TARGET("avx2")
+	inline __m256i Keys_AVX2(const SearchPalette& search, int idx, __m256i pixelRg, __m256i pixelB, __m256i index)
+	{
+		__m256i drg = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(search.rg + idx * 2)), pixelRg);
+		__m256i db  = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(search.b0 + idx * 2)), pixelB);
+		__m256i distance = _mm256_add_epi32(_mm256_madd_epi16(drg, drg), _mm256_madd_epi16(db, db));
+		return _mm256_or_si256(_mm256_slli_epi32(distance, 8), index);
+	}
+
+	// Eight entries at a time, in two chains so they overlap
+	QUANTIZER_TARGET("avx2")
+	int Nearest_AVX2(const SearchPalette& search, int r, int g, int b)
+	{
+		const __m256i pixelRg = _mm256_set1_epi32((g << 16) | r);
+		const __m256i pixelB  = _mm256_set1_epi32(b);
+		const __m256i eight   = _mm256_set1_epi32(8);
+		const __m256i sixteen = _mm256_set1_epi32(16);
+
+		__m256i best0 = _mm256_set1_epi32(0x7FFFFFFF);
+		__m256i best1 = best0;
+		__m256i index0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		__m256i index1 = _mm256_add_epi32(index0, eight);
+
+		int idx = 0;
+		for (; idx + 16 <= search.numPadded; idx += 16)
+		{
+			best0 = _mm256_min_epi32(best0, Keys_AVX2(search, idx, pixelRg, pixelB, index0));
+			best1 = _mm256_min_epi32(best1, Keys_AVX2(search, idx + 8, pixelRg, pixelB, index1));
+			index0 = _mm256_add_epi32(index0, sixteen);
+			index1 = _mm256_add_epi32(index1, sixteen);
+		}
+		if (idx < search.numPadded)
+			best0 = _mm256_min_epi32(best0, Keys_AVX2(search, idx, pixelRg, pixelB, index0));
+
+		__m256i best = _mm256_min_epi32(best0, best1);
+		__m128i half = _mm_min_epi32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+		half = _mm_min_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+		half = _mm_min_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtsi128_si32(half) & 0xFF;
+	}
+
+	bool CpuHasAVX2()
+	{
+	#if defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 0);
+		int maxLeaf = regs[0];
+
+		__cpuid(regs, 1);
+		bool osAvx = ((regs[2] & (1 << 27)) != 0) && ((regs[2] & (1 << 28)) != 0) &&
+					 ((_xgetbv(0) & 6) == 6);
+		if (!osAvx || maxLeaf < 7)
+			return false;
+
+		__cpuidex(regs, 7, 0);
+		return (regs[1] & (1 << 5)) != 0;
+	#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	#endif
+	}
+
+	bool CpuHasSSE2()
+	{
+	#if defined(_M_X64) || defined(__x86_64__)
+		return true;
+	#elif defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 1);
+		return (regs[3] & (1 << 26)) != 0;
+	#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") != 0;
+	#endif
+	}
+
+#endif // QUANTIZER_SIMD
+
+	// Picked once, on first use
+	NearestFn GetNearestKernel()
+	{
+		static const NearestFn kernel = []()
+		{
+			NearestFn fn = Nearest_Scalar;
+		#if QUANTIZER_SIMD
+			if (CpuHasSSE2())
+			{
+				fn = Nearest_SSE2;
+
+				if (CpuHasAVX2())
+					fn = Nearest_AVX2;
+			}
+		#endif
+			return fn;
+		}();
+
+		return kernel;
+	}
+
+	//--------------------------------------------------------------------------
+	// k-means over the samples, starting from the median cut's palette
+
+	void RefinePalette(const std::vector<Sample>& samples, QuantizerColor* pPalette, int numColors)
+	{
+		NearestFn nearest = GetNearestKernel();
+		SearchPalette search;
+
+		std::vector<double> sums(numColors * 4);
+
+		for (int pass = 0; pass < QUANTIZER_KMEANS_PASSES; ++pass)
+		{
+			PrepareSearch(pPalette, numColors, search);
+			std::fill(sums.begin(), sums.end(), 0.0);
+
+			for (size_t idx = 0; idx < samples.size(); ++idx)
+			{
+				const Sample& s = samples[idx];
+				int entry = nearest(search, (int)(s.c[0] + 0.5f), (int)(s.c[1] + 0.5f), (int)(s.c[2] + 0.5f));
+
+				double* pSum = &sums[entry * 4];
+				pSum[0] += s.weight * s.c[0];
+				pSum[1] += s.weight * s.c[1];
+				pSum[2] += s.weight * s.c[2];
+				pSum[3] += s.weight;
+			}
+
+			bool moved = false;
+			for (int entry = 0; entry < numColors; ++entry)
+			{
+				const double* pSum = &sums[entry * 4];
+
+				// nothing nearest to it: leave it where it is
+				if (pSum[3] <= 0)
+					continue;
+
+				QuantizerColor c;
+				c.r = (unsigned char)(pSum[0] / pSum[3] + 0.5);
+				c.g = (unsigned char)(pSum[1] / pSum[3] + 0.5);
+				c.b = (unsigned char)(pSum[2] / pSum[3] + 0.5);
+
+				if (c.r != pPalette[entry].r || c.g != pPalette[entry].g || c.b != pPalette[entry].b)
+				{
+					pPalette[entry] = c;
+					moved = true;
+				}
+			}
+
+			if (!moved)
+				break;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
+int QuantizePalette(const unsigned char* pRgba, size_t numPixels,
+					int maxColors, QuantizerColor* pPalette, bool* pExact)
+{
+	if (pExact != NULL)
+		*pExact = false;
+
+	if (maxColors < 1)
+		return 0;
+	if (maxColors > 256)
+		maxColors = 256;
+
+	// few enough colors to keep them all as they are
+	int numColors;
+	if (CollectExactColors(pRgba, numPixels, maxColors, pPalette, numColors))
+	{
+		if (pExact != NULL)
+			*pExact = true;
+		return numColors;
+	}
+
+	std::vector<Sample> samples;
+	BuildSamples(pRgba, numPixels, samples);
+
+	std::vector<Box> boxes;
+	MedianCut(samples, maxColors, boxes);
+
+	numColors = (int)boxes.size();
+	for (int idx = 0; idx < numColors; ++idx)
+	{
+		float mean[3];
+		MeasureBox(samples, boxes[idx], mean);
+
+		pPalette[idx].r = (unsigned char)(mean[0] + 0.5f);
+		pPalette[idx].g = (unsigned char)(mean[1] + 0.5f);
+		pPalette[idx].b = (unsigned char)(mean[2] + 0.5f);
+	}
+
+	RefinePalette(samples, pPalette, numColors);
+
+	return numColors;
+}
+
+void MapToPalette(const unsigned char* pRgba, size_t numPixels,
+				  const QuantizerColor* pPalette, int numColors,
+				  unsigned char* pIndices)
+{
+	if (numColors < 1)
+		return;
+	if (numColors > 256)
+		numColors = 256;
+
+	SearchPalette search;
+	PrepareSearch(pPalette, numColors, search);
+
+	NearestFn nearest = GetNearestKernel();
+
+	ForEachBand(numPixels, QUANTIZER_MIN_BAND, [&](size_t begin, size_t end)
+	{
+		// keys are rgb | 1 << 24 so 0 means empty
+		std::vector<unsigned int> cacheKeys(QUANTIZER_CACHE_SIZE, 0);
+		std::vector<unsigned char> cacheIndices(QUANTIZER_CACHE_SIZE);
+
+		for (size_t idx = begin; idx < end; ++idx)
+		{
+			const unsigned char* p = pRgba + idx * 4;
+			unsigned int key = (1u << 24) | (p[0] << 16) | (p[1] << 8) | p[2];
+			unsigned int slot = (key * 2654435761u) >> (32 - 12);
+
+			if (cacheKeys[slot] != key)
+			{
+				cacheKeys[slot] = key;
+				cacheIndices[slot] = (unsigned char)nearest(search, p[0], p[1], p[2]);
+			}
+
+			pIndices[idx] = cacheIndices[slot];
+		}
+	});
+}
+
+//------------------------------------------------------------------------------
+// 4 bit per channel palettes
+
+// Largest dither spread, in 8 bit steps; more than that and the noise shows
+// more than the banding did
+#define QUANTIZER_MAX_DITHER 80
+
+namespace
+{
+	const int kBayer4x4[4][4] =
+	{
+		{  0,  8,  2, 10 },
+		{ 12,  4, 14,  6 },
+		{  3, 11,  1,  9 },
+		{ 15,  7, 13,  5 },
+	};
+
+	// Maps one row: each channel, with pOffsets[x & 3] added, rounds to 4 bits
+	// and the three of them index pTable
+	typedef void (*MapRowFn)(const unsigned char* pRgba, int width, const short* pOffsets,
+							 const unsigned char* pTable, unsigned char* pIndices);
+
+	void MapRow444_Scalar(const unsigned char* pRgba, int width, const short* pOffsets,
+						  const unsigned char* pTable, unsigned char* pIndices)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			const unsigned char* p = pRgba + x * 4;
+			int offset = pOffsets[x & 3];
+			int key = 0;
+
+			for (int ch = 0; ch < 3; ++ch)
+			{
+				int v = std::min(255, std::max(0, p[ch] + offset));
+				key = (key << 4) | ChannelTo4Bit(v);
+			}
+
+			pIndices[x] = pTable[key];
+		}
+	}
+
+#if QUANTIZER_SIMD
+
+	// Four pixels at a time. v * 15 + 127 stays below 4096, where
+	// (x * 0x8081) >> 23 is x / 255.
+	QUANTIZER_TARGET("sse2")
+	void MapRow444_SSE2(const unsigned char* pRgba, int width, const short* pOffsets,
+						const unsigned char* pTable, unsigned char* pIndices)
+	{
+		const __m128i zero    = _mm_setzero_si128();
+		const __m128i max     = _mm_set1_epi16(255);
+		const __m128i fifteen = _mm_set1_epi16(15);
+		const __m128i half    = _mm_set1_epi16(127);
+		const __m128i magic   = _mm_set1_epi16((short)0x8081);
+		const __m128i weights = _mm_setr_epi16(256, 16, 1, 0, 256, 16, 1, 0);
+
+		// x steps by 4, so the offsets for x & 3 stay put
+		const __m128i offsetsLo = _mm_setr_epi16(pOffsets[0], pOffsets[0], pOffsets[0], 0,
+												 pOffsets[1], pOffsets[1], pOffsets[1], 0);
+		const __m128i offsetsHi = _mm_setr_epi16(pOffsets[2], pOffsets[2], pOffsets[2], 0,
+												 pOffsets[3], pOffsets[3], pOffsets[3], 0);
+
+		int x = 0;
+		for (; x + 4 <= width; x += 4)
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(pRgba + x * 4));
+			__m128i lo = _mm_unpacklo_epi8(pixels, zero);
+			__m128i hi = _mm_unpackhi_epi8(pixels, zero);
+
+			lo = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(lo, offsetsLo), zero), max);
+			hi = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(hi, offsetsHi), zero), max);
+
+			lo = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(lo, fifteen), half), magic), 7);
+			hi = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_mullo_epi16(hi, fifteen), half), magic), 7);
+
+			// r << 8 | g << 4 in one 32 bit lane and b in the next, then added
+			lo = _mm_madd_epi16(lo, weights);
+			hi = _mm_madd_epi16(hi, weights);
+			lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+			hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+
+			int keys[8];
+			_mm_storeu_si128((__m128i*)keys, lo);
+			_mm_storeu_si128((__m128i*)(keys + 4), hi);
+
+			pIndices[x + 0] = pTable[keys[0]];
+			pIndices[x + 1] = pTable[keys[2]];
+			pIndices[x + 2] = pTable[keys[4]];
+			pIndices[x + 3] = pTable[keys[6]];
+		}
+
+		MapRow444_Scalar(pRgba + x * 4, width - x, pOffsets, pTable, pIndices + x);
+	}
+
+#endif // QUANTIZER_SIMD
+
+	MapRowFn GetMapRowKernel()
+	{
+		static const MapRowFn kernel = []()
+		{
+			MapRowFn fn = MapRow444_Scalar;
+		#if QUANTIZER_SIMD
+			if (CpuHasSSE2())
+				fn = MapRow444_SSE2;
+		#endif
+			return fn;
+		}();
+
+		return kernel;
+	}
+}
+
+void MapToPalette444(const unsigned char* pRgba, int width, int height,
+					 const QuantizerColor* pPalette, int numColors, bool dither,
+					 unsigned char* pIndices)
+{
+	if (numColors < 1 || width < 1 || height < 1)
+		return;
+	if (numColors > 256)
+		numColors = 256;
+
+	// nearest entry for each of the 4096 colors
+	unsigned char table[4096];
+	for (int key = 0; key < 4096; ++key)
+	{
+		int r = key >> 8;
+		int g = (key >> 4) & 15;
+		int b = key & 15;
+
+		int best = 0;
+		int bestDistance = 0x7FFFFFFF;
+		for (int idx = 0; idx < numColors; ++idx)
+		{
+			int distance = ColorDistance(r, g, b, pPalette[idx]);
+			if (distance < bestDistance)
+			{
+				bestDistance = distance;
+				best = idx;
+			}
+		}
+		table[key] = (unsigned char)best;
+	}
+
+	// dither by about the distance between neighboring entries, in 8 bit
+	// steps: less doesn't get from one entry to the next
+	int spread = 0;
+	if (dither && numColors > 1)
+	{
+		double sum = 0;
+		for (int idx = 0; idx < numColors; ++idx)
+		{
+			int nearest = 0x7FFFFFFF;
+			for (int other = 0; other < numColors; ++other)
+			{
+				const QuantizerColor& c = pPalette[other];
+				if (other != idx)
+					nearest = std::min(nearest, ColorDistance(c.r, c.g, c.b, pPalette[idx]));
+			}
+			sum += sqrt((double)nearest) * 17;
+		}
+		spread = std::min(QUANTIZER_MAX_DITHER, (int)(sum / numColors + 0.5));
+	}
+
+	short offsets[4][4];
+	for (int y = 0; y < 4; ++y)
+	{
+		for (int x = 0; x < 4; ++x)
+			offsets[y][x] = (short)floor(((kBayer4x4[y][x] + 0.5) / 16 - 0.5) * spread + 0.5);
+	}
+
+	MapRowFn mapRow = GetMapRowKernel();
+	size_t minRows = std::max<size_t>(1, QUANTIZER_MIN_BAND / width);
+
+	ForEachBand(height, minRows, [&](size_t begin, size_t end)
+	{
+		for (size_t y = begin; y < end; ++y)
+		{
+			mapRow(pRgba + y * width * 4, width, offsets[y & 3], table, pIndices + y * width);
+		}
+	});
+}
@@ -0,0 +1,70 @@
+//
+// Color quantizer: reduces a true color RGBA image to a palette of at most a
+// given number of colors, and maps its pixels to the nearest palette entry.
+//
+// An image with no more colors than that keeps its exact colors. Otherwise
+// the colors are counted into a 5-5-5 histogram, the histogram is split by
+// median cut, and the result is refined with a few k-means passes over the
+// histogram cells, so the cost of building the palette doesn't grow with the
+// image. Counting and mapping run on all cores; mapping searches the palette
+// with SSE2 or AVX2, picked at run time, behind a small cache of recent
+// colors.
+//
+// Pixels are 4 bytes, r g b a. Alpha is ignored, the formats using this have
+// no alpha per pixel.
+//
+// Shared by the plugins that take true color saves.
+//
+#ifndef COLOR_QUANTIZER_H
+#define COLOR_QUANTIZER_H
+
+#include <stddef.h>
+#include <functional>
+
+struct QuantizerColor
+{
+	unsigned char r, g, b;
+};
+
+// Pick at most maxColors (1-256) colors for the numPixels pixels at pRgba.
+// Returns the number of palette entries filled in. pExact, if given, is set
+// when those are all the image's colors, so there is nothing to dither.
+int QuantizePalette(const unsigned char* pRgba, size_t numPixels,
+					int maxColors, QuantizerColor* pPalette, bool* pExact = NULL);
+
+// Write the index of the nearest of the numColors (1-256) palette entries
+// for each of the numPixels pixels at pRgba to pIndices.
+void MapToPalette(const unsigned char* pRgba, size_t numPixels,
+				  const QuantizerColor* pPalette, int numColors,
+				  unsigned char* pIndices);
+
+// Map to a palette of 4 bit per channel colors, pPalette's channels being
+// 0-15. Such a palette can only hold 4096 colors, so each pixel is looked up
+// in a table of the nearest entry for every one of them instead of searching
+// the palette. With dither, a 4x4 ordered dither scaled to the palette's
+// spacing goes on top. Rows are width pixels, pIndices gets width * height.
+void MapToPalette444(const unsigned char* pRgba, int width, int height,
+					 const QuantizerColor* pPalette, int numColors, bool dither,
+					 unsigned char* pIndices);
+
+// 8 bit channel to the nearest of 4 bits
+inline unsigned char ChannelTo4Bit(int c)
+{
+	return (unsigned char)((c * 15 + 127) / 255);
+}
+
+// Run fn(begin, end) over [0, count) split into bands, one per core but
+// none smaller than minBand. The calling thread takes the first band. Used
+// by the above, and by plugins for work of their own.
+void ForEachBand(size_t count, size_t minBand, const std::function<void(size_t, size_t)>& fn);
+
+// Squared RGB distance, the measure both of the above minimize
+inline int ColorDistance(int r0, int g0, int b0, const QuantizerColor& c)
+{
+	int dr = r0 - c.r;
+	int dg = g0 - c.g;
+	int db = b0 - c.b;
+	return dr*dr + dg*dg + db*db;
+}
+
+#endif // COLOR_QUANTIZER_H
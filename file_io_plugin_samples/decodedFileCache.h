@@ -0,0 +1,162 @@
+//
+// DecodedFileCache: holds on to the last few files a plugin opened, decoded,
+// so flipping between a handful of reference images, or Promotion asking
+// about the same file again, doesn't read and unpack it all over.
+//
+// The shim takes the object for the file it's working on out of the cache,
+// and puts it back when it moves on to another file. Entries are keyed by
+// path and only handed out while the file's size and last write time are
+// what they were when it was loaded. Least recently used entries are dropped
+// to stay within a memory budget, as measured by T::GetMemoryUsage().
+//
+// Shared by the i256, i16 and c1 plugins. Not thread safe; only use it from
+// the host's thread.
+//
+#ifndef DECODED_FILE_CACHE_H
+#define DECODED_FILE_CACHE_H
+
+#include "fileStamp.h"
+
+#include <stddef.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+template <class T>
+class DecodedFileCache
+{
+public:
+	// maxBytes caps the memory held by cached objects; 0 turns caching off
+	DecodedFileCache(size_t maxBytes)
+		: m_bytes( 0 )
+		, m_maxBytes( maxBytes )
+	{
+	}
+
+	~DecodedFileCache()
+	{
+		Clear();
+	}
+
+	// The cached object for pPath, now owned by the caller, or null. stamp
+	// is filled in with the file as it is now, to hand back to Put() later.
+	T* Take(const wchar_t* pPath, FileStamp& stamp)
+	{
+		stamp.Read( pPath );
+
+		std::wstring key;
+		if (!FileStamp::MakeKey(pPath, key))
+			return nullptr;
+
+		typename IndexMap::iterator it = m_index.find( key );
+		if (it == m_index.end())
+			return nullptr;
+
+		Entry entry = *it->second;
+		m_bytes -= entry.bytes;
+		m_entries.erase( it->second );
+		m_index.erase( it );
+
+		if (!stamp.IsValid() || (entry.stamp != stamp))
+		{
+			// Changed on disk since
+			delete entry.pFile;
+			return nullptr;
+		}
+
+		return entry.pFile;
+	}
+
+	// Give pFile, loaded from pPath when the file matched stamp, to the
+	// cache. The cache owns it from here on, and deletes it right away if
+	// it can't be kept.
+	void Put(const wchar_t* pPath, const FileStamp& stamp, T* pFile)
+	{
+		if (nullptr == pFile)
+			return;
+
+		std::wstring key;
+		size_t bytes = pFile->GetMemoryUsage();
+
+		if (!stamp.IsValid() || (bytes > m_maxBytes) || !FileStamp::MakeKey(pPath, key))
+		{
+			delete pFile;
+			return;
+		}
+
+		RemoveKey( key );
+
+		Entry entry;
+		entry.key = key;
+		entry.stamp = stamp;
+		entry.pFile = pFile;
+		entry.bytes = bytes;
+
+		m_entries.push_front( entry );
+		m_index[ key ] = m_entries.begin();
+		m_bytes += bytes;
+
+		// Least recently used go first
+		while (m_bytes > m_maxBytes)
+		{
+			RemoveKey( m_entries.back().key );
+		}
+	}
+
+	// Drop pPath, e.g. because it's about to be overwritten
+	void Remove(const wchar_t* pPath)
+	{
+		std::wstring key;
+		if (FileStamp::MakeKey(pPath, key))
+			RemoveKey( key );
+	}
+
+	void Clear()
+	{
+		for (typename EntryList::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+		{
+			delete it->pFile;
+		}
+
+		m_entries.clear();
+		m_index.clear();
+		m_bytes = 0;
+	}
+
+	size_t GetBytes() const { return m_bytes; }
+	int    GetCount() const { return (int)m_entries.size(); }
+
+private:
+	struct Entry
+	{
+		std::wstring key;
+		FileStamp stamp;
+		T* pFile;
+		size_t bytes;
+	};
+
+	typedef std::list<Entry> EntryList;
+	typedef std::unordered_map<std::wstring, typename EntryList::iterator> IndexMap;
+
+	void RemoveKey(const std::wstring& key)
+	{
+		typename IndexMap::iterator it = m_index.find( key );
+		if (it == m_index.end())
+			return;
+
+		m_bytes -= it->second->bytes;
+		delete it->second->pFile;
+		m_entries.erase( it->second );
+		m_index.erase( it );
+	}
+
+	DecodedFileCache(const DecodedFileCache&);
+	DecodedFileCache& operator=(const DecodedFileCache&);
+
+	EntryList m_entries;	// most recently used first
+	IndexMap  m_index;
+	size_t m_bytes;
+	size_t m_maxBytes;
+};
+
+#endif // DECODED_FILE_CACHE_H
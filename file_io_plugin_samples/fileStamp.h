@@ -0,0 +1,70 @@
+//
+// FileStamp: a file's size and last write time, which together tell whether
+// it changed since something about it was remembered; and the normalized path
+// such memories are keyed by.
+//
+// Shared by MetaIndex and DecodedFileCache.
+//
+#ifndef FILE_STAMP_H
+#define FILE_STAMP_H
+
+#include <windows.h>
+#include <wctype.h>
+
+#include <string>
+
+struct FileStamp
+{
+	unsigned long long fileSize;
+	unsigned long long writeTime;
+
+	FileStamp() : fileSize( 0 ), writeTime( 0 ) {}
+
+	// Stamp pPath as it is now; false, and a zero stamp, if there's no such
+	// file
+	bool Read(const wchar_t* pPath)
+	{
+		fileSize = 0;
+		writeTime = 0;
+
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExW(pPath, GetFileExInfoStandard, &data))
+			return false;
+
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			return false;
+
+		fileSize = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		writeTime = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32) |
+					data.ftLastWriteTime.dwLowDateTime;
+		return true;
+	}
+
+	bool IsValid() const { return (0 != fileSize) || (0 != writeTime); }
+
+	bool operator==(const FileStamp& other) const
+	{
+		return (fileSize == other.fileSize) && (writeTime == other.writeTime);
+	}
+
+	bool operator!=(const FileStamp& other) const { return !(*this == other); }
+
+	// Full, lower case path, so the same file always gives the same key
+	static bool MakeKey(const wchar_t* pPath, std::wstring& key)
+	{
+		wchar_t fullPath[ 2048 ];
+		DWORD length = GetFullPathNameW(pPath, 2048, fullPath, NULL);
+		if ((0 == length) || (length >= 2048))
+			return false;
+
+		key.assign( fullPath, length );
+		for (size_t idx = 0; idx < key.size(); ++idx)
+		{
+			key[ idx ] = (wchar_t)towlower( key[ idx ] );
+		}
+
+		return true;
+	}
+};
+
+#endif // FILE_STAMP_H
@@ -7,6 +7,7 @@
 // https://docs.google.com/document/d/10ovgMClDAJVgbW0sOhUsBkVABKWhOPM5Au7vbHJymoA/edit?usp=sharing
 //
 #include "16_file.h"
+#include "..\blobCache.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -26,6 +27,20 @@
 #define LZSA_FLAG_RAW_BLOCK      (1<<1)
 #endif
 
+// Vector nibble kernels, picked at run time (see GetNibbleKernels)
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define C16_NIBBLE_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define C16_TARGET(isa)
+#else
+#define C16_TARGET(isa) __attribute__((target(isa)))
+#endif
+#else
+#define C16_NIBBLE_SIMD 0
+#endif
+
 // If these structs are the wrong size, there's an issue with type sizes, and
 // your compiler
 static_assert(sizeof(C16_Color)==2,       "C16_Color is supposed to be 2 bytes");
@@ -38,10 +53,13 @@ static_assert(sizeof(C16File_CHUNK)==8,   "C16File_CHUNK is supposed to be 8 byt
 //------------------------------------------------------------------------------
 // Load in a C16File constructor
 //
-C16File::C16File(const wchar_t *pFilePath)
+C16File::C16File(const wchar_t *pFilePath, bool bHeaderOnly)
 	: m_widthBytes(0)
 	, m_heightPixels(0)
 	, m_numColors( 0 )
+	, m_sourceWidthPixels( 0 )
+	, m_pBlobCache( nullptr )
+	, m_bLoaded( false )
 {
 
 	m_pal.iNumColors = 0;
@@ -50,7 +68,10 @@ C16File::C16File(const wchar_t *pFilePath)
 	m_scb.iNumScanLines = 0;
 	m_scb.pSCB = nullptr;
 
-	LoadFromFile(pFilePath);
+	if (bHeaderOnly)
+		LoadHeader(pFilePath);
+	else
+		LoadFromFile(pFilePath);
 }
 //------------------------------------------------------------------------------
 // Create a blank C16File constructor
@@ -59,6 +80,9 @@ C16File::C16File(int iWidthBytes, int iHeightPixels, int iNumColors)
 	: m_widthBytes( iWidthBytes )
 	, m_heightPixels( iHeightPixels )
 	, m_numColors( iNumColors )
+	, m_sourceWidthPixels( 0 )
+	, m_pBlobCache( nullptr )
+	, m_bLoaded( false )
 {
 
 	m_pal.iNumColors = iNumColors;
@@ -137,26 +161,262 @@ void C16File::AddImages( const std::vector<unsigned char*>& pPixelMaps )
 	}
 }
 
+//------------------------------------------------------------------------------
+// Nibble row kernels
+//
+// Each kernel handles numPairs whole pixel pairs (numPairs packed bytes); the
+// odd trailing pixel of an odd width row is left to the caller.  The vector
+// kernels run 32 (SSE) or 64 (AVX2) pixels per iteration and finish the row
+// with the scalar loop.
+//
+namespace
+{
+	typedef void (*NibbleRowFn)(const unsigned char* pSrc, unsigned char* pDst,
+								int numPairs);
+
+	void PackPairs_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+						  int numPairs)
+	{
+		for (int idx = 0; idx < numPairs; ++idx)
+		{
+			pDst[ idx ] = (unsigned char)(((pSrc[ idx * 2 ] & 0x0F) << 4) |
+										   (pSrc[ idx * 2 + 1 ] & 0x0F));
+		}
+	}
+
+	void UnpackPairs_Scalar(const unsigned char* pSrc, unsigned char* pDst,
+							int numPairs)
+	{
+		for (int idx = 0; idx < numPairs; ++idx)
+		{
+			unsigned char b = pSrc[ idx ];
+			pDst[ idx * 2 ]     = (b >> 4) & 0x0F;
+			pDst[ idx * 2 + 1 ] = b & 0x0F;
+		}
+	}
+
+#if C16_NIBBLE_SIMD
+
+	// Each 16 bit lane holds an (even, odd) pixel pair; fold it down to
+	// (even << 4) | odd, then saturate-pack the lanes back down to bytes
+	C16_TARGET("sse2")
+	void PackPairs_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+						int numPairs)
+	{
+		const __m128i nibbles = _mm_set1_epi16(0x0F0F);
+		const __m128i lowByte = _mm_set1_epi16(0x00FF);
+		int idx = 0;
+
+		for (; idx + 16 <= numPairs; idx += 16)
+		{
+			__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + idx * 2)), nibbles);
+			__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + idx * 2 + 16)), nibbles);
+
+			a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, lowByte), 4), _mm_srli_epi16(a, 8));
+			b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, lowByte), 4), _mm_srli_epi16(b, 8));
+
+			_mm_storeu_si128((__m128i*)(pDst + idx), _mm_packus_epi16(a, b));
+		}
+
+		PackPairs_Scalar(pSrc + idx * 2, pDst + idx, numPairs - idx);
+	}
+
+	// pmaddubsw does the even * 16 + odd in one go
+	C16_TARGET("ssse3")
+	void PackPairs_SSSE3(const unsigned char* pSrc, unsigned char* pDst,
+						 int numPairs)
+	{
+		const __m128i nibbles = _mm_set1_epi8(0x0F);
+		const __m128i weights = _mm_set1_epi16(0x0110);
+		int idx = 0;
+
+		for (; idx + 16 <= numPairs; idx += 16)
+		{
+			__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + idx * 2)), nibbles);
+			__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + idx * 2 + 16)), nibbles);
+
+			a = _mm_maddubs_epi16(a, weights);
+			b = _mm_maddubs_epi16(b, weights);
+
+			_mm_storeu_si128((__m128i*)(pDst + idx), _mm_packus_epi16(a, b));
+		}
+
+		PackPairs_Scalar(pSrc + idx * 2, pDst + idx, numPairs - idx);
+	}
+
+	// packus works per 128 bit lane, so the qwords need putting back in order
+	C16_TARGET("avx2")
+	void PackPairs_AVX2(const unsigned char* pSrc, unsigned char* pDst,
+						int numPairs)
+	{
+		const __m256i nibbles = _mm256_set1_epi8(0x0F);
+		const __m256i weights = _mm256_set1_epi16(0x0110);
+		int idx = 0;
+
+		for (; idx + 32 <= numPairs; idx += 32)
+		{
+			__m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(pSrc + idx * 2)), nibbles);
+			__m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(pSrc + idx * 2 + 32)), nibbles);
+
+			a = _mm256_maddubs_epi16(a, weights);
+			b = _mm256_maddubs_epi16(b, weights);
+
+			__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+			_mm256_storeu_si256((__m256i*)(pDst + idx), packed);
+		}
+
+		PackPairs_SSSE3(pSrc + idx * 2, pDst + idx, numPairs - idx);
+	}
+
+	// Split the high and low nibbles, then interleave them back out
+	C16_TARGET("sse2")
+	void UnpackPairs_SSE2(const unsigned char* pSrc, unsigned char* pDst,
+						  int numPairs)
+	{
+		const __m128i nibbles = _mm_set1_epi8(0x0F);
+		int idx = 0;
+
+		for (; idx + 16 <= numPairs; idx += 16)
+		{
+			__m128i v  = _mm_loadu_si128((const __m128i*)(pSrc + idx));
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibbles);
+			__m128i lo = _mm_and_si128(v, nibbles);
+
+			_mm_storeu_si128((__m128i*)(pDst + idx * 2),      _mm_unpacklo_epi8(hi, lo));
+			_mm_storeu_si128((__m128i*)(pDst + idx * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+		}
+
+		UnpackPairs_Scalar(pSrc + idx, pDst + idx * 2, numPairs - idx);
+	}
+
+	// unpacklo/hi interleave within each 128 bit lane, so swap the middle
+	// halves back into place on the way out
+	C16_TARGET("avx2")
+	void UnpackPairs_AVX2(const unsigned char* pSrc, unsigned char* pDst,
+						  int numPairs)
+	{
+		const __m256i nibbles = _mm256_set1_epi8(0x0F);
+		int idx = 0;
+
+		for (; idx + 32 <= numPairs; idx += 32)
+		{
+			__m256i v  = _mm256_loadu_si256((const __m256i*)(pSrc + idx));
+			__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibbles);
+			__m256i lo = _mm256_and_si256(v, nibbles);
+
+			__m256i first  = _mm256_unpacklo_epi8(hi, lo);
+			__m256i second = _mm256_unpackhi_epi8(hi, lo);
+
+			_mm256_storeu_si256((__m256i*)(pDst + idx * 2),
+								_mm256_permute2x128_si256(first, second, 0x20));
+			_mm256_storeu_si256((__m256i*)(pDst + idx * 2 + 32),
+								_mm256_permute2x128_si256(first, second, 0x31));
+		}
+
+		UnpackPairs_SSE2(pSrc + idx, pDst + idx * 2, numPairs - idx);
+	}
+
+	//--------------------------------------------------------------------------
+
+	enum CpuLevel
+	{
+		kCpuScalar,
+		kCpuSSE2,
+		kCpuSSSE3,
+		kCpuAVX2
+	};
+
+	CpuLevel DetectCpuLevel()
+	{
+	#if defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 0);
+		int maxLeaf = regs[0];
+
+		__cpuid(regs, 1);
+		bool sse2  = (regs[3] & (1 << 26)) != 0;
+		bool ssse3 = (regs[2] & (1 << 9)) != 0;
+		bool osAvx = ((regs[2] & (1 << 27)) != 0) && ((regs[2] & (1 << 28)) != 0) &&
+					 ((_xgetbv(0) & 6) == 6);
+		bool avx2 = false;
+		if (osAvx && maxLeaf >= 7)
+		{
+			__cpuidex(regs, 7, 0);
+			avx2 = (regs[1] & (1 << 5)) != 0;
+		}
+	#else
+		__builtin_cpu_init();
+		bool sse2  = __builtin_cpu_supports("sse2") != 0;
+		bool ssse3 = __builtin_cpu_supports("ssse3") != 0;
+		bool avx2  = __builtin_cpu_supports("avx2") != 0;
+	#endif
+
+		if (avx2 && ssse3) return kCpuAVX2;
+		if (ssse3) return kCpuSSSE3;
+		if (sse2)  return kCpuSSE2;
+		return kCpuScalar;
+	}
+
+#endif // C16_NIBBLE_SIMD
+
+	struct NibbleKernels
+	{
+		NibbleRowFn pack;
+		NibbleRowFn unpack;
+	};
+
+	// Picked once, on first use
+	const NibbleKernels& GetNibbleKernels()
+	{
+		static const NibbleKernels kernels = []()
+		{
+			NibbleKernels k = { PackPairs_Scalar, UnpackPairs_Scalar };
+		#if C16_NIBBLE_SIMD
+			switch (DetectCpuLevel())
+			{
+			case kCpuAVX2:
+				k.pack   = PackPairs_AVX2;
+				k.unpack = UnpackPairs_AVX2;
+				break;
+			case kCpuSSSE3:
+				k.pack   = PackPairs_SSSE3;
+				k.unpack = UnpackPairs_SSE2;
+				break;
+			case kCpuSSE2:
+				k.pack   = PackPairs_SSE2;
+				k.unpack = UnpackPairs_SSE2;
+				break;
+			default:
+				break;
+			}
+		#endif
+			return k;
+		}();
+
+		return kernels;
+	}
+}
+
 //------------------------------------------------------------------------------
 // Nibble pack: two pixels per byte; even x -> high nibble, odd x -> low nibble.
 //
 void C16File::NibblePack(const unsigned char* pSrc, unsigned char* pDst,
 						 int widthPixels, int heightPixels)
 {
+	const NibbleRowFn packPairs = GetNibbleKernels().pack;
+
 	int packedRowBytes = (widthPixels + 1) / 2;
+	int numPairs = widthPixels / 2;
 
 	for (int y = 0; y < heightPixels; ++y)
 	{
 		const unsigned char* pSrcRow = pSrc + (y * widthPixels);
 		unsigned char* pDstRow = pDst + (y * packedRowBytes);
 
-		for (int x = 0; x < widthPixels; x += 2)
-		{
-			unsigned char hi = pSrcRow[ x ] & 0x0F;
-			unsigned char lo = ((x + 1) < widthPixels) ? (pSrcRow[ x + 1 ] & 0x0F)
-													   : 0;
-			pDstRow[ x >> 1 ] = (unsigned char)((hi << 4) | lo);
-		}
+		packPairs(pSrcRow, pDstRow, numPairs);
+
+		if (widthPixels & 1)
+			pDstRow[ numPairs ] = (unsigned char)((pSrcRow[ widthPixels - 1 ] & 0x0F) << 4);
 	}
 }
 
@@ -166,76 +426,181 @@ void C16File::NibblePack(const unsigned char* pSrc, unsigned char* pDst,
 void C16File::NibbleUnpack(const unsigned char* pSrc, unsigned char* pDst,
 						   int widthPixels, int heightPixels)
 {
+	const NibbleRowFn unpackPairs = GetNibbleKernels().unpack;
+
 	int packedRowBytes = (widthPixels + 1) / 2;
+	int numPairs = widthPixels / 2;
 
 	for (int y = 0; y < heightPixels; ++y)
 	{
 		const unsigned char* pSrcRow = pSrc + (y * packedRowBytes);
 		unsigned char* pDstRow = pDst + (y * widthPixels);
 
-		for (int x = 0; x < widthPixels; x += 2)
-		{
-			unsigned char b = pSrcRow[ x >> 1 ];
-			pDstRow[ x ] = (b >> 4) & 0x0F;
-			if ((x + 1) < widthPixels)
-				pDstRow[ x + 1 ] = b & 0x0F;
-		}
+		unpackPairs(pSrcRow, pDstRow, numPairs);
+
+		if (widthPixels & 1)
+			pDstRow[ widthPixels - 1 ] = (pSrcRow[ numPairs ] >> 4) & 0x0F;
 	}
 }
 
 //------------------------------------------------------------------------------
 //
-// If we're trying to save out a series of images, instead make a giant
-// vertical film-strip
+// Reference the image data, no copy. SaveToFile pulls rows straight out of
+// these buffers.
 //
-void C16File::CombinePixelMaps()
+void C16File::AttachImages( const std::vector<unsigned char*>& pPixelMaps, int srcWidthPixels )
 {
-	int numFrames = (int)m_pPixelMaps.size();
+	for (int idx = 0; idx < pPixelMaps.size(); ++idx)
+	{
+		m_pSourceMaps.push_back( pPixelMaps[ idx ] );
+	}
+	m_sourceWidthPixels = srcWidthPixels;
+}
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+//
+// Fills a 64KB window with nibble-packed bytes, and compresses the window
+// into the next PIXL blob as soon as it's full. Lets SaveToFile encode an
+// animation as one tall film-strip without ever building the film-strip.
+//
+class C16BlobWriter
+{
+public:
+	C16BlobWriter(std::vector<unsigned char>& bytes, BlobCache* pCache)
+		: m_bytes( bytes )
+		, m_pCache( pCache )
+		, m_windowUsed( 0 )
+		, m_numBlobs( 0 )
+		, m_failed( false )
+	{
+		m_pWindow = new unsigned char[ 0x10000 ];
+		m_pWorkBuffer = new unsigned char[ lzsa_get_max_compressed_size_inmem( 0x10000 ) ];
+	}
 
-	if (numFrames > 1)
+	~C16BlobWriter()
 	{
-		int widthPixels = m_widthBytes * 2;
-		int numPixelsPerFrame = widthPixels * m_heightPixels;
-		int numPixelsCombined = numPixelsPerFrame * numFrames;
+		delete[] m_pWindow;
+		delete[] m_pWorkBuffer;
+	}
 
-		unsigned char* pPixels = new unsigned char[ numPixelsCombined ];
+	// Space left in the current window, so callers can pack straight into it
+	size_t Room() const { return 0x10000 - m_windowUsed; }
+	unsigned char* Cursor() { return m_pWindow + m_windowUsed; }
 
-		// Concatenate the frames
+	// The caller wrote numBytes at Cursor()
+	void Commit(size_t numBytes)
+	{
+		m_windowUsed += numBytes;
+		if (0x10000 == m_windowUsed)
+			Flush();
+	}
 
-		for (int frameIndex = 0; frameIndex < numFrames; ++frameIndex)
+	void Write(const unsigned char* pData, size_t numBytes)
+	{
+		while (numBytes)
 		{
-			unsigned char *pDest = pPixels + (numPixelsPerFrame * frameIndex);
-			memcpy(pDest, m_pPixelMaps[ frameIndex ], numPixelsPerFrame);
+			size_t chunk = (numBytes < Room()) ? numBytes : Room();
+			memcpy(Cursor(), pData, chunk);
+			pData += chunk;
+			numBytes -= chunk;
+			Commit(chunk);
 		}
+	}
 
-		// Free Up the original memory
+	// Compress whatever is in the window into a blob
+	void Flush()
+	{
+		if (0 == m_windowUsed)
+			return;
 
-		for (int idx = 0; idx < m_pPixelMaps.size(); ++idx)
+		size_t compSize;
+		if (m_pCache)
+		{
+			compSize = m_pCache->Compress(m_pWindow,		// input
+								 m_pWorkBuffer,  	 			// output
+								 m_windowUsed,  				// input size
+								 lzsa_get_max_compressed_size_inmem( 0x10000 ),  // max output buffer size
+								 LZSA_FLAG_FAVOR_RATIO | LZSA_FLAG_RAW_BLOCK,
+								 0,						// minmatchsize (0 better for ratio)
+								 2, // Format Version
+								 m_numBlobs				// slot, for incremental recompression
+								 );
+		}
+		else
 		{
-			delete[] m_pPixelMaps[idx];
-			m_pPixelMaps[ idx ] = nullptr;
+			compSize = lzsa_compress_inmem(m_pWindow,		// input
+								 m_pWorkBuffer,  	 			// output
+								 m_windowUsed,  				// input size
+								 lzsa_get_max_compressed_size_inmem( 0x10000 ),  // max output buffer size
+								 LZSA_FLAG_FAVOR_RATIO | LZSA_FLAG_RAW_BLOCK,
+								 0,						// minmatchsize (0 better for ratio)
+								 2 // Format Version
+								 );
 		}
 
-		// empty the vector
-		m_pPixelMaps.clear();
+		if ((compSize > 0) && (compSize != (size_t)-1))
+		{
+			if (compSize >= 0x10000)
+			{
+				// Signal 64K uncompressed
+				m_bytes.push_back( 0 );
+				m_bytes.push_back( 0 );
+				m_bytes.insert(m_bytes.end(), m_pWindow, m_pWindow + 0x10000);
+			}
+			else
+			{
+				// Add the blob
+				m_bytes.push_back( (compSize>>0) & 0xFF );
+				m_bytes.push_back( (compSize>>8) & 0xFF );
+				m_bytes.insert(m_bytes.end(), m_pWorkBuffer, m_pWorkBuffer + compSize);
+			}
+		}
+		else
+		{
+			m_failed = true;
+		}
 
-		// insert the new frame
-		m_pPixelMaps.push_back( pPixels );
+		m_windowUsed = 0;
+		++m_numBlobs;
+	}
 
-		// adjust the size of the image
-		m_heightPixels *= numFrames;
+	bool Failed() const { return m_failed; }
 
-	}
-}
+private:
+	std::vector<unsigned char>& m_bytes;
+	BlobCache* m_pCache;			// may be null
+
+	unsigned char* m_pWindow;		// 64KB of packed pixels waiting to compress
+	unsigned char* m_pWorkBuffer;	// compressor output
+	size_t m_windowUsed;
+	int    m_numBlobs;			// blobs flushed so far
+	bool   m_failed;
+};
+
+} // anonymous namespace
 
 //------------------------------------------------------------------------------
 //
 // Save to File
 //
-void C16File::SaveToFile(const wchar_t* pFilenamePath)
+bool C16File::SaveToFile(const wchar_t* pFilenamePath)
 {
+	// Frames to encode, attached frames win over copies
+	std::vector<const unsigned char*> frames( m_pSourceMaps );
+	int srcWidthPixels = m_sourceWidthPixels;
+
+	if (frames.empty())
+	{
+		frames.assign( m_pPixelMaps.begin(), m_pPixelMaps.end() );
+		srcWidthPixels = m_widthBytes * 2;
+	}
+
 	// Handle Animation, by saving out a vertical film-strip
-	CombinePixelMaps();
+	int numFrames = (int)frames.size();
+	int stripHeight = m_heightPixels * numFrames;
 
 	// Actually, going to serialize to memory, then will save that to file
 	std::vector<unsigned char> bytes;
@@ -255,7 +620,7 @@ void C16File::SaveToFile(const wchar_t* pFilenamePath)
 
 	pHeader->version = 0x0000;
 	pHeader->width  = m_widthBytes   & 0xFFFF;
-	pHeader->height = m_heightPixels & 0xFFFF;
+	pHeader->height = stripHeight & 0xFFFF;
 	pHeader->reserved = 0x0000;
 
 	//--------------------------------------------------------------------------
@@ -322,13 +687,10 @@ void C16File::SaveToFile(const wchar_t* pFilenamePath)
 	pPIXL->p = 'P'; pPIXL->i = 'I'; pPIXL->x = 'X'; pPIXL->l = 'L';
 	pPIXL->chunk_length = 0; // Temporary Chunk Size
 
-	// Nibble-pack the pixel data first. Disk byte width per row = m_widthBytes.
+	// Disk byte width per row = m_widthBytes. Odd source widths pack their
+	// last pixel against a zero low nibble, which is the padding.
 	int packedRowBytes = m_widthBytes;
-	int widthPixels    = m_widthBytes * 2;
-	size_t decompressed_size = (size_t)packedRowBytes * (size_t)m_heightPixels;
-
-	unsigned char* pPackedPixels = new unsigned char[ decompressed_size ];
-	NibblePack(m_pPixelMaps[ 0 ], pPackedPixels, widthPixels, m_heightPixels);
+	size_t decompressed_size = (size_t)packedRowBytes * (size_t)stripHeight;
 
 	pPIXL->num_blobs = (short) (decompressed_size / 0x10000);
 
@@ -338,75 +700,43 @@ void C16File::SaveToFile(const wchar_t* pFilenamePath)
 		pPIXL->num_blobs+=1;
 	}
 
-	int num_blobs = pPIXL->num_blobs;
-
-	// Work Buffer Guaranteed to be large enough
-	unsigned char* pWorkBuffer = new unsigned char[ lzsa_get_max_compressed_size_inmem( 65536 ) ];
-	// Compress the packed (nibble) data
-	unsigned char *pSourceData = pPackedPixels;
-
-	// Compressed Blobs to Follow
-	for (int idx = 0; idx < num_blobs; ++idx)
+	// Pack rows straight from the frames into the blob window; each full
+	// window gets compressed immediately
 	{
-		size_t sourceOffset = 0x10000 * idx;
-		int decompressedChunkSize = (int)(decompressed_size - sourceOffset);
-
-		if (decompressedChunkSize > 0x10000)
-		{
-			decompressedChunkSize = 0x10000;
-		}
-
-		compSize = lzsa_compress_inmem(&pSourceData[ sourceOffset ],  // input
-								 pWorkBuffer,  	 					  // output
-								 decompressedChunkSize,  			  // input size
-								 lzsa_get_max_compressed_size_inmem( 65536 ),  // max output buffer size
-								 LZSA_FLAG_FAVOR_RATIO | LZSA_FLAG_RAW_BLOCK,
-								 0,						// minmatchsize (0 better for ratio)
-								 2 // Format Version
-								 );
-
+		C16BlobWriter writer( bytes, m_pBlobCache );
+		unsigned char* pRowBuffer = new unsigned char[ packedRowBytes ];
 
-		if (compSize > 0)
+		for (int frameIndex = 0; frameIndex < numFrames; ++frameIndex)
 		{
-			if (compSize >= 0x10000)
+			for (int y = 0; y < m_heightPixels; ++y)
 			{
-				// Signal 64K uncompressed
-				bytes.push_back( 0 );
-				bytes.push_back( 0 );
+				const unsigned char* pSrcRow = frames[ frameIndex ] + ((size_t)y * srcWidthPixels);
 
-				for (int uncompressedIdx = 0; uncompressedIdx < 0x10000; ++uncompressedIdx)
+				if (writer.Room() >= (size_t)packedRowBytes)
 				{
-					bytes.push_back((unsigned char) pSourceData[ sourceOffset + uncompressedIdx ]);
+					NibblePack(pSrcRow, writer.Cursor(), srcWidthPixels, 1);
+					writer.Commit(packedRowBytes);
 				}
-
-			}
-			else
-			{
-				// Add the blob
-				bytes.push_back( (compSize>>0) & 0xFF );
-				bytes.push_back( (compSize>>8) & 0xFF );
-
-				// is this fast?  Probably not
-				for (int compressedIndex = 0; compressedIndex < compSize; ++compressedIndex)
+				else
 				{
-					bytes.push_back((unsigned char)pWorkBuffer[ compressedIndex ]);
+					// Row straddles two blobs
+					NibblePack(pSrcRow, pRowBuffer, srcWidthPixels, 1);
+					writer.Write(pRowBuffer, packedRowBytes);
 				}
 			}
-
 		}
-		else
+		writer.Flush();
+
+		delete[] pRowBuffer;
+
+		if (writer.Failed())
 		{
 			// FAILED TO COMPRESS — bail out without taking down the host process.
 			// The plugin shim reports SaveToFile failures via its own error path.
-			delete[] pPackedPixels;
-			delete[] pWorkBuffer;
-			return;
+			return false;
 		}
 	}
 
-	delete[] pPackedPixels;
-	delete[] pWorkBuffer;
-
 	// Update the chunk length
 	pPIXL = (C16File_PIXL*)&bytes[ pixl_offset ];
 	pPIXL->chunk_length = (unsigned int) (bytes.size() - pixl_offset);
@@ -474,16 +804,81 @@ void C16File::SaveToFile(const wchar_t* pFilenamePath)
 	FILE* pFile = nullptr;
 	errno_t err = _wfopen_s(&pFile, pFilenamePath, L"wb");
 
-	if (0==err)
+	if ((0!=err) || (nullptr==pFile))
 	{
-		fwrite(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
-		fclose(pFile);
+		return false;
 	}
+
+	size_t written = fwrite(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
+	fclose(pFile);
+
+	return written == bytes.size();
 }
 
 //------------------------------------------------------------------------------
 
 void C16File::LoadFromFile(const wchar_t* pFilePath)
+{
+	if (!LoadHeader(pFilePath))
+		return;
+
+	if (!UnpackPixels())
+	{
+		// Corrupt pixel data, keep a blank frame
+		size_t frameSize = (size_t)GetWidthPixels() * (size_t)m_heightPixels;
+		unsigned char* pFrame = new unsigned char[ frameSize ];
+		memset(pFrame, 0, frameSize);
+		m_pPixelMaps.push_back(pFrame);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+bool C16File::UnpackPixels()
+{
+	if (!m_bLoaded)
+		return false;
+
+	if (!m_pPixelMaps.empty())
+		return true;
+
+	// Go ahead and allocate the bitmap (1 byte per pixel after unpack)
+	size_t frameSize = (size_t)GetWidthPixels() * (size_t)m_heightPixels;
+
+	// Allocate a Frame
+	unsigned char* pFrame = new unsigned char[ frameSize ];
+
+	if (!DecodeRows(0, m_heightPixels, pFrame))
+	{
+		delete[] pFrame;
+		return false;
+	}
+
+	// Save it in the list
+	m_pPixelMaps.push_back(pFrame);
+
+	// Everything is unpacked, the file bytes aren't needed anymore
+	m_blobReader.Clear();
+	std::vector<unsigned char>().swap(m_fileBytes);
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+
+size_t C16File::GetMemoryUsage()
+{
+	size_t bytes = sizeof(*this) + m_fileBytes.capacity();
+
+	if (!m_pPixelMaps.empty())
+		bytes += m_pPixelMaps.size() * (size_t)GetWidthPixels() * (size_t)m_heightPixels;
+
+	return bytes;
+}
+
+//------------------------------------------------------------------------------
+
+bool C16File::LoadHeader(const wchar_t* pFilePath)
 {
 	// Free any existing memory
 	if (m_pal.pColors)
@@ -491,6 +886,7 @@ void C16File::LoadFromFile(const wchar_t* pFilePath)
 		delete[] m_pal.pColors;
 		m_pal.pColors = nullptr;
 	}
+	m_pal.iNumColors = 0;
 	if (m_scb.pSCB)
 	{
 		delete[] m_scb.pSCB;
@@ -504,11 +900,14 @@ void C16File::LoadFromFile(const wchar_t* pFilePath)
 		m_pPixelMaps[ idx ] = nullptr;
 	}
 	m_pPixelMaps.clear();
+	m_blobReader.Clear();
+	m_fileBytes.clear();
+	m_bLoaded = false;
 
 	//--------------------------------------------------------------------------
 
 
-	std::vector<unsigned char> bytes;
+	std::vector<unsigned char>& bytes = m_fileBytes;
 
 	//--------------------------------------------------------------------------
 	// Read the file into memory
@@ -524,68 +923,132 @@ void C16File::LoadFromFile(const wchar_t* pFilePath)
 		bytes.resize( length );			// make sure buffer is large enough
 
 		// Read in the file
-		fread(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
+		if (length)
+			fread(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
 		fclose(pFile);
 	}
 
-	if (bytes.size())
+	if (bytes.size() < sizeof(C16File_Header))
+		return false;
+
+	size_t file_offset = 0;	// File Cursor
+
+	// Bytes are in the buffer, so let's start looking at what we have
+	C16File_Header* pHeader = (C16File_Header*) &bytes[0];
+
+	// Early out if things don't look right
+	if (!pHeader->IsValid((unsigned int)bytes.size()))
+		return false;
+
+	m_widthBytes   = pHeader->width;
+	m_heightPixels = pHeader->height;
+
+	//----------------------------------------------------------------------
+	// Process Chunks as we encounter them
+	file_offset += sizeof(C16File_Header);
+
+	// While we're not at the end of the file
+	while ((file_offset + sizeof(C16File_CHUNK)) <= bytes.size())
 	{
-		size_t file_offset = 0;	// File Cursor
+		// This is pretty dumb, just get it done
+		// These are the types I understand
+		// every chunk is supposed to contain a value chunk_length
+		// at offset +4, so that we can ignore ones we don't understand
+		C16File_CLUT* pCLUT = (C16File_CLUT*)&bytes[ file_offset ];
+		C16File_PIXL* pPIXL = (C16File_PIXL*)&bytes[ file_offset ];
+		C16File_SCBs* pSCBs = (C16File_SCBs*)&bytes[ file_offset ];
+		C16File_CHUNK* pCHUNK = (C16File_CHUNK*)&bytes[ file_offset ];
+
+		// A chunk that doesn't fit means a truncated or corrupt file
+		size_t chunkBytes = pCHUNK->chunk_length;
+		if ((chunkBytes < sizeof(C16File_CHUNK)) || (chunkBytes > (bytes.size() - file_offset)))
+			break;
+
+		if (pCLUT->IsValid())
+		{
+			// We have a CLUT Chunk
+			UnpackClut(pCLUT);
+		}
+		else if (pPIXL->IsValid())
+		{
+			// We have a PIXeL chunk
+			IndexPixel(pPIXL, chunkBytes);
+		}
+		else if (pSCBs->IsValid())
+		{
+			// We have an SCBs chunk
+			UnpackSCBs(pSCBs);
+		}
 
-		// Bytes are in the buffer, so let's start looking at what we have
-		C16File_Header* pHeader = (C16File_Header*) &bytes[0];
+		file_offset += chunkBytes;
+	}
 
-		// Early out if things don't look right
-		if (!pHeader->IsValid((unsigned int)bytes.size()))
-			return;
+	m_bLoaded = true;
+	return true;
+}
 
-		m_widthBytes   = pHeader->width;
-		m_heightPixels = pHeader->height;
+//------------------------------------------------------------------------------
 
-		// Go ahead and allocate the bitmap (1 byte per pixel after unpack)
-		int widthPixels = m_widthBytes * 2;
-		size_t frameSize = (size_t)widthPixels * (size_t)m_heightPixels;
+bool C16File::DecodeRows(int firstRow, int numRows, unsigned char* pDest)
+{
+	if ((firstRow < 0) || (numRows < 0) || ((firstRow + numRows) > m_heightPixels))
+		return false;
 
-		// Allocate a Frame
-		unsigned char* pFrame = new unsigned char[ frameSize ];
-		// Save it in the list
-		m_pPixelMaps.push_back(pFrame);
+	int widthPixels = GetWidthPixels();
 
-		//----------------------------------------------------------------------
-		// Process Chunks as we encounter them
-		file_offset += sizeof(C16File_Header);
+	if (!m_pPixelMaps.empty())
+	{
+		// Already unpacked
+		memcpy(pDest, m_pPixelMaps[ 0 ] + ((size_t)firstRow * widthPixels),
+			   (size_t)numRows * widthPixels);
+		return true;
+	}
 
-		// While we're not at the end of the file
-		while (file_offset < bytes.size())
-		{
-			// This is pretty dumb, just get it done
-			// These are the types I understand
-			// every chunk is supposed to contain a value chunk_length
-			// at offset +4, so that we can ignore ones we don't understand
-			C16File_CLUT* pCLUT = (C16File_CLUT*)&bytes[ file_offset ];
-			C16File_PIXL* pPIXL = (C16File_PIXL*)&bytes[ file_offset ];
-			C16File_SCBs* pSCBs = (C16File_SCBs*)&bytes[ file_offset ];
-			C16File_CHUNK* pCHUNK = (C16File_CHUNK*)&bytes[ file_offset ];
-
-			if (pCLUT->IsValid())
-			{
-				// We have a CLUT Chunk
-				UnpackClut(pCLUT);
-			}
-			else if (pPIXL->IsValid())
-			{
-				// We have a PIXeL chunk
-				UnpackPixel(pPIXL);
-			}
-			else if (pSCBs->IsValid())
-			{
-				// We have an SCBs chunk
-				UnpackSCBs(pSCBs);
-			}
+	size_t begin = (size_t)firstRow * m_widthBytes;
+	size_t end = begin + ((size_t)numRows * m_widthBytes);
+
+	if (m_blobReader.GetDecompressedSize() < end)
+		return false;
+
+	// Decompress the nibble-packed bytes into a temp buffer first.
+	std::vector<unsigned char> packed( end - begin );
+	if (!packed.empty() && !m_blobReader.DecodeRange(begin, end, &packed[0]))
+		return false;
+
+	// Now nibble-unpack into the per-pixel target buffer
+	if (numRows)
+		NibbleUnpack(&packed[0], pDest, widthPixels, numRows);
 
-			file_offset += pCHUNK->chunk_length;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool C16File::DecodeThumbnail(int step, unsigned char* pDest)
+{
+	if (step < 1)
+		return false;
+
+	int widthPixels = GetWidthPixels();
+	int thumbWidth = (widthPixels + step - 1) / step;
+	std::vector<unsigned char> row( widthPixels );
+
+	// Rows come out in order, so each blob is unpacked at most once, and blobs
+	// that hold none of the sampled rows are skipped
+	for (int y = 0; y < m_heightPixels; y += step)
+	{
+		if (!DecodeRows(y, 1, &row[0]))
+			return false;
+
+		for (int x = 0, tx = 0; x < widthPixels; x += step, ++tx)
+		{
+			pDest[ tx ] = row[ x ];
 		}
+
+		pDest += thumbWidth;
 	}
+
+	return true;
 }
 
 //------------------------------------------------------------------------------
@@ -624,66 +1087,21 @@ void C16File::UnpackClut(C16File_CLUT* pCLUT)
 
 //------------------------------------------------------------------------------
 //
-// Unpack the pixel bitmap, that's been weirdly packed into 64KB chunks
-// to make it easier to deal with on 65816, then nibble-unpack to 1 byte/pixel.
+// The nibble-packed pixel bitmap has been weirdly packed into 64KB chunks to
+// make it easier to deal with on 65816. Just find where they are, DecodeRows
+// unpacks them.
 //
-void C16File::UnpackPixel(C16File_PIXL* pPIXL)
+void C16File::IndexPixel(C16File_PIXL* pPIXL, size_t chunkBytes)
 {
-	int num_blobs = pPIXL->num_blobs;
+	if (chunkBytes < sizeof(C16File_PIXL))
+		return;
 
 	unsigned char *pData = ((unsigned char*)pPIXL) + sizeof(C16File_PIXL);
 
-	int packedRowBytes = m_widthBytes;
-	int widthPixels    = m_widthBytes * 2;
-	size_t packedSize = (size_t)packedRowBytes * (size_t)m_heightPixels;
-
-	// Decompress the nibble-packed bytes into a temp buffer first.
-	unsigned char* pPackedBuffer = new unsigned char[ packedSize ];
-	unsigned char* pPackedCursor = pPackedBuffer;
-	size_t bufferSize = packedSize;
-
-	while (num_blobs-- > 0)
-	{
-		int compressedSize = *pData++;
-		compressedSize |= (*pData++)<<8;
-
-		// Zero Size means 64KB
-		if (0 == compressedSize)
-		{
-			// This means 64KB of uncompressed data
-			compressedSize = 0x10000;
-
-			// Copy the non compressed data
-			for (int idx = 0; idx < compressedSize; ++idx)
-			{
-				pPackedCursor[ idx ] = pData[ idx ];
-			}
-
-			bufferSize -= compressedSize;
-
-		}
-		else
-		{
-			int version = 2; // format version;
-			size_t decompressedSize = lzsa_decompress_inmem(pData, 		   // Compressed Data
-															pPackedCursor, // Target uncompressed data
-															compressedSize, // compressed size in bytes
-															bufferSize,
-															LZSA_FLAG_RAW_BLOCK,
-															&version);
-
-			bufferSize -= decompressedSize;
-
-		}
-
-		pData += compressedSize;
-		pPackedCursor += 0x10000;
-	}
-
-	// Now nibble-unpack into the per-pixel target buffer
-	NibbleUnpack(pPackedBuffer, m_pPixelMaps[ 0 ], widthPixels, m_heightPixels);
+	size_t packedSize = (size_t)m_widthBytes * (size_t)m_heightPixels;
 
-	delete[] pPackedBuffer;
+	m_blobReader.Index(pData, chunkBytes - sizeof(C16File_PIXL),
+					   pPIXL->num_blobs, packedSize);
 }
 
 //------------------------------------------------------------------------------
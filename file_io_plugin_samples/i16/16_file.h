@@ -17,6 +17,10 @@
 #include <stdint.h>
 #include <vector>
 
+#include "..\pixlBlobs.h"
+
+class BlobCache;
+
 #pragma pack(push, 1)
 
 // 4-bits-per-channel packed BGRA color (Apple IIgs / Foenix native palette entry).
@@ -166,8 +170,8 @@ class C16File
 public:
 	// Create a Blank 16 File
 	C16File(int iWidthBytes, int iHeightPixels, int iNumColors);
-	// Load in a C16 Image File
-	C16File(const wchar_t *pFilePath);
+	// Load in a C16 Image File; with bHeaderOnly, see LoadHeader()
+	C16File(const wchar_t *pFilePath, bool bHeaderOnly = false);
 
 	~C16File();
 
@@ -178,10 +182,39 @@ public:
 	// bits 3-0 = palette index 0-15).
 	void SetSCBs( const C16_SCB& scbs );
 	void AddImages( const std::vector<unsigned char*>& pPixelMaps );
-	void SaveToFile(const wchar_t* pFilenamePath);
+	// Reference the caller's frames instead of copying them. Each frame is
+	// srcWidthPixels x height, 1 byte per pixel, where srcWidthPixels is
+	// GetWidthPixels() or one less for odd widths (the last column is padded
+	// with index 0 on the fly). The buffers must stay valid until SaveToFile
+	// returns.
+	void AttachImages( const std::vector<unsigned char*>& pPixelMaps, int srcWidthPixels );
+	// Optional, not owned. Blobs whose input is already in the cache reuse
+	// the stored compressed bytes instead of being compressed again.
+	void SetBlobCache( BlobCache* pCache ) { m_pBlobCache = pCache; }
+	// Returns false if compression or the file write fails.
+	bool SaveToFile(const wchar_t* pFilenamePath);
 
 	// Retrieval
 	void LoadFromFile(const wchar_t* pFilePath);
+	// Preview: read the header, palette and SCBs and find the PIXL blobs,
+	// without unpacking any pixels. GetFrameCount() stays 0; pull pixels out
+	// with DecodeRows() or DecodeThumbnail(). Returns false if it's not an I16.
+	bool LoadHeader(const wchar_t* pFilePath);
+	// Unpack numRows rows from firstRow into pDest, 1 byte per pixel
+	// (GetWidthPixels() bytes a row), only decompressing the blobs that
+	// cover them
+	bool DecodeRows(int firstRow, int numRows, unsigned char* pDest);
+	// Every step-th pixel of every step-th row, for a downscaled preview.
+	// pDest is (GetWidthPixels()+step-1)/step by (GetHeight()+step-1)/step bytes.
+	bool DecodeThumbnail(int step, unsigned char* pDest);
+	// After LoadHeader(), unpack the whole frame into GetPixelMaps() and let
+	// go of the file bytes, so DecodeRows() is a plain copy from then on.
+	// Returns false, and changes nothing, on corrupt pixel data.
+	bool UnpackPixels();
+	// True once a file with a valid header was loaded, pixels or not
+	bool IsLoaded() { return m_bLoaded; }
+	// Heap held by this object: file bytes or unpacked frames
+	size_t GetMemoryUsage();
 	int GetFrameCount() { return (int)m_pPixelMaps.size(); }
 	int GetWidthBytes()  { return m_widthBytes; }
 	// Default 16-color/320-mode assumption: 2 pixels per byte.
@@ -196,11 +229,9 @@ public:
 private:
 
 	void UnpackClut(C16File_CLUT* pCLUT);
-	void UnpackPixel(C16File_PIXL* pPIXL);
+	void IndexPixel(C16File_PIXL* pPIXL, size_t chunkBytes);
 	void UnpackSCBs(C16File_SCBs* pSCBs);
 
-	void CombinePixelMaps();
-
 	// Nibble pack/unpack helpers (high nibble = even x, low nibble = odd x)
 	static void NibblePack(const unsigned char* pSrc, unsigned char* pDst,
 						   int widthPixels, int heightPixels);
@@ -215,6 +246,17 @@ private:
 	C16_SCB     m_scb;   // iNumScanLines == 0 when no SCBs chunk is present
 
 	std::vector<unsigned char*> m_pPixelMaps;
+
+	// Borrowed frames from AttachImages (not owned, not freed)
+	std::vector<const unsigned char*> m_pSourceMaps;
+	int m_sourceWidthPixels;
+
+	BlobCache* m_pBlobCache;	// not owned, may be null
+
+	// File contents and blob index while only the header has been loaded
+	std::vector<unsigned char> m_fileBytes;
+	PixlBlobReader m_blobReader;
+	bool m_bLoaded;
 };
 
 
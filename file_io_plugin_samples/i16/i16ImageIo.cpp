@@ -10,12 +10,37 @@
 
 #include "i16ImageIo.h"
 #include "16_file.h"
+#include "..\blobCache.h"
+#include "..\metaIndex.h"
+#include "..\decodedFileCache.h"
+#include "..\colorQuantizer.h"
+#include "..\pinModule.h"
 
 #include <stdio.h>
 #include <malloc.h>
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #define GDEBUG 0
 
+// 1 to keep each image's compressed blobs in <image>.blobcache, so re-saves
+// stay quick across Promotion sessions
+#define BLOB_CACHE_SIDECAR 0
+
+// 1 to remember each file's size and palette in the shared metadata index, so
+// browsing a folder doesn't open files that were seen before
+#define META_INDEX 1
+
+// memory kept for recently opened files, so going back to one is a copy
+// instead of another read and decompress; 0 turns that off
+#define DECODED_FILE_CACHE_BYTES (64 * 1024 * 1024)
+
+// 1 to ordered dither true color saves down to their 16 colors, 0 to map
+// each pixel to its nearest color
+#define TRUE_COLOR_DITHER 1
+
 // some useful defines
 #define FILE_TYPE_ID "de.cosmigo.fileio.16"
 #define FILE_BOX_DESCRIPTION L"16 - I16 Image"
@@ -45,11 +70,37 @@ wchar_t currentFileName[2048];
 // flag needed for auto loading basic file information data (i.e. file header)
 bool basicDataLoaded = false;
 C16File* CurrentFile = nullptr;
+// CurrentFile's file as it was when loaded
+FileStamp currentStamp;
+
+// files opened earlier, CurrentFile goes back in here when it's done with
+DecodedFileCache<C16File> fileCache(DECODED_FILE_CACHE_BYTES);
 
 // Promotion expects 256 entries of RGB / alpha; only first 16 are meaningful for i16.
 unsigned char rgbTable[ 768 ];
 unsigned char alphaTable[ 256 ];
 
+// Write-behind: writeNextImage hands a snapshot of the frame to saveThread,
+// which does the packing, compression and file write off Promotion's UI
+// thread. finishProcessing waits for it and reports any failure.
+std::thread saveThread;
+std::atomic<int>  saveProgress(0);
+std::atomic<bool> saveRunning(false);
+wchar_t saveFileName[2048];
+wchar_t saveErrorMessage[2048];
+
+// True color saves: the frame as handed over, which the worker reduces to
+// the palette and the snapshot
+std::vector<unsigned char> saveRgba;
+
+// Compressed blobs from earlier saves, only the blobs an edit touched get
+// compressed again
+BlobCache blobCache;
+
+#if META_INDEX
+MetaIndex metaIndex(L"i16");
+#endif
+
 #if GDEBUG
 volatile bool GWaitAttach = true;
 
@@ -99,6 +150,16 @@ void resetBasicData()
 	memset(rgbTable, 0, 768);
 	memset(alphaTable, 0, 256);
 
+	// keep the file around, in case Promotion comes back to it
+	if (CurrentFile)
+	{
+		if (CurrentFile->IsLoaded())
+			fileCache.Put(currentFileName, currentStamp, CurrentFile);
+		else
+			delete CurrentFile;
+		CurrentFile = nullptr;
+	}
+
 	resetError();
 }
 
@@ -109,6 +170,30 @@ static inline unsigned char expand4to8(unsigned char n)
 	return (unsigned char)((n << 4) | n);
 }
 
+#if META_INDEX
+// remember what loadBasicData reports for pPath
+void storeMetaData(const wchar_t* pPath, C16File* pFile)
+{
+	MetaIndexEntry meta;
+	meta.handled = true;
+	meta.width = pFile->GetWidthPixels();
+	meta.height = pFile->GetHeight();
+	meta.frameCount = 1;
+
+	const C16_Palette& pal = pFile->GetPalette();
+	meta.numColors = pal.iNumColors;
+
+	for (int idx = 0; idx < pal.iNumColors; ++idx)
+	{
+		meta.rgb[idx*3+0] = expand4to8((unsigned char)pal.pColors[idx].r);
+		meta.rgb[idx*3+1] = expand4to8((unsigned char)pal.pColors[idx].g);
+		meta.rgb[idx*3+2] = expand4to8((unsigned char)pal.pColors[idx].b);
+	}
+
+	metaIndex.Store(pPath, meta);
+}
+#endif
+
 // auto load basic file information from the given file
 bool ensureBasicData()
 {
@@ -124,16 +209,49 @@ bool ensureBasicData()
 		return false;
 	}
 
-	CurrentFile = new C16File(currentFileName);
+	// Opened lately? Then it's all still here, most likely unpacked
+	CurrentFile = fileCache.Take(currentFileName, currentStamp);
 
-	if (CurrentFile->GetFrameCount() < 1)
+	if (!CurrentFile)
 	{
-		basicDataLoaded = false;
-		delete CurrentFile;
-		CurrentFile = nullptr;
-		// Don't report an error here, or we get an error on boot when Promotion
-		// asks every plugin if it can handle some unrelated file.
-		return false;
+#if META_INDEX
+		// Seen this file before? Then it doesn't need to be opened until
+		// loadNextImage
+		MetaIndexEntry meta;
+		if (metaIndex.Lookup(currentFileName, meta))
+		{
+			if (!meta.handled)
+				return false;
+
+			fileHeader.width = meta.width;
+			fileHeader.height = meta.height;
+			memcpy(rgbTable, meta.rgb, meta.numColors * 3);
+
+			basicDataLoaded = true;
+			return true;
+		}
+#endif
+
+		// Header, palette, SCBs and blob index only; the pixels wait for
+		// loadNextImage, so browsing a folder doesn't unpack every picture
+		CurrentFile = new C16File(currentFileName, true);
+
+		if (!CurrentFile->IsLoaded())
+		{
+			basicDataLoaded = false;
+			delete CurrentFile;
+			CurrentFile = nullptr;
+#if META_INDEX
+			metaIndex.Store(currentFileName, MetaIndexEntry());
+#endif
+			// Don't report an error here, or we get an error on boot when
+			// Promotion asks every plugin if it can handle some unrelated file.
+			return false;
+		}
+
+#if META_INDEX
+		storeMetaData(currentFileName, CurrentFile);
+#endif
 	}
 
 	fileHeader.width = CurrentFile->GetWidthPixels();
@@ -163,6 +281,103 @@ void updateProgress(int progress)
 	}
 }
 
+// block until the background save (if any) is done; the worker's progress is
+// forwarded from this thread, so the callback never runs on the worker
+void waitForSave()
+{
+	if (!saveThread.joinable())
+		return;
+
+	while (saveRunning)
+	{
+		updateProgress(saveProgress);
+		std::this_thread::sleep_for(std::chrono::milliseconds(15));
+	}
+	saveThread.join();
+
+	updateProgress(saveProgress);
+}
+
+// pick 16 colors for the true color frame in saveRgba, and map it to them
+// into pSnapshot
+void quantizeFrame(C16File* pFile, unsigned char* pSnapshot)
+{
+	int srcWidth  = (int)fileHeader.width;
+	int srcHeight = (int)fileHeader.height;
+
+	QuantizerColor colors[16];
+	bool exact;
+	int numColors = QuantizePalette(saveRgba.data(), (size_t)srcWidth * srcHeight, 16, colors, &exact);
+
+	// down to the 4 bits per channel the file holds; unused entries stay black
+	for (int idx = 0; idx < numColors; ++idx)
+	{
+		colors[idx].r = ChannelTo4Bit(colors[idx].r);
+		colors[idx].g = ChannelTo4Bit(colors[idx].g);
+		colors[idx].b = ChannelTo4Bit(colors[idx].b);
+	}
+
+	const C16_Palette& Palette = pFile->GetPalette();
+
+	for (int idx = 0; idx < Palette.iNumColors; ++idx)
+	{
+		bool used = idx < numColors;
+
+		Palette.pColors[idx].r = used ? colors[idx].r : 0;
+		Palette.pColors[idx].g = used ? colors[idx].g : 0;
+		Palette.pColors[idx].b = used ? colors[idx].b : 0;
+		Palette.pColors[idx].a = 0xF; // opaque
+	}
+
+	saveProgress = 30;
+
+	// an image that already fits the palette has nothing to dither
+	bool dither = TRUE_COLOR_DITHER && !exact;
+	MapToPalette444(saveRgba.data(), srcWidth, srcHeight, colors, numColors, dither, pSnapshot);
+
+	std::vector<unsigned char>().swap(saveRgba);
+}
+
+// body of the background save, owns pFile and the frame snapshot it references
+void runSave(C16File* pFile, unsigned char* pSnapshot)
+{
+	if (!saveRgba.empty())
+		quantizeFrame(pFile, pSnapshot);
+
+#if BLOB_CACHE_SIDECAR
+	wchar_t sidecarPath[2048 + 16];
+	wcscpy(sidecarPath, saveFileName);
+	wcscat(sidecarPath, L".blobcache");
+	blobCache.LoadSidecar(sidecarPath);
+#endif
+	blobCache.BeginBatch();
+	pFile->SetBlobCache(&blobCache);
+
+	saveProgress = 60;
+
+	if (!pFile->SaveToFile(saveFileName))
+	{
+		wcscpy(saveErrorMessage, ERROR_FILE_WRITE_FAILED);
+	}
+	else
+	{
+#if META_INDEX
+		// index the file as written, ready for the next folder scan
+		storeMetaData(saveFileName, pFile);
+		metaIndex.Flush(true);
+#endif
+#if BLOB_CACHE_SIDECAR
+		blobCache.SaveSidecar(sidecarPath);
+#endif
+	}
+
+	delete pFile;
+	delete[] pSnapshot;
+
+	saveProgress = 100;
+	saveRunning = false;
+}
+
 
 
 extern "C"
@@ -215,7 +430,7 @@ extern "C"
 	bool __stdcall isWriteTrueColorSupported()
 	{
 		resetError();
-		return false;
+		return true;
 	}
 
 	wchar_t* __stdcall getFileBoxDescription()
@@ -246,11 +461,14 @@ extern "C"
 	{
 		// Quick-check optimization possible (read just the 16-byte header) but
 		// we mirror i256's approach: defer to a full load attempt.
+		// A save in flight may still be writing this file.
+		waitForSave();
 		return ensureBasicData();
 	}
 
 	bool __stdcall loadBasicData()
 	{
+		waitForSave();
 		return ensureBasicData();
 	}
 
@@ -301,13 +519,24 @@ extern "C"
 
 		updateProgress(0);
 
-		const std::vector<unsigned char*>& PixelMaps = CurrentFile->GetPixelMaps();
-		int Width = CurrentFile->GetWidthPixels();
+		if (!CurrentFile)
+		{
+			// Basic data came from the metadata index, the file itself
+			// hasn't been opened yet
+			CurrentFile = new C16File(currentFileName, true);
+		}
+
 		int Height = CurrentFile->GetHeight();
 
-		if (PixelMaps.size() > 0)
+		// Unpack the frame into the file object, which then goes to the cache
+		// for a next time, and copy it over to the host
+		if ((CurrentFile->GetWidthPixels() != (int)fileHeader.width) ||
+			(Height != (int)fileHeader.height) ||
+			!CurrentFile->UnpackPixels() ||
+			!CurrentFile->DecodeRows(0, Height, colorFrame))
 		{
-			memcpy(colorFrame, PixelMaps[0], Width * Height);
+			wcscpy(lastErrorMessage, ERROR_FILE_READ_FAILED);
+			return false;
 		}
 
 		updateProgress(50);
@@ -323,6 +552,7 @@ extern "C"
 
 	bool __stdcall beginWrite(int width, int height, int transparentColor, bool alphaEnabled, int numberOfFrames)
 	{
+		waitForSave();
 		resetBasicData();
 
 		// set up file header. We do not actually write yet!
@@ -340,73 +570,105 @@ extern "C"
 
 	bool __stdcall writeNextImage(unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned char* rgba, unsigned short delayMs)
 	{
+		waitForSave();
+
 		if (CurrentFile)
 		{
 			delete CurrentFile;
 			CurrentFile = nullptr;
 		}
 
+		// Whatever was kept of the old file is stale now
+		fileCache.Remove(currentFileName);
+
 		int srcWidth  = (int)fileHeader.width;
 		int srcHeight = (int)fileHeader.height;
 
 		// On disk the .16 format stores width in bytes (2 pixels per byte).
 		int widthBytes = (srcWidth + 1) / 2;
-		int padWidth   = widthBytes * 2;          // always even
 
-		// AddImages reads padWidth*srcHeight bytes from the source pointer, but
-		// Promotion sized colorFrame as srcWidth*srcHeight. Pad on odd widths.
-		unsigned char* paddedFrame = nullptr;
-		unsigned char* framePtr    = colorFrame;
-		if (padWidth != srcWidth)
-		{
-			paddedFrame = new unsigned char[ (size_t)padWidth * (size_t)srcHeight ];
-			memset(paddedFrame, 0, (size_t)padWidth * (size_t)srcHeight);
-			for (int y = 0; y < srcHeight; ++y)
-			{
-				memcpy(paddedFrame + (size_t)y * padWidth,
-				       colorFrame  + (size_t)y * srcWidth,
-				       srcWidth);
-			}
-			framePtr = paddedFrame;
-		}
+#if META_INDEX
+		// The file is about to change under its index entry
+		metaIndex.Forget(currentFileName);
+#endif
 
-		CurrentFile = new C16File(widthBytes, srcHeight, 16);
+		// The save object belongs to the worker from here on
+		C16File* pFile = new C16File(widthBytes, srcHeight, 16);
 
-		const C16_Palette& Palette = CurrentFile->GetPalette();
+		size_t frameSize = (size_t)srcWidth * (size_t)srcHeight;
+		unsigned char* pSnapshot = new unsigned char[ frameSize ];
 
-		// Truncate Promotion's 8-bit palette down to 4 bits per channel.
-		for (int idx = 0; idx < Palette.iNumColors; ++idx)
+		if (rgba != NULL)
+		{
+			// True color: keep the frame, the worker picks the palette and
+			// fills pSnapshot in before it packs
+			saveRgba.assign(rgba, rgba + frameSize * 4);
+		}
+		else
 		{
-			int rgbindex = 3 * idx;
+			const C16_Palette& Palette = pFile->GetPalette();
+
+			// Truncate Promotion's 8-bit palette down to 4 bits per channel.
+			for (int idx = 0; idx < Palette.iNumColors; ++idx)
+			{
+				int rgbindex = 3 * idx;
+
+				Palette.pColors[idx].r = (unsigned char)(colorFramePalette[rgbindex+0] >> 4);
+				Palette.pColors[idx].g = (unsigned char)(colorFramePalette[rgbindex+1] >> 4);
+				Palette.pColors[idx].b = (unsigned char)(colorFramePalette[rgbindex+2] >> 4);
+				Palette.pColors[idx].a = 0xF; // opaque
+			}
 
-			Palette.pColors[idx].r = (unsigned char)(colorFramePalette[rgbindex+0] >> 4);
-			Palette.pColors[idx].g = (unsigned char)(colorFramePalette[rgbindex+1] >> 4);
-			Palette.pColors[idx].b = (unsigned char)(colorFramePalette[rgbindex+2] >> 4);
-			Palette.pColors[idx].a = 0xF; // opaque
+			// Promotion sized colorFrame as srcWidth*srcHeight and may reuse it
+			// as soon as we return, so take a copy as-is. The encoder pads odd
+			// widths row by row while it packs.
+			memcpy(pSnapshot, colorFrame, frameSize);
 		}
 
 		std::vector<unsigned char*> pixels;
-		pixels.push_back(framePtr);
-		CurrentFile->AddImages(pixels);
+		pixels.push_back(pSnapshot);
+		pFile->AttachImages(pixels, srcWidth);
 
-		if (paddedFrame)
+		wcscpy(saveFileName, currentFileName);
+		saveErrorMessage[0] = 0;
+		saveProgress = 10;
+		saveRunning = true;
+
+		try
 		{
-			delete[] paddedFrame;
+			pinModule();
+			saveThread = std::thread(runSave, pFile, pSnapshot);
+		}
+		catch (...)
+		{
+			// No thread to be had, save inline instead
+			runSave(pFile, pSnapshot);
 		}
 
-		updateProgress(60);
-
-		CurrentFile->SaveToFile(currentFileName);
-
-		updateProgress(100);
+		updateProgress(10);
 
 		return true;
 	}
 
 	void __stdcall finishProcessing()
 	{
+		waitForSave();
+
 		resetBasicData();
 
+		// resetBasicData cleared the error, put back any failure from the
+		// background save
+		if (saveErrorMessage[0])
+		{
+			wcscpy(lastErrorMessage, saveErrorMessage);
+			saveErrorMessage[0] = 0;
+		}
+
+#if META_INDEX
+		// writes the index only now and then, not once per file of a scan
+		metaIndex.Flush();
+#endif
+
 		// set progress back to 0 to hide the progress bar
 		updateProgress(0);
 	}
@@ -429,7 +691,12 @@ BOOL APIENTRY DllMain(HANDLE hModule,
 		case DLL_PROCESS_ATTACH:
 		case DLL_THREAD_ATTACH:
 		case DLL_THREAD_DETACH:
+			break;
 		case DLL_PROCESS_DETACH:
+			// The DLL is pinned while a save can run, so this is process
+			// exit, with the worker already gone; let go of its handle
+			if (saveThread.joinable())
+				saveThread.detach();
 			break;
 	}
 	return TRUE;
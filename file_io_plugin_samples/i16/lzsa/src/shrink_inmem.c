@@ -183,3 +183,140 @@ size_t lzsa_compress_inmem(unsigned char *pInputData, unsigned char *pOutBuffer,
    }
 }
 
+/**
+ * Get the size of the parse buffer used by lzsa_compress_block_inmem_incremental()
+ *
+ * @param nInputSize input(source) size in bytes
+ *
+ * @return parse buffer size in bytes
+ */
+size_t lzsa_get_parse_size_inmem(size_t nInputSize) {
+   return nInputSize * sizeof(lzsa_match);
+}
+
+/**
+ * Compress one raw LZSA2 block (LZSA_FLAG_RAW_BLOCK, at most 64 KB), reusing the parse of a previous version of the same
+ * block outside of the bytes that changed
+ *
+ * @param pPrevInputData previous contents of the block, or NULL to compress from scratch
+ * @param nPrevInputSize previous contents size in bytes
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (LZSA_FLAG_xxx), must include LZSA_FLAG_RAW_BLOCK
+ * @param nMinMatchSize minimum match size
+ * @param pParse buffer of lzsa_get_parse_size_inmem(nInputSize) bytes: on entry, the parse of pPrevInputData (unused when
+ *        there are no previous contents); on success, the parse of pInputData
+ * @param pReused optional, set to 1 when the previous parse was reused, 0 when the block was compressed from scratch
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t lzsa_compress_block_inmem_incremental(const unsigned char *pPrevInputData, size_t nPrevInputSize, unsigned char *pInputData, unsigned char *pOutBuffer,
+                                             size_t nInputSize, size_t nMaxOutBufferSize, const unsigned int nFlags, const int nMinMatchSize, void *pParse, int *pReused) {
+   lzsa_compressor compressor;
+   lzsa_match *pBestMatch = (lzsa_match *)pParse;
+   int nOutDataEnd = (int)nMaxOutBufferSize;
+   int nOutDataSize = -2;
+
+   if (pReused)
+      *pReused = 0;
+   if ((nFlags & LZSA_FLAG_RAW_BLOCK) == 0 || (nFlags & LZSA_FLAG_RAW_BACKWARD) != 0 || nInputSize == 0 || nInputSize > BLOCK_SIZE)
+      return -1;
+
+   if (lzsa_compressor_init(&compressor, BLOCK_SIZE * 2, nMinMatchSize, 2, nFlags) != 0)
+      return -1;
+
+   if (nOutDataEnd > BLOCK_SIZE)
+      nOutDataEnd = BLOCK_SIZE;
+
+   if (pPrevInputData && nPrevInputSize == nInputSize) {
+      int nDirtyStart[INCREMENTAL_MAX_WINDOWS];
+      int nDirtyEnd[INCREMENTAL_MAX_WINDOWS];
+      int nNumDirty = 0;
+      int i = 0;
+
+      /* Find the changed ranges; ones closer than the re-parse margins would overlap anyway */
+      while (i < (int)nInputSize && nNumDirty <= INCREMENTAL_MAX_WINDOWS) {
+         if (pPrevInputData[i] == pInputData[i]) {
+            i++;
+            continue;
+         }
+
+         if (nNumDirty && (i - nDirtyEnd[nNumDirty - 1]) < (INCREMENTAL_MARGIN * 2)) {
+            nNumDirty--;
+         }
+         else {
+            if (nNumDirty == INCREMENTAL_MAX_WINDOWS) {
+               nNumDirty++;
+               break;
+            }
+            nDirtyStart[nNumDirty] = i;
+         }
+         while (i < (int)nInputSize && pPrevInputData[i] != pInputData[i])
+            i++;
+         nDirtyEnd[nNumDirty++] = i;
+      }
+
+      if (nNumDirty <= INCREMENTAL_MAX_WINDOWS) {
+         nOutDataSize = lzsa_compressor_shrink_block_incremental(&compressor, pInputData, (int)nInputSize, pBestMatch, nDirtyStart, nDirtyEnd, nNumDirty, pOutBuffer, nOutDataEnd);
+         if (nOutDataSize >= 0 && pReused)
+            *pReused = 1;
+      }
+   }
+
+   if (nOutDataSize == -2) {
+      nOutDataSize = lzsa_compressor_shrink_block(&compressor, pInputData, 0, (int)nInputSize, pOutBuffer, nOutDataEnd);
+      if (nOutDataSize >= 0)
+         memcpy(pBestMatch, lzsa_compressor_get_last_parse(&compressor), nInputSize * sizeof(lzsa_match));
+   }
+
+   lzsa_compressor_destroy(&compressor);
+
+   if (nOutDataSize < 0) {
+      return -1;
+   }
+   else {
+      return nOutDataSize;
+   }
+}
+
+/**
+ * Compress one raw LZSA2 block (LZSA_FLAG_RAW_BLOCK, at most 64 KB) that may match into the bytes before it
+ *
+ * @param pInputData pointer to input(source) data to compress, preceded by nHistorySize bytes of history
+ * @param nHistorySize history size in bytes (at most 64 KB)
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (LZSA_FLAG_xxx), must include LZSA_FLAG_RAW_BLOCK
+ * @param nMinMatchSize minimum match size
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t lzsa_compress_block_inmem_history(unsigned char *pInputData, size_t nHistorySize, unsigned char *pOutBuffer,
+                                         size_t nInputSize, size_t nMaxOutBufferSize, const unsigned int nFlags, const int nMinMatchSize) {
+   lzsa_compressor compressor;
+   int nOutDataEnd = (int)nMaxOutBufferSize;
+   int nOutDataSize;
+
+   if ((nFlags & LZSA_FLAG_RAW_BLOCK) == 0 || (nFlags & LZSA_FLAG_RAW_BACKWARD) != 0 || nInputSize == 0 || nInputSize > BLOCK_SIZE || nHistorySize > BLOCK_SIZE)
+      return -1;
+
+   if (lzsa_compressor_init(&compressor, BLOCK_SIZE * 2, nMinMatchSize, 2, nFlags) != 0)
+      return -1;
+
+   if (nOutDataEnd > BLOCK_SIZE)
+      nOutDataEnd = BLOCK_SIZE;
+
+   nOutDataSize = lzsa_compressor_shrink_block(&compressor, pInputData - nHistorySize, (int)nHistorySize, (int)nInputSize, pOutBuffer, nOutDataEnd);
+
+   lzsa_compressor_destroy(&compressor);
+
+   if (nOutDataSize < 0) {
+      return -1;
+   }
+   else {
+      return nOutDataSize;
+   }
+}
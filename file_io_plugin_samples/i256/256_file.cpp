@@ -6,8 +6,11 @@
 // https://docs.google.com/document/d/10ovgMClDAJVgbW0sOhUsBkVABKWhOPM5Au7vbHJymoA/edit?usp=sharing
 //
 #include "256_file.h"
+#include "..\blobCache.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <unordered_map>
 
 // I have to say, it's a good thing that lzsa2 has good compression ratios
 // because these include names are fucking terrible
@@ -25,14 +28,161 @@ static_assert(sizeof(I256File_Header)==16, "I256File_Header is supposed to be 16
 static_assert(sizeof(I256File_CLUT)==10,  "I256File_CLUT is supposed to be 10 bytes");
 static_assert(sizeof(I256File_PIXL)==10, "I256File_PIXL is supposed to be 10 bytes");
 static_assert(sizeof(I256File_CHUNK)==8, "I256File_CHUNK is supposed to be 8 bytes");
+static_assert(sizeof(I256File_ANIM)==10, "I256File_ANIM is supposed to be 10 bytes");
+static_assert(sizeof(I256File_FRAME)==12, "I256File_FRAME is supposed to be 12 bytes");
+static_assert(sizeof(I256File_TILE)==16, "I256File_TILE is supposed to be 16 bytes");
+static_assert(sizeof(I256File_TMAP)==10, "I256File_TMAP is supposed to be 10 bytes");
+
+// Tile sizes tried with tile dedupe, a tile number for every tile costs less
+// with the bigger ones
+static const int kTileSizes[] = { 16, 8 };
+// Tiles have to get a frame down to this many 1/4s of its size, map included,
+// or it's stored whole
+static const size_t kTileSavingQuarters = 3;
+
+//------------------------------------------------------------------------------
+//
+// Find the rectangle of pixels that differ between two frames. Returns true,
+// with info set up for a delta, unless most of the frame changed; then the
+// frame itself packs better.
+//
+static bool DeltaRect(const unsigned char* pPrevious, const unsigned char* pFrame,
+					  int width, int height, I256File_FRAME& info)
+{
+	int left = width, right = -1;
+	int top = height, bottom = -1;
+	size_t changed = 0;
+
+	for (int y = 0; y < height; ++y)
+	{
+		const unsigned char* pA = pPrevious + (size_t)y * width;
+		const unsigned char* pB = pFrame + (size_t)y * width;
+
+		if (0 == memcmp(pA, pB, width))
+			continue;
+
+		if (y < top) top = y;
+		bottom = y;
+
+		for (int x = 0; x < width; ++x)
+		{
+			if (pA[ x ] != pB[ x ])
+			{
+				if (x < left) left = x;
+				if (x > right) right = x;
+				++changed;
+			}
+		}
+	}
+
+	if (changed > ((size_t)width * height / 2))
+		return false;
+
+	info.flags = I256_FRAME_DELTA;
+	info.x = 0;
+	info.y = 0;
+	info.width = 0;
+	info.height = 0;
+
+	if (changed)
+	{
+		info.x = (unsigned short)left;
+		info.y = (unsigned short)top;
+		info.width = (unsigned short)(right - left + 1);
+		info.height = (unsigned short)(bottom - top + 1);
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+//
+// Split a frame into tileSize x tileSize tiles, the ones on the right and
+// bottom edges padded with 0. Each distinct tile goes into tiles once, map
+// gets the tile number for every tile position, row by row. Tiles are found
+// by their CRC32C, then compared in full. Returns false if there are more
+// distinct tiles than a tile number can tell apart.
+//
+static bool FindTiles(const unsigned char* pFrame, int width, int height, int tileSize,
+					  std::vector<unsigned char>& tiles, std::vector<unsigned short>& map)
+{
+	int tilesWide = (width + tileSize - 1) / tileSize;
+	int tilesHigh = (height + tileSize - 1) / tileSize;
+	size_t tileBytes = (size_t)tileSize * tileSize;
+
+	std::unordered_multimap<unsigned int, int> found;
+	found.reserve( (size_t)tilesWide * tilesHigh );
+
+	std::vector<unsigned char> tile( tileBytes );
+	int numTiles = 0;
+
+	tiles.clear();
+	map.resize( (size_t)tilesWide * tilesHigh );
+
+	for (int ty = 0; ty < tilesHigh; ++ty)
+	{
+		for (int tx = 0; tx < tilesWide; ++tx)
+		{
+			int x = tx * tileSize;
+			int y = ty * tileSize;
+			int copyWidth = ((x + tileSize) <= width) ? tileSize : (width - x);
+
+			for (int row = 0; row < tileSize; ++row)
+			{
+				unsigned char* pRow = &tile[ (size_t)row * tileSize ];
+
+				if ((y + row) < height)
+				{
+					memcpy(pRow, pFrame + (size_t)(y + row) * width + x, copyWidth);
+					memset(pRow + copyWidth, 0, tileSize - copyWidth);
+				}
+				else
+				{
+					memset(pRow, 0, tileSize);
+				}
+			}
+
+			unsigned int crc = BlobCache::Crc32c(&tile[ 0 ], tileBytes);
+			int number = -1;
+
+			auto range = found.equal_range(crc);
+			for (auto it = range.first; it != range.second; ++it)
+			{
+				if (0 == memcmp(&tiles[ (size_t)it->second * tileBytes ], &tile[ 0 ], tileBytes))
+				{
+					number = it->second;
+					break;
+				}
+			}
+
+			if (number < 0)
+			{
+				if (numTiles > 0xFFFF)
+					return false;
+
+				number = numTiles++;
+				tiles.insert(tiles.end(), tile.begin(), tile.end());
+				found.insert(std::make_pair(crc, number));
+			}
+
+			map[ (size_t)ty * tilesWide + tx ] = (unsigned short)number;
+		}
+	}
+
+	return true;
+}
 
 //------------------------------------------------------------------------------
 // Load in a I256File constructor
 //
-I256File::I256File(const wchar_t *pFilePath)
+I256File::I256File(const wchar_t *pFilePath, bool bHeaderOnly)
 	: m_widthPixels(0)
 	, m_heightPixels(0)
 	, m_numColors( 0 )
+	, m_pBlobCache( nullptr )
+	, m_bTileDedupe( false )
+	, m_bBlobHistory( false )
+	, m_bLoaded( false )
 {
 
 	m_pal.iNumColors = 0;
@@ -41,7 +191,10 @@ I256File::I256File(const wchar_t *pFilePath)
 	//memset(&m_pPixelMaps, 0, sizeof(m_pPixelMaps));
 	//memset(&m_pal, 0, sizeof(m_pal));
 
-	LoadFromFile(pFilePath);
+	if (bHeaderOnly)
+		LoadHeader(pFilePath);
+	else
+		LoadFromFile(pFilePath);
 }
 //------------------------------------------------------------------------------
 // Create a blank I256File constructor
@@ -50,6 +203,10 @@ I256File::I256File(int iWidthPixels, int iHeightPixels, int iNumColors)
 	: m_widthPixels( iWidthPixels )
 	, m_heightPixels( iHeightPixels )
 	, m_numColors( iNumColors )
+	, m_pBlobCache( nullptr )
+	, m_bTileDedupe( false )
+	, m_bBlobHistory( false )
+	, m_bLoaded( false )
 {
 	//memset(&m_pPixelMaps, 0, sizeof(m_pPixelMaps));
 	//memset(&m_pal, 0, sizeof(m_pal));
@@ -101,11 +258,23 @@ void I256File::AddImages( const std::vector<unsigned char*>& pPixelMaps )
 	}
 }
 
+//------------------------------------------------------------------------------
+//
+// Reference the image data, no copy
+//
+void I256File::AttachImages( const std::vector<unsigned char*>& pPixelMaps )
+{
+	for (int idx = 0; idx < pPixelMaps.size(); ++idx)
+	{
+		m_pSourceMaps.push_back( pPixelMaps[ idx ] );
+	}
+}
+
 //------------------------------------------------------------------------------
 //
 // Save to File
 //
-void I256File::SaveToFile(const wchar_t* pFilenamePath)
+bool I256File::SaveToFile(const wchar_t* pFilenamePath)
 {
 	// Actually, going to serialize to memory, then will save that to file
 	std::vector<unsigned char> bytes;
@@ -123,6 +292,16 @@ void I256File::SaveToFile(const wchar_t* pFilenamePath)
 
 	pHeader->file_length = (unsigned int)bytes.size(); // get some valid data in there
 
+	// Frames, attached ones win over copies, and get compressed in place
+	std::vector<const unsigned char*> frames( m_pPixelMaps.begin(), m_pPixelMaps.end() );
+	if (!m_pSourceMaps.empty())
+		frames = m_pSourceMaps;
+
+	if (frames.empty())
+		return false;
+
+	int num_frames = (int)frames.size();
+
 	pHeader->version = 0x0000;
 	pHeader->width  = m_widthPixels  & 0xFFFF;
 	pHeader->height = m_heightPixels & 0xFFFF;
@@ -186,9 +365,124 @@ void I256File::SaveToFile(const wchar_t* pFilenamePath)
 	}
 
 	delete[] pCompressedBuffer;
+	// Work Buffer Guaranteed to be large enough
+	unsigned char* pWorkBuffer = new unsigned char[ lzsa_get_max_compressed_size_inmem( 65536 ) ];
+	bool bCompressed = true;
+	bool bTiled = false;
+
+	size_t frameSize = (size_t)m_widthPixels * (size_t)m_heightPixels;
+
+	if (num_frames == 1)
+	{
+		bCompressed = AppendKeyFrame(bytes, frames[ 0 ], pWorkBuffer, 0, bTiled);
+	}
+	else
+	{
+		//----------------------------------------------------------------------
+		// Add an ANIM Chunk, then a PIXL Chunk per frame
+		size_t anim_offset = bytes.size();
+
+		bytes.resize( bytes.size() + sizeof(I256File_ANIM) + (num_frames * sizeof(I256File_FRAME)) );
+		I256File_ANIM* pANIM = (I256File_ANIM*)&bytes[ anim_offset ];
+
+		pANIM->a = 'A'; pANIM->n = 'N'; pANIM->i = 'I'; pANIM->m = 'M';
+		pANIM->chunk_length = (unsigned int)(bytes.size() - anim_offset);
+		pANIM->num_frames = (unsigned short)num_frames;
+
+		// Blobs of a whole frame, each frame gets that many cache slots
+		int frame_slots = (int)((frameSize + 0xFFFF) / 0x10000);
+
+		std::vector<unsigned char> delta;
+
+		for (int frame = 0; (frame < num_frames) && bCompressed; ++frame)
+		{
+			I256File_FRAME info;
+			info.delay_ms = GetDelay(frame);
+			info.flags = 0;
+			info.x = 0;
+			info.y = 0;
+			info.width = m_widthPixels & 0xFFFF;
+			info.height = m_heightPixels & 0xFFFF;
+
+			const unsigned char* pSourceData = frames[ frame ];
+			size_t sourceSize = frameSize;
+
+			if ((frame > 0) && DeltaRect(frames[ frame - 1 ], frames[ frame ], m_widthPixels, m_heightPixels, info))
+			{
+				// Only the rectangle that changed, XORed so what didn't
+				// change in there is zeros. Much less to compress, and less
+				// again once it's compressed.
+				delta.resize( (size_t)info.width * info.height );
+
+				for (int y = 0; y < info.height; ++y)
+				{
+					size_t rowOffset = (size_t)(info.y + y) * m_widthPixels + info.x;
+					unsigned char* pDelta = &delta[ (size_t)y * info.width ];
+
+					for (int x = 0; x < info.width; ++x)
+					{
+						pDelta[ x ] = frames[ frame ][ rowOffset + x ] ^ frames[ frame - 1 ][ rowOffset + x ];
+					}
+				}
+
+				pSourceData = delta.empty() ? nullptr : &delta[ 0 ];
+				sourceSize = delta.size();
+			}
+
+			I256File_FRAME* pFRAME = (I256File_FRAME*)&bytes[ anim_offset + sizeof(I256File_ANIM) ];
+			pFRAME[ frame ] = info;
+
+			if (info.flags & I256_FRAME_DELTA)
+				bCompressed = AppendPixl(bytes, pSourceData, sourceSize, pWorkBuffer, frame * frame_slots);
+			else
+				bCompressed = AppendKeyFrame(bytes, pSourceData, pWorkBuffer, frame * frame_slots, bTiled);
+		}
+	}
+
+	delete[] pWorkBuffer;
+
+	if (!bCompressed)
+	{
+		// FAILED TO COMPRESS -- bail out without taking down the host
+		// process, the plugin shim reports the failure
+		return false;
+	}
+
 	//--------------------------------------------------------------------------
-	// Add a PIXL Chunk, which has the pixel data
+	// Update the header
+	pHeader = (I256File_Header*)&bytes[0]; // Required
+	pHeader->file_length = (unsigned int)bytes.size(); // get some valid data in there
+
+	// A single image of plain pixels stays version 0, which every reader
+	// knows
+	if ((num_frames > 1) || bTiled || (m_bBlobHistory && (frameSize > 0x10000)))
+		pHeader->version = 0x0001;
+
+	//--------------------------------------------------------------------------
+	// Create the file and write it
+	FILE* pFile = nullptr;
+	errno_t err = _wfopen_s(&pFile, pFilenamePath, L"wb");
+
+	if ((0!=err) || (nullptr==pFile))
+	{
+		return false;
+	}
+
+	size_t written = fwrite(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
+	fclose(pFile);
 
+	return written == bytes.size();
+}
+
+//------------------------------------------------------------------------------
+//
+// Add a PIXL Chunk, which has the pixel data of one frame, or of the part of
+// it a delta frame stores. pWorkBuffer holds a compressed 64K blob, the blobs
+// get cache slots from first_slot on. Returns false if compression fails.
+//
+bool I256File::AppendPixl(std::vector<unsigned char>& bytes, const unsigned char* pSourceData,
+						  size_t decompressed_size, unsigned char* pWorkBuffer, int first_slot)
+{
 	size_t pixl_offset = bytes.size();
 
 	// Add space for the PIXL header;
@@ -198,26 +492,120 @@ void I256File::SaveToFile(const wchar_t* pFilenamePath)
 	pPIXL->p = 'P'; pPIXL->i = 'I'; pPIXL->x = 'X'; pPIXL->l = 'L';
 	pPIXL->chunk_length = 0; // Temporary Chunk Size
 
-	size_t decompressed_size = (m_widthPixels * m_heightPixels);
+	int num_blobs = AppendBlobs(bytes, pSourceData, decompressed_size, pWorkBuffer, first_slot);
+	if (num_blobs < 0)
+		return false;
+
+	// Update the chunk length
+	pPIXL = (I256File_PIXL*)&bytes[ pixl_offset ];
+	pPIXL->num_blobs = BlobsField(num_blobs);
+	pPIXL->chunk_length = (unsigned int) (bytes.size() - pixl_offset);
+
+	return true;
+}
 
-	pPIXL->num_blobs = (short) (decompressed_size / 0x10000);
+//------------------------------------------------------------------------------
+//
+// A frame that stands on its own: its distinct tiles and a map of them when
+// tile dedupe is on and that's a lot smaller, a PIXL chunk otherwise. Sets
+// bTiled for the tiles.
+//
+bool I256File::AppendKeyFrame(std::vector<unsigned char>& bytes, const unsigned char* pFrame,
+							  unsigned char* pWorkBuffer, int first_slot, bool& bTiled)
+{
+	size_t frameSize = (size_t)m_widthPixels * (size_t)m_heightPixels;
 
-	// Need to add an extra blob, if we're not a multiple of 65536
-	if (decompressed_size & 0xFFFF)
+	std::vector<unsigned char> tiles, bestTiles;
+	std::vector<unsigned short> map, bestMap;
+	int bestSize = 0;
+	size_t bestBytes = frameSize * kTileSavingQuarters / 4;
+
+	for (int idx = 0; m_bTileDedupe && (idx < (int)(sizeof(kTileSizes) / sizeof(kTileSizes[0]))); ++idx)
 	{
-		pPIXL->num_blobs+=1;
+		if (!FindTiles(pFrame, m_widthPixels, m_heightPixels, kTileSizes[ idx ], tiles, map))
+			continue;
+
+		size_t tiledBytes = tiles.size() + (map.size() * 2);
+		if (tiledBytes < bestBytes)
+		{
+			bestBytes = tiledBytes;
+			bestSize = kTileSizes[ idx ];
+			bestTiles.swap(tiles);
+			bestMap.swap(map);
+		}
 	}
 
-	int num_blobs = pPIXL->num_blobs;
+	if (0 == bestSize)
+		return AppendPixl(bytes, pFrame, frameSize, pWorkBuffer, first_slot);
 
-	// Work Buffer Guaranteed to be large enough
-	unsigned char* pWorkBuffer = new unsigned char[ lzsa_get_max_compressed_size_inmem( 65536 ) ];
-	// Grabbing just the first frame
-	unsigned char *pSourceData = (unsigned char*)m_pPixelMaps[ 0 ];
+	//--------------------------------------------------------------------------
+	// Add a TILE Chunk; blob cache slots are left to PIXL blobs, which sit in
+	// the same place from one save to the next
+	size_t tile_offset = bytes.size();
+
+	bytes.resize( bytes.size() + sizeof(I256File_TILE) );
+
+	int num_blobs = AppendBlobs(bytes, &bestTiles[ 0 ], bestTiles.size(), pWorkBuffer, -1);
+	if (num_blobs < 0)
+		return false;
+
+	I256File_TILE* pTILE = (I256File_TILE*)&bytes[ tile_offset ];
+
+	pTILE->t = 'T'; pTILE->i = 'I'; pTILE->l = 'L'; pTILE->e = 'E';
+	pTILE->chunk_length = (unsigned int)(bytes.size() - tile_offset);
+	pTILE->num_blobs = BlobsField(num_blobs);
+	pTILE->tile_size = (unsigned short)bestSize;
+	pTILE->num_tiles = (unsigned int)(bestTiles.size() / ((size_t)bestSize * bestSize));
+
+	//--------------------------------------------------------------------------
+	// Add a TMAP Chunk, the tile numbers little endian
+	std::vector<unsigned char> mapBytes( bestMap.size() * 2 );
+
+	for (size_t idx = 0; idx < bestMap.size(); ++idx)
+	{
+		mapBytes[ idx * 2 + 0 ] = (bestMap[ idx ] >> 0) & 0xFF;
+		mapBytes[ idx * 2 + 1 ] = (bestMap[ idx ] >> 8) & 0xFF;
+	}
+
+	size_t tmap_offset = bytes.size();
+
+	bytes.resize( bytes.size() + sizeof(I256File_TMAP) );
+
+	num_blobs = AppendBlobs(bytes, &mapBytes[ 0 ], mapBytes.size(), pWorkBuffer, -1);
+	if (num_blobs < 0)
+		return false;
+
+	I256File_TMAP* pTMAP = (I256File_TMAP*)&bytes[ tmap_offset ];
+
+	pTMAP->t = 'T'; pTMAP->m = 'M'; pTMAP->a = 'A'; pTMAP->p = 'P';
+	pTMAP->chunk_length = (unsigned int)(bytes.size() - tmap_offset);
+	pTMAP->num_blobs = BlobsField(num_blobs);
+
+	bTiled = true;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+//
+// Compress decompressed_size bytes as 64K blobs, each with its 16 bit size
+// in front (0 for stored), onto bytes. Returns the number of blobs, -1 if
+// compression fails. first_slot -1 gives the blobs no cache slots.
+//
+int I256File::AppendBlobs(std::vector<unsigned char>& bytes, const unsigned char* pSourceData,
+						  size_t decompressed_size, unsigned char* pWorkBuffer, int first_slot)
+{
+	int num_blobs = (int) (decompressed_size / 0x10000);
+
+	// Need to add an extra blob, if we're not a multiple of 65536
+	if (decompressed_size & 0xFFFF)
+	{
+		num_blobs+=1;
+	}
 
 	// Compressed Blobs to Follow
 	for (int idx = 0; idx < num_blobs; ++idx)
 	{
+		size_t compSize;
 		size_t sourceOffset = 0x10000 * idx;
 		int decompressedChunkSize = (int)(decompressed_size - sourceOffset);
 
@@ -226,7 +614,37 @@ void I256File::SaveToFile(const wchar_t* pFilenamePath)
 			decompressedChunkSize = 0x10000;
 		}
 
-		compSize = lzsa_compress_inmem(&pSourceData[ sourceOffset ],  // input
+		// The blob before is the history; the input for each blob is all
+		// there, so blobs still compress independently of each other
+		size_t historySize = (m_bBlobHistory && idx) ? 0x10000 : 0;
+
+		if (m_pBlobCache)
+		{
+			compSize = m_pBlobCache->Compress(&pSourceData[ sourceOffset ],  // input
+								 pWorkBuffer,  	 					  // output
+								 decompressedChunkSize,  			  // input size
+								 lzsa_get_max_compressed_size_inmem( 65536 ),  // max output buffer size
+								 LZSA_FLAG_FAVOR_RATIO | LZSA_FLAG_RAW_BLOCK,
+								 0,						// minmatchsize (0 better for ratio)
+								 2, // Format Version
+								 (first_slot < 0) ? -1 : (first_slot + idx),	// slot, for incremental recompression
+								 historySize
+								 );
+		}
+		else if (historySize)
+		{
+			compSize = lzsa_compress_block_inmem_history((unsigned char*)&pSourceData[ sourceOffset ],  // input
+								 historySize,						  // history before it
+								 pWorkBuffer,  	 					  // output
+								 decompressedChunkSize,  			  // input size
+								 lzsa_get_max_compressed_size_inmem( 65536 ),  // max output buffer size
+								 LZSA_FLAG_FAVOR_RATIO | LZSA_FLAG_RAW_BLOCK,
+								 0						// minmatchsize (0 better for ratio)
+								 );
+		}
+		else
+		{
+			compSize = lzsa_compress_inmem((unsigned char*)&pSourceData[ sourceOffset ],  // input
 								 pWorkBuffer,  	 					  // output
 								 decompressedChunkSize,  			  // input size
 								 lzsa_get_max_compressed_size_inmem( 65536 ),  // max output buffer size
@@ -234,6 +652,7 @@ void I256File::SaveToFile(const wchar_t* pFilenamePath)
 								 0,						// minmatchsize (0 better for ratio)
 								 2 // Format Version
 								 );
+		}
 
 
 		if (compSize > 0)
@@ -244,10 +663,8 @@ void I256File::SaveToFile(const wchar_t* pFilenamePath)
 				bytes.push_back( 0 );
 				bytes.push_back( 0 );
 
-				for (int uncompressedIdx = 0; uncompressedIdx < 0x10000; ++uncompressedIdx)
-				{
-					bytes.push_back((unsigned char) pSourceData[ sourceOffset + uncompressedIdx ]);
-				}
+				bytes.insert(bytes.end(), &pSourceData[ sourceOffset ],
+							 &pSourceData[ sourceOffset ] + 0x10000);
 
 			}
 			else
@@ -256,50 +673,158 @@ void I256File::SaveToFile(const wchar_t* pFilenamePath)
 				bytes.push_back( (compSize>>0) & 0xFF );
 				bytes.push_back( (compSize>>8) & 0xFF );
 
-				// is this fast?  Probably not
-				for (int compressedIndex = 0; compressedIndex < compSize; ++compressedIndex)
-				{
-					bytes.push_back((unsigned char)pWorkBuffer[ compressedIndex ]);
-				}
+				bytes.insert(bytes.end(), pWorkBuffer, pWorkBuffer + compSize);
 			}
 
 		}
 		else
 		{
-			// FAILED TO COMPRESS
-			printf("FAILED TO COMPRESS\n");
-			exit(-1);
-			return; // just stop
+			return -1;
 		}
 	}
 
-	// Update the chunk length
-	pPIXL = (I256File_PIXL*)&bytes[ pixl_offset ];
-	pPIXL->chunk_length = (unsigned int) (bytes.size() - pixl_offset);
+	return num_blobs;
+}
 
-	//--------------------------------------------------------------------------
-	// Update the header
-	pHeader = (I256File_Header*)&bytes[0]; // Required
-	pHeader->file_length = (unsigned int)bytes.size(); // get some valid data in there
+//------------------------------------------------------------------------------
 
-	// Try not to leak memory, even though we probably do
-	//delete[] pWorkBuffer;
+void I256File::LoadFromFile(const wchar_t* pFilePath)
+{
+	if (!LoadHeader(pFilePath))
+		return;
 
-	//--------------------------------------------------------------------------
-	// Create the file and write it
-	FILE* pFile = nullptr;
-	errno_t err = _wfopen_s(&pFile, pFilenamePath, L"wb");
+	if (!UnpackPixels())
+	{
+		// Corrupt pixel data, keep a blank frame
+		size_t frameSize = (size_t)m_widthPixels * (size_t)m_heightPixels;
+		unsigned char* pFrame = new unsigned char[ frameSize ];
+		memset(pFrame, 0, frameSize);
+		m_pPixelMaps.push_back(pFrame);
+	}
+}
 
-	if (0==err)
+//------------------------------------------------------------------------------
+
+bool I256File::UnpackPixels()
+{
+	if (!m_bLoaded)
+		return false;
+
+	if (!m_pPixelMaps.empty())
+		return true;
+
+	// Go ahead and allocate the bitmaps
+	size_t frameSize = (size_t)m_widthPixels * (size_t)m_heightPixels;
+	std::vector<unsigned char*> frames;
+	bool bDecoded = !m_frameChunks.empty();
+
+	for (int frame = 0; bDecoded && (frame < (int)m_frameChunks.size()); ++frame)
 	{
-		fwrite(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
-		fclose(pFile);
+		// Allocate a Frame
+		unsigned char* pFrame = new unsigned char[ frameSize ];
+		frames.push_back(pFrame);
+
+		bool bDelta = (frame < (int)m_frameInfo.size()) && (m_frameInfo[ frame ].flags & I256_FRAME_DELTA);
+
+		if (m_frameTiles[ frame ] && !bDelta)
+		{
+			bDecoded = ExpandTiles(frame, pFrame);
+			continue;
+		}
+
+		if (0 == frame)
+		{
+			bDecoded = DecodeRows(0, m_heightPixels, pFrame);
+			continue;
+		}
+
+		I256File_PIXL* pPIXL = (I256File_PIXL*)m_frameChunks[ frame ];
+		PixlBlobReader reader;
+
+		if (!pPIXL->IsValid())
+		{
+			// A delta has to be a PIXL
+			bDecoded = false;
+			continue;
+		}
+
+		if (!bDelta)
+		{
+			bDecoded = reader.Index(((unsigned char*)pPIXL) + sizeof(I256File_PIXL),
+									pPIXL->chunk_length - sizeof(I256File_PIXL),
+									pPIXL->num_blobs & ~I256_BLOBS_HISTORY, frameSize,
+									0 != (pPIXL->num_blobs & I256_BLOBS_HISTORY)) &&
+					   reader.DecodeRange(0, frameSize, pFrame);
+			continue;
+		}
+
+		// A delta only holds the rectangle that changed since the frame
+		// before, XORed with it
+		const I256File_FRAME& info = m_frameInfo[ frame ];
+		size_t deltaSize = (size_t)info.width * info.height;
+
+		memcpy(pFrame, frames[ frame - 1 ], frameSize);
+
+		if (0 == deltaSize)
+			continue;
+
+		bDecoded = ((info.x + info.width) <= m_widthPixels) &&
+				   ((info.y + info.height) <= m_heightPixels) &&
+				   reader.Index(((unsigned char*)pPIXL) + sizeof(I256File_PIXL),
+								pPIXL->chunk_length - sizeof(I256File_PIXL),
+								pPIXL->num_blobs & ~I256_BLOBS_HISTORY, deltaSize,
+								0 != (pPIXL->num_blobs & I256_BLOBS_HISTORY));
+
+		std::vector<unsigned char> row( info.width );
+
+		for (int y = 0; bDecoded && (y < info.height); ++y)
+		{
+			unsigned char* pDest = pFrame + ((size_t)(info.y + y) * m_widthPixels) + info.x;
+			size_t rowOffset = (size_t)y * info.width;
+
+			bDecoded = reader.DecodeRange(rowOffset, rowOffset + info.width, &row[ 0 ]);
+
+			for (int x = 0; bDecoded && (x < info.width); ++x)
+			{
+				pDest[ x ] ^= row[ x ];
+			}
+		}
 	}
+
+	if (!bDecoded)
+	{
+		for (int idx = 0; idx < frames.size(); ++idx)
+			delete[] frames[ idx ];
+		return false;
+	}
+
+	// Save them in the list
+	m_pPixelMaps = frames;
+
+	// Everything is unpacked, the file bytes aren't needed anymore
+	m_frameChunks.clear();
+	m_frameTiles.clear();
+	m_blobReader.Clear();
+	std::vector<unsigned char>().swap(m_fileBytes);
+
+	return true;
 }
 
 //------------------------------------------------------------------------------
 
-void I256File::LoadFromFile(const wchar_t* pFilePath)
+size_t I256File::GetMemoryUsage()
+{
+	size_t bytes = sizeof(*this) + m_fileBytes.capacity();
+
+	if (!m_pPixelMaps.empty())
+		bytes += m_pPixelMaps.size() * (size_t)m_widthPixels * (size_t)m_heightPixels;
+
+	return bytes;
+}
+
+//------------------------------------------------------------------------------
+
+bool I256File::LoadHeader(const wchar_t* pFilePath)
 {
 	// Free any existing memory
 	if (m_pal.pColors)
@@ -307,6 +832,7 @@ void I256File::LoadFromFile(const wchar_t* pFilePath)
 		delete[] m_pal.pColors;
 		m_pal.pColors = nullptr;
 	}
+	m_pal.iNumColors = 0;
 	// Free Up the memory
 	for (int idx = 0; idx < m_pPixelMaps.size(); ++idx)
 	{
@@ -314,11 +840,18 @@ void I256File::LoadFromFile(const wchar_t* pFilePath)
 		m_pPixelMaps[ idx ] = nullptr;
 	}
 	m_pPixelMaps.clear();
+	m_delays.clear();
+	m_frameInfo.clear();
+	m_frameChunks.clear();
+	m_frameTiles.clear();
+	m_blobReader.Clear();
+	m_fileBytes.clear();
+	m_bLoaded = false;
 
 	//--------------------------------------------------------------------------
 	
 
-	std::vector<unsigned char> bytes;
+	std::vector<unsigned char>& bytes = m_fileBytes;
 
 	//--------------------------------------------------------------------------
 	// Read the file into memory
@@ -334,61 +867,147 @@ void I256File::LoadFromFile(const wchar_t* pFilePath)
 		bytes.resize( length );			// make sure buffer is large enough
 
 		// Read in the file
-		fread(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
+		if (length)
+			fread(&bytes[0], sizeof(unsigned char), bytes.size(), pFile);
 		fclose(pFile);
 	}
 
-	if (bytes.size())
-	{
-		size_t file_offset = 0;	// File Cursor
+	if (bytes.size() < sizeof(I256File_Header))
+		return false;
 
-		// Bytes are in the buffer, so let's start looking at what we have
-		I256File_Header* pHeader = (I256File_Header*) &bytes[0];
+	size_t file_offset = 0;	// File Cursor
 
-		// Early out if things don't look right
-		if (!pHeader->IsValid((unsigned int)bytes.size()))
-			return;
+	// Bytes are in the buffer, so let's start looking at what we have
+	I256File_Header* pHeader = (I256File_Header*) &bytes[0];
 
-		m_widthPixels = pHeader->width;
-		m_heightPixels = pHeader->height;
+	// Early out if things don't look right
+	if (!pHeader->IsValid((unsigned int)bytes.size()))
+		return false;
 
-		// Go ahead and allocate the bitmap
-		size_t frameSize = pHeader->width * pHeader->height;
+	m_widthPixels = pHeader->width;
+	m_heightPixels = pHeader->height;
 
-		// Allocate a Frame
-		unsigned char* pFrame = new unsigned char[ frameSize ];
-		// Save it in the list
-		m_pPixelMaps.push_back(pFrame);
+	//----------------------------------------------------------------------
+	// Process Chunks as we encounter them
+	file_offset += sizeof(I256File_Header);
 
-		//----------------------------------------------------------------------
-		// Process Chunks as we encounter them
-		file_offset += sizeof(I256File_Header);
+	// The TILE chunk the next TMAP chunk maps
+	I256File_TILE* pLastTILE = nullptr;
 
-		// While we're not at the end of the file
-		while (file_offset < bytes.size())
+	// While we're not at the end of the file
+	while ((file_offset + sizeof(I256File_CHUNK)) <= bytes.size())
+	{
+		// This is pretty dumb, just get it done
+		// These are the types I understand
+		// every chunk is supposed to contain a value chunk_length
+		// at offset +4, so that we can ignore ones we don't understand
+		I256File_CLUT* pCLUT = (I256File_CLUT*)&bytes[ file_offset ];
+		I256File_PIXL* pPIXL = (I256File_PIXL*)&bytes[ file_offset ];
+		I256File_ANIM* pANIM = (I256File_ANIM*)&bytes[ file_offset ];
+		I256File_TILE* pTILE = (I256File_TILE*)&bytes[ file_offset ];
+		I256File_TMAP* pTMAP = (I256File_TMAP*)&bytes[ file_offset ];
+		I256File_CHUNK* pCHUNK = (I256File_CHUNK*)&bytes[ file_offset ];
+
+		// A chunk that doesn't fit means a truncated or corrupt file
+		size_t chunkBytes = pCHUNK->chunk_length;
+		if ((chunkBytes < sizeof(I256File_CHUNK)) || (chunkBytes > (bytes.size() - file_offset)))
+			break;
+
+		if (pCLUT->IsValid())
 		{
-			// This is pretty dumb, just get it done
-			// These are the types I understand
-			// every chunk is supposed to contain a value chunk_length
-			// at offset +4, so that we can ignore ones we don't understand
-			I256File_CLUT* pCLUT = (I256File_CLUT*)&bytes[ file_offset ];
-			I256File_PIXL* pPIXL = (I256File_PIXL*)&bytes[ file_offset ];
-			I256File_CHUNK* pCHUNK = (I256File_CHUNK*)&bytes[ file_offset ];
-
-			if (pCLUT->IsValid())
-			{
-				// We have a CLUT Chunk
-				UnpackClut(pCLUT);
-			}
-			else if (pPIXL->IsValid())
-			{
-				// We have a PIXeL chunk
-				UnpackPixel(pPIXL);
-			}
+			// We have a CLUT Chunk
+			UnpackClut(pCLUT);
+		}
+		else if (pPIXL->IsValid())
+		{
+			// We have a PIXeL chunk
+			IndexPixel(pPIXL, chunkBytes);
+		}
+		else if (pANIM->IsValid())
+		{
+			// We have an ANIMation chunk
+			UnpackAnim(pANIM, chunkBytes);
+		}
+		else if (pTILE->IsValid())
+		{
+			// We have the TILEs of a frame
+			if (chunkBytes >= sizeof(I256File_TILE))
+				pLastTILE = pTILE;
+		}
+		else if (pTMAP->IsValid())
+		{
+			// We have the Tile MAP that goes with them
+			if ((chunkBytes >= sizeof(I256File_TMAP)) && pLastTILE)
+				IndexTileMap(pTMAP, pLastTILE);
+			pLastTILE = nullptr;
+		}
+
+		file_offset += chunkBytes;
+	}
+
+	m_bLoaded = true;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool I256File::DecodeRows(int firstRow, int numRows, unsigned char* pDest)
+{
+	if ((firstRow < 0) || (numRows < 0) || ((firstRow + numRows) > m_heightPixels))
+		return false;
+
+	size_t begin = (size_t)firstRow * m_widthPixels;
+	size_t end = begin + ((size_t)numRows * m_widthPixels);
 
-			file_offset += pCHUNK->chunk_length;
+	if (!m_pPixelMaps.empty())
+	{
+		// Already unpacked
+		memcpy(pDest, m_pPixelMaps[ 0 ] + begin, end - begin);
+		return true;
+	}
+
+	if (!m_frameTiles.empty() && m_frameTiles[ 0 ])
+	{
+		// A tiled first frame isn't rows of blobs, unpack it all
+		if (!UnpackPixels())
+			return false;
+
+		memcpy(pDest, m_pPixelMaps[ 0 ] + begin, end - begin);
+		return true;
+	}
+
+	if (m_blobReader.GetDecompressedSize() < end)
+		return false;
+
+	return m_blobReader.DecodeRange(begin, end, pDest);
+}
+
+//------------------------------------------------------------------------------
+
+bool I256File::DecodeThumbnail(int step, unsigned char* pDest)
+{
+	if (step < 1)
+		return false;
+
+	int thumbWidth = (m_widthPixels + step - 1) / step;
+	std::vector<unsigned char> row( m_widthPixels );
+
+	// Rows come out in order, so each blob is unpacked at most once, and blobs
+	// that hold none of the sampled rows are skipped
+	for (int y = 0; y < m_heightPixels; y += step)
+	{
+		if (!DecodeRows(y, 1, &row[0]))
+			return false;
+
+		for (int x = 0, tx = 0; x < m_widthPixels; x += step, ++tx)
+		{
+			pDest[ tx ] = row[ x ];
 		}
+
+		pDest += thumbWidth;
 	}
+
+	return true;
 }
 
 //------------------------------------------------------------------------------
@@ -440,56 +1059,141 @@ void I256File::UnpackClut(I256File_CLUT* pCLUT)
 
 //------------------------------------------------------------------------------
 //
-// Unpack the pixel bitmap, that's been weirdly packed into 64KB chunks
-// to make it easier to deal with on 65816
+//  Frame delays and flags, the PIXL chunks that follow are the frames
 //
-void I256File::UnpackPixel(I256File_PIXL* pPIXL)
+void I256File::UnpackAnim(I256File_ANIM* pANIM, size_t chunkBytes)
 {
-	int num_blobs = pPIXL->num_blobs;
+	if (chunkBytes < sizeof(I256File_ANIM))
+		return;
 
-	unsigned char *pData = ((unsigned char*)pPIXL) + sizeof(I256File_PIXL);
+	size_t numFrames = (chunkBytes - sizeof(I256File_ANIM)) / sizeof(I256File_FRAME);
+	if (numFrames > pANIM->num_frames)
+		numFrames = pANIM->num_frames;
 
-	unsigned char *pTargetBuffer = m_pPixelMaps[ 0 ]; // Data needs to be pre allocated
+	I256File_FRAME* pFRAME = (I256File_FRAME*)(((unsigned char*)pANIM) + sizeof(I256File_ANIM));
 
-	size_t bufferSize = m_widthPixels * m_heightPixels;
+	m_delays.resize(numFrames);
+	m_frameInfo.assign(pFRAME, pFRAME + numFrames);
 
-	while (num_blobs-- > 0)
+	for (size_t idx = 0; idx < numFrames; ++idx)
 	{
-		int compressedSize = *pData++;
-		compressedSize |= (*pData++)<<8;
+		m_delays[ idx ] = pFRAME[ idx ].delay_ms;
+	}
 
-		// Zero Size means 64KB
-		if (0 == compressedSize)
-		{
-			// This means 64KB of uncompressed data
-			compressedSize = 0x10000;
+	// The first frame has nothing to be a delta of
+	if (numFrames)
+		m_frameInfo[ 0 ].flags &= ~I256_FRAME_DELTA;
+}
 
-			// Copy the non compressed data
-			for (int idx = 0; idx < compressedSize; ++idx)
-			{
-				pTargetBuffer[ idx ] = pData[ idx ];
-			}
+//------------------------------------------------------------------------------
+//
+// The pixel bitmap has been weirdly packed into 64KB chunks to make it easier
+// to deal with on 65816. Just find where they are, DecodeRows unpacks them.
+// Each frame of an animation has a PIXL chunk of its own, only the first one
+// is indexed here; UnpackPixels takes care of the others.
+//
+void I256File::IndexPixel(I256File_PIXL* pPIXL, size_t chunkBytes)
+{
+	if (chunkBytes < sizeof(I256File_PIXL))
+		return;
 
-			bufferSize -= compressedSize;
+	m_frameChunks.push_back((I256File_CHUNK*)pPIXL);
+	m_frameTiles.push_back(nullptr);
+	if (m_frameChunks.size() > 1)
+		return;
 
-		}
-		else
+	unsigned char *pData = ((unsigned char*)pPIXL) + sizeof(I256File_PIXL);
+
+	size_t frameSize = (size_t)m_widthPixels * (size_t)m_heightPixels;
+
+	m_blobReader.Index(pData, chunkBytes - sizeof(I256File_PIXL),
+					   pPIXL->num_blobs & ~I256_BLOBS_HISTORY, frameSize,
+					   0 != (pPIXL->num_blobs & I256_BLOBS_HISTORY));
+}
+
+//------------------------------------------------------------------------------
+//
+// A tiled frame: a TMAP chunk and the TILE chunk before it. Nothing is
+// unpacked until ExpandTiles.
+//
+void I256File::IndexTileMap(I256File_TMAP* pTMAP, I256File_TILE* pTILE)
+{
+	m_frameChunks.push_back((I256File_CHUNK*)pTMAP);
+	m_frameTiles.push_back(pTILE);
+}
+
+//------------------------------------------------------------------------------
+//
+// Put a tiled frame back together, clipping the tiles on the right and bottom
+// edges
+//
+bool I256File::ExpandTiles(int frame, unsigned char* pFrame)
+{
+	I256File_TMAP* pTMAP = (I256File_TMAP*)m_frameChunks[ frame ];
+	I256File_TILE* pTILE = m_frameTiles[ frame ];
+
+	int tileSize = pTILE->tile_size;
+	if ((tileSize < 1) || (tileSize > 256))
+		return false;
+
+	int tilesWide = (m_widthPixels + tileSize - 1) / tileSize;
+	int tilesHigh = (m_heightPixels + tileSize - 1) / tileSize;
+	size_t tileBytes = (size_t)tileSize * tileSize;
+
+	// Every tile is on the map at least once
+	if ((pTILE->num_tiles < 1) || (pTILE->num_tiles > 0x10000) ||
+		(pTILE->num_tiles > (size_t)tilesWide * tilesHigh))
+		return false;
+
+	std::vector<unsigned char> tiles( tileBytes * pTILE->num_tiles );
+	std::vector<unsigned char> map( (size_t)tilesWide * tilesHigh * 2 );
+
+	PixlBlobReader reader;
+
+	if (!reader.Index(((unsigned char*)pTILE) + sizeof(I256File_TILE),
+					  pTILE->chunk_length - sizeof(I256File_TILE),
+					  pTILE->num_blobs & ~I256_BLOBS_HISTORY, tiles.size(),
+					  0 != (pTILE->num_blobs & I256_BLOBS_HISTORY)) ||
+		!reader.DecodeRange(0, tiles.size(), &tiles[ 0 ]))
+	{
+		return false;
+	}
+
+	if (!reader.Index(((unsigned char*)pTMAP) + sizeof(I256File_TMAP),
+					  pTMAP->chunk_length - sizeof(I256File_TMAP),
+					  pTMAP->num_blobs & ~I256_BLOBS_HISTORY, map.size(),
+					  0 != (pTMAP->num_blobs & I256_BLOBS_HISTORY)) ||
+		!reader.DecodeRange(0, map.size(), &map[ 0 ]))
+	{
+		return false;
+	}
+
+	for (int ty = 0; ty < tilesHigh; ++ty)
+	{
+		int y = ty * tileSize;
+		int copyHeight = ((y + tileSize) <= m_heightPixels) ? tileSize : (m_heightPixels - y);
+
+		for (int tx = 0; tx < tilesWide; ++tx)
 		{
-			int version = 2; // format version;
-			size_t decompressedSize = lzsa_decompress_inmem(pData, 		   // Compressed Data
-															pTargetBuffer, // Target uncompressed data
-															compressedSize, // compressed size in bytes
-															bufferSize,
-															LZSA_FLAG_RAW_BLOCK,
-															&version);
+			size_t mapIndex = ((size_t)ty * tilesWide + tx) * 2;
+			unsigned int number = map[ mapIndex ] | (map[ mapIndex + 1 ] << 8);
 
-			bufferSize -= decompressedSize;
+			if (number >= pTILE->num_tiles)
+				return false;
 
-		}
+			int x = tx * tileSize;
+			int copyWidth = ((x + tileSize) <= m_widthPixels) ? tileSize : (m_widthPixels - x);
+			const unsigned char* pTile = &tiles[ number * tileBytes ];
 
-		pData += compressedSize;
-		pTargetBuffer += 0x10000;
+			for (int row = 0; row < copyHeight; ++row)
+			{
+				memcpy(pFrame + (size_t)(y + row) * m_widthPixels + x,
+					   pTile + (size_t)row * tileSize, copyWidth);
+			}
+		}
 	}
+
+	return true;
 }
 
 //------------------------------------------------------------------------------
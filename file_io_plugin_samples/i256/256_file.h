@@ -10,6 +10,10 @@
 
 #include <vector>
 
+#include "..\pixlBlobs.h"
+
+class BlobCache;
+
 #pragma pack(push, 1)
 
 typedef struct I256_Color
@@ -27,7 +31,7 @@ typedef struct I256File_Header
 
 	unsigned int 	file_length;  // In bytes, including the 16 byte header
 
-	short 			version;  // 0x0000 for now
+	short 			version;  // 0x0000, or 0x0001 with ANIM or TILE chunks, or I256_BLOBS_HISTORY
 	short			width;	  // In pixels
 	short			height;	  // In pixels
 
@@ -40,7 +44,7 @@ typedef struct I256File_Header
 		if (file_length != fileLength)
 			return false;				// size isn't right
 
-		if (version != 0)
+		if ((version != 0) && (version != 1))
 			return false;				// version is not right
 
 		if ((hi!='I')||(h2!='2')||(h5!='5')||(h6!='6'))
@@ -57,12 +61,17 @@ typedef struct I256File_Header
 
 } I256File_Header;
 
+// Set in num_blobs when each blob after the first is compressed with the blob
+// before it as history: LZSA2 matches can reach back up to 64KB, into the end
+// of the previous blob. Version 1 files only.
+#define I256_BLOBS_HISTORY 0x8000
+
 // PIXeL chunk
 typedef struct I256File_PIXL
 {
 	char		  p,i,x,l;		// 'P','I','X','L'
 	unsigned int  chunk_length; // in bytes, including the 9 bytes header of this chunk
-	unsigned short num_blobs;	// number of blobs to decompress
+	unsigned short num_blobs;	// number of blobs to decompress, | I256_BLOBS_HISTORY
 
 	// Commands Coded Data Follows
 //------------------------------------------------------------------------------
@@ -79,6 +88,92 @@ typedef struct I256File_PIXL
 } I256File_PIXL;
 
 
+// ANIMation chunk, version 1 files only. One PIXL chunk per frame follows it,
+// in order.
+typedef struct I256File_ANIM
+{
+	char		  a,n,i,m;		// 'A','N','I','M'
+	unsigned int  chunk_length; // in bytes, including the 10 bytes header of this chunk
+	unsigned short num_frames;	// number of frames
+
+	// num_frames I256File_FRAME entries follow
+
+//------------------------------------------------------------------------------
+// If you're doing C, just get rid of these methods
+	bool IsValid()
+	{
+		if ((a!='A')||(n!='N')||(i!='I')||(m!='M'))
+			return false;				// signature is not right
+
+		return true;
+	}
+
+} I256File_ANIM;
+
+// frame's PIXL holds only the rectangle that changed since the previous
+// frame, XORed with it
+#define I256_FRAME_DELTA 0x0001
+
+typedef struct I256File_FRAME
+{
+	unsigned short delay_ms;	// how long the frame shows, in milliseconds
+	unsigned short flags;		// I256_FRAME_DELTA, other bits 0
+
+	// With I256_FRAME_DELTA, the rectangle in the PIXL, 0 wide if nothing
+	// changed; otherwise the whole image
+	unsigned short x, y;
+	unsigned short width, height;
+
+} I256File_FRAME;
+
+// TILE chunk: the distinct tiles of a frame, stored once each. The TMAP
+// chunk right after it says where they go; the pair stands in for the
+// frame's PIXL chunk. Version 1 files only.
+typedef struct I256File_TILE
+{
+	char		  t,i,l,e;		// 'T','I','L','E'
+	unsigned int  chunk_length; // in bytes, including the 16 bytes header of this chunk
+	unsigned short num_blobs;	// number of blobs to decompress, as in PIXL
+	unsigned short tile_size;	// tiles are tile_size x tile_size pixels
+	unsigned int  num_tiles;	// 1-65536
+
+	// Blobs of the tiles follow, one tile after the other, each row by row
+
+//------------------------------------------------------------------------------
+// If you're doing C, just get rid of these methods
+	bool IsValid()
+	{
+		if ((t!='T')||(i!='I')||(l!='L')||(e!='E'))
+			return false;				// signature is not right
+
+		return true;
+	}
+
+} I256File_TILE;
+
+// Tile MAP chunk, follows a TILE chunk
+typedef struct I256File_TMAP
+{
+	char		  t,m,a,p;		// 'T','M','A','P'
+	unsigned int  chunk_length; // in bytes, including the 10 bytes header of this chunk
+	unsigned short num_blobs;	// number of blobs to decompress, as in PIXL
+
+	// Blobs of 16 bit tile numbers follow, one row of tiles after the
+	// other. Tiles on the right and bottom edges may stick out of the
+	// image; what sticks out isn't drawn.
+
+//------------------------------------------------------------------------------
+// If you're doing C, just get rid of these methods
+	bool IsValid()
+	{
+		if ((t!='T')||(m!='M')||(a!='A')||(p!='P'))
+			return false;				// signature is not right
+
+		return true;
+	}
+
+} I256File_TMAP;
+
 // Color LookUp Table, Chunk
 typedef struct I256File_CLUT
 {
@@ -129,19 +224,61 @@ class I256File
 public:
 	// Create a Blank Fan File
 	I256File(int iWidthPixels, int iHeightPixels, int iNumColors);
-	// Load in a I256 Image File
-	I256File(const wchar_t* pFilePath);
+	// Load in a I256 Image File; with bHeaderOnly, see LoadHeader()
+	I256File(const wchar_t* pFilePath, bool bHeaderOnly = false);
 
 	~I256File();
 
 	// Creation
 	void SetPalette( const I256_Palette& palette );
 	void AddImages( const std::vector<unsigned char*>& pPixelMaps );
-	void SaveToFile(const wchar_t* pFilenamePath);
+	// Reference the caller's frames instead of copying them. The buffers
+	// must stay valid until SaveToFile returns.
+	void AttachImages( const std::vector<unsigned char*>& pPixelMaps );
+	// Delay of each frame in milliseconds. More than one frame saves as an
+	// animation, where frames are stored as deltas to the one before when
+	// that's smaller.
+	void SetDelays( const std::vector<unsigned short>& delays ) { m_delays = delays; }
+	// Store frames that repeat the same 8x8 or 16x16 tiles a lot, sprite
+	// sheets and tile maps, as their distinct tiles and a map of them
+	void SetTileDedupe( bool bTileDedupe ) { m_bTileDedupe = bTileDedupe; }
+	// Compress each 64KB blob with the one before it as history; images
+	// bigger than one blob come out smaller, but need a version 1 reader
+	void SetBlobHistory( bool bBlobHistory ) { m_bBlobHistory = bBlobHistory; }
+	// Optional, not owned. Blobs whose input is already in the cache reuse
+	// the stored compressed bytes instead of being compressed again.
+	void SetBlobCache( BlobCache* pCache ) { m_pBlobCache = pCache; }
+	// Returns false if compression or the file write fails.
+	bool SaveToFile(const wchar_t* pFilenamePath);
 
 	// Retrieval
 	void LoadFromFile(const wchar_t* pFilePath);
-	int GetFrameCount() { return (int)m_pPixelMaps.size(); }
+	// Preview: read the header and palette and find the PIXL blobs, without
+	// unpacking any pixels. Pull the first frame's pixels out with
+	// DecodeRows() or DecodeThumbnail(). Returns false if it's not an I256.
+	bool LoadHeader(const wchar_t* pFilePath);
+	// Unpack numRows rows from firstRow into pDest (GetWidth() bytes a row),
+	// only decompressing the blobs that cover them
+	bool DecodeRows(int firstRow, int numRows, unsigned char* pDest);
+	// Every step-th pixel of every step-th row, for a downscaled preview.
+	// pDest is (GetWidth()+step-1)/step by (GetHeight()+step-1)/step bytes.
+	bool DecodeThumbnail(int step, unsigned char* pDest);
+	// After LoadHeader(), unpack every frame into GetPixelMaps() and let go of
+	// the file bytes, so DecodeRows() is a plain copy from then on. Returns
+	// false, and changes nothing, on corrupt pixel data.
+	bool UnpackPixels();
+	// True once a file with a valid header was loaded, pixels or not
+	bool IsLoaded() { return m_bLoaded; }
+	// Heap held by this object: file bytes or unpacked frames
+	size_t GetMemoryUsage();
+	// Frames in the file, or added for saving
+	int GetFrameCount()
+	{
+		if (!m_pSourceMaps.empty())
+			return (int)m_pSourceMaps.size();
+		return m_pPixelMaps.empty() ? (int)m_frameChunks.size() : (int)m_pPixelMaps.size();
+	}
+	unsigned short GetDelay(int frame) { return (frame < (int)m_delays.size()) ? m_delays[ frame ] : 0; }
 	int GetWidth()  { return m_widthPixels; }
 	int GetHeight() { return m_heightPixels; }
 
@@ -151,7 +288,22 @@ public:
 private:
 
 	void UnpackClut(I256File_CLUT* pCLUT);
-	void UnpackPixel(I256File_PIXL* pPIXL);
+	void UnpackAnim(I256File_ANIM* pANIM, size_t chunkBytes);
+	void IndexPixel(I256File_PIXL* pPIXL, size_t chunkBytes);
+	void IndexTileMap(I256File_TMAP* pTMAP, I256File_TILE* pTILE);
+	bool ExpandTiles(int frame, unsigned char* pFrame);
+	bool AppendPixl(std::vector<unsigned char>& bytes, const unsigned char* pSourceData,
+					size_t decompressed_size, unsigned char* pWorkBuffer, int first_slot);
+	bool AppendKeyFrame(std::vector<unsigned char>& bytes, const unsigned char* pFrame,
+						unsigned char* pWorkBuffer, int first_slot, bool& bTiled);
+	int AppendBlobs(std::vector<unsigned char>& bytes, const unsigned char* pSourceData,
+					size_t decompressed_size, unsigned char* pWorkBuffer, int first_slot);
+	// num_blobs of a chunk as stored, with I256_BLOBS_HISTORY when its blobs
+	// after the first were compressed with history
+	unsigned short BlobsField(int num_blobs)
+	{
+		return (unsigned short)(num_blobs | ((m_bBlobHistory && (num_blobs > 1)) ? I256_BLOBS_HISTORY : 0));
+	}
 
 //	int EncodeFrame(unsigned char* pCanvas, unsigned char* pFrame, unsigned char* pWorkBuffer, size_t bufferSize );
 
@@ -163,6 +315,26 @@ private:
 
 	std::vector<unsigned char*> m_pPixelMaps;
 
+	// Borrowed frames from AttachImages (not owned, not freed)
+	std::vector<const unsigned char*> m_pSourceMaps;
+
+	BlobCache* m_pBlobCache;	// not owned, may be null
+	bool m_bTileDedupe;
+	bool m_bBlobHistory;
+
+	// Per frame, from ANIM or SetDelays
+	std::vector<unsigned short> m_delays;
+	std::vector<I256File_FRAME> m_frameInfo;
+
+	// File contents and blob index while only the header has been loaded;
+	// the reader covers the first frame, the others are indexed on unpacking.
+	// Each frame has a PIXL chunk, or a TMAP chunk and its TILE chunk.
+	std::vector<unsigned char> m_fileBytes;
+	std::vector<I256File_CHUNK*> m_frameChunks;
+	std::vector<I256File_TILE*> m_frameTiles;
+	PixlBlobReader m_blobReader;
+	bool m_bLoaded;
+
 };
 
 #pragma pack(pop)
@@ -1,15 +1,48 @@
 // todo file format description
-
-#pragma pack(1)
+//
+// NOTE: no translation-unit-wide `#pragma pack(1)` here. It used to sit above
+// the includes, which packed every class this file pulled in, standard library
+// containers included, so this file disagreed with 256_file.cpp and
+// blobCache.cpp about member offsets. The on-disk structs manage their own
+// packing with push/pop in 256_file.h.
 
 #include "i256ImageIo.h"
 #include "256_file.h"
+#include "..\blobCache.h"
+#include "..\metaIndex.h"
+#include "..\decodedFileCache.h"
+#include "..\colorQuantizer.h"
+#include "..\pinModule.h"
 
 #include <stdio.h>
 #include <malloc.h>
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #define GDEBUG 0
 
+// 1 to keep each image's compressed blobs in <image>.blobcache, so re-saves
+// stay quick across Promotion sessions
+#define BLOB_CACHE_SIDECAR 0
+
+// 1 to remember each file's size and palette in the shared metadata index, so
+// browsing a folder doesn't open files that were seen before
+#define META_INDEX 1
+
+// memory kept for recently opened files, so going back to one is a copy
+// instead of another read and decompress; 0 turns that off
+#define DECODED_FILE_CACHE_BYTES (64 * 1024 * 1024)
+
+// 1 to store images that repeat 8x8 or 16x16 tiles, sprite sheets and tile
+// maps, as their distinct tiles and a map; such files need a version 1 reader
+#define TILE_DEDUPE 1
+
+// 1 to compress each 64KB pixel blob with the one before it as history, for
+// smaller files of images over 64KB; those need a version 1 reader too
+#define BLOB_HISTORY 1
+
 // some useful defines
 #define FILE_TYPE_ID "de.cosmigo.fileio.256"
 #define FILE_BOX_DESCRIPTION L"256 - I256 Image"
@@ -26,6 +59,8 @@
 #define ERROR_FILE_OPEN_FAILED L"Could not open file!"
 #define ERROR_FILE_READ_FAILED L"Could not read file!"
 #define ERROR_FILE_WRITE_FAILED L"Could not write file!"
+#define ERROR_OUT_OF_MEMORY L"Not enough memory to save!"
+#define ERROR_TOO_MANY_FRAMES L"More frames than announced!"
 
 // latest error message
 wchar_t lastErrorMessage[2048];
@@ -39,10 +74,41 @@ wchar_t currentFileName[2048];
 // flag needed for auto loading basic file information data (i.e. file header)
 bool basicDataLoaded = false;
 I256File* CurrentFile = nullptr;
+// CurrentFile's file as it was when loaded
+FileStamp currentStamp;
+
+// files opened earlier, CurrentFile goes back in here when it's done with
+DecodedFileCache<I256File> fileCache( DECODED_FILE_CACHE_BYTES );
 
 unsigned char rgbTable[ 768 ];
 unsigned char alphaTable[ 256 ];
 
+// Write-behind: writeNextImage collects the frames in saveFile, and hands it
+// to saveThread with the last one; the thread does the compression and the
+// file write off Promotion's UI thread. finishProcessing waits for it and
+// reports any failure.
+std::thread saveThread;
+std::atomic<int>  saveProgress( 0 );
+std::atomic<bool> saveRunning( false );
+I256File* saveFile = nullptr;
+std::vector<unsigned short> saveDelays;
+wchar_t saveFileName[2048];
+wchar_t saveErrorMessage[2048];
+
+// True color saves: the frames as handed over, one after the other, and the
+// indexed images the worker quantizes them to; both belong to the worker
+// while it runs
+std::vector<unsigned char> saveRgba;
+std::vector<unsigned char> saveIndices;
+
+// Compressed blobs from earlier saves, only the blobs an edit touched get
+// compressed again
+BlobCache blobCache;
+
+#if META_INDEX
+MetaIndex metaIndex( L"i256" );
+#endif
+
 #if GDEBUG
 volatile bool GWaitAttach = true;
 
@@ -66,9 +132,13 @@ struct
 	unsigned int height;
 	int transparentColor;
 	bool alphaEnabled;
+	int numberOfFrames;
 
 } fileHeader;
 
+// frame loadNextImage hands out next, or writeNextImage takes
+int currentFrameIndex = 0;
+
 // helper method to reset the previous error message
 void resetError()
 {
@@ -89,12 +159,48 @@ void resetBasicData()
 	fileHeader.height= -1;
 	fileHeader.transparentColor= -1;
 	fileHeader.alphaEnabled= false;
+	fileHeader.numberOfFrames= 0;
+	currentFrameIndex= 0;
 	memset( rgbTable, 0, 768 );
 	memset( alphaTable, 0, 256 );
+
+	// keep the file around, in case Promotion comes back to it
+	if (CurrentFile)
+	{
+		if (CurrentFile->IsLoaded())
+			fileCache.Put( currentFileName, currentStamp, CurrentFile );
+		else
+			delete CurrentFile;
+		CurrentFile = nullptr;
+	}
 	
 	resetError();
 }
 
+#if META_INDEX
+// remember what loadBasicData reports for pPath
+void storeMetaData( const wchar_t* pPath, I256File* pFile )
+{
+	MetaIndexEntry meta;
+	meta.handled = true;
+	meta.width = pFile->GetWidth();
+	meta.height = pFile->GetHeight();
+	meta.frameCount = pFile->GetFrameCount();
+
+	const I256_Palette& pal = pFile->GetPalette();
+	meta.numColors = pal.iNumColors;
+
+	for (int idx = 0; idx < pal.iNumColors; ++idx)
+	{
+		meta.rgb[idx*3+0] = pal.pColors[idx].r;
+		meta.rgb[idx*3+1] = pal.pColors[idx].g;
+		meta.rgb[idx*3+2] = pal.pColors[idx].b;
+	}
+
+	metaIndex.Store( pPath, meta );
+}
+#endif
+
 // auto load basic file information from the given file
 bool ensureBasicData()
 {
@@ -110,21 +216,56 @@ bool ensureBasicData()
 		return  false;
 	}
 
-	CurrentFile = new I256File(currentFileName);
+	// Opened lately? Then it's all still here, most likely unpacked
+	CurrentFile = fileCache.Take(currentFileName, currentStamp);
 
-	if (CurrentFile->GetFrameCount() < 1)
+	if (!CurrentFile)
 	{
-		basicDataLoaded = false;
-		delete CurrentFile;
-		CurrentFile = nullptr;
-		// Don't report an error, otherwise we get an error on boot
-		// Basically, if the filetype doesn't match, do not report an error
-		//wcscpy( lastErrorMessage, ERROR_FILE_OPEN_FAILED );
-		return false;
+#if META_INDEX
+		// Seen this file before? Then it doesn't need to be opened until
+		// loadNextImage
+		MetaIndexEntry meta;
+		if (metaIndex.Lookup(currentFileName, meta))
+		{
+			if (!meta.handled)
+				return false;
+
+			fileHeader.width = meta.width;
+			fileHeader.height = meta.height;
+			fileHeader.numberOfFrames = meta.frameCount;
+			memcpy(rgbTable, meta.rgb, meta.numColors * 3);
+
+			basicDataLoaded = true;
+			return true;
+		}
+#endif
+
+		// Header, palette and blob index only; the pixels wait for
+		// loadNextImage, so browsing a folder doesn't unpack every picture
+		CurrentFile = new I256File(currentFileName, true);
+
+		if (!CurrentFile->IsLoaded())
+		{
+			basicDataLoaded = false;
+			delete CurrentFile;
+			CurrentFile = nullptr;
+#if META_INDEX
+			metaIndex.Store(currentFileName, MetaIndexEntry());
+#endif
+			// Don't report an error, otherwise we get an error on boot
+			// Basically, if the filetype doesn't match, do not report an error
+			//wcscpy( lastErrorMessage, ERROR_FILE_OPEN_FAILED );
+			return false;
+		}
+
+#if META_INDEX
+		storeMetaData(currentFileName, CurrentFile);
+#endif
 	}
 
 	fileHeader.width = CurrentFile->GetWidth();
 	fileHeader.height = CurrentFile->GetHeight();
+	fileHeader.numberOfFrames = CurrentFile->GetFrameCount();
 
 	const I256_Palette& pal = CurrentFile->GetPalette();
 
@@ -150,6 +291,154 @@ void updateProgress( int progress )
 	}
 }
 
+// block until the background save (if any) is done; the worker's progress is
+// forwarded from this thread, so the callback never runs on the worker
+void waitForSave()
+{
+	if ( !saveThread.joinable() )
+		return;
+
+	while ( saveRunning )
+	{
+		updateProgress( saveProgress );
+		std::this_thread::sleep_for( std::chrono::milliseconds( 15 ) );
+	}
+	saveThread.join();
+
+	updateProgress( saveProgress );
+}
+
+// reduce the true color frames in saveRgba to pFile's palette and pixels;
+// all of them share the palette
+void quantizeFrames( I256File* pFile )
+{
+	size_t numPixels = saveRgba.size() / 4;
+
+	QuantizerColor colors[ 256 ];
+	int numColors = QuantizePalette( saveRgba.data(), numPixels, 256, colors );
+
+	saveProgress = 30;
+
+	// unused entries stay black
+	const I256_Palette& Palette = pFile->GetPalette();
+
+	for (int idx = 0; idx < Palette.iNumColors; ++idx)
+	{
+		bool used = idx < numColors;
+
+		Palette.pColors[idx].r = used ? colors[idx].r : 0;
+		Palette.pColors[idx].g = used ? colors[idx].g : 0;
+		Palette.pColors[idx].b = used ? colors[idx].b : 0;
+		Palette.pColors[idx].a = 255;
+	}
+
+	saveIndices.resize( numPixels );
+	MapToPalette( saveRgba.data(), numPixels, colors, numColors, saveIndices.data() );
+
+	std::vector<unsigned char>().swap( saveRgba );
+
+	// saveIndices outlives the save, no need for another copy
+	size_t frameSize = (size_t)pFile->GetWidth() * pFile->GetHeight();
+
+	std::vector<unsigned char*> pixels;
+	for (size_t offset = 0; offset < numPixels; offset += frameSize)
+		pixels.push_back( saveIndices.data() + offset );
+	pFile->AttachImages( pixels );
+}
+
+// body of the background save, owns pFile
+void runSave( I256File* pFile )
+{
+	if ( !saveRgba.empty() )
+	{
+		try
+		{
+			quantizeFrames( pFile );
+		}
+		catch (const std::bad_alloc&)
+		{
+			wcscpy( saveErrorMessage, ERROR_OUT_OF_MEMORY );
+			delete pFile;
+			std::vector<unsigned char>().swap( saveRgba );
+			std::vector<unsigned char>().swap( saveIndices );
+			saveProgress = 100;
+			saveRunning = false;
+			return;
+		}
+	}
+
+#if BLOB_CACHE_SIDECAR
+	wchar_t sidecarPath[ 2048 + 16 ];
+	wcscpy( sidecarPath, saveFileName );
+	wcscat( sidecarPath, L".blobcache" );
+	blobCache.LoadSidecar( sidecarPath );
+#endif
+	blobCache.BeginBatch();
+	pFile->SetBlobCache( &blobCache );
+
+	saveProgress = 60;
+
+	if ( !pFile->SaveToFile( saveFileName ) )
+	{
+		wcscpy( saveErrorMessage, ERROR_FILE_WRITE_FAILED );
+	}
+	else
+	{
+#if META_INDEX
+		// index the file as written, ready for the next folder scan
+		storeMetaData( saveFileName, pFile );
+		metaIndex.Flush( true );
+#endif
+#if BLOB_CACHE_SIDECAR
+		blobCache.SaveSidecar( sidecarPath );
+#endif
+	}
+
+	delete pFile;
+
+	std::vector<unsigned char>().swap( saveIndices );
+
+	saveProgress = 100;
+	saveRunning = false;
+}
+
+// hand the frames collected so far to the worker
+void startSave()
+{
+	I256File* pFile = saveFile;
+	saveFile = nullptr;
+
+	pFile->SetDelays( saveDelays );
+	pFile->SetTileDedupe( TILE_DEDUPE != 0 );
+	pFile->SetBlobHistory( BLOB_HISTORY != 0 );
+	saveDelays.clear();
+
+	wcscpy( saveFileName, currentFileName );
+	saveErrorMessage[0] = 0;
+	saveProgress = 10;
+	saveRunning = true;
+
+	try
+	{
+		pinModule();
+		saveThread = std::thread( runSave, pFile );
+	}
+	catch (...)
+	{
+		// No thread to be had, save inline instead
+		runSave( pFile );
+	}
+}
+
+// drop frames collected for a save that never got all of them
+void discardSave()
+{
+	delete saveFile;
+	saveFile = nullptr;
+	saveDelays.clear();
+	std::vector<unsigned char>().swap( saveRgba );
+}
+
 
 
 extern "C"
@@ -161,7 +450,7 @@ extern "C"
 		// we don't care about language in this sample!
 		
 		*version= PLUGIN_INTERFACE_VERSION_USED;
-		*animation= false; // it's an image processing plugin
+		*animation= true; // frames of an animation go in one file
 
 		currentFileName[0]= 0; // no initial file name
 
@@ -202,7 +491,7 @@ extern "C"
 	bool  __stdcall isWriteTrueColorSupported()
 	{
 		resetError();
-		return false;
+		return true;
 	}
 
 	wchar_t* __stdcall getFileBoxDescription()
@@ -231,6 +520,9 @@ extern "C"
 
 	bool  __stdcall canHandle()
 	{
+		// a save in flight may still be writing this file
+		waitForSave();
+
 		// To speed things up, we should only check if the file is supported by reading only the first bytes
 		// of the file. We make it simpler here.
 		return ensureBasicData();
@@ -238,6 +530,7 @@ extern "C"
 
 	bool  __stdcall loadBasicData()
 	{
+		waitForSave();
 		return ensureBasicData();
 	}
 
@@ -253,8 +546,10 @@ extern "C"
 
 	int  __stdcall getImageCount()
 	{
-		resetError();
-		return 1;
+		if ( !ensureBasicData() )
+			return 0;
+
+		return fileHeader.numberOfFrames;
 	}
 
 	bool __stdcall canExtractPalette()
@@ -295,15 +590,33 @@ extern "C"
 		updateProgress( 0 );
 
 
-		const std::vector<unsigned char*>& PixelMaps = CurrentFile->GetPixelMaps();
-		int Width = CurrentFile->GetWidth();
+		if (!CurrentFile)
+		{
+			// Basic data came from the metadata index, the file itself
+			// hasn't been opened yet
+			CurrentFile = new I256File(currentFileName, true);
+		}
+
 		int Height = CurrentFile->GetHeight();
 
-		if (PixelMaps.size() > 0)
+		// Unpack the frames into the file object, which then goes to the
+		// cache for a next time, and copy this one over to the host
+		if ((CurrentFile->GetWidth() != (int)fileHeader.width) ||
+			(Height != (int)fileHeader.height) ||
+			!CurrentFile->UnpackPixels() ||
+			(currentFrameIndex >= CurrentFile->GetFrameCount()))
 		{
-			memcpy(colorFrame, PixelMaps[0], Width*Height);
+			wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
+			return false;
 		}
 
+		memcpy( colorFrame, CurrentFile->GetPixelMaps()[ currentFrameIndex ], (size_t)fileHeader.width * Height );
+
+		if ( delayMs != NULL )
+			*delayMs = CurrentFile->GetDelay( currentFrameIndex );
+
+		currentFrameIndex++;
+
 		updateProgress( 50 );
 
 		//const I256_Palette& Palette = CurrentFile->GetPalette();
@@ -326,6 +639,8 @@ extern "C"
 
 	bool  __stdcall beginWrite( int width, int height, int transparentColor, bool alphaEnabled, int numberOfFrames )
 	{
+		waitForSave();
+		discardSave();
 		resetBasicData();
 
 		// set up file header. We do not actually write yet!
@@ -335,6 +650,7 @@ extern "C"
 		fileHeader.height= height;
 		fileHeader.transparentColor= transparentColor;
 		fileHeader.alphaEnabled= alphaEnabled;
+		fileHeader.numberOfFrames= numberOfFrames;
 
 		updateProgress( 0 );
 
@@ -343,44 +659,150 @@ extern "C"
 
 	bool __stdcall writeNextImage( unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned char* rgba, unsigned short delayMs )
 	{
+		waitForSave();
 
-		if (CurrentFile)
+		// The announced last frame started the save already, or an error
+		// dropped it; a new save with the frames after would overwrite it
+		if ( saveFile == nullptr && currentFrameIndex > 0 )
 		{
-			delete CurrentFile;
-			CurrentFile = nullptr;
+			bool bTooMany = currentFrameIndex >= fileHeader.numberOfFrames;
+			wcscpy( lastErrorMessage, bTooMany ? ERROR_TOO_MANY_FRAMES : ERROR_FILE_WRITE_FAILED );
+			return false;
 		}
 
-		CurrentFile = new I256File(fileHeader.width, fileHeader.height, 256);
+		size_t numPixels = (size_t)fileHeader.width * fileHeader.height;
 
-		const I256_Palette& Palette = CurrentFile->GetPalette();
+		// The first frame decides whether the save is true color
+		bool bTrueColor = (currentFrameIndex == 0) ? (rgba != NULL) : !saveRgba.empty();
 
-		for (int idx = 0; idx < Palette.iNumColors; ++idx)
+		// A true color frame may also come as indexed pixels, an indexed one
+		// must
+		if ( bTrueColor ? (rgba == NULL && colorFrame == NULL) : (colorFrame == NULL) )
 		{
-			int rgbindex = 3*idx;
-
-			Palette.pColors[idx].r = colorFramePalette[rgbindex+0];
-			Palette.pColors[idx].g = colorFramePalette[rgbindex+1];
-			Palette.pColors[idx].b = colorFramePalette[rgbindex+2];
-			Palette.pColors[idx].a = 255; //alphaFramePalette[idx];
+			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
+			discardSave();
+			return false;
 		}
 
-		std::vector<unsigned char*> pixels;
-		pixels.push_back(colorFrame);
-		CurrentFile->AddImages(pixels);
+		try
+		{
+			if ( saveFile == nullptr )
+			{
+				// First frame
+				if (CurrentFile)
+				{
+					delete CurrentFile;
+					CurrentFile = nullptr;
+				}
+
+				// Whatever was kept of the old file is stale now
+				fileCache.Remove( currentFileName );
+
+#if META_INDEX
+				// The file is about to change under its index entry
+				metaIndex.Forget( currentFileName );
+#endif
 
-		updateProgress( 60 );
+				// The save object belongs to the worker once all frames are in
+				saveFile = new I256File(fileHeader.width, fileHeader.height, 256);
+
+				if ( rgba == NULL )
+				{
+					// The file has one palette, the first frame's
+					const I256_Palette& Palette = saveFile->GetPalette();
+
+					for (int idx = 0; idx < Palette.iNumColors; ++idx)
+					{
+						int rgbindex = 3*idx;
+
+						Palette.pColors[idx].r = colorFramePalette[rgbindex+0];
+						Palette.pColors[idx].g = colorFramePalette[rgbindex+1];
+						Palette.pColors[idx].b = colorFramePalette[rgbindex+2];
+						Palette.pColors[idx].a = 255; //alphaFramePalette[idx];
+					}
+				}
+			}
+
+			if ( bTrueColor )
+			{
+				// True color: snapshot the frame, the worker picks the palette
+				// and maps the pixels to it. An indexed frame after true color
+				// ones goes in through its palette.
+				size_t offset = saveRgba.size();
+				saveRgba.resize( offset + numPixels * 4 );
+
+				if ( rgba != NULL )
+				{
+					memcpy( &saveRgba[ offset ], rgba, numPixels * 4 );
+				}
+				else
+				{
+					for (size_t idx = 0; idx < numPixels; ++idx)
+					{
+						memcpy( &saveRgba[ offset + idx * 4 ], colorFramePalette + colorFrame[ idx ] * 3, 3 );
+						saveRgba[ offset + idx * 4 + 3 ] = 255;
+					}
+				}
+			}
+			else
+			{
+				// Snapshot the frame, Promotion may reuse colorFrame as soon as we
+				// return
+				std::vector<unsigned char*> pixels;
+				pixels.push_back(colorFrame);
+				saveFile->AddImages(pixels);
+			}
+
+			saveDelays.push_back( delayMs );
+		}
+		catch (const std::bad_alloc&)
+		{
+			// Every frame is kept until the last one is in, a long animation
+			// may not fit
+			wcscpy( lastErrorMessage, ERROR_OUT_OF_MEMORY );
+			discardSave();
+			return false;
+		}
 
-		CurrentFile->SaveToFile(currentFileName);
+		currentFrameIndex++;
 
-		updateProgress( 100 );
+		// Saving starts with the last frame
+		if ( currentFrameIndex >= fileHeader.numberOfFrames )
+		{
+			startSave();
+			updateProgress( 10 );
+		}
+		else
+		{
+			updateProgress( 10 * currentFrameIndex / fileHeader.numberOfFrames );
+		}
 
 		return true;
 	}
 
 	void  __stdcall finishProcessing()
 	{
+		// fewer frames came than beginWrite announced, save those
+		if ( saveFile != nullptr )
+			startSave();
+
+		waitForSave();
+
 		resetBasicData();
 
+		// resetBasicData cleared the error, put back any failure from the
+		// background save
+		if ( saveErrorMessage[0] )
+		{
+			wcscpy( lastErrorMessage, saveErrorMessage );
+			saveErrorMessage[0] = 0;
+		}
+
+#if META_INDEX
+		// writes the index only now and then, not once per file of a scan
+		metaIndex.Flush();
+#endif
+
 
 		// set progress back to 0 to hide the progress bar
 		updateProgress( 0 );
@@ -405,7 +827,12 @@ BOOL APIENTRY DllMain( HANDLE hModule,
 		case DLL_PROCESS_ATTACH:
 		case DLL_THREAD_ATTACH:
 		case DLL_THREAD_DETACH:
+			break;
 		case DLL_PROCESS_DETACH:
+			// The DLL is pinned while a save can run, so this is process
+			// exit, with the worker already gone; let go of its handle
+			if ( saveThread.joinable() )
+				saveThread.detach();
 			break;
     }
     return TRUE;
@@ -161,3 +161,23 @@ size_t lzsa_decompress_inmem(unsigned char *pFileData, unsigned char *pOutBuffer
 
    return (int)(pCurOutBuffer - pOutBuffer);
 }
+
+/**
+ * Decompress one raw block that was compressed by lzsa_compress_block_inmem_history(), with the bytes before it as history
+ *
+ * @param pFileData compressed data
+ * @param pOutBuffer buffer for decompressed data, preceded by the nHistorySize bytes the block was compressed after
+ * @param nHistorySize history size in bytes (at most 64 KB)
+ * @param nFileSize compressed size in bytes
+ * @param nMaxOutBufferSize maximum capacity of decompression buffer, after the history
+ * @param nFlags compression flags (LZSA_FLAG_xxx), must include LZSA_FLAG_RAW_BLOCK
+ * @param nFormatVersion version of format to use (1-2)
+ *
+ * @return actual decompressed size, or -1 for error
+ */
+size_t lzsa_decompress_block_inmem_history(unsigned char *pFileData, unsigned char *pOutBuffer, size_t nHistorySize, size_t nFileSize, size_t nMaxOutBufferSize, const unsigned int nFlags, const int nFormatVersion) {
+   if ((nFlags & LZSA_FLAG_RAW_BLOCK) == 0 || (nFlags & LZSA_FLAG_RAW_BACKWARD) != 0 || nHistorySize > BLOCK_SIZE)
+      return -1;
+
+   return (size_t)lzsa_decompressor_expand_block(pFileData, (int)nFileSize, pOutBuffer - nHistorySize, (int)nHistorySize, (int)nMaxOutBufferSize, nFormatVersion, nFlags);
+}
@@ -1379,6 +1379,111 @@ int lzsa_optimize_and_write_block_v2(lzsa_compressor *pCompressor, const unsigne
    nResult = lzsa_write_block_v2(pCompressor, pBestMatch, pInWindow, nPreviousBlockSize, nPreviousBlockSize + nInDataSize, pOutData, nMaxOutDataSize);
    if (nResult < 0 && pCompressor->flags & LZSA_FLAG_RAW_BLOCK) {
       nResult = lzsa_write_raw_uncompressed_block_v2(pCompressor, pInWindow, nPreviousBlockSize, nPreviousBlockSize + nInDataSize, pOutData, nMaxOutDataSize);
+      if (nResult >= 0) {
+         /* Everything went out as literals */
+         memset(pCompressor->best_match, 0, nInDataSize * sizeof(lzsa_match));
+         pBestMatch = pCompressor->best_match - nPreviousBlockSize;
+      }
+   }
+
+   /* Leave the parse that was written in best_match, for incremental recompression */
+   if (pBestMatch != pCompressor->best_match - nPreviousBlockSize) {
+      memcpy(pCompressor->best_match, pBestMatch + nPreviousBlockSize, nInDataSize * sizeof(lzsa_match));
+   }
+
+   return nResult;
+}
+
+/**
+ * Re-select the matches for some windows of a block whose other commands are kept from a previous parse, and then emit the
+ * whole block of compressed LZSA2 data
+ *
+ * The matches for all the windows must have been found already, stored one window after the other. Each window is parsed with
+ * the same passes as the whole block would get; the commands around the windows are taken as they are.
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to input data (the block, there are no previously compressed bytes)
+ * @param nInDataSize number of input bytes in the block
+ * @param pBestMatch full parse of the block; only the windows are replaced
+ * @param pWindowStart offset of the first byte to re-parse, for each window; must be command boundaries in pBestMatch
+ * @param pWindowEnd offset after the last byte to re-parse, for each window; must be command boundaries in pBestMatch
+ * @param nNumWindows number of windows, in increasing order and not overlapping
+ * @param pOutData pointer to output buffer
+ * @param nMaxOutDataSize maximum size of output buffer, in bytes
+ *
+ * @return size of compressed data in output buffer, or -1 if the data is uncompressible
+ */
+int lzsa_optimize_and_write_block_windows_v2(lzsa_compressor *pCompressor, const unsigned char *pInWindow, const int nInDataSize, lzsa_match *pBestMatch, const int *pWindowStart, const int *pWindowEnd, const int nNumWindows, unsigned char *pOutData, const int nMaxOutDataSize) {
+   const int nArrivalsPerPosition = (nInDataSize < 65536) ? NARRIVALS_PER_POSITION_V2_BIG : NARRIVALS_PER_POSITION_V2_SMALL;
+   const int nRleEnd = nNumWindows ? pWindowEnd[nNumWindows - 1] : 0;
+   int *rle_len = (int*)pCompressor->intervals /* reuse */;
+   lzsa_match *pAllMatches = pCompressor->match;
+   int nMatchBase = 0;
+   int nResult, w, i;
+
+   i = 0;
+   while (i < nRleEnd) {
+      int nRangeStartIdx = i;
+      unsigned char c = pInWindow[nRangeStartIdx];
+      do {
+         i++;
+      } while (i < nRleEnd && pInWindow[i] == c);
+      while (nRangeStartIdx < i) {
+         rle_len[nRangeStartIdx] = i - nRangeStartIdx;
+         nRangeStartIdx++;
+      }
+   }
+
+   for (w = 0; w < nNumWindows; w++) {
+      const int nStartOffset = pWindowStart[w];
+      const int nEndOffset = pWindowEnd[w];
+      const int nWindowSize = nEndOffset - nStartOffset;
+      lzsa_match *pWindowMatch = pCompressor->best_match;
+      int nBaseCompressedSize;
+      int nDidReduce, nPasses;
+
+      /* The parser looks up matches relative to the start offset, point it at this window's */
+      pCompressor->match = pAllMatches + (nMatchBase << MATCHES_PER_INDEX_SHIFT_V2);
+      nMatchBase += nWindowSize;
+
+      memset(pCompressor->best_match + nStartOffset, 0, nWindowSize * sizeof(lzsa_match));
+      lzsa_optimize_forward_v2(pCompressor, pInWindow, pCompressor->best_match, nStartOffset, nEndOffset, 0 /* reduce */, (nInDataSize < 65536) ? 1 : 0 /* insert forward reps */, nArrivalsPerPosition);
+
+      nPasses = 0;
+      do {
+         nDidReduce = lzsa_optimize_command_count_v2(pCompressor, pInWindow, pCompressor->best_match, nStartOffset, nEndOffset);
+         nPasses++;
+      } while (nDidReduce && nPasses < 20);
+
+      nBaseCompressedSize = lzsa_get_compressed_size_v2(pCompressor, pCompressor->best_match, nStartOffset, nEndOffset);
+
+      if (nBaseCompressedSize > 0 && nInDataSize < 65536) {
+         int nReducedCompressedSize;
+
+         memset(pCompressor->improved_match + nStartOffset, 0, nWindowSize * sizeof(lzsa_match));
+         lzsa_optimize_forward_v2(pCompressor, pInWindow, pCompressor->improved_match, nStartOffset, nEndOffset, 1 /* reduce */, 0 /* use forward reps */, nArrivalsPerPosition);
+
+         nPasses = 0;
+         do {
+            nDidReduce = lzsa_optimize_command_count_v2(pCompressor, pInWindow, pCompressor->improved_match, nStartOffset, nEndOffset);
+            nPasses++;
+         } while (nDidReduce && nPasses < 20);
+
+         nReducedCompressedSize = lzsa_get_compressed_size_v2(pCompressor, pCompressor->improved_match, nStartOffset, nEndOffset);
+         if (nReducedCompressedSize > 0 && nReducedCompressedSize <= nBaseCompressedSize)
+            pWindowMatch = pCompressor->improved_match;
+      }
+
+      memcpy(pBestMatch + nStartOffset, pWindowMatch + nStartOffset, nWindowSize * sizeof(lzsa_match));
+   }
+
+   pCompressor->match = pAllMatches;
+
+   nResult = lzsa_write_block_v2(pCompressor, pBestMatch, pInWindow, 0, nInDataSize, pOutData, nMaxOutDataSize);
+   if (nResult < 0 && pCompressor->flags & LZSA_FLAG_RAW_BLOCK) {
+      nResult = lzsa_write_raw_uncompressed_block_v2(pCompressor, pInWindow, 0, nInDataSize, pOutData, nMaxOutDataSize);
+      if (nResult >= 0)
+         memset(pBestMatch, 0, nInDataSize * sizeof(lzsa_match));
    }
 
    return nResult;
@@ -35,6 +35,7 @@
 
 /* Forward declarations */
 typedef struct _lzsa_compressor lzsa_compressor;
+typedef struct _lzsa_match lzsa_match;
 
 /**
  * Select the most optimal matches, reduce the token count if possible, and then emit a block of compressed LZSA2 data
@@ -50,4 +51,22 @@ typedef struct _lzsa_compressor lzsa_compressor;
  */
 int lzsa_optimize_and_write_block_v2(lzsa_compressor *pCompressor, const unsigned char *pInWindow, const int nPreviousBlockSize, const int nInDataSize, unsigned char *pOutData, const int nMaxOutDataSize);
 
+/**
+ * Re-select the matches for some windows of a block whose other commands are kept from a previous parse, and then emit the
+ * whole block of compressed LZSA2 data
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to input data (the block, there are no previously compressed bytes)
+ * @param nInDataSize number of input bytes in the block
+ * @param pBestMatch full parse of the block; only the windows are replaced
+ * @param pWindowStart offset of the first byte to re-parse, for each window; must be command boundaries in pBestMatch
+ * @param pWindowEnd offset after the last byte to re-parse, for each window; must be command boundaries in pBestMatch
+ * @param nNumWindows number of windows, in increasing order and not overlapping
+ * @param pOutData pointer to output buffer
+ * @param nMaxOutDataSize maximum size of output buffer, in bytes
+ *
+ * @return size of compressed data in output buffer, or -1 if the data is uncompressible
+ */
+int lzsa_optimize_and_write_block_windows_v2(lzsa_compressor *pCompressor, const unsigned char *pInWindow, const int nInDataSize, lzsa_match *pBestMatch, const int *pWindowStart, const int *pWindowEnd, const int nNumWindows, unsigned char *pOutData, const int nMaxOutDataSize);
+
 #endif /* _SHRINK_BLOCK_V2_H */
@@ -253,6 +253,143 @@ int lzsa_compressor_shrink_block(lzsa_compressor *pCompressor, unsigned char *pI
    return nCompressedSize;
 }
 
+/**
+ * Check that a match of a previous parse still copies the right bytes
+ *
+ * @param pInWindow pointer to the new input data
+ * @param nInDataSize number of input bytes
+ * @param pMatch match to check
+ * @param nOffset position of the match
+ *
+ * @return non-zero if the match is still good
+ */
+static int lzsa_is_match_still_valid(const unsigned char *pInWindow, const int nInDataSize, const lzsa_match *pMatch, const int nOffset) {
+   const int nMatchLen = pMatch->length;
+   const int nMatchOffset = pMatch->offset;
+
+   if (nMatchOffset < MIN_OFFSET || nMatchOffset > nOffset || (nOffset + nMatchLen) > nInDataSize)
+      return 0;
+   return memcmp(pInWindow + nOffset - nMatchOffset, pInWindow + nOffset, nMatchLen) == 0;
+}
+
+/**
+ * Recompress one LZSA2 block after an edit, keeping the commands of the previous parse that the edit didn't touch
+ *
+ * A window is re-parsed around each changed range, starting and ending on commands of the previous parse so that the new
+ * commands join up with the old ones. Old commands after a window are kept as long as they still copy the right bytes; one
+ * that now reads changed bytes gets a small window of its own.
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to the new input data (a single block, with no previously compressed bytes)
+ * @param nInDataSize number of input bytes to compress
+ * @param pBestMatch on entry, the parse of the previous contents of the block; on success, the parse that was written
+ * @param pDirtyStart offset of the first byte that changed, for each changed range
+ * @param pDirtyEnd offset after the last byte that changed, for each changed range
+ * @param nNumDirty number of changed ranges, in increasing order
+ * @param pOutData pointer to output buffer
+ * @param nMaxOutDataSize maximum size of output buffer, in bytes
+ *
+ * @return size of compressed data in output buffer, -1 if the data is uncompressible, or -2 if the edit reaches too much of the
+ *         block to be worth it (compress the block from scratch instead)
+ */
+int lzsa_compressor_shrink_block_incremental(lzsa_compressor *pCompressor, unsigned char *pInWindow, const int nInDataSize, lzsa_match *pBestMatch, const int *pDirtyStart, const int *pDirtyEnd, const int nNumDirty, unsigned char *pOutData, const int nMaxOutDataSize) {
+   int nWindowStart[INCREMENTAL_MAX_WINDOWS];
+   int nWindowEnd[INCREMENTAL_MAX_WINDOWS];
+   int nNumWindows = 0;
+   int nInWindow = 0;
+   int nTargetEnd = 0;
+   int nWindowBytes = 0;
+   int nDirtyIdx = 0;
+   lzsa_match *pMatch;
+   int i, w;
+
+   if (pCompressor->format_version != 2 || (pCompressor->flags & LZSA_FLAG_RAW_BACKWARD) || nInDataSize > BLOCK_SIZE)
+      return -2;
+
+   for (i = 0; i < nInDataSize; ) {
+      const int nIsMatch = (pBestMatch[i].length >= MIN_MATCH_SIZE_V2) ? 1 : 0;
+      const int nCommandLen = nIsMatch ? pBestMatch[i].length : 1;
+
+      if (nInWindow && i >= nTargetEnd) {
+         nWindowEnd[nNumWindows - 1] = i;
+         nInWindow = 0;
+      }
+
+      if (!nInWindow) {
+         /* Open a window on the command that reaches into the margin before the next change, or on an old match that
+          * doesn't copy the right bytes anymore */
+         if ((nDirtyIdx < nNumDirty && (i + nCommandLen) > (pDirtyStart[nDirtyIdx] - INCREMENTAL_MARGIN)) ||
+             (nIsMatch && !lzsa_is_match_still_valid(pInWindow, nInDataSize, pBestMatch + i, i))) {
+            if (nNumWindows && nWindowEnd[nNumWindows - 1] == i) {
+               nNumWindows--;
+            }
+            else {
+               if (nNumWindows >= INCREMENTAL_MAX_WINDOWS)
+                  return -2;
+               nWindowStart[nNumWindows] = i;
+            }
+            nNumWindows++;
+            nInWindow = 1;
+            nTargetEnd = i + nCommandLen + INCREMENTAL_MARGIN;
+         }
+      }
+
+      if (nInWindow) {
+         while (nDirtyIdx < nNumDirty && (pDirtyStart[nDirtyIdx] - INCREMENTAL_MARGIN) < (i + nCommandLen)) {
+            if (nTargetEnd < pDirtyEnd[nDirtyIdx] + INCREMENTAL_MARGIN)
+               nTargetEnd = pDirtyEnd[nDirtyIdx] + INCREMENTAL_MARGIN;
+            nDirtyIdx++;
+         }
+      }
+
+      i += nCommandLen;
+   }
+
+   if (nInWindow)
+      nWindowEnd[nNumWindows - 1] = nInDataSize;
+
+   for (w = 0; w < nNumWindows; w++)
+      nWindowBytes += nWindowEnd[w] - nWindowStart[w];
+   if (nWindowBytes > (nInDataSize >> 1))
+      return -2;
+   if (nNumWindows == 0)
+      return lzsa_optimize_and_write_block_windows_v2(pCompressor, pInWindow, nInDataSize, pBestMatch, nWindowStart, nWindowEnd, 0, pOutData, nMaxOutDataSize);
+
+   /* Only the data up to the end of the last window can be referenced by the new matches */
+   if (lzsa_build_suffix_array(pCompressor, pInWindow, nWindowEnd[nNumWindows - 1]))
+      return -1;
+
+   /* Store the matches for the windows one after the other; size them like matches for the whole block */
+   pMatch = pCompressor->match;
+   i = 0;
+   for (w = 0; w < nNumWindows; w++) {
+      lzsa_skip_matches(pCompressor, i, nWindowStart[w]);
+
+      for (i = nWindowStart[w]; i < nWindowEnd[w]; i++) {
+         int nMatches = lzsa_find_matches_at(pCompressor, i, pMatch, NMATCHES_PER_INDEX_V2, nInDataSize);
+
+         while (nMatches < NMATCHES_PER_INDEX_V2) {
+            pMatch[nMatches].length = 0;
+            pMatch[nMatches].offset = 0;
+            nMatches++;
+         }
+
+         pMatch += NMATCHES_PER_INDEX_V2;
+      }
+   }
+
+   return lzsa_optimize_and_write_block_windows_v2(pCompressor, pInWindow, nInDataSize, pBestMatch, nWindowStart, nWindowEnd, nNumWindows, pOutData, nMaxOutDataSize);
+}
+
+/**
+ * Get the parse that the last compressed block was written with
+ *
+ * @return pointer to one match per input byte of the block (length 0 for a literal)
+ */
+const lzsa_match *lzsa_compressor_get_last_parse(lzsa_compressor *pCompressor) {
+   return pCompressor->best_match;
+}
+
 /**
  * Get the number of compression commands issued in compressed data blocks
  *
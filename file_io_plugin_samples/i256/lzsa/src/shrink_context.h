@@ -65,6 +65,9 @@ extern "C" {
 
 #define MODESWITCH_PENALTY 3
 
+#define INCREMENTAL_MARGIN 256
+#define INCREMENTAL_MAX_WINDOWS 64
+
 /** One match */
 typedef struct _lzsa_match {
    unsigned short length;
@@ -169,6 +172,31 @@ void lzsa_compressor_destroy(lzsa_compressor *pCompressor);
  */
 int lzsa_compressor_shrink_block(lzsa_compressor *pCompressor, unsigned char *pInWindow, const int nPreviousBlockSize, const int nInDataSize, unsigned char *pOutData, const int nMaxOutDataSize);
 
+/**
+ * Recompress one LZSA2 block after an edit, keeping the commands of the previous parse that the edit didn't touch
+ *
+ * @param pCompressor compression context
+ * @param pInWindow pointer to the new input data (a single block, with no previously compressed bytes)
+ * @param nInDataSize number of input bytes to compress
+ * @param pBestMatch on entry, the parse of the previous contents of the block; on success, the parse that was written
+ * @param pDirtyStart offset of the first byte that changed, for each changed range
+ * @param pDirtyEnd offset after the last byte that changed, for each changed range
+ * @param nNumDirty number of changed ranges, in increasing order
+ * @param pOutData pointer to output buffer
+ * @param nMaxOutDataSize maximum size of output buffer, in bytes
+ *
+ * @return size of compressed data in output buffer, -1 if the data is uncompressible, or -2 if the edit reaches too much of the
+ *         block to be worth it (compress the block from scratch instead)
+ */
+int lzsa_compressor_shrink_block_incremental(lzsa_compressor *pCompressor, unsigned char *pInWindow, const int nInDataSize, lzsa_match *pBestMatch, const int *pDirtyStart, const int *pDirtyEnd, const int nNumDirty, unsigned char *pOutData, const int nMaxOutDataSize);
+
+/**
+ * Get the parse that the last LZSA2 block was written with
+ *
+ * @return pointer to one match per input byte of the block (length 0 for a literal)
+ */
+const lzsa_match *lzsa_compressor_get_last_parse(lzsa_compressor *pCompressor);
+
 /**
  * Get the number of compression commands issued in compressed data blocks
  *
@@ -64,6 +64,54 @@ size_t lzsa_get_max_compressed_size_inmem(size_t nInputSize);
 size_t lzsa_compress_inmem(unsigned char *pInputData, unsigned char *pOutBuffer, size_t nInputSize, size_t nMaxOutBufferSize,
    const unsigned int nFlags, const int nMinMatchSize, const int nFormatVersion);
 
+/**
+ * Get the size of the parse buffer used by lzsa_compress_block_inmem_incremental()
+ *
+ * @param nInputSize input(source) size in bytes
+ *
+ * @return parse buffer size in bytes
+ */
+size_t lzsa_get_parse_size_inmem(size_t nInputSize);
+
+/**
+ * Compress one raw LZSA2 block (LZSA_FLAG_RAW_BLOCK, at most 64 KB), reusing the parse of a previous version of the same
+ * block outside of the bytes that changed. The output decompresses like the output of lzsa_compress_inmem(), but can be a
+ * little larger, as only the area around the edit is parsed again.
+ *
+ * @param pPrevInputData previous contents of the block, or NULL to compress from scratch
+ * @param nPrevInputSize previous contents size in bytes
+ * @param pInputData pointer to input(source) data to compress
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (LZSA_FLAG_xxx), must include LZSA_FLAG_RAW_BLOCK
+ * @param nMinMatchSize minimum match size
+ * @param pParse buffer of lzsa_get_parse_size_inmem(nInputSize) bytes: on entry, the parse of pPrevInputData (unused when
+ *        there are no previous contents); on success, the parse of pInputData
+ * @param pReused optional, set to 1 when the previous parse was reused, 0 when the block was compressed from scratch
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t lzsa_compress_block_inmem_incremental(const unsigned char *pPrevInputData, size_t nPrevInputSize, unsigned char *pInputData, unsigned char *pOutBuffer,
+   size_t nInputSize, size_t nMaxOutBufferSize, const unsigned int nFlags, const int nMinMatchSize, void *pParse, int *pReused);
+
+/**
+ * Compress one raw LZSA2 block (LZSA_FLAG_RAW_BLOCK, at most 64 KB) that may match into the bytes before it. The output
+ * decompresses with lzsa_decompress_block_inmem_history(), given the same history.
+ *
+ * @param pInputData pointer to input(source) data to compress, preceded by nHistorySize bytes of history
+ * @param nHistorySize history size in bytes (at most 64 KB)
+ * @param pOutBuffer buffer for compressed data
+ * @param nInputSize input(source) size in bytes
+ * @param nMaxOutBufferSize maximum capacity of compression buffer
+ * @param nFlags compression flags (LZSA_FLAG_xxx), must include LZSA_FLAG_RAW_BLOCK
+ * @param nMinMatchSize minimum match size
+ *
+ * @return actual compressed size, or -1 for error
+ */
+size_t lzsa_compress_block_inmem_history(unsigned char *pInputData, size_t nHistorySize, unsigned char *pOutBuffer,
+   size_t nInputSize, size_t nMaxOutBufferSize, const unsigned int nFlags, const int nMinMatchSize);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,462 @@
+//
+// MetaIndex, see metaIndex.h
+//
+#include "metaIndex.h"
+#include "fileStamp.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+// Index layout, all little endian:
+//   'P','M','I','X'  u32 version  u32 numRecords
+//   numRecords x { u16 pathLength  u16 path[pathLength]
+//                  u64 fileSize  u64 writeTime  u8 flags
+//                  i32 width  i32 height  i32 frameCount  i32 transparentColor
+//                  u16 numColors  u8 rgb[numColors*3] }
+//
+static const unsigned int kIndexVersion = 1;
+
+static const unsigned char kFlagHandled = 1<<0;
+static const unsigned char kFlagAlpha   = 1<<1;
+
+// Keeps a runaway scan from growing the index without bound; past this, new
+// files just aren't indexed
+static const size_t kMaxRecords = 200000;
+
+// Store() writes the index out once this many changes (or a quarter of the
+// index, whichever is more) have piled up, so a scan rewrites it a bounded
+// number of times
+static const int kMinFlushChanges = 64;
+
+// Unforced Flush() calls closer together than this are skipped
+static const unsigned long long kFlushIntervalMs = 2000;
+
+namespace
+{
+	//--------------------------------------------------------------------------
+	// Index helpers
+
+	void PutU16(std::vector<unsigned char>& bytes, unsigned int value)
+	{
+		bytes.push_back( (value>>0) & 0xFF );
+		bytes.push_back( (value>>8) & 0xFF );
+	}
+
+	void PutU32(std::vector<unsigned char>& bytes, unsigned int value)
+	{
+		bytes.push_back( (value>>0)  & 0xFF );
+		bytes.push_back( (value>>8)  & 0xFF );
+		bytes.push_back( (value>>16) & 0xFF );
+		bytes.push_back( (value>>24) & 0xFF );
+	}
+
+	void PutU64(std::vector<unsigned char>& bytes, unsigned long long value)
+	{
+		PutU32(bytes, (unsigned int)value);
+		PutU32(bytes, (unsigned int)(value >> 32));
+	}
+
+	// Bounds checked cursor over the bytes of an index file
+	struct Reader
+	{
+		const unsigned char* pData;
+		size_t size;
+		size_t pos;
+
+		bool Has(size_t count) const { return (size - pos) >= count; }
+
+		bool U8(unsigned char& value)
+		{
+			if (!Has(1))
+				return false;
+			value = pData[ pos++ ];
+			return true;
+		}
+
+		bool U16(unsigned int& value)
+		{
+			if (!Has(2))
+				return false;
+			value = pData[ pos ] | (pData[ pos + 1 ] << 8);
+			pos += 2;
+			return true;
+		}
+
+		bool U32(unsigned int& value)
+		{
+			if (!Has(4))
+				return false;
+			value = pData[ pos ] | (pData[ pos + 1 ] << 8) | (pData[ pos + 2 ] << 16) |
+					((unsigned int)pData[ pos + 3 ] << 24);
+			pos += 4;
+			return true;
+		}
+
+		bool U64(unsigned long long& value)
+		{
+			unsigned int lo, hi;
+			if (!U32(lo) || !U32(hi))
+				return false;
+			value = ((unsigned long long)hi << 32) | lo;
+			return true;
+		}
+
+		bool I32(int& value)
+		{
+			unsigned int u;
+			if (!U32(u))
+				return false;
+			value = (int)u;
+			return true;
+		}
+	};
+}
+
+//------------------------------------------------------------------------------
+MetaIndexEntry::MetaIndexEntry()
+	: handled( false )
+	, alphaEnabled( false )
+	, width( 0 )
+	, height( 0 )
+	, frameCount( 0 )
+	, transparentColor( -1 )
+	, numColors( 0 )
+{
+	memset(rgb, 0, sizeof(rgb));
+}
+
+//------------------------------------------------------------------------------
+MetaIndex::MetaIndex(const wchar_t* pName)
+	: m_name( pName )
+	, m_indexTime( 0 )
+	, m_pending( 0 )
+	, m_lastFlushTick( 0 )
+	, m_bLoaded( false )
+{
+	// Nothing is touched on disk until the first lookup; this runs while the
+	// DLL is being loaded
+}
+
+//------------------------------------------------------------------------------
+void MetaIndex::EnsureLoaded()
+{
+	if (m_bLoaded)
+		return;
+
+	m_bLoaded = true;
+
+	wchar_t localAppData[ 1024 ];
+	DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", localAppData, 1024);
+	if ((0 == length) || (length >= 1024))
+		return;		// no index on disk, the records still help this session
+
+	std::wstring dir( localAppData );
+	dir += L"\\cosmigo";
+	CreateDirectoryW(dir.c_str(), NULL);
+	dir += L"\\fileio_index";
+	CreateDirectoryW(dir.c_str(), NULL);
+
+	m_indexPath = dir + L"\\" + m_name + L".idx";
+
+	ReadIndex( m_records );
+}
+
+//------------------------------------------------------------------------------
+// Replace records with what's in the index file; false if there's no usable
+// index
+//
+bool MetaIndex::ReadIndex(RecordMap& records)
+{
+	records.clear();
+
+	FileStamp indexStamp;
+	if (m_indexPath.empty() || !indexStamp.Read(m_indexPath.c_str()))
+		return false;
+
+	m_indexTime = indexStamp.writeTime;
+
+	FILE* pFile = nullptr;
+	errno_t err = _wfopen_s(&pFile, m_indexPath.c_str(), L"rb");
+	if ((0 != err) || (nullptr == pFile))
+		return false;
+
+	std::vector<unsigned char> bytes( (size_t)indexStamp.fileSize );
+	size_t bytesRead = bytes.empty() ? 0 : fread(&bytes[0], 1, bytes.size(), pFile);
+	fclose(pFile);
+
+	if (bytesRead != bytes.size())
+		return false;
+
+	Reader reader = { bytes.empty() ? nullptr : &bytes[0], bytes.size(), 0 };
+
+	unsigned int version = 0;
+	unsigned int numRecords = 0;
+
+	if (!reader.Has(4) || (0 != memcmp(reader.pData, "PMIX", 4)))
+		return false;
+	reader.pos += 4;
+
+	if (!reader.U32(version) || (kIndexVersion != version) || !reader.U32(numRecords))
+		return false;
+
+	bool ok = true;
+	std::wstring key;
+
+	for (unsigned int idx = 0; ok && (idx < numRecords); ++idx)
+	{
+		Record record;
+		unsigned int pathLength = 0;
+		unsigned int numColors = 0;
+		unsigned char flags = 0;
+
+		ok = reader.U16(pathLength) && (pathLength > 0) && reader.Has(pathLength * 2);
+
+		if (ok)
+		{
+			key.resize( pathLength );
+			for (unsigned int ch = 0; ch < pathLength; ++ch)
+			{
+				unsigned int unit = 0;
+				reader.U16(unit);
+				key[ ch ] = (wchar_t)unit;
+			}
+
+			ok = reader.U64(record.fileSize) && reader.U64(record.writeTime) &&
+				 reader.U8(flags) &&
+				 reader.I32(record.entry.width) && reader.I32(record.entry.height) &&
+				 reader.I32(record.entry.frameCount) &&
+				 reader.I32(record.entry.transparentColor) &&
+				 reader.U16(numColors) && (numColors <= 256) &&
+				 reader.Has(numColors * 3);
+		}
+
+		if (ok)
+		{
+			record.entry.handled = (flags & kFlagHandled) != 0;
+			record.entry.alphaEnabled = (flags & kFlagAlpha) != 0;
+			record.entry.numColors = (int)numColors;
+			memcpy(record.entry.rgb, reader.pData + reader.pos, numColors * 3);
+			reader.pos += numColors * 3;
+
+			records[ key ] = record;
+		}
+	}
+
+	if (!ok)
+	{
+		// Damaged, start over
+		records.clear();
+	}
+
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+bool MetaIndex::Lookup(const wchar_t* pPath, MetaIndexEntry& entry)
+{
+	std::wstring key;
+	FileStamp stamp;
+
+	if (!FileStamp::MakeKey(pPath, key) || !stamp.Read(key.c_str()))
+		return false;
+
+	std::lock_guard<std::mutex> lock( m_mutex );
+	EnsureLoaded();
+
+	RecordMap::iterator it = m_records.find( key );
+
+	if (it == m_records.end())
+	{
+		// Another plugin instance may have indexed it since we last looked
+		FileStamp indexStamp;
+		if (!m_indexPath.empty() && indexStamp.Read(m_indexPath.c_str()) &&
+			(indexStamp.writeTime != m_indexTime))
+		{
+			RecordMap disk;
+			ReadIndex( disk );
+			for (RecordMap::iterator diskIt = disk.begin(); diskIt != disk.end(); ++diskIt)
+			{
+				m_records.insert( *diskIt );
+			}
+
+			it = m_records.find( key );
+		}
+	}
+
+	if ((it == m_records.end()) || (it->second.fileSize != stamp.fileSize) ||
+		(it->second.writeTime != stamp.writeTime))
+	{
+		return false;
+	}
+
+	entry = it->second.entry;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+void MetaIndex::Store(const wchar_t* pPath, const MetaIndexEntry& entry)
+{
+	std::wstring key;
+	FileStamp stamp;
+
+	if (!FileStamp::MakeKey(pPath, key) || !stamp.Read(key.c_str()))
+		return;
+
+	Record record;
+	record.fileSize = stamp.fileSize;
+	record.writeTime = stamp.writeTime;
+
+	record.entry = entry;
+	if ((record.entry.numColors < 0) || (record.entry.numColors > 256))
+		record.entry.numColors = 0;
+
+	std::lock_guard<std::mutex> lock( m_mutex );
+	EnsureLoaded();
+
+	if ((m_records.size() >= kMaxRecords) && (m_records.find( key ) == m_records.end()))
+		return;
+
+	m_records[ key ] = record;
+
+	for (size_t idx = 0; idx < m_forgotten.size(); ++idx)
+	{
+		if (m_forgotten[ idx ] == key)
+		{
+			m_forgotten.erase( m_forgotten.begin() + idx );
+			break;
+		}
+	}
+
+	++m_pending;
+
+	int flushAt = (int)(m_records.size() / 4);
+	if (flushAt < kMinFlushChanges)
+		flushAt = kMinFlushChanges;
+
+	if (m_pending >= flushAt)
+	{
+		FlushLocked();
+	}
+}
+
+//------------------------------------------------------------------------------
+void MetaIndex::Forget(const wchar_t* pPath)
+{
+	std::wstring key;
+	if (!FileStamp::MakeKey(pPath, key))
+		return;
+
+	std::lock_guard<std::mutex> lock( m_mutex );
+	EnsureLoaded();
+
+	if (m_records.erase( key ))
+	{
+		m_forgotten.push_back( key );
+		++m_pending;
+	}
+}
+
+//------------------------------------------------------------------------------
+bool MetaIndex::Flush(bool bForce)
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	if (!bForce && ((GetTickCount64() - m_lastFlushTick) < kFlushIntervalMs))
+		return true;
+
+	return FlushLocked();
+}
+
+//------------------------------------------------------------------------------
+bool MetaIndex::FlushLocked()
+{
+	if (0 == m_pending)
+		return true;
+
+	if (m_indexPath.empty())
+	{
+		m_pending = 0;
+		return false;
+	}
+
+	// Keep whatever other instances wrote since we read the index; our own
+	// records win, and files we forgot stay forgotten
+	FileStamp indexStamp;
+	if (indexStamp.Read(m_indexPath.c_str()) && (indexStamp.writeTime != m_indexTime))
+	{
+		RecordMap disk;
+		ReadIndex( disk );
+		for (size_t idx = 0; idx < m_forgotten.size(); ++idx)
+		{
+			disk.erase( m_forgotten[ idx ] );
+		}
+
+		for (RecordMap::iterator it = disk.begin(); it != disk.end(); ++it)
+		{
+			if (m_records.size() >= kMaxRecords)
+				break;
+			m_records.insert( *it );
+		}
+	}
+
+	std::vector<unsigned char> bytes;
+	bytes.reserve( 16 + (m_records.size() * 128) );
+
+	bytes.insert(bytes.end(), "PMIX", "PMIX" + 4);
+	PutU32(bytes, kIndexVersion);
+	PutU32(bytes, (unsigned int)m_records.size());
+
+	for (RecordMap::const_iterator it = m_records.begin(); it != m_records.end(); ++it)
+	{
+		const std::wstring& key = it->first;
+		const Record& record = it->second;
+		const MetaIndexEntry& entry = record.entry;
+
+		PutU16(bytes, (unsigned int)key.size());
+		for (size_t ch = 0; ch < key.size(); ++ch)
+		{
+			PutU16(bytes, (unsigned int)key[ ch ]);
+		}
+
+		PutU64(bytes, record.fileSize);
+		PutU64(bytes, record.writeTime);
+		bytes.push_back( (entry.handled ? kFlagHandled : 0) | (entry.alphaEnabled ? kFlagAlpha : 0) );
+		PutU32(bytes, (unsigned int)entry.width);
+		PutU32(bytes, (unsigned int)entry.height);
+		PutU32(bytes, (unsigned int)entry.frameCount);
+		PutU32(bytes, (unsigned int)entry.transparentColor);
+		PutU16(bytes, (unsigned int)entry.numColors);
+		bytes.insert(bytes.end(), entry.rgb, entry.rgb + (entry.numColors * 3));
+	}
+
+	// Write next to the index and swap it in, so nobody reads half an index
+	wchar_t suffix[ 32 ];
+	swprintf(suffix, 32, L".%lu.tmp", (unsigned long)GetCurrentProcessId());
+	std::wstring tempPath = m_indexPath + suffix;
+
+	FILE* pFile = nullptr;
+	errno_t err = _wfopen_s(&pFile, tempPath.c_str(), L"wb");
+	if ((0 != err) || (nullptr == pFile))
+		return false;
+
+	size_t written = fwrite(&bytes[0], 1, bytes.size(), pFile);
+	int closed = fclose(pFile);
+
+	if ((written != bytes.size()) || (0 != closed) ||
+		!MoveFileExW(tempPath.c_str(), m_indexPath.c_str(),
+					 MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		DeleteFileW(tempPath.c_str());
+		return false;
+	}
+
+	FileStamp newStamp;
+	newStamp.Read(m_indexPath.c_str());
+	m_indexTime = newStamp.writeTime;
+
+	m_forgotten.clear();
+	m_pending = 0;
+	m_lastFlushTick = GetTickCount64();
+	return true;
+}
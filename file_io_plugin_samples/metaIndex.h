@@ -0,0 +1,87 @@
+//
+// MetaIndex: what loadBasicData found out about each file the plugin has seen
+// (size, palette, frame count, or that it isn't ours), kept on disk so that
+// scanning a folder of thousands of assets costs one stat per file instead of
+// opening and parsing every one of them.
+//
+// Entries are keyed by the full path, and only used while the file's size and
+// last write time still match what was recorded. The index lives in
+// %LOCALAPPDATA%\cosmigo\fileio_index\<name>.idx, one file per plugin; it is
+// rewritten to a temp file and swapped in with MoveFileEx, so a reader (or a
+// second Promotion) never sees a half written index.
+//
+// Shared by the i256, i16, c1 and san plugins.
+//
+#ifndef META_INDEX_H
+#define META_INDEX_H
+
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct MetaIndexEntry
+{
+	bool handled;			// false = the plugin rejected the file
+	bool alphaEnabled;
+	int width;
+	int height;
+	int frameCount;
+	int transparentColor;
+	int numColors;			// entries of rgb that are valid
+	unsigned char rgb[ 768 ];
+
+	MetaIndexEntry();
+};
+
+class MetaIndex
+{
+public:
+	// pName names the index file, e.g. L"i256"
+	MetaIndex(const wchar_t* pName);
+
+	// True if pPath is in the index and unchanged since it was stored
+	bool Lookup(const wchar_t* pPath, MetaIndexEntry& entry);
+
+	// Record entry for pPath as the file is right now. Call it after the file
+	// is completely written. Does nothing if the file can't be found.
+	void Store(const wchar_t* pPath, const MetaIndexEntry& entry);
+
+	// Drop pPath, e.g. before it gets overwritten
+	void Forget(const wchar_t* pPath);
+
+	// Write the index out if anything changed. Unless bForce, that only
+	// happens if the last write was a while ago, so calling it after every
+	// file of a folder scan is cheap. Store() also flushes by itself once
+	// enough changes pile up.
+	bool Flush(bool bForce = false);
+
+private:
+	struct Record
+	{
+		unsigned long long fileSize;
+		unsigned long long writeTime;
+		MetaIndexEntry entry;
+	};
+
+	typedef std::unordered_map<std::wstring, Record> RecordMap;
+
+	void EnsureLoaded();
+	bool ReadIndex(RecordMap& records);
+	bool FlushLocked();
+
+	std::wstring m_name;
+	std::wstring m_indexPath;	// empty when there's nowhere to keep it
+
+	RecordMap m_records;
+	std::vector<std::wstring> m_forgotten;	// not to be merged back in
+	unsigned long long m_indexTime;			// write time of the index we read
+	int  m_pending;							// changes since the last flush
+	unsigned long long m_lastFlushTick;		// GetTickCount64 of the last write
+	bool m_bLoaded;
+
+	std::mutex m_mutex;
+};
+
+#endif // META_INDEX_H
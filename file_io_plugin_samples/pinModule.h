@@ -0,0 +1,25 @@
+//
+// pinModule: keeps the plugin DLL loaded until the process exits. A plugin
+// that starts a thread running its own code on its globals calls it first, so
+// FreeLibrary can't pull the DLL out from under a thread the host never
+// waited for.
+//
+// Shared by the background saves of the image plugins and the threads of the
+// SAN plugin.
+//
+#ifndef PIN_MODULE_H
+#define PIN_MODULE_H
+
+#include <windows.h>
+
+inline void pinModule()
+{
+	static bool pinned = false;
+
+	HMODULE hModule;
+	if (!pinned)
+		pinned = GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+									(LPCWSTR)&pinModule, &hModule) != 0;
+}
+
+#endif // PIN_MODULE_H
@@ -0,0 +1,219 @@
+//
+// PixlBlobReader, see pixlBlobs.h
+//
+#include "pixlBlobs.h"
+
+#include <string.h>
+
+//lzsa memory decompressor
+#include "expand_inmem.h"
+
+// LZSA flag for raw blocks (from lib.h, which is C only)
+#define PIXL_BLOBS_LZSA_FLAG_RAW_BLOCK (1<<1)
+
+static const size_t kBlobSize = 0x10000;
+
+//------------------------------------------------------------------------------
+PixlBlobReader::PixlBlobReader()
+	: m_decompressedSize( 0 )
+	, m_bHistory( false )
+	, m_scratchBlob( -1 )
+{
+}
+
+//------------------------------------------------------------------------------
+void PixlBlobReader::Clear()
+{
+	m_blobs.clear();
+	m_decompressedSize = 0;
+	m_bHistory = false;
+	m_scratchBlob = -1;
+}
+
+//------------------------------------------------------------------------------
+bool PixlBlobReader::Index(const unsigned char* pData, size_t dataSize, int numBlobs,
+						   size_t decompressedSize, bool bHistory)
+{
+	Clear();
+
+	// Only the blobs that hold the first decompressedSize bytes matter
+	int neededBlobs = (int)((decompressedSize + kBlobSize - 1) / kBlobSize);
+	if ((0 == decompressedSize) || (numBlobs < neededBlobs))
+		return false;
+
+	m_blobs.reserve( neededBlobs );
+
+	size_t offset = 0;
+	for (int idx = 0; idx < neededBlobs; ++idx)
+	{
+		if ((offset + 2) > dataSize)
+		{
+			Clear();
+			return false;
+		}
+
+		Blob blob;
+		blob.compressedSize = pData[ offset ] | (pData[ offset + 1 ] << 8);
+		blob.pData = pData + offset + 2;
+		offset += 2 + (blob.compressedSize ? blob.compressedSize : kBlobSize);
+
+		if (offset > dataSize)
+		{
+			Clear();
+			return false;
+		}
+
+		m_blobs.push_back( blob );
+	}
+
+	m_decompressedSize = decompressedSize;
+	m_bHistory = bHistory;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Unpack one whole blob; pDest needs room for the blob's share of the stream
+//
+bool PixlBlobReader::DecodeBlob(int blobIndex, unsigned char* pDest)
+{
+	const Blob& blob = m_blobs[ blobIndex ];
+
+	size_t blobStart = blobIndex * kBlobSize;
+	size_t blobSize = m_decompressedSize - blobStart;
+	if (blobSize > kBlobSize)
+		blobSize = kBlobSize;
+
+	if (0 == blob.compressedSize)
+	{
+		// Zero Size means 64KB of uncompressed data
+		memcpy(pDest, blob.pData, blobSize);
+		return true;
+	}
+
+	if (m_bHistory && (blobIndex > 0))
+	{
+		// Matches can reach back into the previous blob, just before pDest
+		size_t decompressedSize = lzsa_decompress_block_inmem_history((unsigned char*)blob.pData,
+																	  pDest, kBlobSize,
+																	  blob.compressedSize,
+																	  blobSize,
+																	  PIXL_BLOBS_LZSA_FLAG_RAW_BLOCK,
+																	  2);
+		return decompressedSize == blobSize;
+	}
+
+	int version = 2; // format version;
+	size_t decompressedSize = lzsa_decompress_inmem((unsigned char*)blob.pData, // Compressed Data
+													pDest,					   // Target uncompressed data
+													blob.compressedSize,	   // compressed size in bytes
+													blobSize,
+													PIXL_BLOBS_LZSA_FLAG_RAW_BLOCK,
+													&version);
+
+	return decompressedSize == blobSize;
+}
+
+//------------------------------------------------------------------------------
+// Unpack one blob into m_scratch. With history, unpack the ones before it
+// too, from the one already there if that's earlier, from the first if not.
+//
+bool PixlBlobReader::DecodeScratch(int blobIndex)
+{
+	if (m_scratchBlob == blobIndex)
+		return true;
+
+	size_t scratchOffset = m_bHistory ? kBlobSize : 0;
+	m_scratch.resize( scratchOffset + kBlobSize );
+
+	int firstBlob = blobIndex;
+	if (m_bHistory)
+		firstBlob = ((m_scratchBlob >= 0) && (m_scratchBlob < blobIndex)) ? m_scratchBlob + 1 : 0;
+
+	for (int idx = firstBlob; idx <= blobIndex; ++idx)
+	{
+		// The blob before moves down to be the history
+		if (m_bHistory && (idx > 0))
+			memcpy(&m_scratch[ 0 ], &m_scratch[ kBlobSize ], kBlobSize);
+
+		m_scratchBlob = -1;
+		if (!DecodeBlob( idx, &m_scratch[ scratchOffset ] ))
+			return false;
+		m_scratchBlob = idx;
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Keep a blob unpacked in place as the one in m_scratch, so the next partial
+// read of it, or with history of the blob after it, carries on from there
+//
+void PixlBlobReader::KeepBlob(int blobIndex, const unsigned char* pBlob)
+{
+	size_t blobSize = m_decompressedSize - (blobIndex * kBlobSize);
+	if (blobSize > kBlobSize)
+		blobSize = kBlobSize;
+
+	size_t scratchOffset = m_bHistory ? kBlobSize : 0;
+	m_scratch.resize( scratchOffset + kBlobSize );
+	memcpy(&m_scratch[ scratchOffset ], pBlob, blobSize);
+	m_scratchBlob = blobIndex;
+}
+
+//------------------------------------------------------------------------------
+bool PixlBlobReader::DecodeRange(size_t begin, size_t end, unsigned char* pDest)
+{
+	if (end > m_decompressedSize)
+		end = m_decompressedSize;
+
+	size_t rangeBegin = begin;
+	int lastInPlace = -1;
+	unsigned char* pLastInPlace = nullptr;
+
+	while (begin < end)
+	{
+		int blobIndex = (int)(begin / kBlobSize);
+		size_t blobStart = blobIndex * kBlobSize;
+		size_t blobEnd = blobStart + kBlobSize;
+		if (blobEnd > m_decompressedSize)
+			blobEnd = m_decompressedSize;
+
+		size_t chunkEnd = (end < blobEnd) ? end : blobEnd;
+
+		// With history, the blob before has to be unpacked right before this
+		// one, which it is if the range has all of it
+		bool bInPlace = !m_bHistory || (0 == blobIndex) || ((rangeBegin + kBlobSize) <= blobStart);
+
+		if ((begin == blobStart) && (chunkEnd == blobEnd) && bInPlace)
+		{
+			// The range covers the whole blob, unpack it where it goes
+			if (!DecodeBlob( blobIndex, pDest ))
+				return false;
+
+			lastInPlace = blobIndex;
+			pLastInPlace = pDest;
+		}
+		else
+		{
+			// With history, carry on from the blob just unpacked in place,
+			// rather than from the first one
+			if (m_bHistory && (lastInPlace >= 0) && (lastInPlace == blobIndex - 1) && (m_scratchBlob != blobIndex))
+				KeepBlob( lastInPlace, pLastInPlace );
+
+			if (!DecodeScratch( blobIndex ))
+				return false;
+
+			size_t scratchOffset = m_bHistory ? kBlobSize : 0;
+			memcpy(pDest, &m_scratch[ scratchOffset + begin - blobStart ], chunkEnd - begin);
+		}
+
+		pDest += chunkEnd - begin;
+		begin = chunkEnd;
+	}
+
+	// Keep the last blob unpacked, so the next range can carry on from it
+	if (lastInPlace > m_scratchBlob)
+		KeepBlob( lastInPlace, pLastInPlace );
+
+	return true;
+}
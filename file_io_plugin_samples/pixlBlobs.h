@@ -0,0 +1,71 @@
+//
+// PixlBlobReader: random access into the PIXL chunk of the I256 and I16
+// formats, which store the pixel bytes as a run of 64KB LZSA2 blobs, each
+// prefixed with its 16 bit compressed size (0 = 64KB stored raw).
+//
+// Index() walks the size prefixes once and remembers where every blob starts,
+// without decompressing anything. DecodeRange() then only decompresses the
+// blobs that cover the bytes asked for, so a preview of the top rows, or of a
+// few rows spread over a big image, doesn't pay for the whole picture.
+//
+// Blobs can also be compressed with the 64KB before them as history, so their
+// first bytes can match the end of the previous blob. Then every blob needs
+// the one before it unpacked first, and DecodeRange() works its way forward
+// from the last blob it unpacked, or from the start.
+//
+// Shared by the i16 and i256 plugins.
+//
+#ifndef PIXL_BLOBS_H
+#define PIXL_BLOBS_H
+
+#include <stddef.h>
+#include <vector>
+
+class PixlBlobReader
+{
+public:
+	PixlBlobReader();
+
+	// pData points at the first blob size prefix, with dataSize bytes readable
+	// from there. decompressedSize is how much of the unpacked pixel stream is
+	// wanted; blobs past it are ignored. Returns false if there are too few
+	// blobs, or they run past the data. The data isn't copied, and must
+	// outlive the reader. bHistory for blobs compressed with the previous
+	// blob as history.
+	bool Index(const unsigned char* pData, size_t dataSize, int numBlobs,
+			   size_t decompressedSize, bool bHistory = false);
+
+	void Clear();
+
+	int    GetBlobCount() const { return (int)m_blobs.size(); }
+	size_t GetDecompressedSize() const { return m_decompressedSize; }
+
+	// Unpack bytes [begin, end) of the pixel stream into pDest. Blobs that lie
+	// entirely inside the range are decompressed in place; the most recently
+	// used blob is kept, in place or not, so walking a range row by row
+	// decompresses each blob once. Returns false on a corrupt blob.
+	bool DecodeRange(size_t begin, size_t end, unsigned char* pDest);
+
+private:
+	struct Blob
+	{
+		const unsigned char* pData;	// compressed bytes, after the size prefix
+		int compressedSize;			// 0 = stored raw
+	};
+
+	// With history, the blob before blobIndex has to be right before pDest
+	bool DecodeBlob(int blobIndex, unsigned char* pDest);
+	bool DecodeScratch(int blobIndex);
+	void KeepBlob(int blobIndex, const unsigned char* pBlob);
+
+	std::vector<Blob> m_blobs;
+	size_t m_decompressedSize;
+	bool m_bHistory;
+
+	// One decompressed blob; with history, at 64KB in, after room for the
+	// blob before it
+	std::vector<unsigned char> m_scratch;
+	int m_scratchBlob;						// which one, or -1
+};
+
+#endif // PIXL_BLOBS_H
@@ -1,11 +1,20 @@
 // todo file format description
 
+// Ahead of the pack(1) below, which would otherwise pack the standard library
+// containers in MetaIndex and the frame codec differently from their cpps
+#include "..\metaIndex.h"
+#include "..\pinModule.h"
+#include "sanFileWriter.h"
+#include "sanFrameCodec.h"
+#include "sanFramePrefetch.h"
+
 #pragma pack(1)
 
 #include "sanAnimationIo.h"
 
 #include <stdio.h>
 #include <malloc.h>
+#include <io.h>
 
 
 
@@ -14,6 +23,34 @@
 #define FILE_BOX_DESCRIPTION L"SAN - Sample Animation"
 #define FILE_EXTENSION L"san"
 
+// 1 to remember each file's header in the shared metadata index, so browsing
+// a folder doesn't open files that were seen before
+#define META_INDEX 1
+
+// file version beginWrite writes: 1 stores frames raw, 2 compresses them with
+// LZSA2 and RLE on a pool of worker threads (see sanFrameCodec.h). Both can be
+// read; earlier builds of this plugin read 1 only (see readme.txt).
+#define SAN_WRITE_VERSION 2
+
+// version 2 stores frames as XOR deltas against the frame before; every
+// SAN_KEYFRAME_INTERVAL-th frame is stored whole, so seeking never decodes
+// more than that many frames. 0 stores every frame whole.
+#define SAN_KEYFRAME_INTERVAL 30
+
+// frames being saved are staged in a ring of this many bytes and written by a
+// background thread, so a slow disk doesn't hold up the host
+#define SAN_WRITE_BEHIND_BYTES (16 * 1024 * 1024)
+
+// 1 to read the frames after the current one on a background thread while
+// loading frames in order. SAN_PREFETCH_FRAMES frames at most are read ahead,
+// and no more than SAN_PREFETCH_MAX_BYTES of them.
+#define SAN_PREFETCH 1
+#define SAN_PREFETCH_FRAMES 4
+#define SAN_PREFETCH_MAX_BYTES (64 * 1024 * 1024)
+
+// 1 to report how many frames were read ahead in time to the debugger
+#define SAN_PREFETCH_STATS 0
+
 // at the moment there is only version "1" of the file plugin interface
 #define PLUGIN_INTERFACE_VERSION_USED 1
 
@@ -25,6 +62,7 @@
 #define ERROR_FILE_OPEN_FAILED L"Could not open file!"
 #define ERROR_FILE_READ_FAILED L"Could not read file!"
 #define ERROR_FILE_WRITE_FAILED L"Could not write file!"
+#define ERROR_NO_SUCH_FRAME L"The file has no such frame!"
 
 // latest error message
 wchar_t lastErrorMessage[2048];
@@ -44,9 +82,35 @@ unsigned int currentFrameIndex;
 // file handle for reading and writing
 FILE* file;
 
+// set by beginWrite, file is the animation being written
+bool writingFile;
+
+#if META_INDEX
+MetaIndex metaIndex( L"san" );
+#endif
+
+// writes everything beginWrite and writeNextImage save, in the background
+SanFileWriter fileWriter;
+
+// packs and writes version 2 frames
+SanFrameEncoder frameEncoder;
+
+// finds and unpacks version 2 frames
+SanFrameReader frameReader;
+
+#if SAN_PREFETCH
+// reads ahead while loading frames in order
+SanFramePrefetcher framePrefetcher;
+#endif
+
+void stopPrefetch();
+
 // helper to close global file
 void closeFile()
 {
+	// drops what's not written yet, after an error
+	fileWriter.Cancel();
+
 	if ( file!=NULL )
 	{
 		fclose( file );
@@ -84,6 +148,23 @@ bool isError()
 // reset internal data to be ready for the next file io
 void resetBasicData()
 {
+	// the prefetch thread reads the header, stop it first
+	stopPrefetch();
+
+#if SAN_PREFETCH && SAN_PREFETCH_STATS
+	int taken= framePrefetcher.GetHits() + framePrefetcher.GetMisses();
+	if ( taken > 0 )
+	{
+		wchar_t buf[ 160 ];
+		swprintf( buf, 160, L"san: %d of %d frames were read ahead in time (%d%%)\n",
+				  framePrefetcher.GetHits(), taken, 100 * framePrefetcher.GetHits() / taken );
+		OutputDebugStringW( buf );
+	}
+#endif
+#if SAN_PREFETCH
+	framePrefetcher.ResetStats();
+#endif
+
 	basicDataLoaded= false;
 	fileHeader.width= -1;
 	fileHeader.height= -1;
@@ -91,11 +172,29 @@ void resetBasicData()
 	fileHeader.alphaEnabled= false;
 
 	currentFrameIndex= 0;
+	frameEncoder.Cancel();
+	frameReader.Reset();
 	closeFile();
 	
 	resetError();
 }
 
+#if META_INDEX
+// remember the header in fileHeader for pPath
+void storeMetaData( const wchar_t* pPath )
+{
+	MetaIndexEntry meta;
+	meta.handled= true;
+	meta.width= fileHeader.width;
+	meta.height= fileHeader.height;
+	meta.frameCount= fileHeader.numberOfFrames;
+	meta.transparentColor= fileHeader.transparentColor;
+	meta.alphaEnabled= fileHeader.alphaEnabled;
+
+	metaIndex.Store( pPath, meta );
+}
+#endif
+
 // auto load basic file information from the given file
 bool ensureBasicData()
 {
@@ -111,6 +210,28 @@ bool ensureBasicData()
 		return  false;
 	}
 
+#if META_INDEX
+	// seen this file before? then there's no need to open it
+	MetaIndexEntry meta;
+	if ( metaIndex.Lookup( currentFileName, meta ) )
+	{
+		if ( !meta.handled )
+			return false;
+
+		// the version isn't indexed; readFrame reads it when it opens the file
+		strncpy( fileHeader.typeId, FILE_HEADER_TYPE_ID, 4 );
+		fileHeader.version= 1;
+		fileHeader.width= meta.width;
+		fileHeader.height= meta.height;
+		fileHeader.transparentColor= meta.transparentColor;
+		fileHeader.alphaEnabled= meta.alphaEnabled;
+		fileHeader.numberOfFrames= meta.frameCount;
+
+		basicDataLoaded= true;
+		return true;
+	}
+#endif
+
 	// open file and read header data plus color palette
 	FILE* file= _wfopen( currentFileName, L"rb" ); 
 	if ( file==NULL )
@@ -128,9 +249,12 @@ bool ensureBasicData()
 	}
 
 	// if type and version does not match then stop here
-	if ( fileHeader.version != 1 || strncmp( fileHeader.typeId, FILE_HEADER_TYPE_ID, 4 ) != 0 )
+	if ( (fileHeader.version != 1 && fileHeader.version != 2) || strncmp( fileHeader.typeId, FILE_HEADER_TYPE_ID, 4 ) != 0 )
 	{
 		fclose( file );
+#if META_INDEX
+		metaIndex.Store( currentFileName, MetaIndexEntry() );
+#endif
 		return false;
 	}
 
@@ -144,10 +268,228 @@ bool ensureBasicData()
 
 	fclose( file );
 
+#if META_INDEX
+	storeMetaData( currentFileName );
+#endif
+
 	basicDataLoaded= true;
 	return true;
 }
 
+// size of one frame in the file: delay, palette, alpha palette and bitmaps
+long long frameSize()
+{
+	long long pixels= (long long)fileHeader.width * fileHeader.height;
+	long long size= 2 + 768 + pixels;
+
+	if ( fileHeader.alphaEnabled )
+		size+= 256 + pixels;
+
+	return size;
+}
+
+// all version 1 frames have the same size, so frame frameIndex starts here
+long long frameOffset( unsigned int frameIndex )
+{
+	return sizeof( fileHeader ) + frameIndex * frameSize();
+}
+
+// read the version of an open file; the header may have come from the
+// metadata index, which doesn't know it
+bool readVersion( FILE* pFile, unsigned char& version )
+{
+	return fseek( pFile, 4, SEEK_SET ) == 0 && fread( &version, 1, 1, pFile ) == 1 &&
+		   (version == 1 || version == 2);
+}
+
+// read frame frameIndex from pFile, through reader for version 2. Only seeks
+// if the file isn't already there, so reading the frames in order stays
+// sequential.
+bool readFrameFrom( FILE* pFile, SanFrameReader& reader, unsigned char version, unsigned int frameIndex,
+					unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned short* delayMs )
+{
+	if ( version == 2 )
+	{
+		return reader.ReadFrame( pFile, sizeof( fileHeader ), frameIndex,
+								 fileHeader.width, fileHeader.height, fileHeader.alphaEnabled,
+								 colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs );
+	}
+
+	// jump to the frame
+	long long offset= frameOffset( frameIndex );
+	if ( _ftelli64( pFile ) != offset && _fseeki64( pFile, offset, SEEK_SET ) != 0 )
+		return false;
+
+	// read delay and colors
+	if ( fread( delayMs, 1, 2, pFile ) != 2 || fread( colorFramePalette, 1, 768, pFile ) != 768 )
+		return false;
+
+	// read alpha values if enabled
+	if ( fileHeader.alphaEnabled && fread( alphaFramePalette, 1, 256, pFile ) != 256 )
+		return false;
+
+	// read color bitmap data
+	if ( fread( colorFrame, 1, fileHeader.width * fileHeader.height, pFile ) != fileHeader.width * fileHeader.height )
+		return false;
+
+	// if enabled read alpha bitmap data. Without a buffer for it it's
+	// skipped by the seek to the next frame.
+	if ( fileHeader.alphaEnabled && alphaFrame!=NULL &&
+		 fread( alphaFrame, 1, fileHeader.width * fileHeader.height, pFile ) != fileHeader.width * fileHeader.height )
+	{
+		return false;
+	}
+
+	return true;
+}
+
+// read frame frameIndex, opening the file if needed
+bool readFrame( unsigned int frameIndex, unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned short* delayMs )
+{
+	if ( frameIndex >= fileHeader.numberOfFrames )
+	{
+		wcscpy( lastErrorMessage, ERROR_NO_SUCH_FRAME );
+		return false;
+	}
+
+	// open file and read 
+	if ( file==NULL )
+	{
+		file= _wfopen( currentFileName, L"rb" ); 
+		if ( file==NULL )
+		{
+			wcscpy( lastErrorMessage, ERROR_FILE_OPEN_FAILED );
+			return false;
+		}
+
+		unsigned char version;
+		if ( !readVersion( file, version ) )
+		{
+			wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
+			closeFile();
+			return false;
+		}
+
+		fileHeader.version= version;
+		frameReader.Reset();
+	}
+
+	if ( !readFrameFrom( file, frameReader, fileHeader.version, frameIndex,
+						 colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs ) )
+	{
+		wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
+		closeFile();
+		return false;
+	}
+
+	return true;
+}
+
+#if SAN_PREFETCH
+// the prefetch thread reads frames through its own handle on the file, so it
+// never shares one with reads on the host's thread
+FILE* prefetchFile;
+unsigned char prefetchVersion;
+SanFrameReader prefetchReader;
+
+// SanFramePrefetcher::ReadFunc, runs on the prefetch thread
+bool prefetchFrame( unsigned int frameIndex, PrefetchFrame& frame )
+{
+	if ( prefetchFile==NULL )
+	{
+		prefetchFile= _wfopen( currentFileName, L"rb" );
+		if ( prefetchFile==NULL )
+			return false;
+
+		if ( !readVersion( prefetchFile, prefetchVersion ) )
+		{
+			fclose( prefetchFile );
+			prefetchFile= NULL;
+			return false;
+		}
+	}
+
+	return readFrameFrom( prefetchFile, prefetchReader, prefetchVersion, frameIndex,
+						  frame.color.data(), frame.palette, frame.alpha.empty() ? NULL : frame.alpha.data(), frame.alphaPalette,
+						  &frame.delayMs );
+}
+#endif
+
+// stop reading ahead, for a jump or the next file. Stats are kept for the
+// whole file.
+void stopPrefetch()
+{
+#if SAN_PREFETCH
+	framePrefetcher.Stop();
+
+	if ( prefetchFile!=NULL )
+	{
+		fclose( prefetchFile );
+		prefetchFile= NULL;
+	}
+#endif
+}
+
+#if SAN_PREFETCH
+// read ahead from currentFrameIndex. After a jump the host's reader holds the
+// frame before it; the prefetch reader starts out as a copy, so it applies the
+// next delta instead of decoding from the keyframe once more.
+bool startPrefetch()
+{
+	stopPrefetch();
+
+	if ( file!=NULL )
+		prefetchReader= frameReader;
+	else
+		prefetchReader.Reset();
+
+	pinModule();
+	return framePrefetcher.Start( prefetchFrame, currentFrameIndex, fileHeader.numberOfFrames,
+								  (size_t)fileHeader.width * fileHeader.height, fileHeader.alphaEnabled,
+								  SAN_PREFETCH_FRAMES, SAN_PREFETCH_MAX_BYTES );
+}
+#endif
+
+// write a version 1 frame, raw
+bool writeRawFrame( unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned short delayMs )
+{
+	size_t planeSize= (size_t)fileHeader.width * fileHeader.height;
+
+	// delay, colors, alpha values if enabled, then the bitmaps. These are
+	// only copies into the write-behind ring.
+	if ( !fileWriter.Write( &delayMs, 2 ) ||
+		 !fileWriter.Write( colorFramePalette, 768 ) ||
+		 (fileHeader.alphaEnabled && !fileWriter.Write( alphaFramePalette, 256 )) ||
+		 !fileWriter.Write( colorFrame, planeSize ) ||
+		 (fileHeader.alphaEnabled && !fileWriter.Write( alphaFrame, planeSize )) )
+	{
+		wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
+		closeFile();
+		return false;
+	}
+
+	return true;
+}
+
+// once all frames are written: correct the frame count in the header if the
+// host wrote fewer or more frames than announced, and get it all to disk
+bool completeFile()
+{
+	if ( currentFrameIndex != fileHeader.numberOfFrames )
+	{
+		fileHeader.numberOfFrames= currentFrameIndex;
+
+		long long offset= (char*)&fileHeader.numberOfFrames - (char*)&fileHeader;
+		if ( _fseeki64( file, offset, SEEK_SET ) != 0 ||
+			 fwrite( &fileHeader.numberOfFrames, 1, sizeof( fileHeader.numberOfFrames ), file ) != sizeof( fileHeader.numberOfFrames ) )
+		{
+			return false;
+		}
+	}
+
+	return fflush( file ) == 0 && _commit( _fileno( file ) ) == 0;
+}
+
 // helper to forward progress if a callback exists
 void updateProgress( int progress )
 {
@@ -298,75 +640,56 @@ extern "C"
 		if ( !basicDataLoaded )
 			return false;
 
-		// open file and read 
-		if ( file==NULL )
+#if SAN_PREFETCH
+		// the frames in order are usually read already
+		if ( !framePrefetcher.IsActive() )
+			startPrefetch();
+
+		if ( !framePrefetcher.Take( currentFrameIndex, colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs ) )
 		{
-			file= _wfopen( currentFileName, L"rb" ); 
-			if ( file==NULL )
-			{
-				wcscmp( lastErrorMessage, ERROR_FILE_OPEN_FAILED );
-				return false;
-			}
+			// not read ahead, or it failed; reading it here reports why
+			stopPrefetch();
 
-			// jump to first frame
-			if ( fseek( file, sizeof( fileHeader ),  SEEK_SET ) != 0 )
-			{
-				wcscmp( lastErrorMessage, ERROR_FILE_READ_FAILED );
-				closeFile();
+			if ( !readFrame( currentFrameIndex, colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs ) )
 				return false;
-			}
 		}
-
-		// read delay
-		if ( fread( delayMs, 1, 2, file ) != 2 )
-		{
-			wcscmp( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			closeFile();
+#else
+		if ( !readFrame( currentFrameIndex, colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs ) )
 			return false;
-		}
+#endif
 
-		// read colors
-		if ( fread( colorFramePalette, 1, 768, file ) != 768 )
-		{
-			wcscmp( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			closeFile();
+		// set progress
+		if ( fileHeader.numberOfFrames > 0 ) 
+			updateProgress( 100 * currentFrameIndex / fileHeader.numberOfFrames );
+
+		currentFrameIndex++;
+		
+		return true;
+	}
+
+	bool  __stdcall loadImage( int frameIndex, unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned short* delayMs )
+	{
+		if ( !ensureBasicData() )
 			return false;
-		}
 
-		// read alpha values if enabled
-		if ( fileHeader.alphaEnabled )
+#if SAN_PREFETCH
+		// a jump ends reading ahead, the next loadNextImage starts over
+		if ( frameIndex >= 0 &&
+			 framePrefetcher.Take( frameIndex, colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs ) )
 		{
-			if ( fread( alphaFramePalette, 1, 256, file ) != 256 )
-			{
-				wcscmp( lastErrorMessage, ERROR_FILE_READ_FAILED );
-				closeFile();
-				return false;
-			}
+			currentFrameIndex= frameIndex + 1;
+			return true;
 		}
 
-		// read color bitmap data
-		if ( fread( colorFrame, 1, fileHeader.width * fileHeader.height, file ) != fileHeader.width * fileHeader.height )
-		{
-			wcscmp( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			closeFile();
-			return false;
-		}
+		stopPrefetch();
+#endif
 
-		// if enabled read alpha bitmap data
-		if ( fileHeader.alphaEnabled && alphaFrame!=NULL &&
-			 fread( alphaFrame, 1, fileHeader.width * fileHeader.height, file ) != fileHeader.width * fileHeader.height )
-		{
-			wcscmp( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			fclose( file );
+		if ( frameIndex < 0 || !readFrame( frameIndex, colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs ) )
 			return false;
-		}
 
-		// set progress
-		if ( fileHeader.numberOfFrames > 0 ) 
-			updateProgress( 100 * currentFrameIndex / fileHeader.numberOfFrames );
+		// a following loadNextImage continues from here
+		currentFrameIndex= frameIndex + 1;
 
-		currentFrameIndex++;
-		
 		return true;
 	}
 
@@ -376,7 +699,7 @@ extern "C"
 
 		// set up file header. We do not actually write yet!
 		strncpy( fileHeader.typeId, FILE_HEADER_TYPE_ID, 4 );
-		fileHeader.version= 1;
+		fileHeader.version= SAN_WRITE_VERSION;
 		fileHeader.width= width;
 		fileHeader.height= height;
 		fileHeader.transparentColor= transparentColor;
@@ -386,6 +709,11 @@ extern "C"
 		// reset progress
 		updateProgress( 0 );
 
+#if META_INDEX
+		// the file is about to change under its index entry
+		metaIndex.Forget( currentFileName );
+#endif
+
 		// open file for writing
 		file= _wfopen( currentFileName, L"w+b" ); 
 		if ( file==NULL )
@@ -394,55 +722,44 @@ extern "C"
 			return false;
 		}
 
-		if ( fwrite( &fileHeader, 1, sizeof( fileHeader ), file ) != sizeof( fileHeader ) )
+		pinModule();
+		fileWriter.Begin( file, SAN_WRITE_BEHIND_BYTES );
+
+		if ( !fileWriter.Write( &fileHeader, sizeof( fileHeader ) ) )
 		{
 			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
 			closeFile();
 			return false;
 		}
 
+		// frames get packed in the background, and written as they're done
+		if ( fileHeader.version == 2 )
+			frameEncoder.Begin( &fileWriter, width, height, alphaEnabled, SAN_KEYFRAME_INTERVAL );
+
+		writingFile= true;
 		return true;
 	}
 
 	bool __stdcall writeNextImage( unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned char* rgba, unsigned short delayMs )
 	{
-		// write delay
-		if ( fwrite( &delayMs, 1, 2, file ) != 2 )
-		{
-			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
-			closeFile();
-			return false;
-		}
-
-		// write color data
-		if ( fwrite( colorFramePalette, 1, 768, file ) != 768 )
-		{
-			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
-			closeFile();
-			return false;
-		}
-
-		// if enabled read alpha data
-		if ( fileHeader.alphaEnabled && fwrite( alphaFramePalette, 1, 256, file ) != 256 )
+		if ( file==NULL )
 		{
 			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
-			closeFile();
 			return false;
 		}
 
-		// write color bitmap data
-		if ( fwrite( colorFrame, 1, fileHeader.width * fileHeader.height, file ) != fileHeader.width * fileHeader.height )
+		if ( frameEncoder.IsActive() )
 		{
-			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
-			closeFile();
-			return false;
+			if ( !frameEncoder.Submit( delayMs, colorFramePalette, alphaFramePalette, colorFrame, alphaFrame ) )
+			{
+				wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
+				frameEncoder.Cancel();
+				closeFile();
+				return false;
+			}
 		}
-
-		// if enabled write alpha bitmap data
-		if ( fileHeader.alphaEnabled && fwrite( alphaFrame, 1, fileHeader.width * fileHeader.height, file ) != fileHeader.width * fileHeader.height )
+		else if ( !writeRawFrame( colorFrame, colorFramePalette, alphaFrame, alphaFramePalette, delayMs ) )
 		{
-			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
-			closeFile();
 			return false;
 		}
 
@@ -457,6 +774,35 @@ extern "C"
 
 	void  __stdcall finishProcessing()
 	{
+		// the frames still being packed go out now, then what's still staged
+		if ( (frameEncoder.IsActive() && !frameEncoder.Finish()) ||
+			 (fileWriter.IsActive() && !fileWriter.Finish()) ||
+			 (writingFile && file!=NULL && !completeFile()) )
+		{
+			wcscpy( lastErrorMessage, ERROR_FILE_WRITE_FAILED );
+			closeFile();
+		}
+
+		// every write error closes the file, so if it's still open all frames
+		// went out
+		bool written= writingFile && file!=NULL;
+		writingFile= false;
+		closeFile();
+
+#if META_INDEX
+		if ( written )
+		{
+			// index the file as written, ready for the next folder scan
+			storeMetaData( currentFileName );
+			metaIndex.Flush( true );
+		}
+		else
+		{
+			// writes the index only now and then, not once per file of a scan
+			metaIndex.Flush();
+		}
+#endif
+
 		resetBasicData();
 
 
@@ -479,6 +825,7 @@ BOOL APIENTRY DllMain( HANDLE hModule,
 		case DLL_PROCESS_ATTACH:
 		case DLL_THREAD_ATTACH:
 		case DLL_THREAD_DETACH:
+			break;
 		case DLL_PROCESS_DETACH:
 			break;
     }
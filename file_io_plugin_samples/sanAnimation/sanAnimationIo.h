@@ -22,6 +22,15 @@
 #include <windows.h>
 #include "..\pluginInterface.h"
 
+// SAN specific addition to the plugin interface, exported through
+// sanAnimationIo.def
+extern "C"
+{
+	// like loadNextImage, but loads frame frameIndex directly, without
+	// reading the frames in front of it. loadNextImage continues after it.
+	bool  __stdcall loadImage( int frameIndex, unsigned char* colorFrame, unsigned char* colorFramePalette, unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned short* delayMs ); 
+}
+
 
 
 
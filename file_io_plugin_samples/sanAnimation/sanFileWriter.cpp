@@ -0,0 +1,202 @@
+//
+// Write-behind for saving, see sanFileWriter.h
+//
+#include "sanFileWriter.h"
+
+#include <string.h>
+
+// the thread waits for this many bytes before writing, unless stopping
+#define WRITE_CHUNK (1024 * 1024)
+
+SanFileWriter::SanFileWriter()
+	: m_pFile( NULL )
+	, m_queued( 0 )
+	, m_written( 0 )
+	, m_failed( false )
+	, m_stop( false )
+	, m_cancel( false )
+{
+}
+
+// finishProcessing stops the thread, see ~SanFrameEncoder
+SanFileWriter::~SanFileWriter()
+{
+	if ( m_thread.joinable() )
+		m_thread.detach();
+}
+
+void SanFileWriter::Begin( FILE* pFile, size_t ringSize )
+{
+	Cancel();
+
+	// the ring must hold a whole chunk, or the thread would never write
+	if ( ringSize < WRITE_CHUNK )
+		ringSize= WRITE_CHUNK;
+
+	m_pFile= pFile;
+	m_ring.resize( ringSize );
+	m_queued= 0;
+	m_written= 0;
+	m_failed= false;
+	m_stop= false;
+	m_cancel= false;
+
+	// without a thread, Write writes straight through the file's own buffering
+	try
+	{
+		m_thread= std::thread( &SanFileWriter::ThreadLoop, this );
+	}
+	catch ( ... )
+	{
+		std::vector<unsigned char>().swap( m_ring );
+		return;
+	}
+
+	// everything goes out in big writes already, stdio buffering would only
+	// copy it once more
+	setvbuf( pFile, NULL, _IONBF, 0 );
+}
+
+bool SanFileWriter::Write( const void* pData, size_t size )
+{
+	if ( m_pFile==NULL )
+		return false;
+
+	if ( !m_thread.joinable() )
+	{
+		if ( m_failed || fwrite( pData, 1, size, m_pFile ) != size )
+		{
+			m_failed= true;
+			return false;
+		}
+
+		m_queued+= size;
+		m_written+= size;
+		return true;
+	}
+
+	const unsigned char* pBytes= (const unsigned char*)pData;
+	size_t ringSize= m_ring.size();
+
+	while ( size > 0 )
+	{
+		size_t free;
+		{
+			std::unique_lock<std::mutex> lock( m_mutex );
+			m_spaceFree.wait( lock, [this, ringSize] { return m_failed || m_queued - m_written < ringSize; } );
+
+			if ( m_failed )
+				return false;
+
+			free= ringSize - (size_t)(m_queued - m_written);
+		}
+
+		// copy as much as fits up to the end of the ring; the thread doesn't
+		// touch the free part
+		size_t at= (size_t)(m_queued % ringSize);
+		size_t count= size;
+		if ( count > free )
+			count= free;
+		if ( count > ringSize - at )
+			count= ringSize - at;
+
+		memcpy( m_ring.data() + at, pBytes, count );
+		pBytes+= count;
+		size-= count;
+
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+			m_queued+= count;
+		}
+		m_dataReady.notify_one();
+	}
+
+	return true;
+}
+
+bool SanFileWriter::Finish()
+{
+	if ( m_pFile==NULL )
+		return false;
+
+	StopThread();
+
+	bool ok= !m_failed && m_written == m_queued;
+
+	// don't hold on to the ring until the next save
+	std::vector<unsigned char>().swap( m_ring );
+	m_pFile= NULL;
+	return ok;
+}
+
+void SanFileWriter::Cancel()
+{
+	if ( m_pFile==NULL )
+		return;
+
+	// the thread may be in the middle of a write; it stops after that one
+	// instead of taking the rest of the queue
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_cancel= true;
+	}
+	StopThread();
+
+	std::vector<unsigned char>().swap( m_ring );
+	m_pFile= NULL;
+}
+
+// stop the thread once it wrote what's queued, or right away after Cancel
+void SanFileWriter::StopThread()
+{
+	if ( !m_thread.joinable() )
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_stop= true;
+	}
+	m_dataReady.notify_all();
+
+	m_thread.join();
+}
+
+void SanFileWriter::ThreadLoop()
+{
+	size_t ringSize= m_ring.size();
+
+	for (;;)
+	{
+		size_t at;
+		size_t count;
+		{
+			std::unique_lock<std::mutex> lock( m_mutex );
+
+			// gather a chunk, so the file sees few big writes
+			m_dataReady.wait( lock, [this] { return m_stop || m_cancel || m_queued - m_written >= WRITE_CHUNK; } );
+
+			// stopping writes out the rest first
+			if ( m_cancel || m_failed || m_written >= m_queued )
+				return;
+
+			size_t pending= (size_t)(m_queued - m_written);
+
+			at= (size_t)(m_written % ringSize);
+			count= pending;
+			if ( count > ringSize - at )
+				count= ringSize - at;
+		}
+
+		bool ok= fwrite( m_ring.data() + at, 1, count, m_pFile ) == count;
+
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+
+			if ( ok )
+				m_written+= count;
+			else
+				m_failed= true;
+		}
+		m_spaceFree.notify_one();
+	}
+}
@@ -0,0 +1,67 @@
+//
+// Write-behind for saving: the bytes of a file get copied into a large
+// staging ring, and a background thread writes them out in big sequential
+// chunks, so the host's thread doesn't wait on the disk for every frame.
+//
+// Include this ahead of any #pragma pack, the class holds standard library
+// containers.
+//
+#ifndef SAN_FILE_WRITER_H
+#define SAN_FILE_WRITER_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// All methods are called from the host's thread; only the writes to the file
+// run on the writer's thread. The file mustn't be touched otherwise between
+// Begin and Finish or Cancel. Call one of those before the writer goes away,
+// the destructor doesn't wait for the thread.
+class SanFileWriter
+{
+public:
+	SanFileWriter();
+	~SanFileWriter();
+
+	// Start writing to pFile at its current position, staging up to
+	// ringSize bytes. Turns off the file's own buffering, the ring does it.
+	// If the thread can't be started, Write writes to the file directly.
+	void Begin( FILE* pFile, size_t ringSize );
+
+	// Queue size bytes; waits for room in the ring if it's full. False if a
+	// write failed.
+	bool Write( const void* pData, size_t size );
+
+	// Write everything queued and stop the thread. False if any write
+	// failed.
+	bool Finish();
+
+	// Stop the thread, dropping what's queued
+	void Cancel();
+
+	bool IsActive() const { return m_pFile != NULL; }
+
+private:
+	void ThreadLoop();
+	void StopThread();
+
+	FILE* m_pFile;
+	std::vector<unsigned char> m_ring;
+	unsigned long long m_queued;		// bytes handed to Write so far
+	unsigned long long m_written;		// bytes of them written to the file
+	bool m_failed;
+	bool m_stop;						// write out what's queued, then stop
+	bool m_cancel;						// stop after the write in progress
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_dataReady;
+	std::condition_variable m_spaceFree;
+
+	SanFileWriter( const SanFileWriter& );
+	SanFileWriter& operator=( const SanFileWriter& );
+};
+
+#endif // SAN_FILE_WRITER_H
@@ -0,0 +1,756 @@
+//
+// Version 2 SAN frames, see sanFrameCodec.h
+//
+#include "sanFrameCodec.h"
+#include "sanFileWriter.h"
+
+#include <string.h>
+
+//lzsa numeric includes
+#include "lib.h"
+//lzsa memory compressor
+#include "shrink_inmem.h"
+//lzsa memory decompressor
+#include "expand_inmem.h"
+
+// frames in flight per worker before Submit waits for the oldest
+#define FRAMES_IN_FLIGHT_PER_WORKER 2
+
+// a color plane that RLE already shrinks to 1/n of its size is kept RLE. Such
+// flat planes are where the LZSA2 optimal parse is slowest, and it would only
+// gain a little over RLE there.
+#define RLE_GOOD_ENOUGH 4
+
+// how a plane is stored
+#define PLANE_RAW  0
+#define PLANE_LZSA 1
+#define PLANE_RLE  2
+#define PLANE_METHOD_MASK 0x7F
+// the plane is XORed with the previous frame's
+#define PLANE_DELTA 0x80
+
+// what's known about a frame in SanFrameReader
+// set in a record's size if it doesn't store palettes, because they're the
+// same as the previous frame's
+#define RECORD_SAME_PALETTES 0x80000000u
+#define RECORD_SIZE_MASK     0x7FFFFFFFu
+
+#define FRAME_UNKNOWN 0
+#define FRAME_KEY     1
+#define FRAME_DELTA   2
+
+//------------------------------------------------------------------------------
+
+static void appendBytes( std::vector<unsigned char>& bytes, const void* pData, size_t size )
+{
+	const unsigned char* pBytes= (const unsigned char*)pData;
+	bytes.insert( bytes.end(), pBytes, pBytes + size );
+}
+
+static void appendSize( std::vector<unsigned char>& bytes, size_t size )
+{
+	unsigned int value= (unsigned int)size;
+	appendBytes( bytes, &value, 4 );
+}
+
+// PackBits style RLE: a control byte below 128 is followed by that many + 1
+// literal bytes, one of 128 and up by a byte repeated control - 126 times
+static void packRle( const unsigned char* pPlane, size_t planeSize, std::vector<unsigned char>& packed )
+{
+	packed.clear();
+
+	size_t pos= 0;
+	while ( pos < planeSize )
+	{
+		// length of the run starting here
+		size_t run= 1;
+		while ( pos + run < planeSize && run < 129 && pPlane[ pos + run ] == pPlane[ pos ] )
+			run++;
+
+		if ( run >= 2 )
+		{
+			packed.push_back( (unsigned char)(run + 126) );
+			packed.push_back( pPlane[ pos ] );
+			pos+= run;
+			continue;
+		}
+
+		// literals, up to the next run
+		size_t count= 1;
+		while ( pos + count < planeSize && count < 128 &&
+				!(pos + count + 1 < planeSize && pPlane[ pos + count ] == pPlane[ pos + count + 1 ]) )
+			count++;
+
+		packed.push_back( (unsigned char)(count - 1) );
+		packed.insert( packed.end(), pPlane + pos, pPlane + pos + count );
+		pos+= count;
+	}
+}
+
+// unpack into pPlane, or with bXor, XOR the unpacked bytes into it
+static bool unpackRle( const unsigned char* pPacked, size_t size, unsigned char* pPlane, size_t planeSize, bool bXor )
+{
+	const unsigned char* pEnd= pPacked + size;
+	size_t pos= 0;
+
+	while ( pPacked < pEnd )
+	{
+		unsigned int control= *pPacked++;
+
+		if ( control >= 128 )
+		{
+			size_t run= control - 126;
+			if ( pPacked == pEnd || pos + run > planeSize )
+				return false;
+
+			unsigned char value= *pPacked++;
+			if ( !bXor )
+			{
+				memset( pPlane + pos, value, run );
+			}
+			else if ( value != 0 )
+			{
+				for ( size_t idx= 0; idx < run; ++idx )
+					pPlane[ pos + idx ]^= value;
+			}
+			pos+= run;
+		}
+		else
+		{
+			size_t count= control + 1;
+			if ( (size_t)(pEnd - pPacked) < count || pos + count > planeSize )
+				return false;
+
+			if ( bXor )
+			{
+				for ( size_t idx= 0; idx < count; ++idx )
+					pPlane[ pos + idx ]^= pPacked[ idx ];
+			}
+			else
+			{
+				memcpy( pPlane + pos, pPacked, count );
+			}
+			pPacked+= count;
+			pos+= count;
+		}
+	}
+
+	return pos == planeSize;
+}
+
+static void appendPlaneAs( std::vector<unsigned char>& record, unsigned char method, const unsigned char* pData, size_t size )
+{
+	record.push_back( method );
+	appendSize( record, size );
+	appendBytes( record, pData, size );
+}
+
+// append one plane in whichever way stores it smallest. The alpha plane is
+// only RLE packed, it is mostly flat anyway. With pPrevious, the previous
+// frame's plane, the plane is stored as a delta if that packs smaller, which
+// it does by far when little changed.
+static void appendPlane( std::vector<unsigned char>& record, const unsigned char* pPlane, const unsigned char* pPrevious,
+						 size_t planeSize, bool bTryLzsa, std::vector<unsigned char>& rle, std::vector<unsigned char>& work )
+{
+	unsigned char delta= 0;
+	packRle( pPlane, planeSize, rle );
+
+	std::vector<unsigned char> xorPlane;
+	if ( pPrevious!=NULL )
+	{
+		xorPlane.resize( planeSize );
+		for ( size_t idx= 0; idx < planeSize; ++idx )
+			xorPlane[ idx ]= pPlane[ idx ] ^ pPrevious[ idx ];
+
+		std::vector<unsigned char> xorRle;
+		packRle( xorPlane.data(), planeSize, xorRle );
+
+		// carry on with whichever packs smaller
+		if ( xorRle.size() < rle.size() )
+		{
+			rle.swap( xorRle );
+			pPlane= xorPlane.data();
+			delta= PLANE_DELTA;
+		}
+	}
+
+	if ( bTryLzsa && rle.size() > planeSize / RLE_GOOD_ENOUGH )
+	{
+		size_t compSize= lzsa_compress_inmem( (unsigned char*)pPlane,	// input
+											  work.data(),				// output
+											  planeSize,				// input size
+											  work.size(),				// max output buffer size
+											  LZSA_FLAG_FAVOR_RATIO,
+											  0,						// minmatchsize (0 better for ratio)
+											  2							// Format Version
+											  );
+
+		if ( compSize != (size_t)-1 && compSize < rle.size() && compSize < planeSize )
+		{
+			appendPlaneAs( record, PLANE_LZSA | delta, work.data(), compSize );
+			return;
+		}
+	}
+
+	if ( rle.size() < planeSize )
+		appendPlaneAs( record, PLANE_RLE | delta, rle.data(), rle.size() );
+	else
+		appendPlaneAs( record, PLANE_RAW | delta, pPlane, planeSize );
+}
+
+// unpack one plane from pData into pPlane, which holds the previous frame's
+// plane for a delta. scratch is for unpacking LZSA2 deltas.
+static bool readPlane( const unsigned char*& pData, const unsigned char* pEnd, unsigned char* pPlane, size_t planeSize,
+					   std::vector<unsigned char>& scratch )
+{
+	if ( pEnd - pData < 5 )
+		return false;
+
+	unsigned char method= pData[ 0 ];
+	unsigned int size;
+	memcpy( &size, pData + 1, 4 );
+	pData+= 5;
+
+	if ( (size_t)(pEnd - pData) < size )
+		return false;
+
+	const unsigned char* pPacked= pData;
+	pData+= size;
+
+	bool bDelta= (method & PLANE_DELTA) != 0;
+
+	switch ( method & PLANE_METHOD_MASK )
+	{
+		case PLANE_RAW:
+			if ( size != planeSize )
+				return false;
+
+			if ( bDelta )
+			{
+				for ( size_t idx= 0; idx < planeSize; ++idx )
+					pPlane[ idx ]^= pPacked[ idx ];
+			}
+			else
+			{
+				memcpy( pPlane, pPacked, planeSize );
+			}
+			return true;
+
+		case PLANE_LZSA:
+		{
+			unsigned char* pOut= pPlane;
+			if ( bDelta )
+			{
+				scratch.resize( planeSize );
+				pOut= scratch.data();
+			}
+
+			int formatVersion= 2;
+			size_t unpacked= lzsa_decompress_inmem( (unsigned char*)pPacked, pOut, size, planeSize, 0, &formatVersion );
+			if ( unpacked != planeSize )
+				return false;
+
+			if ( bDelta )
+			{
+				for ( size_t idx= 0; idx < planeSize; ++idx )
+					pPlane[ idx ]^= pOut[ idx ];
+			}
+			return true;
+		}
+
+		case PLANE_RLE:
+			return unpackRle( pPacked, size, pPlane, planeSize, bDelta );
+	}
+
+	return false;
+}
+
+//------------------------------------------------------------------------------
+
+SanFrameEncoder::SanFrameEncoder()
+	: m_pWriter( NULL )
+	, m_width( 0 )
+	, m_height( 0 )
+	, m_alphaEnabled( false )
+	, m_keyframeInterval( 0 )
+	, m_frameCount( 0 )
+	, m_failed( false )
+	, m_stop( false )
+{
+}
+
+// finishProcessing stops the workers. One still running here is the host
+// quitting mid-save, and joining it under the loader lock would hang.
+SanFrameEncoder::~SanFrameEncoder()
+{
+	for ( size_t idx= 0; idx < m_workers.size(); ++idx )
+	{
+		m_workers[ idx ].detach();
+	}
+}
+
+void SanFrameEncoder::Begin( SanFileWriter* pWriter, int width, int height, bool alphaEnabled, int keyframeInterval )
+{
+	Cancel();
+
+	m_pWriter= pWriter;
+	m_width= width;
+	m_height= height;
+	m_alphaEnabled= alphaEnabled;
+	m_keyframeInterval= keyframeInterval;
+	m_frameCount= 0;
+	m_failed= false;
+	m_stop= false;
+
+	unsigned int numWorkers= std::thread::hardware_concurrency();
+	if ( numWorkers < 1 )
+		numWorkers= 1;
+
+	// the workers that could be started take the frames; with none at all,
+	// Submit packs them itself
+	try
+	{
+		m_workers.reserve( numWorkers );
+
+		for ( unsigned int idx= 0; idx < numWorkers; ++idx )
+		{
+			m_workers.push_back( std::thread( &SanFrameEncoder::WorkerLoop, this ) );
+		}
+	}
+	catch ( ... )
+	{
+	}
+}
+
+bool SanFrameEncoder::Submit( unsigned short delayMs, const unsigned char* pPalette, const unsigned char* pAlphaPalette,
+							  const unsigned char* pColor, const unsigned char* pAlpha )
+{
+	if ( m_pWriter==NULL || m_failed )
+		return false;
+
+	size_t planeSize= (size_t)m_width * m_height;
+
+	std::shared_ptr<std::vector<unsigned char> > input= std::make_shared<std::vector<unsigned char> >();
+	input->reserve( 2 + 768 + 256 + 2 * planeSize );
+	appendBytes( *input, &delayMs, 2 );
+	appendBytes( *input, pPalette, 768 );
+	if ( m_alphaEnabled )
+		appendBytes( *input, pAlphaPalette, 256 );
+	appendBytes( *input, pColor, planeSize );
+	if ( m_alphaEnabled )
+		appendBytes( *input, pAlpha, planeSize );
+
+	Job* pJob= new Job();
+	pJob->done= false;
+	pJob->samePalettes= false;
+	pJob->input= input;
+
+	// every keyframeInterval-th frame stands on its own, so readers can
+	// start decoding there
+	bool bKeyframe= m_keyframeInterval <= 0 || (m_frameCount % m_keyframeInterval) == 0;
+	if ( !bKeyframe )
+	{
+		pJob->previous= m_previous;
+
+		size_t palettesSize= 768 + (m_alphaEnabled ? 256 : 0);
+		pJob->samePalettes= memcmp( input->data() + 2, m_previous->data() + 2, palettesSize ) == 0;
+	}
+
+	m_previous= input;
+	m_frameCount++;
+
+	// without workers (see Begin) the frame is packed right here
+	if ( m_workers.empty() )
+	{
+		PackFrame( pJob );
+		pJob->done= true;
+
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_pending.push_back( pJob );
+	}
+	else
+	{
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+			m_pending.push_back( pJob );
+			m_queue.push_back( pJob );
+		}
+		m_workReady.notify_one();
+	}
+
+	return WriteFinished( false, FRAMES_IN_FLIGHT_PER_WORKER * m_workers.size() );
+}
+
+bool SanFrameEncoder::Finish()
+{
+	if ( m_pWriter==NULL )
+		return false;
+
+	WriteFinished( true, 0 );
+	StopWorkers();
+
+	m_previous.reset();
+	m_pWriter= NULL;
+	return !m_failed;
+}
+
+void SanFrameEncoder::Cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_queue.clear();
+	}
+
+	StopWorkers();
+
+	for ( size_t idx= 0; idx < m_pending.size(); ++idx )
+	{
+		delete m_pending[ idx ];
+	}
+	m_pending.clear();
+
+	m_previous.reset();
+	m_pWriter= NULL;
+}
+
+// write the finished frames at the front of the file order. With bWait, or
+// while more than maxPending frames are queued, wait for the front one.
+bool SanFrameEncoder::WriteFinished( bool bWait, size_t maxPending )
+{
+	std::unique_lock<std::mutex> lock( m_mutex );
+
+	while ( !m_pending.empty() )
+	{
+		Job* pJob= m_pending.front();
+
+		if ( !pJob->done )
+		{
+			if ( !bWait && m_pending.size() <= maxPending )
+				break;
+
+			m_jobDone.wait( lock, [pJob] { return pJob->done; } );
+		}
+
+		m_pending.pop_front();
+		lock.unlock();
+
+		if ( !m_pWriter->Write( pJob->record.data(), pJob->record.size() ) )
+			m_failed= true;
+
+		delete pJob;
+		lock.lock();
+	}
+
+	return !m_failed;
+}
+
+void SanFrameEncoder::StopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_stop= true;
+	}
+	m_workReady.notify_all();
+
+	for ( size_t idx= 0; idx < m_workers.size(); ++idx )
+	{
+		m_workers[ idx ].join();
+	}
+	m_workers.clear();
+}
+
+void SanFrameEncoder::WorkerLoop()
+{
+	for (;;)
+	{
+		Job* pJob;
+		{
+			std::unique_lock<std::mutex> lock( m_mutex );
+			m_workReady.wait( lock, [this] { return m_stop || !m_queue.empty(); } );
+
+			// finish what's queued before stopping, Cancel clears the queue
+			if ( m_queue.empty() )
+				return;
+
+			pJob= m_queue.front();
+			m_queue.pop_front();
+		}
+
+		PackFrame( pJob );
+
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+			pJob->done= true;
+		}
+		m_jobDone.notify_all();
+	}
+}
+
+void SanFrameEncoder::PackFrame( Job* pJob ) const
+{
+	size_t planeSize= (size_t)m_width * m_height;
+	size_t palettesSize= 2 + 768 + (m_alphaEnabled ? 256 : 0);
+
+	const unsigned char* pInput= pJob->input->data();
+	const unsigned char* pPrevious= pJob->previous ? pJob->previous->data() : NULL;
+
+	std::vector<unsigned char> work( lzsa_get_max_compressed_size_inmem( planeSize ) );
+	std::vector<unsigned char> rle;
+	std::vector<unsigned char>& record= pJob->record;
+
+	record.reserve( 4 + palettesSize + 5 + planeSize );
+	appendSize( record, 0 );	// record size, filled in below
+	appendBytes( record, pInput, pJob->samePalettes ? 2 : palettesSize );
+
+	appendPlane( record, pInput + palettesSize, pPrevious ? pPrevious + palettesSize : NULL,
+				 planeSize, true, rle, work );
+	if ( m_alphaEnabled )
+		appendPlane( record, pInput + palettesSize + planeSize, pPrevious ? pPrevious + palettesSize + planeSize : NULL,
+					 planeSize, false, rle, work );
+
+	unsigned int recordSize= (unsigned int)(record.size() - 4);
+	if ( pJob->samePalettes )
+		recordSize|= RECORD_SAME_PALETTES;
+	memcpy( record.data(), &recordSize, 4 );
+
+	// the input isn't needed any more, don't hold on to it until written
+	pJob->input.reset();
+	pJob->previous.reset();
+}
+
+//------------------------------------------------------------------------------
+
+SanFrameReader::SanFrameReader()
+	: m_decodedFrame( -1 )
+	, m_delay( 0 )
+{
+	memset( m_palettes, 0, sizeof( m_palettes ) );
+}
+
+void SanFrameReader::Reset()
+{
+	m_offsets.clear();
+	m_frameKinds.clear();
+	m_decodedFrame= -1;
+}
+
+// offset of frame frameIndex, hopping over the records after the last one
+// known
+bool SanFrameReader::FindFrame( FILE* pFile, unsigned int frameIndex, long long& offset )
+{
+	while ( m_offsets.size() <= frameIndex )
+	{
+		long long at= m_offsets.back();
+		unsigned int recordSize;
+
+		if ( _fseeki64( pFile, at, SEEK_SET ) != 0 ||
+			 fread( &recordSize, 1, 4, pFile ) != 4 )
+		{
+			return false;
+		}
+
+		m_offsets.push_back( at + 4 + (recordSize & RECORD_SIZE_MASK) );
+	}
+
+	if ( m_frameKinds.size() < m_offsets.size() )
+		m_frameKinds.resize( m_offsets.size(), FRAME_UNKNOWN );
+
+	offset= m_offsets[ frameIndex ];
+	return true;
+}
+
+// whether frameIndex is a keyframe, i.e. has its palettes and no delta
+// planes. Only the record size and method bytes get read, and only once per
+// frame.
+bool SanFrameReader::IsKeyFrame( FILE* pFile, unsigned int frameIndex, size_t palettesSize, bool alphaEnabled,
+								 bool& bKey )
+{
+	long long offset;
+	if ( !FindFrame( pFile, frameIndex, offset ) )
+		return false;
+
+	if ( m_frameKinds[ frameIndex ] == FRAME_UNKNOWN )
+	{
+		unsigned int recordSize;
+		if ( _fseeki64( pFile, offset, SEEK_SET ) != 0 ||
+			 fread( &recordSize, 1, 4, pFile ) != 4 )
+		{
+			return false;
+		}
+
+		bool bDelta= (recordSize & RECORD_SAME_PALETTES) != 0;
+
+		unsigned char plane[ 5 ];
+		if ( _fseeki64( pFile, 2 + (bDelta ? 0 : palettesSize), SEEK_CUR ) != 0 ||
+			 fread( plane, 1, 5, pFile ) != 5 )
+		{
+			return false;
+		}
+
+		bDelta|= (plane[ 0 ] & PLANE_DELTA) != 0;
+
+		if ( alphaEnabled )
+		{
+			unsigned int size;
+			memcpy( &size, plane + 1, 4 );
+
+			if ( _fseeki64( pFile, size, SEEK_CUR ) != 0 ||
+				 fread( plane, 1, 1, pFile ) != 1 )
+			{
+				return false;
+			}
+
+			bDelta|= (plane[ 0 ] & PLANE_DELTA) != 0;
+		}
+
+		m_frameKinds[ frameIndex ]= bDelta ? FRAME_DELTA : FRAME_KEY;
+	}
+
+	bKey= m_frameKinds[ frameIndex ] == FRAME_KEY;
+	return true;
+}
+
+// read frame frameIndex and apply it to the frame buffer, which must hold
+// the frame before it, unless it's a keyframe
+bool SanFrameReader::DecodeFrame( FILE* pFile, unsigned int frameIndex, size_t planeSize, size_t palettesSize,
+								  bool alphaEnabled )
+{
+	long long offset;
+	if ( !FindFrame( pFile, frameIndex, offset ) )
+		return false;
+
+	// only seek if not there already, so reading in order stays sequential
+	if ( _ftelli64( pFile ) != offset && _fseeki64( pFile, offset, SEEK_SET ) != 0 )
+		return false;
+
+	size_t maxPlaneSize= lzsa_get_max_compressed_size_inmem( planeSize );
+	if ( maxPlaneSize < planeSize )
+		maxPlaneSize= planeSize;
+
+	unsigned int recordSize;
+	if ( fread( &recordSize, 1, 4, pFile ) != 4 )
+		return false;
+
+	bool bSamePalettes= (recordSize & RECORD_SAME_PALETTES) != 0;
+	recordSize&= RECORD_SIZE_MASK;
+
+	// the palettes to keep are the previous frame's
+	if ( bSamePalettes && m_decodedFrame != (long long)frameIndex - 1 )
+		return false;
+
+	size_t headerSize= 2 + (bSamePalettes ? 0 : palettesSize);
+
+	// a broken size would have us allocate any amount of memory
+	if ( recordSize < headerSize + 5 || recordSize > headerSize + 2 * (5 + maxPlaneSize) )
+		return false;
+
+	m_record.resize( recordSize );
+	if ( fread( m_record.data(), 1, recordSize, pFile ) != recordSize )
+		return false;
+
+	// the next frame starts right behind this one
+	if ( m_offsets.size() == frameIndex + 1 )
+	{
+		m_offsets.push_back( offset + 4 + recordSize );
+		m_frameKinds.push_back( FRAME_UNKNOWN );
+	}
+
+	const unsigned char* pData= m_record.data();
+	const unsigned char* pEnd= pData + recordSize;
+
+	// no frame to apply a delta to until this one is through
+	m_decodedFrame= -1;
+
+	memcpy( &m_delay, pData, 2 );
+	pData+= 2;
+
+	// repeated palettes aren't stored, the kept ones stay as they are
+	if ( !bSamePalettes )
+	{
+		memcpy( m_palettes, pData, palettesSize );
+		pData+= palettesSize;
+	}
+
+	bool bDelta= bSamePalettes || (pData[ 0 ] & PLANE_DELTA) != 0;
+
+	if ( !readPlane( pData, pEnd, m_color.data(), planeSize, m_scratch ) )
+		return false;
+
+	if ( alphaEnabled )
+	{
+		if ( pData < pEnd )
+			bDelta|= (pData[ 0 ] & PLANE_DELTA) != 0;
+
+		if ( !readPlane( pData, pEnd, m_alpha.data(), planeSize, m_scratch ) )
+			return false;
+	}
+
+	m_frameKinds[ frameIndex ]= bDelta ? FRAME_DELTA : FRAME_KEY;
+	m_decodedFrame= frameIndex;
+	return true;
+}
+
+bool SanFrameReader::ReadFrame( FILE* pFile, long long firstFrame, unsigned int frameIndex,
+								int width, int height, bool alphaEnabled,
+								unsigned char* colorFrame, unsigned char* colorFramePalette,
+								unsigned char* alphaFrame, unsigned char* alphaFramePalette,
+								unsigned short* delayMs )
+{
+	if ( m_offsets.empty() )
+		m_offsets.push_back( firstFrame );
+
+	size_t planeSize= (size_t)width * height;
+	size_t palettesSize= 768 + (alphaEnabled ? 256 : 0);
+
+	if ( m_color.size() != planeSize || m_alpha.size() != (alphaEnabled ? planeSize : 0) )
+	{
+		m_color.assign( planeSize, 0 );
+		m_alpha.assign( alphaEnabled ? planeSize : 0, 0 );
+		m_decodedFrame= -1;
+	}
+
+	if ( m_decodedFrame != (long long)frameIndex )
+	{
+		// decode from the last keyframe up to frameIndex, or from the frame
+		// in the buffer, if that's later
+		bool bContinue= m_decodedFrame >= 0 && m_decodedFrame < (long long)frameIndex;
+		long long first= bContinue ? m_decodedFrame + 1 : 0;
+		long long start= -1;
+
+		for ( long long idx= frameIndex; idx > first; --idx )
+		{
+			bool bKey;
+			if ( !IsKeyFrame( pFile, (unsigned int)idx, palettesSize, alphaEnabled, bKey ) )
+				return false;
+
+			if ( bKey )
+			{
+				start= idx;
+				break;
+			}
+		}
+
+		if ( start < 0 )
+		{
+			// the first frame of a file is always a keyframe
+			start= first;
+		}
+
+		for ( long long idx= start; idx <= (long long)frameIndex; ++idx )
+		{
+			if ( !DecodeFrame( pFile, (unsigned int)idx, planeSize, palettesSize, alphaEnabled ) )
+				return false;
+		}
+	}
+
+	*delayMs= m_delay;
+	memcpy( colorFramePalette, m_palettes, 768 );
+	if ( alphaEnabled && alphaFramePalette!=NULL )
+		memcpy( alphaFramePalette, m_palettes + 768, 256 );
+
+	memcpy( colorFrame, m_color.data(), planeSize );
+	if ( alphaEnabled && alphaFrame!=NULL )
+		memcpy( alphaFrame, m_alpha.data(), planeSize );
+
+	return true;
+}
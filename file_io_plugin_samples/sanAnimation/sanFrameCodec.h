@@ -0,0 +1,152 @@
+//
+// Version 2 SAN frames: every frame's planes are compressed.
+//
+// A version 2 file has the same header as version 1 (with version 2), followed
+// by one record per frame:
+//
+//   unsigned int   recordSize      bytes of the record after this field; bit
+//                                  31 set if the palettes are left out
+//   unsigned short delay
+//   unsigned char  palette[768]        unless left out
+//   unsigned char  alphaPalette[256]   only if alpha is enabled, and unless
+//                                      left out
+//   plane          color plane
+//   plane          alpha plane, only if alpha is enabled
+//
+// and each plane is
+//
+//   unsigned char  method          0 raw, 1 LZSA2 stream, 2 RLE; bit 7 set
+//                                  if the plane is XORed with the previous
+//                                  frame's (a delta plane)
+//   unsigned int   size, then size bytes of plane data
+//
+// The color plane is LZSA2 compressed, unless RLE does about as well, which is
+// much faster for flat art. The alpha plane is RLE packed. Either is stored
+// raw if it doesn't get any smaller. A plane is stored as a delta when that
+// packs smaller, except in keyframes; a frame without delta planes is a
+// keyframe, and decoding can start there. Palettes are left out of frames
+// other than keyframes if they're the same as the previous frame's.
+//
+// Include this ahead of any #pragma pack, the classes hold standard library
+// containers.
+//
+#ifndef SAN_FRAME_CODEC_H
+#define SAN_FRAME_CODEC_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class SanFileWriter;
+
+// Packs frames on a pool of worker threads while the host keeps handing in new
+// ones, and writes the records to the file in order, as they complete. All
+// methods are called from the host's thread; only the packing runs on the
+// workers. Finish or Cancel before the encoder goes away, the destructor
+// doesn't wait for the workers.
+class SanFrameEncoder
+{
+public:
+	SanFrameEncoder();
+	~SanFrameEncoder();
+
+	// Start a file; records get written through pWriter.
+	// Every keyframeInterval-th frame is a keyframe, 0 for no delta frames.
+	void Begin( SanFileWriter* pWriter, int width, int height, bool alphaEnabled, int keyframeInterval );
+
+	// Queue a frame; the buffers are copied, so they can be reused right
+	// away. Writes out whatever frames finished packing, and waits for the
+	// oldest one if too many are in flight. False if a write failed.
+	bool Submit( unsigned short delayMs, const unsigned char* pPalette, const unsigned char* pAlphaPalette,
+				 const unsigned char* pColor, const unsigned char* pAlpha );
+
+	// Write the remaining frames and stop the workers. False if any frame
+	// failed to write.
+	bool Finish();
+
+	// Drop the remaining frames unwritten and stop the workers
+	void Cancel();
+
+	bool IsActive() const { return m_pWriter != NULL; }
+
+private:
+	struct Job
+	{
+		std::shared_ptr<const std::vector<unsigned char> > input;		// delay, palettes and planes as given
+		std::shared_ptr<const std::vector<unsigned char> > previous;	// the frame before, unless a keyframe
+		std::vector<unsigned char> record;	// the packed record, once done
+		bool samePalettes;					// palettes are the previous frame's
+		bool done;
+	};
+
+	void WorkerLoop();
+	void PackFrame( Job* pJob ) const;
+	bool WriteFinished( bool bWait, size_t maxPending );
+	void StopWorkers();
+
+	SanFileWriter* m_pWriter;
+	int   m_width;
+	int   m_height;
+	bool  m_alphaEnabled;
+	int   m_keyframeInterval;
+	int   m_frameCount;
+	bool  m_failed;
+
+	std::shared_ptr<const std::vector<unsigned char> > m_previous;	// last frame submitted
+
+	std::deque<Job*> m_pending;		// every queued frame, in file order
+	std::deque<Job*> m_queue;		// frames no worker has picked up yet
+	std::vector<std::thread> m_workers;
+	bool m_stop;
+
+	std::mutex m_mutex;
+	std::condition_variable m_workReady;
+	std::condition_variable m_jobDone;
+
+	SanFrameEncoder( const SanFrameEncoder& );
+	SanFrameEncoder& operator=( const SanFrameEncoder& );
+};
+
+// Reads version 2 frames in any order. Frame offsets are learned from the
+// record sizes as frames are read, and for a jump ahead by hopping over the
+// records in between, so each frame's offset is only ever looked up once.
+// The last decoded frame is kept, so reading in order only applies each
+// delta; a jump decodes from the closest keyframe before the frame, or from
+// the kept frame if that's closer.
+class SanFrameReader
+{
+public:
+	SanFrameReader();
+
+	// Forget the offsets and the kept frame, for the next file
+	void Reset();
+
+	// Read frame frameIndex of a file whose first frame starts at firstFrame.
+	// alphaFrame may be NULL to skip the alpha plane.
+	bool ReadFrame( FILE* pFile, long long firstFrame, unsigned int frameIndex,
+					int width, int height, bool alphaEnabled,
+					unsigned char* colorFrame, unsigned char* colorFramePalette,
+					unsigned char* alphaFrame, unsigned char* alphaFramePalette,
+					unsigned short* delayMs );
+
+private:
+	bool FindFrame( FILE* pFile, unsigned int frameIndex, long long& offset );
+	bool IsKeyFrame( FILE* pFile, unsigned int frameIndex, size_t palettesSize, bool alphaEnabled, bool& bKey );
+	bool DecodeFrame( FILE* pFile, unsigned int frameIndex, size_t planeSize, size_t palettesSize, bool alphaEnabled );
+
+	std::vector<long long> m_offsets;		// known frame offsets, from frame 0
+	std::vector<unsigned char> m_frameKinds;	// FRAME_xxx, parallel to m_offsets
+	std::vector<unsigned char> m_record;
+	std::vector<unsigned char> m_color;		// the kept frame's planes
+	std::vector<unsigned char> m_alpha;
+	std::vector<unsigned char> m_scratch;
+	long long m_decodedFrame;				// index of the kept frame, -1 for none
+	unsigned short m_delay;					// and its delay and palettes
+	unsigned char m_palettes[ 768 + 256 ];
+};
+
+#endif // SAN_FRAME_CODEC_H
@@ -0,0 +1,181 @@
+//
+// Read-ahead of frames, see sanFramePrefetch.h
+//
+#include "sanFramePrefetch.h"
+
+#include <string.h>
+
+SanFramePrefetcher::SanFramePrefetcher()
+	: m_pRead( NULL )
+	, m_frameCount( 0 )
+	, m_nextTake( 0 )
+	, m_nextRead( 0 )
+	, m_failed( false )
+	, m_done( false )
+	, m_stop( false )
+	, m_hits( 0 )
+	, m_misses( 0 )
+{
+}
+
+// finishProcessing stops the thread, see ~SanFrameEncoder
+SanFramePrefetcher::~SanFramePrefetcher()
+{
+	if ( m_thread.joinable() )
+		m_thread.detach();
+}
+
+bool SanFramePrefetcher::Start( ReadFunc pRead, unsigned int firstFrame, unsigned int frameCount,
+								size_t planeSize, bool alphaEnabled, int depth, size_t maxBytes )
+{
+	Stop();
+
+	if ( firstFrame >= frameCount )
+		return false;
+
+	// as many frames as the memory allows, up to depth
+	size_t frameBytes= sizeof( PrefetchFrame ) + planeSize * (alphaEnabled ? 2 : 1);
+	size_t fit= maxBytes / frameBytes;
+	if ( depth < 1 || fit < 1 )
+		return false;
+
+	if ( fit > (size_t)depth )
+		fit= depth;
+
+	size_t alphaSize= alphaEnabled ? planeSize : 0;
+	if ( m_ring.size() != fit || m_ring[ 0 ].color.size() != planeSize || m_ring[ 0 ].alpha.size() != alphaSize )
+	{
+		m_ring.clear();
+		m_ring.resize( fit );
+
+		for ( size_t idx= 0; idx < fit; ++idx )
+		{
+			m_ring[ idx ].color.resize( planeSize );
+			m_ring[ idx ].alpha.resize( alphaSize );
+		}
+	}
+
+	m_pRead= pRead;
+	m_frameCount= frameCount;
+	m_nextTake= firstFrame;
+	m_nextRead= firstFrame;
+	m_failed= false;
+	m_done= false;
+	m_stop= false;
+
+	// without a thread nothing is read ahead, and Take leaves every frame to
+	// the caller
+	try
+	{
+		m_thread= std::thread( &SanFramePrefetcher::ThreadLoop, this );
+	}
+	catch ( ... )
+	{
+		m_pRead= NULL;
+		m_frameCount= 0;
+		m_done= true;
+		return false;
+	}
+
+	return true;
+}
+
+void SanFramePrefetcher::Stop()
+{
+	if ( !m_thread.joinable() )
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_stop= true;
+	}
+	m_slotFree.notify_all();
+
+	m_thread.join();
+}
+
+bool SanFramePrefetcher::Take( unsigned int frameIndex, unsigned char* colorFrame, unsigned char* colorFramePalette,
+							   unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned short* delayMs )
+{
+	if ( !m_thread.joinable() || frameIndex != m_nextTake || frameIndex >= m_frameCount )
+		return false;
+
+	{
+		std::unique_lock<std::mutex> lock( m_mutex );
+
+		if ( m_nextRead > frameIndex )
+		{
+			m_hits++;
+		}
+		else
+		{
+			m_misses++;
+			m_frameReady.wait( lock, [this, frameIndex] { return m_nextRead > frameIndex || m_failed || m_done; } );
+
+			if ( m_nextRead <= frameIndex )
+				return false;
+		}
+	}
+
+	// the thread doesn't touch a ready frame's slot until it's taken
+	const PrefetchFrame& frame= m_ring[ frameIndex % m_ring.size() ];
+
+	*delayMs= frame.delayMs;
+	memcpy( colorFramePalette, frame.palette, 768 );
+	memcpy( colorFrame, frame.color.data(), frame.color.size() );
+
+	if ( !frame.alpha.empty() )
+	{
+		if ( alphaFramePalette!=NULL )
+			memcpy( alphaFramePalette, frame.alphaPalette, 256 );
+		if ( alphaFrame!=NULL )
+			memcpy( alphaFrame, frame.alpha.data(), frame.alpha.size() );
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_nextTake++;
+	}
+	m_slotFree.notify_one();
+
+	return true;
+}
+
+void SanFramePrefetcher::ThreadLoop()
+{
+	for (;;)
+	{
+		unsigned int frameIndex;
+		{
+			std::unique_lock<std::mutex> lock( m_mutex );
+
+			// wait for a free slot; all of them hold frames not yet taken
+			m_slotFree.wait( lock, [this] { return m_stop || m_nextRead - m_nextTake < m_ring.size(); } );
+
+			if ( m_stop || m_nextRead >= m_frameCount )
+			{
+				m_done= true;
+				break;
+			}
+
+			frameIndex= m_nextRead;
+		}
+
+		bool ok= m_pRead( frameIndex, m_ring[ frameIndex % m_ring.size() ] );
+
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+
+			if ( ok )
+				m_nextRead++;
+			else
+				m_failed= true;
+		}
+		m_frameReady.notify_one();
+
+		if ( !ok )
+			return;
+	}
+
+	m_frameReady.notify_one();
+}
@@ -0,0 +1,89 @@
+//
+// Read-ahead for loading frames in order: a background thread reads (and
+// unpacks) the frames after the one asked for into a small ring of
+// preallocated frame buffers, so taking the next frame is mostly a copy.
+//
+// Include this ahead of any #pragma pack, the class holds standard library
+// containers.
+//
+#ifndef SAN_FRAME_PREFETCH_H
+#define SAN_FRAME_PREFETCH_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// one frame as loadNextImage hands it out
+struct PrefetchFrame
+{
+	std::vector<unsigned char> color;
+	std::vector<unsigned char> alpha;	// empty without alpha
+	unsigned char palette[ 768 ];
+	unsigned char alphaPalette[ 256 ];
+	unsigned short delayMs;
+};
+
+// Reads frames ahead on its own thread. All methods are called from the
+// host's thread; only the read function runs on the prefetch thread, and
+// never on two frames at once. Stop before the prefetcher goes away, the
+// destructor doesn't wait for the thread.
+class SanFramePrefetcher
+{
+public:
+	// reads frame frameIndex into frame, whose buffers are already sized.
+	// False if it couldn't, which stops the read-ahead.
+	typedef bool (*ReadFunc)( unsigned int frameIndex, PrefetchFrame& frame );
+
+	SanFramePrefetcher();
+	~SanFramePrefetcher();
+
+	// Start reading frames firstFrame up to frameCount - 1 ahead, at most
+	// depth of them, and no more than maxBytes of frame buffers. False if not
+	// even one frame fits, or the thread can't be started.
+	bool Start( ReadFunc pRead, unsigned int firstFrame, unsigned int frameCount,
+				size_t planeSize, bool alphaEnabled, int depth, size_t maxBytes );
+
+	// Stop reading ahead, waiting for a frame being read. The buffers stay
+	// allocated for the next Start of the same size.
+	void Stop();
+
+	bool IsActive() const { return m_thread.joinable(); }
+
+	// Copy out frame frameIndex, waiting for it if it's still being read.
+	// False if it isn't the next frame in order or couldn't be read; the
+	// caller reads it itself then. alphaFrame may be NULL to skip alpha.
+	bool Take( unsigned int frameIndex, unsigned char* colorFrame, unsigned char* colorFramePalette,
+			   unsigned char* alphaFrame, unsigned char* alphaFramePalette, unsigned short* delayMs );
+
+	// frames taken that were ready, and frames taken that had to be waited for
+	int GetHits() const   { return m_hits; }
+	int GetMisses() const { return m_misses; }
+	void ResetStats()     { m_hits= 0; m_misses= 0; }
+
+private:
+	void ThreadLoop();
+
+	ReadFunc m_pRead;
+	std::vector<PrefetchFrame> m_ring;	// frame n is read into m_ring[ n % size ]
+	unsigned int m_frameCount;
+	unsigned int m_nextTake;			// frame the host takes next
+	unsigned int m_nextRead;			// frame the thread reads next; the ones
+										// from m_nextTake up to here are ready
+	bool m_failed;						// reading m_nextRead failed
+	bool m_done;						// the thread has stopped by itself
+	bool m_stop;
+
+	int m_hits;
+	int m_misses;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_frameReady;
+	std::condition_variable m_slotFree;
+
+	SanFramePrefetcher( const SanFramePrefetcher& );
+	SanFramePrefetcher& operator=( const SanFramePrefetcher& );
+};
+
+#endif // SAN_FRAME_PREFETCH_H
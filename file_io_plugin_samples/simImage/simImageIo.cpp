@@ -14,6 +14,10 @@
 #define FILE_BOX_DESCRIPTION L"SIM - Sample Image"
 #define FILE_EXTENSION L"sim"
 
+// planes get copied from views of at most this many bytes of the mapped file,
+// so a huge file doesn't need address space for all of it at once
+#define MAP_VIEW_BYTES (64 * 1024 * 1024)
+
 // at the moment there is only version "1" of the file plugin interface
 #define PLUGIN_INTERFACE_VERSION_USED 1
 
@@ -41,6 +45,13 @@ bool basicDataLoaded;
 unsigned char rgbTable[ 768 ];
 unsigned char alphaTable[ 256 ];
 
+// the current file, mapped for reading. It's only open while the header or
+// the image data is copied out, so other programs can delete, rename or
+// overwrite it while it's merely shown in the file box.
+HANDLE mappedFile= INVALID_HANDLE_VALUE;
+HANDLE fileMapping= NULL;
+unsigned long long mappedFileSize;
+
 // Header data of the file
 struct 
 {
@@ -66,9 +77,116 @@ bool isError()
 	return lastErrorMessage[0]!=0;
 }
 
+// helper to close the mapped file
+void closeMapping()
+{
+	if ( fileMapping!=NULL )
+	{
+		CloseHandle( fileMapping );
+		fileMapping= NULL;
+	}
+
+	if ( mappedFile!=INVALID_HANDLE_VALUE )
+	{
+		CloseHandle( mappedFile );
+		mappedFile= INVALID_HANDLE_VALUE;
+	}
+
+	mappedFileSize= 0;
+}
+
+// map the current file, unless it is already
+bool openMapping()
+{
+	if ( fileMapping!=NULL )
+		return true;
+
+	mappedFile= CreateFileW( currentFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( mappedFile==INVALID_HANDLE_VALUE )
+		return false;
+
+	// an empty file can't be mapped, and isn't ours anyway
+	LARGE_INTEGER size;
+	if ( !GetFileSizeEx( mappedFile, &size ) || size.QuadPart < 5 )
+	{
+		closeMapping();
+		return false;
+	}
+	mappedFileSize= size.QuadPart;
+
+	fileMapping= CreateFileMappingW( mappedFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( fileMapping==NULL )
+	{
+		closeMapping();
+		return false;
+	}
+
+	return true;
+}
+
+// copy out of a view; a read error on the file shows up as an exception
+// while touching the mapped pages
+bool copyView( void* pDest, const void* pView, size_t size )
+{
+#ifdef _MSC_VER
+	__try
+	{
+		memcpy( pDest, pView, size );
+	}
+	__except ( GetExceptionCode()==EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH )
+	{
+		return false;
+	}
+#else
+	memcpy( pDest, pView, size );
+#endif
+	return true;
+}
+
+// copy size bytes at offset of the mapped file to pDest, through views of at
+// most MAP_VIEW_BYTES
+bool copyMapped( unsigned long long offset, void* pDest, size_t size )
+{
+	if ( offset > mappedFileSize || size > mappedFileSize - offset )
+		return false;
+
+	// views start at multiples of the allocation granularity
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	unsigned long long granularity= info.dwAllocationGranularity;
+
+	unsigned char* pOut= (unsigned char*)pDest;
+	while ( size > 0 )
+	{
+		unsigned long long viewOffset= offset - offset % granularity;
+		size_t skip= (size_t)(offset - viewOffset);
+		size_t count= size;
+		if ( count > MAP_VIEW_BYTES - skip )
+			count= MAP_VIEW_BYTES - skip;
+
+		unsigned char* pView= (unsigned char*)MapViewOfFile( fileMapping, FILE_MAP_READ, (DWORD)(viewOffset >> 32), (DWORD)viewOffset, skip + count );
+		if ( pView==NULL )
+			return false;
+
+		bool ok= copyView( pOut, pView + skip, count );
+		UnmapViewOfFile( pView );
+
+		if ( !ok )
+			return false;
+
+		pOut+= count;
+		offset+= count;
+		size-= count;
+	}
+
+	return true;
+}
+
 // reset internal data to be ready for the next file io
 void resetBasicData()
 {
+	closeMapping();
+
 	basicDataLoaded= false;
 	fileHeader.width= -1;
 	fileHeader.height= -1;
@@ -95,57 +213,62 @@ bool ensureBasicData()
 		return  false;
 	}
 
-	// open file and read header data plus color palette
-	FILE* file= _wfopen( currentFileName, L"rb" ); 
-	if ( file==NULL )
+	// map the file, just for the header
+	if ( !openMapping() )
 	{
 		wcscpy( lastErrorMessage, ERROR_FILE_OPEN_FAILED );
 		return false;
 	}
 
-	// read file type and version. we assume there may be no file smaller than 5 bytes!
-	if ( fread( &fileHeader, 1, 5, file ) != 5 )
+	size_t headerSize= sizeof( fileHeader ) + sizeof( rgbTable ) + sizeof( alphaTable );
+	if ( headerSize > mappedFileSize )
+		headerSize= (size_t)mappedFileSize;
+
+	const unsigned char* pView= (const unsigned char*)MapViewOfFile( fileMapping, FILE_MAP_READ, 0, 0, headerSize );
+	if ( pView==NULL )
 	{
 		wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
-		fclose( file );
+		closeMapping();
 		return false;
 	}
 
-	// if type and version does not match then stop here
-	if ( fileHeader.version != 1 || strncmp( fileHeader.typeId, FILE_HEADER_TYPE_ID, 4 ) != 0 )
+	// check file type and version in place, the file may not be ours
+	unsigned char typeAndVersion[ 5 ];
+	if ( !copyView( typeAndVersion, pView, 5 ) )
 	{
-		fclose( file );
+		wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
+		UnmapViewOfFile( pView );
+		closeMapping();
 		return false;
 	}
 
-    // read rest of header
-	if ( fread( &fileHeader.width, 1, sizeof( fileHeader ) - 5, file ) != (sizeof( fileHeader ) - 5) )
+	// if type and version does not match then stop here
+	if ( typeAndVersion[ 4 ] != 1 || strncmp( (const char*)typeAndVersion, FILE_HEADER_TYPE_ID, 4 ) != 0 )
 	{
-		wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
-		fclose( file );
+		UnmapViewOfFile( pView );
+		closeMapping();
 		return false;
 	}
 
-	// read colors
-	if ( fread( rgbTable, 1, sizeof( rgbTable ), file ) != sizeof( rgbTable ) )
+	// header, colors and alpha values if enabled
+	bool ok= headerSize >= sizeof( fileHeader ) + sizeof( rgbTable ) &&
+			 copyView( &fileHeader, pView, sizeof( fileHeader ) ) &&
+			 copyView( rgbTable, pView + sizeof( fileHeader ), sizeof( rgbTable ) );
+
+	if ( ok && fileHeader.alphaEnabled )
 	{
-		wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
-		fclose( file );
-		return false;
+		ok= headerSize == sizeof( fileHeader ) + sizeof( rgbTable ) + sizeof( alphaTable ) &&
+			copyView( alphaTable, pView + sizeof( fileHeader ) + sizeof( rgbTable ), sizeof( alphaTable ) );
 	}
 
-	// read alpha values if enabled
-	if ( fileHeader.alphaEnabled )
+	UnmapViewOfFile( pView );
+	closeMapping();
+
+	if ( !ok )
 	{
-		if ( fread( alphaTable, 1, sizeof( alphaTable ), file ) != sizeof( alphaTable ) )
-		{
-			wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			fclose( file );
-			return false;
-		}
+		wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
+		return false;
 	}
-	
-	fclose( file );
 
 	basicDataLoaded= true;
 	return true;
@@ -305,9 +428,8 @@ extern "C"
 		// reset progress
 		updateProgress( 0 );
 
-		// open file and read 
-		FILE* file= _wfopen( currentFileName, L"rb" ); 
-		if ( file==NULL )
+		// map the file again, for the image data
+		if ( !openMapping() )
 		{
 			wcscpy( lastErrorMessage, ERROR_FILE_OPEN_FAILED );
 			return false;
@@ -320,40 +442,37 @@ extern "C"
 
 
 		// continue with image data
-		int bitmapPos= sizeof( fileHeader ) + 768;
+		unsigned long long bitmapPos= sizeof( fileHeader ) + 768;
 		if ( fileHeader.alphaEnabled )
 			bitmapPos+= 256;
-		if ( fseek( file, bitmapPos, SEEK_SET ) != 0 )
-		{
-			wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			fclose( file );
-			return false;
-		}
 
-		// read color bitmap data
-		if ( fread( colorFrame, 1, fileHeader.width * fileHeader.height, file ) != fileHeader.width * fileHeader.height )
+		size_t planeSize= (size_t)fileHeader.width * fileHeader.height;
+
+		// copy color bitmap data
+		if ( !copyMapped( bitmapPos, colorFrame, planeSize ) )
 		{
 			wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			fclose( file );
+			closeMapping();
 			return false;
 		}
 
 		// set progress
 		updateProgress( 50 );
 
-		// if enabled read alpha bitmap data
+		// if enabled copy alpha bitmap data
 		if ( fileHeader.alphaEnabled && alphaFrame!=NULL &&
-			 fread( alphaFrame, 1, fileHeader.width * fileHeader.height, file ) != fileHeader.width * fileHeader.height )
+			 !copyMapped( bitmapPos + planeSize, alphaFrame, planeSize ) )
 		{
 			wcscpy( lastErrorMessage, ERROR_FILE_READ_FAILED );
-			fclose( file );
+			closeMapping();
 			return false;
 		}
 
+		closeMapping();
+
 		// set progress
 		updateProgress( 100 );
 		
-		fclose( file );
 		return true;
 	}
 